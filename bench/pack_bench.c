@@ -0,0 +1,164 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+/**
+ * Times the encoders setValue uses for a lua array of numbers. luai_encode_elements converts each item
+ * through luai_encode_value as it is read (the path BOOL arrays take), luai_get_array gathers the items
+ * then packs them with pack_integers / pack_floats, and luai_encode_formatted with a ">i16" or ">f32"
+ * format packs and byte swaps them. lua_interface.c is compiled into the benchmark so the static
+ * encoders are the ones the simulator ships.
+ *
+ * Usage: pack-bench [iterations]
+ **/
+
+#include "lua_interface.c"
+
+#define BENCH_MIN_ITEMS 16
+#define BENCH_MAX_ITEMS 4096
+#define BENCH_DEFAULT_ITERATIONS 20000
+
+DBusConnection *global_dbus_connection = NULL; //nothing is put on the bus
+
+static double bench_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+//a bare state with the context the encoders take their scratch buffer from
+static lua_State *bench_open_state (void)
+{
+  lua_State *lua_state = luaL_newstate ();
+  if (NULL == lua_state)
+  {
+    return NULL;
+  }
+
+  luai_context_t *context = calloc (1, sizeof (*context));
+  if (NULL == context)
+  {
+    lua_close (lua_state);
+    return NULL;
+  }
+  *(luai_context_t **) lua_getextraspace (lua_state) = context;
+  return lua_state;
+}
+
+static void bench_close_state (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  lua_close (lua_state);
+  free (context->scratch);
+  free (context);
+}
+
+static bool bench_per_element (lua_State *lua_state, size_t items, ble_data_type_t type)
+{
+  uint8_t *buf = luai_get_scratch (lua_state, items * BLE_DATA_TYPE_SIZE[type]);
+  return luai_encode_elements (lua_state, 1, type, buf, &items);
+}
+
+static bool bench_bulk (lua_State *lua_state, ble_data_type_t type)
+{
+  const void *data = NULL;
+  size_t data_size = 0;
+  return luai_get_array (lua_state, 1, type, &data, &data_size);
+}
+
+static bool bench_bulk_swap (lua_State *lua_state, const format_t *format)
+{
+  const void *data = NULL;
+  size_t data_size = 0;
+  return luai_encode_formatted (lua_state, 1, format, &data, &data_size);
+}
+
+static void bench_push_array (lua_State *lua_state, size_t items, bool real)
+{
+  lua_settop (lua_state, 0);
+  lua_createtable (lua_state, (int) items, 0);
+  for (size_t i = 1; i <= items; i++)
+  {
+    if (real)
+    {
+      lua_pushnumber (lua_state, (lua_Number) i * 0.25 - 100.0);
+    }
+    else
+    {
+      lua_pushinteger (lua_state, (lua_Integer) (i * 37) % 65536 - 32768);
+    }
+    lua_rawseti (lua_state, 1, (lua_Integer) i);
+  }
+}
+
+int main (int argc, char *argv[])
+{
+  unsigned long iterations = argc > 1 ? strtoul (argv[1], NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+  if (iterations == 0)
+  {
+    iterations = BENCH_DEFAULT_ITERATIONS;
+  }
+
+  lua_State *lua_state = bench_open_state ();
+  if (NULL == lua_state)
+  {
+    fprintf (stderr, "Could not create lua state\n");
+    return 1;
+  }
+
+  const char *error = NULL;
+  format_t *formats[] = {format_compile (">i16", &error), format_compile (">f32", &error)};
+  if (NULL == formats[0] || NULL == formats[1])
+  {
+    fprintf (stderr, "Could not compile formats: %s\n", error);
+    return 1;
+  }
+
+  bool success = true;
+  printf ("%-6s %6s %14s %14s %14s\n", "type", "items", "element ns", "bulk ns", "bulk swap ns");
+  for (int real = 0; real <= 1; real++)
+  {
+    ble_data_type_t type = real ? BLE_FLOAT : BLE_INT16;
+    for (size_t items = BENCH_MIN_ITEMS; items <= BENCH_MAX_ITEMS; items *= 2)
+    {
+      bench_push_array (lua_state, items, real);
+
+      double start = bench_now_ns ();
+      for (unsigned long i = 0; i < iterations; i++)
+      {
+        success &= bench_per_element (lua_state, items, type);
+      }
+      double element = (bench_now_ns () - start) / (double) iterations;
+
+      start = bench_now_ns ();
+      for (unsigned long i = 0; i < iterations; i++)
+      {
+        success &= bench_bulk (lua_state, type);
+      }
+      double bulk = (bench_now_ns () - start) / (double) iterations;
+
+      start = bench_now_ns ();
+      for (unsigned long i = 0; i < iterations; i++)
+      {
+        success &= bench_bulk_swap (lua_state, formats[real]);
+      }
+      double swapped = (bench_now_ns () - start) / (double) iterations;
+
+      printf ("%-6s %6zu %14.1f %14.1f %14.1f\n", real ? "float" : "int16", items, element, bulk, swapped);
+    }
+  }
+
+  format_free (formats[0]);
+  format_free (formats[1]);
+  bench_close_state (lua_state);
+  if (!success)
+  {
+    fprintf (stderr, "An encoder failed\n");
+    return 1;
+  }
+  return 0;
+}
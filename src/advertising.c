@@ -73,7 +73,7 @@ static dbus_method_t advertisement_methods[] =
 
 void advertisement_init (
   advertisement_t *advertisement,
-  char *object_path,
+  objpath_id_t device_path_id,
   service_t **services,
   char **device_name,
   uint16_t manufacturer_key,
@@ -82,7 +82,8 @@ void advertisement_init (
 )
 {
   advertisement->registered = false;
-  advertisement->object_path = strdup (object_path);
+  advertisement->register_call = NULL;
+  advertisement->path_id = objpath_add (device_path_id, OBJPATH_KIND_ADVERTISEMENT, 0, advertisement);
   advertisement->services = services;
   advertisement->local_name = device_name;
 
@@ -115,26 +116,39 @@ void advertisement_fini (advertisement_t *advertisement)
     return;
   }
 
-  free (advertisement->object_path);
+  dbusutils_cancel_pending_call (&advertisement->register_call);
+  objpath_remove (advertisement->path_id);
+  advertisement->path_id = OBJPATH_NONE;
   free (advertisement->type);
   free (advertisement->secondary_channel);
 }
 
 bool advertisement_register (advertisement_t *advertisement)
 {
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (advertisement->path_id, path);
   return dbusutils_register_object (
     global_dbus_connection,
-    advertisement->object_path,
+    path,
     advertisement_properties,
     advertisement_methods,
     advertisement
   );
 }
 
+void advertisement_unregister (advertisement_t *advertisement)
+{
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (advertisement->path_id, path);
+  dbusutils_unregister_object (global_dbus_connection, path);
+}
+
 static void on_register_advert_reply (DBusPendingCall *pending_call, void *user_data)
 {
   advertisement_t *advertisement = (advertisement_t *) user_data;
   DBusMessage *reply = dbus_pending_call_steal_reply (pending_call);
+  dbus_pending_call_unref (advertisement->register_call);
+  advertisement->register_call = NULL;
   if (NULL == reply)
   {
     return;
@@ -181,7 +195,7 @@ bool advertisement_register_with_bluez (
   //setup message "oa{sv}"
   DBusMessageIter args, dict;
   dbus_message_iter_init_append (message, &args);
-  dbus_message_iter_append_basic (&args, DBUS_TYPE_OBJECT_PATH, &advertisement->object_path);
+  objpath_iter_append (&args, advertisement->path_id);
   dbus_message_iter_open_container (
     &args,
     DBUS_TYPE_ARRAY,
@@ -197,24 +211,47 @@ bool advertisement_register_with_bluez (
   DBusError error;
   dbus_error_init (&error);
 
-  DBusPendingCall *pending_call = NULL;
-
-  dbus_connection_send_with_reply (connection, message, &pending_call, DBUS_TIMEOUT_USE_DEFAULT);
-  if (pending_call)
+  //the call is kept until the reply arrives so unregistering the advertisement can cancel it
+  dbusutils_cancel_pending_call (&advertisement->register_call);
+  dbus_connection_send_with_reply (connection, message, &advertisement->register_call, DBUS_TIMEOUT_USE_DEFAULT);
+  if (advertisement->register_call)
   {
-    dbus_pending_call_set_notify (pending_call, on_register_advert_reply, advertisement, NULL);
+    dbus_pending_call_set_notify (advertisement->register_call, on_register_advert_reply, advertisement, NULL);
   }
 
   if (message)
   {
     dbus_message_unref (message);
   }
-  if (pending_call)
+
+  return true;
+}
+
+bool advertisement_unregister_with_bluez (
+  advertisement_t *advertisement,
+  const char *controller_path,
+  DBusConnection *connection
+)
+{
+  dbusutils_cancel_pending_call (&advertisement->register_call);
+  if (!advertisement->registered)
   {
-    dbus_pending_call_unref (pending_call);
+    return true;
   }
 
-  return true;
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (advertisement->path_id, path);
+  bool success = dbusutils_send_object_path_method_call (
+    connection,
+    BLUEZ_BUS_NAME,
+    controller_path,
+    BLUEZ_LE_ADVERTISING_MANAGER_INTERFACE,
+    BLUEZ_METHOD_UNREGISTER_ADVERTISEMENT,
+    path
+  );
+
+  advertisement->registered = false;
+  return success;
 }
 
 static DBusMessage *advertisement_release (
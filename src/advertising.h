@@ -13,6 +13,7 @@
 
 #include "service.h"
 #include "dbusutils.h"
+#include "objpath.h"
 
 extern DBusConnection *global_dbus_connection;
 
@@ -43,7 +44,8 @@ typedef struct data_t
 typedef struct advertisement_t
 {
   bool registered;
-  char *object_path;
+  DBusPendingCall *register_call; //RegisterAdvertisement waiting for its reply, cancelled if the advertisement goes first
+  objpath_id_t path_id;
   char *type;
   service_t **services; //pointer to the devices services pointer
   manufacturer_data_t manufacturer_data;
@@ -66,7 +68,7 @@ typedef struct advertisement_t
 /**
  * Initialised advertisement values 
  * @param advertisement pointer to the advertisement
- * @param object_path object path of the advertisement
+ * @param device_path_id object path of the device the advertisement belongs to
  * @param services pointer to a pointer for list of services
  * @param device_name pointer to the device name pointer
  * @param manufacturer_key the manufacturer key
@@ -75,7 +77,7 @@ typedef struct advertisement_t
  **/
 void advertisement_init (
   advertisement_t *advertisement,
-  char *object_path,
+  objpath_id_t device_path_id,
   service_t **services,
   char **device_name,
   uint16_t manufacturer_key,
@@ -96,6 +98,12 @@ void advertisement_fini (advertisement_t *advertisement);
  **/
 bool advertisement_register (advertisement_t *advertisement);
 
+/**
+ * Unregisters the advertisement object from dbus
+ * @param advertisement pointer to the advertisement
+ **/
+void advertisement_unregister (advertisement_t *advertisement);
+
 /**
  * Registers the advertisement object with bluez advertisement manager
  * @param advertisement pointer to the advertisement
@@ -108,4 +116,16 @@ bool advertisement_register_with_bluez (
   DBusConnection *connection
 );
 
+/**
+ * Releases the advertisement from the bluez advertisement manager
+ * @param advertisement pointer to the advertisement
+ * @param controller_path path of the bluez controller the advertisement is registered with
+ * @return success true/false
+ **/
+bool advertisement_unregister_with_bluez (
+  advertisement_t *advertisement,
+  const char *controller_path,
+  DBusConnection *connection
+);
+
 #endif //BLE_SIM_ADVERTISING_H
\ No newline at end of file
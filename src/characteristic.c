@@ -11,8 +11,12 @@
 
 #include "characteristic.h"
 #include "descriptor.h"
+#include "device.h"
 #include "dbusutils.h"
+#include "events.h"
+#include "generator.h"
 #include "defines.h"
+#include "simclock.h"
 #include "utils.h"
 #include "logger.h"
 
@@ -52,6 +56,10 @@ static dbus_method_t characteristic_methods[] =
     DBUS_METHOD_NULL
   };
 
+static characteristic_t *pending_notifications = NULL; //characteristics with a changed value to signal
+
+static characteristic_read_function read_function = NULL;
+
 static object_flag_t characteristic_flags[] =
   {
     {CHARACTERISTIC_FLAG_BROADCAST,                     CHARACTERISTIC_FLAG_BROADCAST_ENABLED_BIT},
@@ -76,17 +84,105 @@ static object_flag_t characteristic_flags[] =
 void characteristic_init (characteristic_t *characteristic, const char *uuid, int origin)
 {
   characteristic->origin = origin;
-  characteristic->uuid = strdup (uuid);
-  characteristic->service_path = NULL;
-  characteristic->object_path = NULL;
+  characteristic->uuid = (origin == ORIGIN_SCHEMA) ? (char *) uuid : strdup (uuid);
+  characteristic->path_id = OBJPATH_NONE;
 
   characteristic->value = NULL;
   characteristic->value_size = 0;
 
   characteristic->notifying = false;
+  characteristic->subscribed = false;
+  atomic_init (&characteristic->skipped, false);
   characteristic->flags = CHARACTERISTIC_FLAGS_ALL_ENABLED; //all enabled for now
   characteristic->descriptors = NULL;
   characteristic->descriptor_count = 0;
+  characteristic->notification_pending = false;
+  characteristic->event_mask = 0;
+  characteristic->event_listener = NULL;
+  characteristic->read_ttl_ms = 0;
+  characteristic->read_expires_ms = 0;
+  characteristic->generator = NULL;
+  characteristic->next = NULL;
+  characteristic->next_pending = NULL;
+}
+
+static void characteristic_remove_pending (characteristic_t *characteristic)
+{
+  if (!characteristic->notification_pending)
+  {
+    return;
+  }
+
+  for (characteristic_t **pending = &pending_notifications; *pending; pending = &(*pending)->next_pending)
+  {
+    if (*pending == characteristic)
+    {
+      *pending = characteristic->next_pending;
+      break;
+    }
+  }
+  characteristic->next_pending = NULL;
+  characteristic->notification_pending = false;
+}
+
+//a characteristic the script frees before the service it was added to leaves the service's list
+static void characteristic_unlink (characteristic_t *characteristic)
+{
+  service_t *service = (service_t *) objpath_get_object (objpath_get_parent (characteristic->path_id));
+  if (NULL == service)
+  {
+    return;
+  }
+
+  for (characteristic_t **link = &service->characteristics; *link; link = &(*link)->next)
+  {
+    if (*link == characteristic)
+    {
+      *link = characteristic->next;
+      break;
+    }
+  }
+}
+
+//takes the characteristic off the bus and out of the path table, descriptors the script made stay with the script
+static void characteristic_release (characteristic_t *characteristic)
+{
+  characteristic_remove_pending (characteristic);
+  if (OBJPATH_NONE != characteristic->path_id)
+  {
+    device_set_subscribed (characteristic, false);
+    characteristic_unregister (characteristic);
+  }
+
+  descriptor_t *descriptor = characteristic->descriptors;
+  while (descriptor)
+  {
+    descriptor_t *next = descriptor->next;
+    if (descriptor->origin == ORIGIN_LUA)
+    {
+      descriptor_detach (descriptor);
+    }
+    else if (characteristic->origin == ORIGIN_C)
+    {
+      descriptor_free (descriptor);
+    }
+    else if (characteristic->origin == ORIGIN_SCHEMA)
+    {
+      descriptor_fini (descriptor);
+    }
+    descriptor = next;
+  }
+  characteristic->descriptors = NULL;
+
+  objpath_remove (characteristic->path_id);
+  characteristic->path_id = OBJPATH_NONE;
+}
+
+void characteristic_detach (characteristic_t *characteristic)
+{
+  characteristic_release (characteristic);
+  characteristic->notifying = false;
+  atomic_store (&characteristic->skipped, false);
   characteristic->next = NULL;
 }
 
@@ -97,20 +193,21 @@ void characteristic_fini (characteristic_t *characteristic)
     return;
   }
 
-  free (characteristic->uuid);
-  free (characteristic->service_path);
-  free (characteristic->object_path);
+  if (characteristic->origin == ORIGIN_LUA && OBJPATH_NONE != characteristic->path_id)
+  {
+    characteristic_unlink (characteristic);
+  }
+  generator_detach (characteristic);
+  if (characteristic->event_mask)
+  {
+    events_remove_object (characteristic);
+  }
+  characteristic_release (characteristic);
   free (characteristic->value);
 
-  if (characteristic->origin == ORIGIN_C)
+  if (characteristic->origin != ORIGIN_SCHEMA)
   {
-    descriptor_t *tmp = NULL;
-    while (characteristic->descriptors)
-    {
-      tmp = characteristic->descriptors->next;
-      descriptor_free (characteristic->descriptors);
-      characteristic->descriptors = tmp;
-    }
+    free (characteristic->uuid);
   }
 
 }
@@ -121,6 +218,19 @@ void characteristic_free (characteristic_t *characteristic)
   free (characteristic);
 }
 
+uint32_t characteristic_get_flag_bit (const char *flag)
+{
+  unsigned int flag_count = sizeof (characteristic_flags) / sizeof (characteristic_flags[0]);
+  for (unsigned int i = 0; i < flag_count; i++)
+  {
+    if (strcmp (flag, characteristic_flags[i].flag_value) == 0)
+    {
+      return characteristic_flags[i].enabled_bit;
+    }
+  }
+  return 0;
+}
+
 descriptor_t *characteristic_get_descriptor (characteristic_t *characteristic, const char *descriptor_uuid)
 {
   descriptor_t *descriptor = characteristic->descriptors;
@@ -138,13 +248,13 @@ descriptor_t *characteristic_get_descriptor (characteristic_t *characteristic, c
 
 bool characteristic_add_descriptor (characteristic_t *characteristic, descriptor_t *descriptor)
 {
-  if (NULL == characteristic->object_path)
+  if (OBJPATH_NONE == characteristic->path_id)
   {
     log_error ("Characteristic must be added to a service first in order to add a descriptor to it.");
     return false;
   }
 
-  if (NULL != descriptor->characteristic_path)
+  if (OBJPATH_NONE != descriptor->path_id)
   {
     log_error ("Descriptor already belongs to another characteristic.");
     return false;
@@ -155,13 +265,13 @@ bool characteristic_add_descriptor (characteristic_t *characteristic, descriptor
     return false;
   }
 
-  descriptor->object_path = dbusutils_create_object_path (characteristic->object_path, DESCRIPTOR_OBJECT_NAME, characteristic->descriptor_count);
-  if (!descriptor_register (descriptor))
+  descriptor->path_id = objpath_add (characteristic->path_id, OBJPATH_KIND_DESCRIPTOR, characteristic->descriptor_count, descriptor);
+  if (OBJPATH_NONE == descriptor->path_id || !descriptor_register (descriptor))
   {
-    free (descriptor->object_path);
+    objpath_remove (descriptor->path_id);
+    descriptor->path_id = OBJPATH_NONE;
     return false;
   }
-  descriptor->characteristic_path = strdup (characteristic->object_path);
 
   descriptor->next = characteristic->descriptors;
   characteristic->descriptors = descriptor;
@@ -171,7 +281,20 @@ bool characteristic_add_descriptor (characteristic_t *characteristic, descriptor
 
 bool characteristic_register (characteristic_t *characteristic)
 {
-  return dbusutils_register_object (global_dbus_connection, characteristic->object_path, characteristic_properties, characteristic_methods, characteristic);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (characteristic->path_id, path);
+  return dbusutils_register_object (global_dbus_connection, path, characteristic_properties, characteristic_methods, characteristic);
+}
+
+void characteristic_unregister (characteristic_t *characteristic)
+{
+  for (descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+  {
+    descriptor_unregister (descriptor);
+  }
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (characteristic->path_id, path);
+  dbusutils_unregister_object (global_dbus_connection, path);
 }
 
 static bool is_new_value (characteristic_t *characteristic, const void *new_value, const uint32_t value_size)
@@ -189,7 +312,7 @@ static bool is_new_value (characteristic_t *characteristic, const void *new_valu
   return false;
 }
 
-void characteristic_update_value (characteristic_t *characteristic, const void *new_value, const uint32_t value_size, DBusConnection *connection)
+void characteristic_update_value (characteristic_t *characteristic, const void *new_value, const uint32_t value_size)
 {
   if (!is_new_value (characteristic, new_value, value_size))
   {
@@ -198,26 +321,65 @@ void characteristic_update_value (characteristic_t *characteristic, const void *
 
   characteristic_set_value (characteristic, new_value, value_size);
 
-  if (characteristic->notifying)
+  if (characteristic->notifying && !characteristic->notification_pending)
   {
-    dbus_property_t changed_property[] = {
-      {BLE_PROPERTY_VALUE, DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING, characteristic_get_value},
-      DBUS_PROPERTY_NULL
-    };
-    dbusutils_send_object_properties_changed_signal (connection, characteristic->object_path, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, changed_property,
-                                                     characteristic);
+    characteristic->notification_pending = true;
+    characteristic->next_pending = pending_notifications;
+    pending_notifications = characteristic;
   }
 }
 
+void characteristic_send_notifications (DBusConnection *connection)
+{
+  dbus_property_t changed_property[] = {
+    {BLE_PROPERTY_VALUE, DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING, characteristic_get_value},
+    DBUS_PROPERTY_NULL
+  };
+
+  while (pending_notifications)
+  {
+    characteristic_t *characteristic = pending_notifications;
+    pending_notifications = characteristic->next_pending;
+    characteristic->next_pending = NULL;
+    characteristic->notification_pending = false;
+
+    if (characteristic->notifying && NULL != connection)
+    {
+      char path[OBJPATH_MAX_LENGTH];
+      objpath_format (characteristic->path_id, path);
+      dbusutils_send_object_properties_changed_signal (connection, path, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, changed_property,
+                                                       characteristic);
+    }
+  }
+}
+
+void characteristic_set_read_function (characteristic_read_function function)
+{
+  read_function = function;
+}
+
 void characteristic_set_notifying (characteristic_t *characteristic, bool notifying)
 {
   characteristic->notifying = notifying;
 }
 
+void characteristic_set_subscribed (characteristic_t *characteristic, bool subscribed)
+{
+  characteristic_set_notifying (characteristic, subscribed);
+  device_set_subscribed (characteristic, subscribed);
+  event_kind_t kind = subscribed ? EVENT_SUBSCRIBE : EVENT_UNSUBSCRIBE;
+  if (characteristic->event_mask & EVENT_MASK (kind))
+  {
+    events_post (kind, characteristic, characteristic->event_listener, NULL, 0);
+  }
+}
+
 //DBus Methods
 void characteristic_get_object (characteristic_t *characteristic, DBusMessageIter *iter)
 {
-  dbusutils_get_object_data (iter, characteristic_properties, characteristic->object_path, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, characteristic);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (characteristic->path_id, path);
+  dbusutils_get_object_data (iter, characteristic_properties, path, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, characteristic);
 }
 
 static void characteristic_get_uuid (void *user_data, DBusMessageIter *iter)
@@ -229,7 +391,7 @@ static void characteristic_get_uuid (void *user_data, DBusMessageIter *iter)
 static void characteristic_get_service (void *user_data, DBusMessageIter *iter)
 {
   characteristic_t *characteristic = (characteristic_t *) user_data;
-  dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH, &characteristic->service_path);
+  objpath_iter_append (iter, objpath_get_parent (characteristic->path_id));
 }
 
 static void characteristic_get_flags (void *user_data, DBusMessageIter *iter)
@@ -268,14 +430,17 @@ static void characteristic_set_value (characteristic_t *characteristic, const vo
     return;
   }
 
-  free (characteristic->value);
-  characteristic->value = NULL;
-  characteristic->value_size = 0;
-
-  characteristic->value = malloc (value_size);
-  if (NULL == characteristic->value)
+  if (value_size != characteristic->value_size) //values of the same size reuse the buffer
   {
-    return;
+    void *value = realloc (characteristic->value, value_size ? value_size : 1);
+    if (NULL == value)
+    {
+      free (characteristic->value);
+      characteristic->value = NULL;
+      characteristic->value_size = 0;
+      return;
+    }
+    characteristic->value = value;
   }
   memcpy (characteristic->value, new_value, value_size);
   characteristic->value_size = value_size;
@@ -285,6 +450,16 @@ static void characteristic_set_value (characteristic_t *characteristic, const vo
 static DBusMessage *characteristic_read_value (void *user_data, DBusConnection *connection, DBusMessage *message)
 {
   //TODO: parse message options  
+  characteristic_t *characteristic = (characteristic_t *) user_data;
+  if ((characteristic->event_mask & EVENT_MASK (EVENT_READ)) && NULL != read_function)
+  {
+    uint64_t now = simclock_now_ms ();
+    if (now >= characteristic->read_expires_ms && read_function (characteristic))
+    {
+      characteristic->read_expires_ms = now + characteristic->read_ttl_ms;
+    }
+  }
+
   DBusMessage *reply = dbus_message_new_method_return (message);
   if (NULL == reply)
   {
@@ -315,7 +490,12 @@ static DBusMessage *characteristic_write_value (void *user_data, DBusConnection
   //TODO: parse message options 
 
   //set the value
-  characteristic_set_value ((characteristic_t *) user_data, new_value, (uint32_t) element_count);
+  characteristic_t *characteristic = (characteristic_t *) user_data;
+  characteristic_set_value (characteristic, new_value, (uint32_t) element_count);
+  if (characteristic->event_mask & EVENT_MASK (EVENT_WRITE))
+  {
+    events_post (EVENT_WRITE, characteristic, characteristic->event_listener, new_value, (uint32_t) element_count);
+  }
 
   DBusMessage *reply = dbus_message_new_method_return (message); //might need to return some sort of success, or maybe a lack of error is a success? ;) 
   return reply;
@@ -324,7 +504,7 @@ static DBusMessage *characteristic_write_value (void *user_data, DBusConnection
 static DBusMessage *characteristic_start_notify (void *user_data, DBusConnection *connection, DBusMessage *message)
 {
   characteristic_t *characteristic = (characteristic_t *) user_data;
-  characteristic_set_notifying (characteristic, true);
+  characteristic_set_subscribed (characteristic, true);
 
   DBusMessage *reply = dbus_message_new_method_return (message);
   return reply;
@@ -333,7 +513,7 @@ static DBusMessage *characteristic_start_notify (void *user_data, DBusConnection
 static DBusMessage *characteristic_stop_notify (void *user_data, DBusConnection *connection, DBusMessage *message)
 {
   characteristic_t *characteristic = (characteristic_t *) user_data;
-  characteristic_set_notifying (characteristic, false);
+  characteristic_set_subscribed (characteristic, false);
 
   DBusMessage *reply = dbus_message_new_method_return (message);
   return reply;
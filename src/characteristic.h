@@ -9,6 +9,7 @@
 #define BLE_SIM_CHARACTERISTIC_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include <dbus/dbus.h>
 
 #include "defines.h"
@@ -17,23 +18,39 @@
 typedef struct characteristic_t
 {
   char *uuid; //128-bit characteristic UUID.
-  char *service_path; //Object path of the GATT service the characteristic belongs to.
-  char *object_path; //Object path of the characteristic object
+  objpath_id_t path_id; //Object path of the characteristic object, its parent is the GATT service the characteristic belongs to
   void *value; //The characteristic's value
   uint32_t value_size;
   bool notifying; //if notifications or indications on this	characteristic are currently enabled
+  bool subscribed; //a central started notifications and has not stopped them, counted by the device
+  atomic_bool skipped; //updates are skipped as the device is idle, kept by the dbus thread for device_skips_characteristic
   uint32_t flags; //Flags to define how the characteristic value can be used
   descriptor_t *descriptors;
   unsigned int descriptor_count;
   int origin; //where the object was created - influences how we free it
+  bool notification_pending; //queued for a PropertiesChanged signal
+  uint8_t event_mask; //EVENT_MASK bits of the events a script listens for
+  void *event_listener; //set by the lua interface to route the events to the state that listens
+  uint32_t read_ttl_ms; //how long a value computed by the read function is reused for
+  uint64_t read_expires_ms; //when the value computed by the read function expires
+  struct generator_t *generator; //generator that sets the value or NULL
   struct characteristic_t *next;
+  struct characteristic_t *next_pending; //pending notification list
 } characteristic_t;
 
+/**
+ * Computes a characteristics value when a central reads it, used for characteristics
+ * with the EVENT_READ bit in their event mask
+ * @param characteristic the characteristic being read
+ * @return true/false if the value was computed, it is reused for read_ttl_ms if so
+ **/
+typedef bool (*characteristic_read_function) (characteristic_t *characteristic);
+
 /**
  * Initialises values for a new characteristic
  * @param characteristic the characteristic
  * @param uuid the uuid of the characteristic
- * @param origin the origin of the object used to distinguish if it was created in lua
+ * @param origin the origin of the object used to distinguish if it was created in lua, ORIGIN_SCHEMA objects borrow the uuid
  * @return initialised characteristic  
  **/
 void characteristic_init (characteristic_t *characteristic, const char *uuid, int origin);
@@ -50,6 +67,19 @@ void characteristic_fini (characteristic_t *characteristic);
  **/
 void characteristic_free (characteristic_t *characteristic);
 
+/**
+ * Takes a characteristic whose service is being freed off the bus and out of the path table with its descriptors,
+ * the characteristic stays usable and can be added to another service
+ * @param characteristic the characteristic
+ **/
+void characteristic_detach (characteristic_t *characteristic);
+
+/**
+ * Looks up the bit for a characteristic flag e.g "notify"
+ * @param flag the flag string
+ * @return the flag bit or 0 if the flag is unknown
+ **/
+uint32_t characteristic_get_flag_bit (const char *flag);
 
 /**
  * Searches the characteristic for a descriptor
@@ -70,14 +100,27 @@ descriptor_t *characteristic_get_descriptor (characteristic_t *characteristic, c
 bool characteristic_add_descriptor (characteristic_t *characteristic, descriptor_t *descriptor);
 
 /**
- * Updates a characteristics value. If the characterisitc is notifying it will produce a PropertiesChanged signal 
+ * Updates a characteristics value. If the value changed and the characterisitc is notifying it is queued
+ * for a PropertiesChanged signal, sent by characteristic_send_notifications
  * 
  * @param characteristic the characteristic to update
  * @param new_value pointer to the new value 
  * @param value_size size of the new value
- * @param connection dbus connection to send the properties changed signal on
  **/
-void characteristic_update_value (characteristic_t *characteristic, const void *new_value, const uint32_t value_size, DBusConnection *connection);
+void characteristic_update_value (characteristic_t *characteristic, const void *new_value, const uint32_t value_size);
+
+/**
+ * Sends one PropertiesChanged signal for each characteristic whose value changed since the last call,
+ * however many times it was updated
+ * @param connection dbus connection to send the signals on
+ **/
+void characteristic_send_notifications (DBusConnection *connection);
+
+/**
+ * Sets the function that computes values on read
+ * @param function the function or NULL
+ **/
+void characteristic_set_read_function (characteristic_read_function function);
 
 /**
  * Sets a characteristics notifying state 
@@ -86,6 +129,15 @@ void characteristic_update_value (characteristic_t *characteristic, const void *
  */
 void characteristic_set_notifying (characteristic_t *characteristic, bool notifying);
 
+/**
+ * A central started or stopped notifications, with StartNotify and StopNotify or by writing the Client
+ * Characteristic Configuration descriptor. Sets notifying, counts the subscription against the device
+ * and posts a subscribe or unsubscribe event if a script listens for it
+ * @param characteristic the characteristic
+ * @param subscribed true/false if notifications were started or stopped
+ **/
+void characteristic_set_subscribed (characteristic_t *characteristic, bool subscribed);
+
 /**
  * Registers the characteristic object with dbus
  * @param characteristic pointer to the characteristic
@@ -93,6 +145,12 @@ void characteristic_set_notifying (characteristic_t *characteristic, bool notify
  **/
 bool characteristic_register (characteristic_t *characteristic);
 
+/**
+ * Unregisters the characteristic object and its descriptors from dbus
+ * @param characteristic pointer to the characteristic
+ **/
+void characteristic_unregister (characteristic_t *characteristic);
+
 //DBus Methods
 /**
  * Populates a dbus message iter with a characteristic's object data
@@ -42,6 +42,8 @@ const DBusObjectPathVTable object_vtable =
 
 atomic_bool dbusutils_mainloop_running = false;
 
+static atomic_uint registered_object_count = 0;
+
 void dbusutils_send_object_properties_changed_signal (
   DBusConnection *connection,
   const char *path,
@@ -200,18 +202,6 @@ void dbusutils_get_object_data (
   dbus_message_iter_close_container (iter, &entry);
 }
 
-char *dbusutils_create_object_path (
-  const char *prev_path,
-  const char *object_name,
-  unsigned int object_id
-)
-{
-  size_t required = snprintf (NULL, 0, "%s/%s%u", prev_path, object_name, object_id) + 1;
-  char *path = malloc (required);
-  sprintf (path, "%s/%s%u", prev_path, object_name, object_id);
-  return path;
-}
-
 const char *dbusutils_get_error_message_from_reply (DBusMessage *reply)
 {
   if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_ERROR)
@@ -233,6 +223,50 @@ const char *dbusutils_get_error_message_from_reply (DBusMessage *reply)
   return error_message;
 }
 
+bool dbusutils_get_option_offset (DBusMessageIter *options, uint16_t *offset)
+{
+  *offset = 0;
+  int type = dbus_message_iter_get_arg_type (options);
+  if (type == DBUS_TYPE_INVALID)
+  {
+    return true;
+  }
+  if (type != DBUS_TYPE_ARRAY)
+  {
+    return false;
+  }
+
+  DBusMessageIter array, entry, variant;
+  dbus_message_iter_recurse (options, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY)
+  {
+    const char *option = NULL;
+    dbus_message_iter_recurse (&array, &entry);
+    if (dbus_message_iter_get_arg_type (&entry) != DBUS_TYPE_STRING)
+    {
+      return false;
+    }
+    dbus_message_iter_get_basic (&entry, &option);
+    if (strcmp (option, BLUEZ_OPTION_OFFSET) == 0)
+    {
+      if (!dbus_message_iter_next (&entry) || dbus_message_iter_get_arg_type (&entry) != DBUS_TYPE_VARIANT)
+      {
+        return false;
+      }
+      dbus_message_iter_recurse (&entry, &variant);
+      if (dbus_message_iter_get_arg_type (&variant) != DBUS_TYPE_UINT16)
+      {
+        return false;
+      }
+      dbus_uint16_t value = 0;
+      dbus_message_iter_get_basic (&variant, &value);
+      *offset = value;
+    }
+    dbus_message_iter_next (&array);
+  }
+  return true;
+}
+
 DBusConnection *dbusutils_get_connection (void)
 {
   DBusError err;
@@ -251,6 +285,7 @@ static void dbusutils_object_handle_unregister (DBusConnection *connection, void
 {
   //object_data_t *object_data = (object_data_t*) data;
 
+  registered_object_count--;
   free (data);
 }
 
@@ -402,7 +437,16 @@ bool dbusutils_register_object (DBusConnection *connection,
                                 dbus_method_t *method_table,
                                 void *object_ptr)
 {
+  if (NULL == connection) //dry run, nothing is put on the bus
+  {
+    return true;
+  }
+
   object_data_t *object_data = calloc (1, sizeof (*object_data));
+  if (NULL == object_data)
+  {
+    return false;
+  }
   object_data->methods = method_table;
   object_data->properties = properties_table;
   object_data->object_ptr = object_ptr;
@@ -414,11 +458,86 @@ bool dbusutils_register_object (DBusConnection *connection,
   {
     log_debug ("[%s:%d] Error registering object path (%s): (%s)", __FUNCTION__, __LINE__, object_path, err.message);
     dbus_error_free (&err);
+    free (object_data);
     return false;
   }
+  registered_object_count++;
   return true;
 }
 
+bool dbusutils_unregister_object (DBusConnection *connection, const char *object_path)
+{
+  if (NULL == object_path)
+  {
+    return false;
+  }
+
+  if (NULL == connection)
+  {
+    return true;
+  }
+
+  //objects are released both when they are unregistered and when they are freed, the second time there is nothing to do
+  void *object_data = NULL;
+  if (!dbus_connection_get_object_path_data (connection, object_path, &object_data) || NULL == object_data)
+  {
+    return true;
+  }
+
+  if (!dbus_connection_unregister_object_path (connection, object_path))
+  {
+    log_debug ("[%s:%d] Error unregistering object path (%s)", __FUNCTION__, __LINE__, object_path);
+    return false;
+  }
+  return true;
+}
+
+void dbusutils_cancel_pending_call (DBusPendingCall **pending_call)
+{
+  if (NULL == *pending_call)
+  {
+    return;
+  }
+
+  dbus_pending_call_cancel (*pending_call);
+  dbus_pending_call_unref (*pending_call);
+  *pending_call = NULL;
+}
+
+size_t dbusutils_get_object_data_size (void)
+{
+  return sizeof (object_data_t);
+}
+
+unsigned int dbusutils_get_registered_object_count (void)
+{
+  return registered_object_count;
+}
+
+bool dbusutils_send_object_path_method_call (
+  DBusConnection *connection,
+  const char *bus_name,
+  const char *path,
+  const char *iface,
+  const char *method,
+  const char *object_path
+)
+{
+  DBusMessage *message = dbus_message_new_method_call (bus_name, path, iface, method);
+  if (NULL == message)
+  {
+    return false;
+  }
+
+  DBusMessageIter args;
+  dbus_message_iter_init_append (message, &args);
+  dbus_message_iter_append_basic (&args, DBUS_TYPE_OBJECT_PATH, &object_path);
+
+  bool success = dbus_connection_send (connection, message, NULL);
+  dbus_message_unref (message);
+  return success;
+}
+
 DBusMessage *dbusutils_set_property_basic (
   DBusConnection *connection,
   const char *bus_name,
@@ -429,6 +548,12 @@ DBusMessage *dbusutils_set_property_basic (
   void *data
 )
 {
+  if (NULL == connection)
+  {
+    log_debug ("[%s:%u] No dbus connection to set %s on", __FUNCTION__, __LINE__, property);
+    return NULL;
+  }
+
   DBusError err;
   dbus_error_init (&err);
 
@@ -9,6 +9,7 @@
 #define BLE_SIM_DBUSUTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdatomic.h>
 #include <dbus/dbus.h>
 
@@ -103,30 +104,20 @@ void dbusutils_get_object_data (
   void *object_pointer
 );
 
-/**
- * creates a valid dbus object path:
- * prev_path + "/" + object_name + object_id
- * 
- * e.g prev_path = "/dev", object_name = "service", object_id = 1
- *  output would be "/dev/service1"
- * 
- * @param prev_path object hierarchy path
- * @param object_name name of the object
- * @param object_id id of the object
- * @return the created object path
- **/
-char *dbusutils_create_object_path (
-  const char *prev_path,
-  const char *object_name,
-  unsigned int object_id
-);
-
 /**
  * @param The dbus message to get the error message from
  * @return error message (should not be free'd) or NULL
  **/
 const char *dbusutils_get_error_message_from_reply (DBusMessage *reply);
 
+/**
+ * Reads the offset option of a ReadValue or WriteValue call
+ * @param options iterator at the a{sv} options argument, an iterator past the last argument reads as no options
+ * @param offset set to the offset, 0 if the option is not given
+ * @return true/false if the options could be read, false if they are not a{sv} or the offset is not a uint16
+ **/
+bool dbusutils_get_option_offset (DBusMessageIter *options, uint16_t *offset);
+
 /**
  * Creates a dbus connection
  * 
@@ -143,6 +134,7 @@ bool dbusutils_request_application_bus_name (DBusConnection *connection);
 
 /**
  *  Registers a handler for a given path in the object hierarchy. 
+ *  A NULL connection (dry run) registers nothing and succeeds
  *  @param DBusConnection the dbus connection 
  *  @param path the object path
  *  @param property_table the object's property table
@@ -152,6 +144,50 @@ bool dbusutils_request_application_bus_name (DBusConnection *connection);
  **/
 bool dbusutils_register_object (DBusConnection *connection, const char *path, dbus_property_t *property_table, dbus_method_t *method_table, void *object_ptr);
 
+/**
+ *  Unregisters the handler for a path in the object hierarchy
+ *  @param DBusConnection the dbus connection
+ *  @param path the object path
+ *  @return successful true/false
+ **/
+bool dbusutils_unregister_object (DBusConnection *connection, const char *path);
+
+/**
+ *  Cancels a call whose reply has not arrived yet so its notify function is never called, and drops the reference to it
+ *  @param pending_call the call, set to NULL - a NULL call is ignored
+ **/
+void dbusutils_cancel_pending_call (DBusPendingCall **pending_call);
+
+/**
+ * @return the size of the wrapper registered with libdbus for each object in bytes
+ **/
+size_t dbusutils_get_object_data_size (void);
+
+/**
+ * @return the number of objects currently registered with libdbus
+ **/
+unsigned int dbusutils_get_registered_object_count (void);
+
+/**
+ * Sends a method call which takes a single object path argument without waiting for the reply
+ *
+ * @param connection a DBusConnection
+ * @param bus_name Dbus bus name
+ * @param path dbus path
+ * @param iface dbus interface
+ * @param method dbus method to call
+ * @param object_path the object path argument
+ * @return successful true/false
+ **/
+bool dbusutils_send_object_path_method_call (
+  DBusConnection *connection,
+  const char *bus_name,
+  const char *path,
+  const char *iface,
+  const char *method,
+  const char *object_path
+);
+
 /**
  * Performs a dbus method call
  *
@@ -13,6 +13,23 @@
 #define SIM_ARGS_OPTION_SCRIPT "--script"
 #define SIM_ARGS_OPTION_HELP "--help"
 #define SIM_ARGS_OPTION_LOGGING "--logging"
+#define SIM_ARGS_OPTION_DRY_RUN "--dry-run"
+#define SIM_ARGS_OPTION_SNAPSHOT "--snapshot"
+#define SIM_ARGS_OPTION_WORKERS "--workers"
+#define SIM_ARGS_OPTION_LUA_MEMORY_LIMIT "--lua-memory-limit"
+#define SIM_ARGS_OPTION_LUA_TIME_BUDGET "--lua-time-budget"
+#define SIM_ARGS_OPTION_LUA_INSTRUCTION_BUDGET "--lua-instruction-budget"
+#define SIM_ARGS_OPTION_SCRIPT_CACHE "--script-cache"
+#define SIM_ARGS_OPTION_PROFILE "--profile"
+#define SIM_ARGS_OPTION_TIME_SCALE "--time-scale"
+#define SIM_ARGS_OPTION_SEED "--seed"
+#define SIM_ARGS_OPTION_SKIP_IDLE "--skip-idle"
+
+#define SIM_MAX_WORKERS 256
+#define SIM_MAX_LUA_MEMORY_LIMIT_MB 65536
+#define SIM_MAX_BULK_DEVICES 65536 //devices built by one ble.createDevices call
+#define SIM_DEFAULT_LUA_TIME_BUDGET_MS 0 //per call into a script, budgets are opt in
+#define SIM_MAX_TIME_SCALE 1000000.0
 
 #define LOGGING_LEVEL_NONE_STR "None"
 #define LOGGING_LEVEL_INFO_STR "Info"
@@ -22,6 +39,7 @@
 #define LOGGING_LEVEL_TRACE_STR "Trace"
 
 #define ORIGIN_C 1
+#define ORIGIN_SCHEMA 2 //part of a device instantiated from a schema, uuid is shared with the schema and memory is freed with the device
 #define ORIGIN_LUA 3
 
 #define HCI_WAKEUP_TIME 100
@@ -91,6 +109,7 @@
 
 #define BLUEZ_BUS_NAME "org.bluez"
 #define BLUEZ_ADAPTER_INTERFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_INTERFACE "org.bluez.Device1"
 #define BLUEZ_GATT_MANAGER_INTERFACE "org.bluez.GattManager1"
 #define BLUEZ_GATT_SERVICE_INTERFACE "org.bluez.GattService1"
 #define BLUEZ_GATT_CHARACTERISTIC_INTERFACE "org.bluez.GattCharacteristic1"
@@ -100,14 +119,27 @@
 
 #define BLUEZ_ADAPTER_PROPERTY_POWERED "Powered"
 #define BLUEZ_ADAPTER_PROPERTY_DISCOVERABLE "Discoverable"
+#define BLUEZ_DEVICE_PROPERTY_CONNECTED "Connected"
+
+//matches the Connected changes of remote devices on every controller
+#define BLUEZ_DEVICE_PROPERTIES_CHANGED_MATCH \
+  "type='signal',sender='" BLUEZ_BUS_NAME "',interface='" DBUS_INTERFACE_PROPERTIES "',member='" DBUS_SIGNAL_PROPERTIES_CHANGED "',arg0='" BLUEZ_DEVICE_INTERFACE "'"
 
 #define BLUEZ_METHOD_RELEASE "Release"
 #define BLUEZ_METHOD_REGISTER_APPLICATION "RegisterApplication"
 #define BLUEZ_METHOD_REGISTER_ADVERTISEMENT "RegisterAdvertisement"
+#define BLUEZ_METHOD_UNREGISTER_APPLICATION "UnregisterApplication"
+#define BLUEZ_METHOD_UNREGISTER_ADVERTISEMENT "UnregisterAdvertisement"
 #define BLUEZ_METHOD_READ_VALUE "ReadValue"
 #define BLUEZ_METHOD_WRITE_VALUE "WriteValue"
 #define BLUEZ_METHOD_START_NOTIFY "StartNotify"
 #define BLUEZ_METHOD_STOP_NOTIFY "StopNotify"
+#define BLUEZ_OPTION_OFFSET "offset" //ReadValue and WriteValue option, uint16
+
+#define BLUEZ_ERROR_INVALID_ARGUMENTS "org.bluez.Error.InvalidArguments"
+#define BLUEZ_ERROR_INVALID_OFFSET "org.bluez.Error.InvalidOffset"
+#define BLUEZ_ERROR_NOT_PERMITTED "org.bluez.Error.NotPermitted"
+#define BLUEZ_ERROR_NOT_SUPPORTED "org.bluez.Error.NotSupported"
 
 #define DEFAULT_TIMEOUT 1000
 
@@ -149,6 +181,11 @@
 #define CHARACTERISTIC_FLAG_AUTHORIZE_ENABLED_BIT (1 << 16)
 
 #define DESCRIPTOR_FLAGS_ALL_ENABLED 0x01FF
+#define DESCRIPTOR_UUID_CCCD "2902" //Client Characteristic Configuration
+#define DESCRIPTOR_UUID_CCCD_FULL "00002902-0000-1000-8000-00805f9b34fb"
+#define DESCRIPTOR_CCCD_SIZE 2
+#define DESCRIPTOR_CCCD_NOTIFY 0x01 //bits of the first byte of the little endian value
+#define DESCRIPTOR_CCCD_INDICATE 0x02
 #define DESCRIPTOR_FLAG_READ "read"
 #define DESCRIPTOR_FLAG_READ_ENABLED_BIT (1 << 0)
 #define DESCRIPTOR_FLAG_WRITE "write"
@@ -178,31 +215,107 @@
 #define LUA_USERDATA_SERVICE "service"
 #define LUA_USERDATA_CHARACTERISTIC "characteristic"
 #define LUA_USERDATA_DESCRIPTOR "descriptor"
+#define LUA_USERDATA_SCHEMA "schema"
+#define LUA_USERDATA_BUFFER "buffer"
+#define LUA_USERDATA_VIEW "view"
+#define LUA_USERDATA_FORMAT "format"
 
 #define LUA_INDEX_FIELD "__index"
 #define LUA_GARBAGE_COLLECTOR_FIELD "__gc"
+#define LUA_NEW_INDEX_FIELD "__newindex"
+#define LUA_LENGTH_FIELD "__len"
 //lua api names
 #define LUA_API_CREATE_DEVICE "createDevice"
 #define LUA_API_CREATE_SERVICE "createService"
 #define LUA_API_CREATE_CHARACTERISTIC "createCharacteristic"
 #define LUA_API_CREATE_DESCRIPTOR "createDescriptor"
 #define LUA_API_REGISTER_DEVICE "registerDevice"
+#define LUA_API_REMOVE_DEVICE "removeDevice"
+#define LUA_API_CREATE_SCHEMA "createSchema"
+#define LUA_API_CREATE_DEVICES "createDevices"
+#define LUA_API_GET_DEVICE "getDevice"
+#define LUA_API_BUFFER "buffer"
+#define LUA_API_FORMAT "format"
+#define LUA_API_SET_VALUES "setValues"
+#define LUA_API_WORKER "worker"
+#define LUA_API_SPAWN "spawn"
+#define LUA_API_SLEEP "sleep"
+#define LUA_API_WAIT_FOR "waitFor"
+#define LUA_API_SIGNAL "signal"
+#define LUA_API_NOW "now"
+#define LUA_API_RESTORED "restored"
+#define LUA_API_RELOADED "reloaded"
 
 #define LUA_API_FUNCTION_UPDATE "Update"
 
+//replaced in the math library of a seeded run
+#define LUA_MATH_LIBRARY "math"
+#define LUA_MATH_RANDOM "random"
+#define LUA_MATH_RANDOMSEED "randomseed"
+
 //lua device methods
 #define LUA_DEVICE_ADD_SERVICE "addService"
 #define LUA_DEVICE_SET_POWERED "powered"
 #define LUA_DEVICE_SET_DISCOVERABLE "discoverable"
+#define LUA_DEVICE_GET_SERVICE "getService"
+#define LUA_DEVICE_SET_VALUES "setValues"
+#define LUA_DEVICE_ON_CONNECT "onConnect"
+#define LUA_DEVICE_ON_DISCONNECT "onDisconnect"
+#define LUA_DEVICE_IS_ACTIVE "isActive"
 
 //lua service methods
 #define LUA_SERVICE_ADD_CHARACTERISTIC "addCharacteristic"
+#define LUA_SERVICE_GET_CHARACTERISTIC "getCharacteristic"
 
 //lua characteristic methods
 #define LUA_CHARACTERISTIC_ADD_DESCRIPTOR "addDescriptor"
+#define LUA_CHARACTERISTIC_GET_DESCRIPTOR "getDescriptor"
 #define LUA_CHARACTERISTIC_SET_NOTIFYING "notifying"
 #define LUA_CHARACTERISTIC_SET_VALUE "setValue"
+#define LUA_CHARACTERISTIC_ON_WRITE "onWrite"
+#define LUA_CHARACTERISTIC_ON_READ "onRead"
+#define LUA_CHARACTERISTIC_ON_SUBSCRIBE "onSubscribe"
+#define LUA_CHARACTERISTIC_ON_UNSUBSCRIBE "onUnsubscribe"
+#define LUA_CHARACTERISTIC_GENERATE "generate"
 //lua descriptor methods
+#define LUA_DESCRIPTOR_SET_VALUE "setValue"
+
+//lua schema methods
+#define LUA_SCHEMA_INSTANTIATE "instantiate"
+
+//lua buffer methods
+#define LUA_BUFFER_WRITE "write"
+#define LUA_BUFFER_FILL "fill"
+#define LUA_BUFFER_TO_STRING "toString"
+
+//lua schema definition table fields
+#define LUA_FIELD_SERVICES "services"
+#define LUA_FIELD_CHARACTERISTICS "characteristics"
+#define LUA_FIELD_DESCRIPTORS "descriptors"
+#define LUA_FIELD_UUID "uuid"
+#define LUA_FIELD_PRIMARY "primary"
+#define LUA_FIELD_FLAGS "flags"
+#define LUA_FIELD_INDEX "index"
+#define LUA_FIELD_COUNT "count"
+#define LUA_FIELD_NAME "name"
+#define LUA_FIELD_START "start"
+#define LUA_FIELD_TEMPLATE "template"
+
+//lua generator table fields
+#define LUA_FIELD_KIND "kind"
+#define LUA_FIELD_TYPE "type"
+#define LUA_FIELD_RATE "rate"
+#define LUA_FIELD_PERIOD "period"
+#define LUA_FIELD_AMPLITUDE "amplitude"
+#define LUA_FIELD_OFFSET "offset"
+#define LUA_FIELD_MIN "min"
+#define LUA_FIELD_MAX "max"
+#define LUA_FIELD_STEP "step"
+#define LUA_FIELD_VALUES "values"
+#define LUA_FIELD_SEED "seed"
+
+#define GENERATOR_DEFAULT_RATE_MS 1000
+#define GENERATOR_DEFAULT_PERIOD_MS 60000
 
 typedef enum
 { //Datatypes supported by the sim
@@ -218,6 +331,7 @@ typedef enum
   BLE_FLOAT = 9,
   BLE_DOUBLE = 10,
   BLE_STRING = 11,
+  BLE_BYTES = 12, //raw bytes from a lua string or buffer, embedded nuls are kept
 } ble_data_type_t;
 
 static const size_t BLE_DATA_TYPE_SIZE[] =
@@ -234,6 +348,7 @@ static const size_t BLE_DATA_TYPE_SIZE[] =
   4, //BLE_FLOAT
   8, //BLE_DOUBLE
   0, //BLE_STRING
+  0, //BLE_BYTES
 };
 
 
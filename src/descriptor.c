@@ -8,8 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "descriptor.h"
+#include "characteristic.h"
 #include "defines.h"
 #include "dbusutils.h"
 #include "utils.h"
@@ -22,8 +24,11 @@ static void descriptor_get_flags (void *user_data, DBusMessageIter *iter);
 
 static void descriptor_get_value (void *user_data, DBusMessageIter *iter);
 
-static void descriptor_read_value (descriptor_t *descriptor, DBusMessageIter *iter);
+static void descriptor_append_value (descriptor_t *descriptor, uint32_t offset, DBusMessageIter *iter);
 
+static DBusMessage *descriptor_read_value (void *user_data, DBusConnection *connection, DBusMessage *message);
+
+static DBusMessage *descriptor_write_value (void *user_data, DBusConnection *connection, DBusMessage *message);
 
 static dbus_property_t descriptor_properties[] =
   {
@@ -36,6 +41,8 @@ static dbus_property_t descriptor_properties[] =
 
 static dbus_method_t descriptor_methods[] =
   {
+    {BLUEZ_GATT_DESCRIPTOR_INTERFACE, BLUEZ_METHOD_READ_VALUE, descriptor_read_value},
+    {BLUEZ_GATT_DESCRIPTOR_INTERFACE, BLUEZ_METHOD_WRITE_VALUE, descriptor_write_value},
     DBUS_METHOD_NULL
   };
 
@@ -55,14 +62,44 @@ static object_flag_t descriptor_flags[] =
 void descriptor_init (descriptor_t *descriptor, const char *uuid, int origin)
 {
   descriptor->origin = origin;
-  descriptor->uuid = strdup (uuid);
-  descriptor->characteristic_path = NULL;
-  descriptor->object_path = NULL;
+  descriptor->uuid = (origin == ORIGIN_SCHEMA) ? (char *) uuid : strdup (uuid);
+  descriptor->path_id = OBJPATH_NONE;
 
   descriptor->value = NULL;
   descriptor->value_size = 0;
 
   descriptor->flags = DESCRIPTOR_FLAGS_ALL_ENABLED;
+  descriptor->cccd = strcasecmp (uuid, DESCRIPTOR_UUID_CCCD) == 0 || strcasecmp (uuid, DESCRIPTOR_UUID_CCCD_FULL) == 0;
+  descriptor->next = NULL;
+}
+
+//a descriptor the script frees before the characteristic it was added to leaves the characteristic's list
+static void descriptor_unlink (descriptor_t *descriptor)
+{
+  characteristic_t *characteristic = (characteristic_t *) objpath_get_object (objpath_get_parent (descriptor->path_id));
+  if (NULL == characteristic)
+  {
+    return;
+  }
+
+  for (descriptor_t **link = &characteristic->descriptors; *link; link = &(*link)->next)
+  {
+    if (*link == descriptor)
+    {
+      *link = descriptor->next;
+      break;
+    }
+  }
+}
+
+void descriptor_detach (descriptor_t *descriptor)
+{
+  if (OBJPATH_NONE != descriptor->path_id)
+  {
+    descriptor_unregister (descriptor);
+    objpath_remove (descriptor->path_id);
+    descriptor->path_id = OBJPATH_NONE;
+  }
   descriptor->next = NULL;
 }
 
@@ -72,10 +109,21 @@ void descriptor_fini (descriptor_t *descriptor)
   {
     return;
   }
-  
-  free (descriptor->object_path);
-  free (descriptor->uuid);
-  free (descriptor->characteristic_path);
+
+  if (descriptor->origin == ORIGIN_LUA && OBJPATH_NONE != descriptor->path_id)
+  {
+    descriptor_unlink (descriptor);
+  }
+  if (OBJPATH_NONE != descriptor->path_id)
+  {
+    descriptor_unregister (descriptor);
+  }
+  objpath_remove (descriptor->path_id);
+  descriptor->path_id = OBJPATH_NONE;
+  if (descriptor->origin != ORIGIN_SCHEMA)
+  {
+    free (descriptor->uuid);
+  }
   free (descriptor->value);
 }
 
@@ -86,15 +134,91 @@ void descriptor_free (descriptor_t *descriptor)
   free (descriptor);
 }
 
+//the characteristic of a registered descriptor, NULL if it has not been added to one
+static characteristic_t *descriptor_get_parent_characteristic (const descriptor_t *descriptor)
+{
+  return (characteristic_t *) objpath_get_object (objpath_get_parent (descriptor->path_id));
+}
+
+//writes value_size bytes at offset, the value ends after them. offset is at most the current size
+static bool descriptor_set_value_at (descriptor_t *descriptor, uint32_t offset, const void *new_value, uint32_t value_size)
+{
+  uint32_t size = offset + value_size;
+  if (size != descriptor->value_size) //values of the same size reuse the buffer, realloc keeps the bytes before offset
+  {
+    uint8_t *value = realloc (descriptor->value, size ? size : 1);
+    if (NULL == value)
+    {
+      return false;
+    }
+    descriptor->value = value;
+  }
+  if (value_size)
+  {
+    memcpy (descriptor->value + offset, new_value, value_size);
+  }
+  descriptor->value_size = size;
+  return true;
+}
+
+static bool descriptor_set_value (descriptor_t *descriptor, const void *new_value, uint32_t value_size)
+{
+  return descriptor_set_value_at (descriptor, 0, new_value, value_size);
+}
+
+static bool descriptor_cccd_enabled (const uint8_t *value, uint32_t value_size)
+{
+  return value_size > 0 && (value[0] & (DESCRIPTOR_CCCD_NOTIFY | DESCRIPTOR_CCCD_INDICATE));
+}
+
+bool descriptor_update_value (descriptor_t *descriptor, const void *new_value, uint32_t value_size)
+{
+  if (!descriptor_set_value (descriptor, new_value, value_size))
+  {
+    return false;
+  }
+
+  characteristic_t *characteristic = descriptor->cccd ? descriptor_get_parent_characteristic (descriptor) : NULL;
+  if (NULL != characteristic)
+  {
+    characteristic_set_notifying (characteristic, descriptor_cccd_enabled (descriptor->value, value_size));
+  }
+  return true;
+}
+
+uint16_t descriptor_get_flag_bit (const char *flag)
+{
+  unsigned int flag_count = sizeof (descriptor_flags) / sizeof (descriptor_flags[0]);
+  for (unsigned int i = 0; i < flag_count; i++)
+  {
+    if (strcmp (flag, descriptor_flags[i].flag_value) == 0)
+    {
+      return (uint16_t) descriptor_flags[i].enabled_bit;
+    }
+  }
+  return 0;
+}
+
 bool descriptor_register (descriptor_t *descriptor)
 {
-  return dbusutils_register_object (global_dbus_connection, descriptor->object_path, descriptor_properties, descriptor_methods, descriptor);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (descriptor->path_id, path);
+  return dbusutils_register_object (global_dbus_connection, path, descriptor_properties, descriptor_methods, descriptor);
+}
+
+void descriptor_unregister (descriptor_t *descriptor)
+{
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (descriptor->path_id, path);
+  dbusutils_unregister_object (global_dbus_connection, path);
 }
 
 //DBus methods
 void descriptor_get_object (descriptor_t *descriptor, DBusMessageIter *iter)
 {
-  dbusutils_get_object_data (iter, descriptor_properties, descriptor->object_path, BLUEZ_GATT_DESCRIPTOR_INTERFACE, descriptor);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (descriptor->path_id, path);
+  dbusutils_get_object_data (iter, descriptor_properties, path, BLUEZ_GATT_DESCRIPTOR_INTERFACE, descriptor);
 }
 
 static void descriptor_get_uuid (void *user_data, DBusMessageIter *iter)
@@ -106,7 +230,7 @@ static void descriptor_get_uuid (void *user_data, DBusMessageIter *iter)
 static void descriptor_get_characteristic (void *user_data, DBusMessageIter *iter)
 {
   descriptor_t *descriptor = (descriptor_t *) user_data;
-  dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH, &descriptor->characteristic_path);
+  objpath_iter_append (iter, objpath_get_parent (descriptor->path_id));
 }
 
 static void descriptor_get_flags (void *user_data, DBusMessageIter *iter)
@@ -130,31 +254,141 @@ static void descriptor_get_flags (void *user_data, DBusMessageIter *iter)
 static void descriptor_get_value (void *user_data, DBusMessageIter *iter)
 {
   descriptor_t *descriptor = (descriptor_t *) user_data;
-  descriptor_read_value (descriptor, iter);
+  descriptor_append_value (descriptor, 0, iter);
 }
 
-static void descriptor_read_value (descriptor_t *descriptor, DBusMessageIter *iter)
+//the value of a Client Characteristic Configuration descriptor is read from the notifying flag so it
+//matches notifications started with StartNotify or by the script
+static const uint8_t *descriptor_get_current_value (const descriptor_t *descriptor, uint8_t *cccd, uint32_t *value_size)
 {
-  DBusMessageIter array;
+  const characteristic_t *characteristic = descriptor->cccd ? descriptor_get_parent_characteristic (descriptor) : NULL;
+  if (NULL == characteristic)
+  {
+    *value_size = descriptor->value_size;
+    return descriptor->value;
+  }
 
+  memset (cccd, 0, DESCRIPTOR_CCCD_SIZE);
+  if (characteristic->notifying)
+  {
+    cccd[0] = utils_is_flag_set (characteristic->flags, CHARACTERISTIC_FLAG_NOTIFY_ENABLED_BIT) ? DESCRIPTOR_CCCD_NOTIFY : DESCRIPTOR_CCCD_INDICATE;
+  }
+  *value_size = DESCRIPTOR_CCCD_SIZE;
+  return cccd;
+}
+
+//appends the value from offset, which is at most its size
+static void descriptor_append_value (descriptor_t *descriptor, uint32_t offset, DBusMessageIter *iter)
+{
+  uint8_t cccd[DESCRIPTOR_CCCD_SIZE];
+  uint32_t value_size = 0;
+  const uint8_t *value = descriptor_get_current_value (descriptor, cccd, &value_size);
+  if (NULL != value)
+  {
+    value += offset;
+  }
+
+  DBusMessageIter array;
   dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &array);
-  dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &descriptor->value, descriptor->value_size);
+  dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &value, value_size - offset);
   dbus_message_iter_close_container (iter, &array);
 }
 
-// TODO: implement these functions
-// void descriptor_get_all (descriptor_t *descriptor)
-// {
+//Bluez methods
+static DBusMessage *descriptor_read_value (void *user_data, DBusConnection *connection, DBusMessage *message)
+{
+  descriptor_t *descriptor = (descriptor_t *) user_data;
+  if (!utils_is_flag_set (descriptor->flags, DESCRIPTOR_FLAG_READ_ENABLED_BIT))
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_NOT_PERMITTED, "Read not permitted");
+  }
 
-// }
+  DBusMessageIter args;
+  uint16_t offset = 0;
+  dbus_message_iter_init (message, &args); //an iterator of a call without arguments reads as no options
+  if (!dbusutils_get_option_offset (&args, &offset))
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_ARGUMENTS, "Invalid options");
+  }
 
-// //Bluez methods
-// void descriptor_read_value (descriptor_t *descriptor)
-// {
+  uint8_t cccd[DESCRIPTOR_CCCD_SIZE];
+  uint32_t value_size = 0;
+  descriptor_get_current_value (descriptor, cccd, &value_size);
+  if (offset > value_size) //a long read ends with an offset equal to the size
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_OFFSET, "Offset is past the end of the value");
+  }
 
-// }
+  DBusMessage *reply = dbus_message_new_method_return (message);
+  if (NULL == reply)
+  {
+    return NULL;
+  }
 
-// void descriptor_write_value (descriptor_t *descriptor)
-// {
+  DBusMessageIter iter;
+  dbus_message_iter_init_append (reply, &iter);
+  descriptor_append_value (descriptor, offset, &iter);
+  return reply;
+}
 
-// }
+//a write of a Client Characteristic Configuration descriptor subscribes the central like StartNotify and StopNotify
+static DBusMessage *descriptor_write_value (void *user_data, DBusConnection *connection, DBusMessage *message)
+{
+  descriptor_t *descriptor = (descriptor_t *) user_data;
+  if (!utils_is_flag_set (descriptor->flags, DESCRIPTOR_FLAG_WRITE_ENABLED_BIT))
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_NOT_PERMITTED, "Write not permitted");
+  }
+
+  DBusMessageIter args, array;
+  if (!dbus_message_iter_init (message, &args) || dbus_message_iter_get_arg_type (&args) != DBUS_TYPE_ARRAY)
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_ARGUMENTS, "Value must be an array of bytes");
+  }
+
+  int element_count = 0;
+  uint8_t *new_value = NULL;
+  dbus_message_iter_recurse (&args, &array);
+  dbus_message_iter_get_fixed_array (&array, &new_value, &element_count);
+  uint16_t offset = 0;
+  dbus_message_iter_next (&args);
+  if (element_count < 0 || (NULL == new_value && element_count > 0) || !dbusutils_get_option_offset (&args, &offset))
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_ARGUMENTS, "Invalid value or options");
+  }
+
+  characteristic_t *characteristic = descriptor->cccd ? descriptor_get_parent_characteristic (descriptor) : NULL;
+  bool enabled = descriptor_cccd_enabled (new_value, (uint32_t) element_count);
+  if (NULL != characteristic)
+  {
+    if (offset != 0)
+    {
+      return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_OFFSET, "Configuration is written whole");
+    }
+    if (enabled && !utils_is_flag_set (characteristic->flags, CHARACTERISTIC_FLAG_NOTIFY_ENABLED_BIT)
+      && !utils_is_flag_set (characteristic->flags, CHARACTERISTIC_FLAG_INDICATE_ENABLED_BIT))
+    {
+      return dbus_message_new_error (message, BLUEZ_ERROR_NOT_SUPPORTED, "Characteristic does not notify or indicate");
+    }
+  }
+  else if (offset > descriptor->value_size)
+  {
+    return dbus_message_new_error (message, BLUEZ_ERROR_INVALID_OFFSET, "Offset is past the end of the value");
+  }
+
+  if (!descriptor_set_value_at (descriptor, offset, new_value, (uint32_t) element_count))
+  {
+    return NULL;
+  }
+
+  if (NULL != characteristic && enabled != characteristic->subscribed)
+  {
+    characteristic_set_subscribed (characteristic, enabled);
+  }
+  else if (NULL != characteristic && !enabled && characteristic->notifying) //notifications the script started, no central to unsubscribe
+  {
+    characteristic_set_notifying (characteristic, false);
+  }
+
+  return dbus_message_new_method_return (message);
+}
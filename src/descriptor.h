@@ -13,15 +13,17 @@
 
 #include <dbus/dbus.h>
 
+#include "objpath.h"
+
 typedef struct descriptor_t
 {
   char *uuid; //128-bit descriptor UUID.
-  char *characteristic_path; //Object path of the GATT characteristic the descriptor belongs to.
-  char *object_path; //Object path of the descriptor object
+  objpath_id_t path_id; //Object path of the descriptor object, its parent is the characteristic the descriptor belongs to
   uint8_t *value; //Descriptors value
   uint32_t value_size;
   uint16_t flags; //Flags that define how the descriptor value can be used
   int origin; //where the object was created - influences how we free it
+  bool cccd; //Client Characteristic Configuration descriptor, its value follows the notifying flag of the characteristic
   struct descriptor_t *next;
 } descriptor_t;
 
@@ -31,7 +33,7 @@ extern DBusObjectPathVTable descriptor_dbus_callbacks;
  * Initialises values for a new descriptor
  * @param descriptor the descriptor
  * @param uuid the uuid of the descriptor
- * @param the origin of the object used to distinguish if it was created in lua
+ * @param the origin of the object used to distinguish if it was created in lua, ORIGIN_SCHEMA objects borrow the uuid
  * @return initialised descriptor  
  **/
 void descriptor_init (descriptor_t *descriptor, const char *uuid, int origin);
@@ -49,6 +51,30 @@ void descriptor_fini (descriptor_t *descriptor);
  **/
 void descriptor_free (descriptor_t *descriptor);
 
+/**
+ * Takes a descriptor whose characteristic is being freed off the bus and out of the path table, the descriptor
+ * stays usable and can be added to another characteristic
+ * @param descriptor the descriptor
+ **/
+void descriptor_detach (descriptor_t *descriptor);
+
+/**
+ * Sets a descriptors value. Setting the value of a Client Characteristic Configuration descriptor
+ * turns notifying of its characteristic on or off like characteristic_set_notifying
+ * @param descriptor the descriptor
+ * @param new_value pointer to the new value
+ * @param value_size size of the new value
+ * @return success true/false - false if the value could not be allocated
+ **/
+bool descriptor_update_value (descriptor_t *descriptor, const void *new_value, uint32_t value_size);
+
+/**
+ * Looks up the bit for a descriptor flag e.g "read"
+ * @param flag the flag string
+ * @return the flag bit or 0 if the flag is unknown
+ **/
+uint16_t descriptor_get_flag_bit (const char *flag);
+
 /**
  * Registers the descriptor object with dbus
  * @param descriptor pointer to the descriptor
@@ -56,6 +82,12 @@ void descriptor_free (descriptor_t *descriptor);
  **/
 bool descriptor_register (descriptor_t *descriptor);
 
+/**
+ * Unregisters the descriptor object from dbus
+ * @param descriptor pointer to the descriptor
+ **/
+void descriptor_unregister (descriptor_t *descriptor);
+
 //DBus methods
 /**
  * Populates a dbus message iter with a descriptor's object data
@@ -64,8 +96,4 @@ bool descriptor_register (descriptor_t *descriptor);
  **/
 void descriptor_get_object (descriptor_t *descriptor, DBusMessageIter *iter);
 
-// //Bluez methods
-// void descriptor_read_value (descriptor_t *descriptor);
-// void descriptor_write_value (descriptor_t *descriptor);
-
 #endif //BLE_SIM_DESCRIPTOR_H
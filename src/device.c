@@ -5,28 +5,42 @@
  *
  **********************************************************************/
 
+#include <stdio.h>
 #include <string.h>
 
 #include "device.h"
+#include "registry.h"
+#include "schema.h"
 #include "service.h"
 #include "characteristic.h"
 #include "descriptor.h"
 #include "dbusutils.h"
+#include "events.h"
 #include "utils.h"
 #include "logger.h"
 
-static void add_device_to_device_list (device_t *device);
-
 static DBusMessage *device_get_managed_objects (void *device_ptr, DBusConnection *connection, DBusMessage *message);
 
-static service_t *device_get_service (device_t *device, const char *service_uuid);
-
 static bool device_init_controller (device_t *device);
 
-static device_t *device_list_head = NULL;
+static void device_close_controller (device_t *device);
+
+static void device_unregister (device_t *device);
+
+static void device_unregister_objects (device_t *device);
+
+static void device_update_skipped (device_t *device);
+
+static void device_reset_advertisement (device_t *device)
+{
+  memset (&device->advertisement, 0, sizeof (device->advertisement));
+  device->advertisement.path_id = OBJPATH_NONE;
+}
+
+static bool device_skip_idle = false;
 
-static unsigned int device_count = 0;
-static unsigned int controller_count = 1;
+static id_allocator_t device_ids = {0, NULL, 0, 0};
+static id_allocator_t controller_ids = {1, NULL, 0, 0}; //hci0 is the default controller
 
 static dbus_method_t device_methods[] =
   {
@@ -34,38 +48,31 @@ static dbus_method_t device_methods[] =
     DBUS_METHOD_NULL
   };
 
-static void add_device_to_device_list (device_t *device)
-{
-  if (NULL == device)
-  {
-    return;
-  }
-
-  if (device_list_head == NULL)
-  {
-    device_list_head = device;
-    return;
-  }
-
-  device->next = device_list_head;
-  device_list_head = device;
-}
-
 void device_init (device_t *device, const char *device_name, int origin)
 {
   device->origin = origin;
   device->device_name = strdup (device_name);
   device->controller = NULL;
   device->application_registered = false;
+  device->register_call = NULL;
   device->initialised = false;
   device->services = NULL;
   device->service_count = 0;
-  device->object_path = dbusutils_create_object_path (EMPTY_STRING, DEVICE_OBJECT_NAME, device_count);
+  device->device_id = id_allocator_acquire (&device_ids);
+  device->controller_id = 0;
+  device->path_id = objpath_add (OBJPATH_NONE, OBJPATH_KIND_DEVICE, device->device_id, device);
   device->next = NULL;
+  device->prev = NULL;
+  device->bucket_next = NULL;
 
   device->virtual_controller = NULL;
-
-  device_count++;
+  device_reset_advertisement (device);
+  device->schema = NULL;
+  device->event_mask = 0;
+  device->event_listener = NULL;
+  device->scripted = false;
+  atomic_init (&device->connections, 0);
+  atomic_init (&device->subscriptions, 0);
 }
 
 void device_fini (device_t *device)
@@ -75,24 +82,48 @@ void device_fini (device_t *device)
     return;
   }
 
-  free (device->controller);
-  free (device->device_name);
-  free (device->object_path);
+  registry_remove (device);
+  dbusutils_cancel_pending_call (&device->register_call);
+  device_close_controller (device);
+  if (device->event_mask)
+  {
+    events_remove_object (device);
+  }
 
+  //a device freed without being removed (a failed instantiation, an unregistered lua device) can still have objects on the bus
+  device_unregister_objects (device);
   advertisement_fini (&device->advertisement);
+  device_reset_advertisement (device);
 
-  vhci_close (device->virtual_controller);
-
-  if (device->origin == ORIGIN_C)
+  //services the script made stay with the script, they are detached so none of their paths outlive the device
+  service_t *service = device->services;
+  while (service)
   {
-    service_t *tmp = NULL;
-    while (device->services)
+    service_t *next = service->next;
+    if (service->origin == ORIGIN_LUA)
+    {
+      service_detach (service);
+    }
+    else if (device->origin == ORIGIN_C)
     {
-      tmp = device->services->next;
-      service_free (device->services);
-      device->services = tmp;
+      service_free (service);
     }
+    else if (device->origin == ORIGIN_SCHEMA)
+    {
+      service_fini (service);
+    }
+    service = next;
   }
+  device->services = NULL;
+
+  free (device->device_name);
+  device->device_name = NULL;
+  objpath_remove (device->path_id);
+  device->path_id = OBJPATH_NONE;
+  id_allocator_release (&device_ids, device->device_id);
+
+  device_schema_unref (device->schema);
+  device->schema = NULL;
 
 }
 
@@ -170,6 +201,8 @@ static void on_register_application_reply (DBusPendingCall *pending_call, void *
 {
   device_t *device = (device_t *) user_data;
   DBusMessage *reply = dbus_pending_call_steal_reply (pending_call);
+  dbus_pending_call_unref (device->register_call);
+  device->register_call = NULL;
   if (NULL == reply)
   {
     return;
@@ -206,7 +239,7 @@ static bool device_register_with_bluez (device_t *device, DBusConnection *connec
   //setup message "oa{sv}""
   DBusMessageIter args, dict;
   dbus_message_iter_init_append (message, &args);
-  dbus_message_iter_append_basic (&args, DBUS_TYPE_OBJECT_PATH, &device->object_path);
+  objpath_iter_append (&args, device->path_id);
   dbus_message_iter_open_container (
     &args,
     DBUS_TYPE_ARRAY,
@@ -222,66 +255,146 @@ static bool device_register_with_bluez (device_t *device, DBusConnection *connec
   DBusError error;
   dbus_error_init (&error);
 
-  DBusPendingCall *pending_call = NULL;
-
-  dbus_connection_send_with_reply (connection, message, &pending_call, DBUS_TIMEOUT_USE_DEFAULT);
-  if (pending_call)
+  //the call is kept until the reply arrives so removing the device can cancel it
+  dbusutils_cancel_pending_call (&device->register_call);
+  dbus_connection_send_with_reply (connection, message, &device->register_call, DBUS_TIMEOUT_USE_DEFAULT);
+  if (device->register_call)
   {
-    dbus_pending_call_set_notify (pending_call, on_register_application_reply, device, NULL);
+    dbus_pending_call_set_notify (device->register_call, on_register_application_reply, device, NULL);
   }
 
   if (message)
   {
     dbus_message_unref (message);
   }
-  if (pending_call)
-  {
-    dbus_pending_call_unref (pending_call);
-  }
 
   return true;
 }
 
 static bool device_init_controller (device_t *device)
 {
-  size_t required = snprintf (NULL, 0, BASE_ADAPTER_PATH"%u", controller_count) + 1;
+  //the kernel hands out the lowest free hci index, so the allocator reuses the lowest released number to match
+  device->controller_id = id_allocator_acquire (&controller_ids);
+  size_t required = snprintf (NULL, 0, BASE_ADAPTER_PATH"%u", device->controller_id) + 1;
   device->controller = malloc (required);
-  sprintf (device->controller , BASE_ADAPTER_PATH"%u", controller_count);
+  sprintf (device->controller , BASE_ADAPTER_PATH"%u", device->controller_id);
 
   //create the virtual controller for the device
   device->virtual_controller = vhci_open(VHCI_TYPE_LE);
   if (NULL == device->virtual_controller)
   {
+    device_close_controller (device);
     return false;
   }
-  log_info ("Created virtual controller hci%u for device %s", controller_count, device->device_name);
+  log_info ("Created virtual controller hci%u for device %s", device->controller_id, device->device_name);
+  return true; //the caller waits HCI_WAKEUP_TIME for the hci to come up before using it
+}
 
-  msleep (HCI_WAKEUP_TIME); //give the hci some time to get up and running and for bluez to see that it is up
-  controller_count++;
-  return true;
+static void device_close_controller (device_t *device)
+{
+  if (device->virtual_controller)
+  {
+    vhci_close (device->virtual_controller);
+    device->virtual_controller = NULL;
+  }
+
+  if (device->controller_id != 0)
+  {
+    id_allocator_release (&controller_ids, device->controller_id);
+    device->controller_id = 0;
+  }
+
+  free (device->controller);
+  device->controller = NULL;
 }
 
-//device manipulators - functions to create device, add services, characterisitcs etc
-bool device_register (device_t *device)
+static void device_unregister (device_t *device)
 {
-  bool success = false;
-  if (device_get_device (device->device_name))
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (device->path_id, path);
+
+  if (OBJPATH_NONE != device->advertisement.path_id)
+  {
+    advertisement_unregister_with_bluez (&device->advertisement, device->controller, global_dbus_connection);
+    advertisement_unregister (&device->advertisement);
+    advertisement_fini (&device->advertisement);
+    device_reset_advertisement (device);
+  }
+
+  dbusutils_cancel_pending_call (&device->register_call);
+  if (device->application_registered)
+  {
+    dbusutils_send_object_path_method_call (
+      global_dbus_connection,
+      BLUEZ_BUS_NAME,
+      device->controller,
+      BLUEZ_GATT_MANAGER_INTERFACE,
+      BLUEZ_METHOD_UNREGISTER_APPLICATION,
+      path
+    );
+    device->application_registered = false;
+  }
+
+  device_unregister_objects (device);
+  device_close_controller (device);
+  device->initialised = false;
+}
+
+static void device_unregister_objects (device_t *device)
+{
+  if (OBJPATH_NONE != device->advertisement.path_id)
+  {
+    advertisement_unregister (&device->advertisement);
+  }
+
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    service_unregister (service);
+  }
+
+  if (OBJPATH_NONE != device->path_id)
+  {
+    char path[OBJPATH_MAX_LENGTH];
+    objpath_format (device->path_id, path);
+    dbusutils_unregister_object (global_dbus_connection, path);
+  }
+}
+
+static bool device_can_register (const device_t *device)
+{
+  if (registry_find (device->device_name))
   {
     log_warn ("Device with that name already exists");
     return false;
   }
 
-  success = device_init_controller (device);
-  if (!success)
+  if (device->initialised)
   {
-    log_error ("Failed to create device (%s) virtual controller", device->device_name);
+    log_warn ("Device %s has already been registered", device->device_name);
     return false;
   }
+  return true;
+}
+
+//dry run - build the tree without a controller, dbus or bluez
+static void device_register_built (device_t *device)
+{
+  registry_add (device);
+  device->initialised = true;
+  log_info ("Built device %s", device->device_name);
+}
 
-  success = dbusutils_register_object (global_dbus_connection, device->object_path, NULL, device_methods, device);
+//registers a device whose controller is up with dbus and bluez and adds it to the registry, the controller is closed on failure
+static bool device_register_with_controller (device_t *device)
+{
+  bool success = false;
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (device->path_id, path);
+  success = dbusutils_register_object (global_dbus_connection, path, NULL, device_methods, device);
   if (!success)
   {
     log_error ("Failed to register device (%s) with dbus", device->device_name);
+    device_close_controller (device);
     return false;
   }
 
@@ -289,6 +402,8 @@ bool device_register (device_t *device)
   if (!success)
   {
     log_error ("Failed to register device (%s) with bluez", device->device_name);
+    dbusutils_unregister_object (global_dbus_connection, path);
+    device_close_controller (device);
     return false;
   }
 
@@ -297,31 +412,31 @@ bool device_register (device_t *device)
   const uint8_t manufacturer_data[] = {0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5};
   const unsigned int size = 24;
   const uint16_t key = 0xBEEF;
-  char *advert_object_path = dbusutils_create_object_path (device->object_path, ADVERTISEMENT_OBJECT_NAME, 0);
   advertisement_init (
     &device->advertisement,
-    advert_object_path,
+    device->path_id,
     &device->services,
     &device->device_name,
     key,
     manufacturer_data,
     size
   );
-  free (advert_object_path);
 
   success = advertisement_register (&device->advertisement);
   if (!success)
   {
+    device_unregister (device);
     return false;
   }
 
   success = advertisement_register_with_bluez (&device->advertisement, device->controller, global_dbus_connection);
   if (!success)
   {
+    device_unregister (device);
     return false;
   }
 
-  add_device_to_device_list (device);
+  registry_add (device);
   device->initialised = true;
 
   log_info ("Simulating device %s", device->device_name);
@@ -329,6 +444,80 @@ bool device_register (device_t *device)
   return true;
 }
 
+//device manipulators - functions to create device, add services, characterisitcs etc
+bool device_register (device_t *device)
+{
+  if (!device_can_register (device))
+  {
+    return false;
+  }
+
+  if (NULL == global_dbus_connection)
+  {
+    device_register_built (device);
+    return true;
+  }
+
+  if (!device_init_controller (device))
+  {
+    log_error ("Failed to create device (%s) virtual controller", device->device_name);
+    return false;
+  }
+  msleep (HCI_WAKEUP_TIME); //give the hci some time to get up and running and for bluez to see that it is up
+  return device_register_with_controller (device);
+}
+
+size_t device_register_batch (device_t **devices, size_t count)
+{
+  size_t registered = 0;
+  bool opened = false;
+  for (size_t i = 0; i < count; i++)
+  {
+    device_t *device = devices[i];
+    if (NULL == device || !device_can_register (device))
+    {
+      continue;
+    }
+
+    if (NULL == global_dbus_connection)
+    {
+      device_register_built (device);
+      registered++;
+    }
+    else if (device_init_controller (device))
+    {
+      opened = true;
+    }
+    else
+    {
+      log_error ("Failed to create device (%s) virtual controller", device->device_name);
+    }
+  }
+
+  if (!opened)
+  {
+    return registered;
+  }
+  msleep (HCI_WAKEUP_TIME); //the controllers come up together
+
+  for (size_t i = 0; i < count; i++)
+  {
+    device_t *device = devices[i];
+    if (NULL == device || NULL == device->virtual_controller || device->initialised)
+    {
+      continue;
+    }
+    if (registry_find (device->device_name)) //an earlier device of the batch took the name
+    {
+      log_warn ("Device with that name already exists");
+      device_close_controller (device);
+      continue;
+    }
+    registered += device_register_with_controller (device) ? 1 : 0;
+  }
+  return registered;
+}
+
 bool device_set_discoverable (device_t *device, bool discoverable)
 {
   if (!device->initialised)
@@ -393,19 +582,85 @@ bool device_set_powered (device_t *device, bool powered)
 
 device_t *device_get_device (const char *device_name)
 {
-  device_t *device = device_list_head;
-  while (device)
+  return registry_find (device_name);
+}
+
+bool device_remove (const char *device_name)
+{
+  device_t *device = registry_find (device_name);
+  if (NULL == device)
+  {
+    log_warn ("Device %s does not exist", device_name);
+    return false;
+  }
+
+  registry_remove (device);
+  device_unregister (device);
+
+  log_info ("Removed device %s", device->device_name);
+  if (device->origin != ORIGIN_LUA)
+  {
+    device_free (device);
+  }
+  return true;
+}
+
+void device_remove_all (void)
+{
+  device_t *device = NULL;
+  while ((device = registry_get_devices ()))
+  {
+    device_remove (device->device_name);
+  }
+}
+
+static bool device_same_descriptors (const characteristic_t *characteristic, const characteristic_t *other)
+{
+  const descriptor_t *descriptor = characteristic->descriptors;
+  const descriptor_t *other_descriptor = other->descriptors;
+  for (; descriptor && other_descriptor; descriptor = descriptor->next, other_descriptor = other_descriptor->next)
   {
-    if (strcmp (device_name, device->device_name) == 0)
+    if (strcmp (descriptor->uuid, other_descriptor->uuid) != 0 || descriptor->flags != other_descriptor->flags)
     {
-      return device;
+      return false;
     }
-    device = device->next;
   }
-  return NULL;
+  return descriptor == other_descriptor; //both NULL
+}
+
+static bool device_same_characteristics (const service_t *service, const service_t *other)
+{
+  const characteristic_t *characteristic = service->characteristics;
+  const characteristic_t *other_characteristic = other->characteristics;
+  for (; characteristic && other_characteristic; characteristic = characteristic->next, other_characteristic = other_characteristic->next)
+  {
+    if (strcmp (characteristic->uuid, other_characteristic->uuid) != 0 ||
+        characteristic->flags != other_characteristic->flags ||
+        !device_same_descriptors (characteristic, other_characteristic))
+    {
+      return false;
+    }
+  }
+  return characteristic == other_characteristic;
 }
 
-static service_t *device_get_service (device_t *device, const char *service_uuid)
+bool device_has_same_layout (const device_t *device, const device_t *other)
+{
+  const service_t *service = device->services;
+  const service_t *other_service = other->services;
+  for (; service && other_service; service = service->next, other_service = other_service->next)
+  {
+    if (strcmp (service->uuid, other_service->uuid) != 0 ||
+        service->primary != other_service->primary ||
+        !device_same_characteristics (service, other_service))
+    {
+      return false;
+    }
+  }
+  return service == other_service;
+}
+
+service_t *device_get_service (device_t *device, const char *service_uuid)
 {
   service_t *service = device->services;
   while (service)
@@ -428,7 +683,7 @@ bool device_add_service (device_t *device, service_t *service)
     return false;
   }
 
-  if (NULL != service->device_path)
+  if (OBJPATH_NONE != service->path_id)
   {
     log_warn ("Service already belongs to a device.");
     return false;
@@ -440,13 +695,13 @@ bool device_add_service (device_t *device, service_t *service)
     return false;
   }
 
-  service->object_path = dbusutils_create_object_path (device->object_path, SERVICE_OBJECT_NAME, device->service_count);
-  if (!service_register (service))
+  service->path_id = objpath_add (device->path_id, OBJPATH_KIND_SERVICE, device->service_count, service);
+  if (OBJPATH_NONE == service->path_id || !service_register (service))
   {
-    free (service->object_path);
+    objpath_remove (service->path_id);
+    service->path_id = OBJPATH_NONE;
     return false;
   }
-  service->device_path = strdup (device->object_path);
 
   service->next = device->services;
   device->services = service;
@@ -454,3 +709,169 @@ bool device_add_service (device_t *device, service_t *service)
   device->service_count++;
   return true;
 }
+
+//only the dbus thread changes the counts, a missed signal must not wrap one below 0
+static void device_count_change (atomic_uint *count, bool increment)
+{
+  if (increment)
+  {
+    atomic_fetch_add (count, 1);
+  }
+  else if (atomic_load (count) > 0)
+  {
+    atomic_fetch_sub (count, 1);
+  }
+}
+
+//finds the value of the Connected property in a PropertiesChanged a{sv}, returns false if it did not change
+static bool device_get_connected_change (DBusMessageIter *changed, bool *connected)
+{
+  DBusMessageIter array, entry, variant;
+  dbus_message_iter_recurse (changed, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY)
+  {
+    const char *property = NULL;
+    dbus_message_iter_recurse (&array, &entry);
+    dbus_message_iter_get_basic (&entry, &property);
+    if (strcmp (property, BLUEZ_DEVICE_PROPERTY_CONNECTED) == 0)
+    {
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+      if (dbus_message_iter_get_arg_type (&variant) != DBUS_TYPE_BOOLEAN)
+      {
+        return false;
+      }
+      dbus_bool_t value = FALSE;
+      dbus_message_iter_get_basic (&variant, &value);
+      *connected = value;
+      return true;
+    }
+    dbus_message_iter_next (&array);
+  }
+  return false;
+}
+
+void device_handle_remote_properties_changed (DBusMessage *message)
+{
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_PROPERTIES, DBUS_SIGNAL_PROPERTIES_CHANGED))
+  {
+    return;
+  }
+
+  //remote devices are at /org/bluez/hci<controller>/dev_XX_XX_XX_XX_XX_XX
+  const char *path = dbus_message_get_path (message);
+  unsigned int controller_id = 0;
+  char address[18];
+  if (NULL == path || sscanf (path, BASE_ADAPTER_PATH "%u/dev_%17[0-9A-Fa-f_]", &controller_id, address) != 2 || controller_id == 0)
+  {
+    return;
+  }
+
+  DBusMessageIter args;
+  const char *interface = NULL;
+  if (!dbus_message_iter_init (message, &args) || dbus_message_iter_get_arg_type (&args) != DBUS_TYPE_STRING)
+  {
+    return;
+  }
+  dbus_message_iter_get_basic (&args, &interface);
+  bool connected = false;
+  if (strcmp (interface, BLUEZ_DEVICE_INTERFACE) != 0 || !dbus_message_iter_next (&args) ||
+      dbus_message_iter_get_arg_type (&args) != DBUS_TYPE_ARRAY || !device_get_connected_change (&args, &connected))
+  {
+    return;
+  }
+
+  device_t *device = registry_get_devices ();
+  while (device && device->controller_id != controller_id)
+  {
+    device = device->next;
+  }
+  if (NULL == device)
+  {
+    return;
+  }
+  bool active = device_is_active (device);
+  device_count_change (&device->connections, connected);
+  if (active != device_is_active (device))
+  {
+    device_update_skipped (device);
+  }
+
+  event_kind_t kind = connected ? EVENT_CONNECT : EVENT_DISCONNECT;
+  if (!(device->event_mask & EVENT_MASK (kind)))
+  {
+    return;
+  }
+
+  for (char *c = address; *c; c++)
+  {
+    if (*c == '_')
+    {
+      *c = ':';
+    }
+  }
+  events_post (kind, device, device->event_listener, address, (uint32_t) strlen (address) + 1);
+}
+
+//a characteristic path is device/service/characteristic
+static device_t *device_get_characteristic_device (const characteristic_t *characteristic)
+{
+  return (device_t *) objpath_get_object (objpath_get_parent (objpath_get_parent (characteristic->path_id)));
+}
+
+void device_set_subscribed (characteristic_t *characteristic, bool subscribed)
+{
+  if (characteristic->subscribed == subscribed)
+  {
+    return;
+  }
+  characteristic->subscribed = subscribed;
+
+  device_t *device = device_get_characteristic_device (characteristic);
+  if (NULL != device)
+  {
+    bool active = device_is_active (device);
+    device_count_change (&device->subscriptions, subscribed);
+    if (active != device_is_active (device))
+    {
+      device_update_skipped (device);
+    }
+  }
+}
+
+bool device_is_active (const device_t *device)
+{
+  return atomic_load (&device->connections) > 0 || atomic_load (&device->subscriptions) > 0;
+}
+
+void device_set_skip_idle (bool skip_idle)
+{
+  device_skip_idle = skip_idle;
+  for (device_t *device = registry_get_devices (); device; device = device->next)
+  {
+    device_update_skipped (device);
+  }
+}
+
+bool device_is_skipped (const device_t *device)
+{
+  return device_skip_idle && !device_is_active (device);
+}
+
+//the flags are read by workers in place of the object paths, which only the dbus thread may walk
+static void device_update_skipped (device_t *device)
+{
+  bool skipped = device_is_skipped (device);
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    for (characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      atomic_store (&characteristic->skipped, skipped);
+    }
+  }
+}
+
+bool device_skips_characteristic (const characteristic_t *characteristic)
+{
+  return atomic_load (&characteristic->skipped);
+}
@@ -10,6 +10,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include <dbus/dbus.h>
 
@@ -18,6 +19,7 @@
 #include "defines.h"
 #include "service.h"
 #include "advertising.h"
+#include "objpath.h"
 
 extern DBusConnection *global_dbus_connection;
 
@@ -27,13 +29,24 @@ typedef struct device_t
   unsigned int service_count;
   char *controller; //path to bluez controller
   char *device_name; //name of the device
-  char *object_path; //dbus object path to register to
+  objpath_id_t path_id; //dbus object path to register to
+  unsigned int device_id; //number used in the object path, reused once the device is freed
+  unsigned int controller_id; //hci number of the virtual controller, 0 if the device has no controller
   bool application_registered;
+  DBusPendingCall *register_call; //RegisterApplication waiting for its reply, cancelled if the device goes first
   bool initialised; //if device has been sucessfully registered and initialised and is operation
   int origin;//where the object was created - influences how we free it
   struct vhci *virtual_controller;
   advertisement_t advertisement; //advertisement
-  struct device_t *next;
+  struct device_schema_t *schema; //schema the device was instantiated from or NULL
+  uint8_t event_mask; //EVENT_MASK bits of the events a script listens for
+  void *event_listener; //set by the lua interface to route the events to the state that listens
+  bool scripted; //registered by the script, a reload of the script that no longer registers it removes it
+  atomic_uint connections; //centrals connected to the controller, written by the dbus thread and read by workers
+  atomic_uint subscriptions; //characteristics a central started notifications on
+  struct device_t *next; //registry device list
+  struct device_t *prev;
+  struct device_t *bucket_next; //registry name index chain
 } device_t;
 
 /**
@@ -58,7 +71,7 @@ void device_fini (device_t *device);
 void device_free (device_t *device);
 
 /**
- * Searches internal device list for a device with a matching device_name
+ * Searches the device registry for a device with a matching device_name
  *
  * @param device_name name of the device to find
  * @return found device or NULL if not found  
@@ -77,12 +90,45 @@ device_t *device_get_device (const char *device_name);
 bool device_register (device_t *device);
 
 /**
- * Removes a device from the list
+ * Registers several devices like device_register, opening every virtual controller first so the wait for
+ * them to come up is paid once rather than per device. A device that fails is left unregistered
+ * @param devices the devices, NULL entries are skipped
+ * @param count number of entries
+ * @return the number of devices registered, registered devices are initialised
+ **/
+size_t device_register_batch (device_t **devices, size_t count);
+
+/**
+ * Removes a device from the registry, unregisters its objects,
+ * releases its advertisement and closes its virtual controller.
+ * Devices created in C or from a schema are freed, devices created in lua are freed by lua
  * @param device_name unique name of the device
- * @return successful true/false if the device was added to the list
+ * @return successful true/false if the device was removed
  **/
 bool device_remove (const char *device_name);
 
+/**
+ * Removes every registered device
+ **/
+void device_remove_all (void);
+
+/**
+ * Compares the GATT layout of two devices - the uuids of their services, characteristics and descriptors
+ * in order, if services are primary and the characteristic and descriptor flags. Values are not compared
+ * @param device a device
+ * @param other the device to compare it with
+ * @return true/false if the layouts are the same
+ **/
+bool device_has_same_layout (const device_t *device, const device_t *other);
+
+/**
+ * Searches the device for a service
+ * @param device the device to search
+ * @param service_uuid uuid of the service
+ * @return found service or NULL if not found
+ **/
+service_t *device_get_service (device_t *device, const char *service_uuid);
+
 /**
  * Adds a service to device
  * @param device_name unique name of the device to add the service to
@@ -107,4 +153,47 @@ bool device_set_discoverable (device_t *device, bool discoverable);
  **/
 bool device_set_powered (device_t *device, bool powered);
 
+/**
+ * Handles a bluez PropertiesChanged signal for a remote device, counts the connection and posts a connect
+ * or disconnect event if the remote device is connected to one of the simulated devices controllers
+ * @param message the signal
+ **/
+void device_handle_remote_properties_changed (DBusMessage *message);
+
+/**
+ * Counts a central starting or stopping notifications on a characteristic against its device,
+ * called from StartNotify and StopNotify
+ * @param characteristic the characteristic
+ * @param subscribed true/false if notifications were started or stopped
+ **/
+void device_set_subscribed (characteristic_t *characteristic, bool subscribed);
+
+/**
+ * A device is active while a central is connected to it or subscribed to one of its characteristics.
+ * Safe to call from a worker
+ * @param device the device
+ * @return true/false if the device is active
+ **/
+bool device_is_active (const device_t *device);
+
+/**
+ * @param skip_idle skip value updates of devices that are not active, see device_skips_characteristic
+ **/
+void device_set_skip_idle (bool skip_idle);
+
+/**
+ * @param device the device
+ * @return true/false if skipping is enabled and the device is not active
+ **/
+bool device_is_skipped (const device_t *device);
+
+/**
+ * Generators and scripts do not update the values of characteristics of idle devices when skipping is
+ * enabled, the next update after a central connects brings them up to date. Reads a flag the dbus thread
+ * keeps on the characteristic so it is safe to call from a worker
+ * @param characteristic the characteristic
+ * @return true/false if updates to the characteristic are skipped
+ **/
+bool device_skips_characteristic (const characteristic_t *characteristic);
+
 #endif //BLE_SIM_DEVICE_H
@@ -0,0 +1,155 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+#include "logger.h"
+
+static event_queue_t pending_events = {NULL, 0, 0, 0};
+
+void event_queue_init (event_queue_t *queue)
+{
+  queue->events = NULL;
+  queue->head = 0;
+  queue->count = 0;
+  queue->capacity = 0;
+}
+
+void event_queue_fini (event_queue_t *queue)
+{
+  event_t event;
+  while (event_queue_pop (queue, &event))
+  {
+    event_fini (&event);
+  }
+  free (queue->events);
+  event_queue_init (queue);
+}
+
+static bool event_queue_grow (event_queue_t *queue)
+{
+  size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+  event_t *events = malloc (capacity * sizeof (*events));
+  if (NULL == events)
+  {
+    return false;
+  }
+
+  //unwrap the ring into the new buffer
+  for (size_t i = 0; i < queue->count; i++)
+  {
+    events[i] = queue->events[(queue->head + i) % queue->capacity];
+  }
+  free (queue->events);
+  queue->events = events;
+  queue->head = 0;
+  queue->capacity = capacity;
+  return true;
+}
+
+bool event_queue_push (event_queue_t *queue, event_t *event)
+{
+  if (queue->count == queue->capacity && !event_queue_grow (queue))
+  {
+    event_fini (event);
+    return false;
+  }
+
+  queue->events[(queue->head + queue->count) % queue->capacity] = *event;
+  queue->count++;
+  return true;
+}
+
+bool event_queue_pop (event_queue_t *queue, event_t *event)
+{
+  if (queue->count == 0)
+  {
+    return false;
+  }
+
+  *event = queue->events[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  return true;
+}
+
+size_t event_queue_get_count (const event_queue_t *queue)
+{
+  return queue->count;
+}
+
+const uint8_t *event_get_data (const event_t *event)
+{
+  return event->heap_data ? event->heap_data : event->data;
+}
+
+void event_fini (event_t *event)
+{
+  free (event->heap_data);
+  event->heap_data = NULL;
+}
+
+void events_post (event_kind_t kind, void *object, void *listener, const void *data, uint32_t size)
+{
+  event_t event;
+  event.kind = kind;
+  event.object = object;
+  event.listener = listener;
+  event.size = size;
+  event.heap_data = NULL;
+  if (size > EVENT_INLINE_SIZE)
+  {
+    event.heap_data = malloc (size);
+    if (NULL == event.heap_data)
+    {
+      log_error ("Could not allocate event, it is dropped");
+      return;
+    }
+    memcpy (event.heap_data, data, size);
+  }
+  else if (size > 0)
+  {
+    memcpy (event.data, data, size);
+  }
+
+  if (!event_queue_push (&pending_events, &event))
+  {
+    log_error ("Could not queue event, it is dropped");
+  }
+}
+
+event_queue_t *events_get_pending (void)
+{
+  return &pending_events;
+}
+
+void events_remove_object (const void *object)
+{
+  //compact the ring in place keeping the order of the other events
+  size_t kept = 0;
+  for (size_t i = 0; i < pending_events.count; i++)
+  {
+    event_t *event = &pending_events.events[(pending_events.head + i) % pending_events.capacity];
+    if (event->object == object)
+    {
+      event_fini (event);
+    }
+    else
+    {
+      pending_events.events[(pending_events.head + kept) % pending_events.capacity] = *event;
+      kept++;
+    }
+  }
+  pending_events.count = kept;
+}
+
+void events_fini (void)
+{
+  event_queue_fini (&pending_events);
+}
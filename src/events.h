@@ -0,0 +1,124 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_EVENTS_H
+#define BLE_SIM_EVENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Events caused by centrals - characteristic writes, subscriptions and device connections.
+ * The dbus handlers post events for objects that have a listener (see event_mask on characteristics
+ * and devices) and the lua interface delivers them to the script callbacks once per tick.
+ **/
+
+#define EVENT_INLINE_SIZE 32 //written values up to this size are copied into the event, larger ones are allocated
+#define EVENT_MASK(kind) (1u << (kind))
+
+typedef enum event_kind_t
+{
+  EVENT_WRITE = 0, //a central wrote a characteristic value
+  EVENT_SUBSCRIBE, //a central started notifications on a characteristic
+  EVENT_UNSUBSCRIBE, //a central stopped notifications on a characteristic
+  EVENT_CONNECT, //a central connected to a device, data is its address
+  EVENT_DISCONNECT, //a central disconnected from a device, data is its address
+  EVENT_READ //a central reads a characteristic, not queued - the onRead callback is called while the read is handled
+} event_kind_t;
+
+typedef struct event_t
+{
+  event_kind_t kind;
+  void *object; //the characteristic or device
+  void *listener; //the objects event_listener when the event was posted
+  uint32_t size;
+  uint8_t *heap_data; //set if size is over EVENT_INLINE_SIZE
+  uint8_t data[EVENT_INLINE_SIZE];
+} event_t;
+
+typedef struct event_queue_t
+{
+  event_t *events; //ring buffer
+  size_t head; //next event to pop
+  size_t count;
+  size_t capacity;
+} event_queue_t;
+
+/**
+ * Initialises an event queue
+ * @param queue the queue
+ **/
+void event_queue_init (event_queue_t *queue);
+
+/**
+ * Frees an event queue and the events in it
+ * @param queue the queue
+ **/
+void event_queue_fini (event_queue_t *queue);
+
+/**
+ * Moves an event on to the back of a queue
+ * @param queue the queue
+ * @param event the event, the queue takes its data
+ * @return success true/false, on failure the events data is freed
+ **/
+bool event_queue_push (event_queue_t *queue, event_t *event);
+
+/**
+ * Takes the event at the front of a queue
+ * @param queue the queue
+ * @param event set to the event, free it with event_fini
+ * @return true/false if an event was taken
+ **/
+bool event_queue_pop (event_queue_t *queue, event_t *event);
+
+/**
+ * @param queue the queue
+ * @return number of events in the queue
+ **/
+size_t event_queue_get_count (const event_queue_t *queue);
+
+/**
+ * @param event the event
+ * @return the events data
+ **/
+const uint8_t *event_get_data (const event_t *event);
+
+/**
+ * Frees an events data
+ * @param event the event
+ **/
+void event_fini (event_t *event);
+
+/**
+ * Posts an event to the pending events
+ * @param kind kind of event
+ * @param object the characteristic or device
+ * @param listener the objects event_listener
+ * @param data data copied into the event, may be NULL if size is 0
+ * @param size size of the data
+ **/
+void events_post (event_kind_t kind, void *object, void *listener, const void *data, uint32_t size);
+
+/**
+ * @return the pending events, consumed by the lua interface
+ **/
+event_queue_t *events_get_pending (void);
+
+/**
+ * Drops the pending events for an object, called when the object is freed
+ * @param object the object
+ **/
+void events_remove_object (const void *object);
+
+/**
+ * Frees the pending events
+ **/
+void events_fini (void);
+
+#endif //BLE_SIM_EVENTS_H
@@ -0,0 +1,349 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "format.h"
+
+#define FORMAT_SFLOAT_NAN 0x07FF
+#define FORMAT_SFLOAT_POSITIVE_INFINITY 0x07FE
+#define FORMAT_SFLOAT_NEGATIVE_INFINITY 0x0802
+#define FORMAT_SFLOAT_MAX_MANTISSA 2045 //+-2046 and up are special values
+#define FORMAT_SFLOAT_MIN_EXPONENT -8
+#define FORMAT_SFLOAT_MAX_EXPONENT 7
+
+#define FORMAT_FLOAT_NAN 0x007FFFFF
+#define FORMAT_FLOAT_POSITIVE_INFINITY 0x007FFFFE
+#define FORMAT_FLOAT_NEGATIVE_INFINITY 0x00800002
+#define FORMAT_FLOAT_MAX_MANTISSA 8388605
+#define FORMAT_FLOAT_MIN_EXPONENT -128
+#define FORMAT_FLOAT_MAX_EXPONENT 127
+
+typedef struct format_type_name_t
+{
+  const char *name;
+  format_field_type_t type;
+} format_type_name_t;
+
+static const format_type_name_t format_type_names[] =
+  {
+    {"x",      FORMAT_PAD},
+    {"u8",     FORMAT_U8},
+    {"i8",     FORMAT_I8},
+    {"u16",    FORMAT_U16},
+    {"i16",    FORMAT_I16},
+    {"u24",    FORMAT_U24},
+    {"i24",    FORMAT_I24},
+    {"u32",    FORMAT_U32},
+    {"i32",    FORMAT_I32},
+    {"u64",    FORMAT_U64},
+    {"i64",    FORMAT_I64},
+    {"f32",    FORMAT_F32},
+    {"f64",    FORMAT_F64},
+    {"sfloat", FORMAT_SFLOAT},
+    {"float",  FORMAT_FLOAT}
+  };
+
+static const uint8_t format_type_size[] =
+  {
+    1, //FORMAT_PAD
+    1, //FORMAT_U8
+    1, //FORMAT_I8
+    2, //FORMAT_U16
+    2, //FORMAT_I16
+    3, //FORMAT_U24
+    3, //FORMAT_I24
+    4, //FORMAT_U32
+    4, //FORMAT_I32
+    8, //FORMAT_U64
+    8, //FORMAT_I64
+    4, //FORMAT_F32
+    8, //FORMAT_F64
+    2, //FORMAT_SFLOAT
+    4  //FORMAT_FLOAT
+  };
+
+static bool format_host_big_endian (void)
+{
+  const uint16_t probe = 1;
+  return *(const uint8_t *) &probe == 0;
+}
+
+//sets *big_endian and returns true if c is an endianness character
+static bool format_parse_endianness (char c, bool *big_endian)
+{
+  switch (c)
+  {
+    case '<': *big_endian = false; return true;
+    case '>': *big_endian = true; return true;
+    case '=': *big_endian = format_host_big_endian (); return true;
+    default: return false;
+  }
+}
+
+static const format_type_name_t *format_find_type (const char *token, size_t length)
+{
+  for (size_t i = 0; i < sizeof (format_type_names) / sizeof (format_type_names[0]); i++)
+  {
+    if (strlen (format_type_names[i].name) == length && strncmp (format_type_names[i].name, token, length) == 0)
+    {
+      return &format_type_names[i];
+    }
+  }
+  return NULL;
+}
+
+format_t *format_compile (const char *spec, const char **error)
+{
+  //count the tokens first so the format is one allocation
+  size_t token_count = 0;
+  for (const char *c = spec; *c;)
+  {
+    while (*c == ' ')
+    {
+      c++;
+    }
+    if (*c)
+    {
+      token_count++;
+    }
+    while (*c && *c != ' ')
+    {
+      c++;
+    }
+  }
+
+  format_t *format = malloc (sizeof (*format) + token_count * sizeof (format->fields[0]));
+  if (NULL == format)
+  {
+    *error = "could not allocate format";
+    return NULL;
+  }
+  format->size = 0;
+  format->value_count = 0;
+  format->field_count = 0;
+
+  bool big_endian = false;
+  const char *c = spec;
+  while (*c)
+  {
+    while (*c == ' ')
+    {
+      c++;
+    }
+    const char *token = c;
+    while (*c && *c != ' ')
+    {
+      c++;
+    }
+    size_t length = (size_t) (c - token);
+    if (length == 0)
+    {
+      break;
+    }
+
+    bool field_big_endian = big_endian;
+    if (format_parse_endianness (*token, &field_big_endian))
+    {
+      token++;
+      length--;
+      if (length == 0) //a lone endianness character applies to the rest of the format
+      {
+        big_endian = field_big_endian;
+        continue;
+      }
+    }
+
+    const format_type_name_t *type = format_find_type (token, length);
+    if (NULL == type)
+    {
+      *error = "unknown field type";
+      free (format);
+      return NULL;
+    }
+    size_t size = format_type_size[type->type];
+    if (format->size + size > FORMAT_MAX_SIZE)
+    {
+      *error = "format is larger than an attribute value";
+      free (format);
+      return NULL;
+    }
+
+    format_field_t *field = &format->fields[format->field_count++];
+    field->type = type->type;
+    field->big_endian = field_big_endian;
+    field->offset = (uint16_t) format->size;
+    format->size += size;
+    if (type->type != FORMAT_PAD)
+    {
+      format->value_count++;
+    }
+  }
+
+  if (format->field_count == 0)
+  {
+    *error = "format has no fields";
+    free (format);
+    return NULL;
+  }
+  return format;
+}
+
+void format_free (format_t *format)
+{
+  free (format);
+}
+
+bool format_field_is_real (const format_field_t *field)
+{
+  return field->type >= FORMAT_F32;
+}
+
+bool format_field_is_swapped (const format_field_t *field)
+{
+  return field->big_endian != format_host_big_endian ();
+}
+
+static void format_put (uint8_t *data, uint64_t bits, unsigned int size, bool big_endian)
+{
+  for (unsigned int i = 0; i < size; i++)
+  {
+    data[big_endian ? size - 1 - i : i] = (uint8_t) (bits >> (8 * i));
+  }
+}
+
+//picks the smallest exponent whose mantissa fits, returns false if the value is too large for any exponent
+static bool format_to_decimal (double value, int min_exponent, int max_exponent, int64_t max_mantissa, int digits, int *exponent, int64_t *mantissa)
+{
+  if (value == 0)
+  {
+    *exponent = 0;
+    *mantissa = 0;
+    return true;
+  }
+
+  int e = (int) floor (log10 (fabs (value))) - digits + 1;
+  if (e < min_exponent)
+  {
+    e = min_exponent;
+  }
+  for (; e <= max_exponent; e++)
+  {
+    double m = nearbyint (value / pow (10, e));
+    if (fabs (m) <= (double) max_mantissa)
+    {
+      *exponent = e;
+      *mantissa = (int64_t) m;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint16_t format_to_sfloat (double value)
+{
+  if (isnan (value))
+  {
+    return FORMAT_SFLOAT_NAN;
+  }
+
+  int exponent = 0;
+  int64_t mantissa = 0;
+  if (isinf (value) || !format_to_decimal (value, FORMAT_SFLOAT_MIN_EXPONENT, FORMAT_SFLOAT_MAX_EXPONENT, FORMAT_SFLOAT_MAX_MANTISSA, 4, &exponent, &mantissa))
+  {
+    return value > 0 ? FORMAT_SFLOAT_POSITIVE_INFINITY : FORMAT_SFLOAT_NEGATIVE_INFINITY;
+  }
+  return (uint16_t) (((uint16_t) (exponent & 0xF) << 12) | ((uint16_t) mantissa & 0x0FFF));
+}
+
+uint32_t format_to_float (double value)
+{
+  if (isnan (value))
+  {
+    return FORMAT_FLOAT_NAN;
+  }
+
+  int exponent = 0;
+  int64_t mantissa = 0;
+  if (isinf (value) || !format_to_decimal (value, FORMAT_FLOAT_MIN_EXPONENT, FORMAT_FLOAT_MAX_EXPONENT, FORMAT_FLOAT_MAX_MANTISSA, 7, &exponent, &mantissa))
+  {
+    return value > 0 ? FORMAT_FLOAT_POSITIVE_INFINITY : FORMAT_FLOAT_NEGATIVE_INFINITY;
+  }
+  return ((uint32_t) (exponent & 0xFF) << 24) | ((uint32_t) mantissa & 0x00FFFFFF);
+}
+
+void format_encode_integer (const format_field_t *field, int64_t value, uint8_t *record)
+{
+  if (format_field_is_real (field))
+  {
+    format_encode_real (field, (double) value, record);
+    return;
+  }
+  if (field->type == FORMAT_PAD)
+  {
+    value = 0;
+  }
+  format_put (record + field->offset, (uint64_t) value, format_type_size[field->type], field->big_endian);
+}
+
+bool format_round_integer (double value, int64_t *integer)
+{
+  if (!isfinite (value))
+  {
+    return false;
+  }
+  value = nearbyint (value);
+  if (value < -9223372036854775808.0 || value >= 18446744073709551616.0)
+  {
+    return false;
+  }
+  //values from 2^63 are only held by u64 fields, their bits are kept
+  *integer = value >= 9223372036854775808.0 ? (int64_t) (uint64_t) value : (int64_t) value;
+  return true;
+}
+
+bool format_encode_real (const format_field_t *field, double value, uint8_t *record)
+{
+  uint8_t *data = record + field->offset;
+  switch (field->type)
+  {
+    case FORMAT_F32:
+    {
+      float f = (float) value;
+      uint32_t bits;
+      memcpy (&bits, &f, sizeof (bits));
+      format_put (data, bits, sizeof (bits), field->big_endian);
+      break;
+    }
+    case FORMAT_F64:
+    {
+      uint64_t bits;
+      memcpy (&bits, &value, sizeof (bits));
+      format_put (data, bits, sizeof (bits), field->big_endian);
+      break;
+    }
+    case FORMAT_SFLOAT:
+      format_put (data, format_to_sfloat (value), 2, field->big_endian);
+      break;
+    case FORMAT_FLOAT:
+      format_put (data, format_to_float (value), 4, field->big_endian);
+      break;
+    default:
+    {
+      int64_t integer = 0;
+      if (!format_round_integer (value, &integer))
+      {
+        return false;
+      }
+      format_encode_integer (field, integer, record);
+      break;
+    }
+  }
+  return true;
+}
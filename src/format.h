@@ -0,0 +1,130 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_FORMAT_H
+#define BLE_SIM_FORMAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Value formats for multi-field GATT values e.g "<u8 sfloat u16".
+ * A format string is compiled once into a list of fields with their offsets, encoding a record
+ * is then one pass over the fields writing straight into the value buffer.
+ *
+ * Tokens are separated by spaces:
+ *  < little endian (the default), > big endian, = host byte order - applies to the tokens after it,
+ *    or to one token when written in front of it e.g ">u16"
+ *  u8 i8 u16 i16 u24 i24 u32 i32 u64 i64 - integers
+ *  f32 f64 - IEEE-754 floats
+ *  sfloat float - IEEE-11073 16 bit SFLOAT and 32 bit FLOAT
+ *  x - a zero pad byte, takes no value
+ **/
+
+#define FORMAT_MAX_SIZE 512 //largest attribute value
+
+typedef enum format_field_type_t
+{
+  FORMAT_PAD = 0,
+  FORMAT_U8,
+  FORMAT_I8,
+  FORMAT_U16,
+  FORMAT_I16,
+  FORMAT_U24,
+  FORMAT_I24,
+  FORMAT_U32,
+  FORMAT_I32,
+  FORMAT_U64,
+  FORMAT_I64,
+  FORMAT_F32,
+  FORMAT_F64,
+  FORMAT_SFLOAT,
+  FORMAT_FLOAT
+} format_field_type_t;
+
+typedef struct format_field_t
+{
+  format_field_type_t type;
+  bool big_endian;
+  uint16_t offset; //byte offset in the record
+} format_field_t;
+
+typedef struct format_t
+{
+  size_t size; //bytes in an encoded record
+  size_t value_count; //fields that take a value, every field but pads
+  size_t field_count;
+  format_field_t fields[];
+} format_t;
+
+/**
+ * Compiles a format string
+ * @param spec the format string
+ * @param error set to a description of the problem if the string is invalid
+ * @return the format, free with format_free, or NULL if the string is invalid or allocation failed
+ **/
+format_t *format_compile (const char *spec, const char **error);
+
+/**
+ * Frees a compiled format
+ * @param format the format
+ **/
+void format_free (format_t *format);
+
+/**
+ * @param field a field
+ * @return true/false if the field holds a real number (f32, f64, sfloat, float)
+ **/
+bool format_field_is_real (const format_field_t *field);
+
+/**
+ * @param field a field
+ * @return true/false if the field's byte order differs from the host's
+ **/
+bool format_field_is_swapped (const format_field_t *field);
+
+/**
+ * Encodes an integer field, the value is truncated to the width of the field. Pads ignore the value
+ * @param field the field
+ * @param value the value
+ * @param record start of the record, the field is written at its offset
+ **/
+void format_encode_integer (const format_field_t *field, int64_t value, uint8_t *record);
+
+/**
+ * Rounds a real number to the nearest integer, values from 2^63 to 2^64 are returned as the bits of a u64
+ * @param value the value
+ * @param integer set to the rounded value
+ * @return true/false if the value is finite and within the range of an i64 or u64 field
+ **/
+bool format_round_integer (double value, int64_t *integer);
+
+/**
+ * Encodes a real number field, integer fields take the value rounded to the nearest integer
+ * @param field the field
+ * @param value the value
+ * @param record start of the record, the field is written at its offset
+ * @return true/false if the value could be encoded, false for an integer field given a value format_round_integer rejects
+ **/
+bool format_encode_real (const format_field_t *field, double value, uint8_t *record);
+
+/**
+ * Encodes a value as an IEEE-11073 16 bit SFLOAT, the exponent is chosen to keep as many digits as fit
+ * @param value the value, NaN and infinities are encoded as the reserved special values
+ * @return the SFLOAT
+ **/
+uint16_t format_to_sfloat (double value);
+
+/**
+ * Encodes a value as an IEEE-11073 32 bit FLOAT
+ * @param value the value
+ * @return the FLOAT
+ **/
+uint32_t format_to_float (double value);
+
+#endif //BLE_SIM_FORMAT_H
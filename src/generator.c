@@ -0,0 +1,332 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "generator.h"
+#include "characteristic.h"
+#include "device.h"
+#include "utils.h"
+#include "logger.h"
+
+#define GENERATOR_TWO_PI 6.28318530717958647692
+
+typedef struct generator_t
+{
+  generator_config_t config; //values points at the generators own copy
+  struct characteristic_t *characteristic;
+  uint64_t start; //time the generator was attached, the origin of periodic kinds
+  uint64_t due; //when the next value is generated
+  uint64_t random_state; //splitmix64 state
+  double value; //last walk or counter value
+  size_t step_index;
+  size_t heap_index;
+} generator_t;
+
+static const char *generator_kind_names[] =
+  {
+    "sine",
+    "ramp",
+    "random",
+    "walk",
+    "counter",
+    "step"
+  };
+
+static generator_t **generators = NULL; //min heap ordered by due
+static size_t generator_count = 0;
+static size_t generator_capacity = 0;
+static uint64_t generator_attach_count = 0;
+static uint64_t generator_seed = 0; //mixed into the seed of generators without one
+
+void generator_set_seed (uint64_t seed)
+{
+  generator_seed = seed;
+}
+
+bool generator_get_kind (const char *name, generator_kind_t *kind)
+{
+  for (size_t i = 0; i < sizeof (generator_kind_names) / sizeof (generator_kind_names[0]); i++)
+  {
+    if (strcmp (name, generator_kind_names[i]) == 0)
+    {
+      *kind = (generator_kind_t) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t generator_next_random (generator_t *generator)
+{
+  return utils_splitmix64 (&generator->random_state);
+}
+
+//uniform in [0, 1)
+static double generator_next_unit (generator_t *generator)
+{
+  return (double) (generator_next_random (generator) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void generator_heap_set (size_t index, generator_t *generator)
+{
+  generators[index] = generator;
+  generator->heap_index = index;
+}
+
+static void generator_sift_up (size_t index)
+{
+  generator_t *generator = generators[index];
+  while (index > 0 && generators[(index - 1) / 2]->due > generator->due)
+  {
+    generator_heap_set (index, generators[(index - 1) / 2]);
+    index = (index - 1) / 2;
+  }
+  generator_heap_set (index, generator);
+}
+
+static void generator_sift_down (size_t index)
+{
+  generator_t *generator = generators[index];
+  while (2 * index + 1 < generator_count)
+  {
+    size_t child = 2 * index + 1;
+    if (child + 1 < generator_count && generators[child + 1]->due < generators[child]->due)
+    {
+      child++;
+    }
+    if (generator->due <= generators[child]->due)
+    {
+      break;
+    }
+    generator_heap_set (index, generators[child]);
+    index = child;
+  }
+  generator_heap_set (index, generator);
+}
+
+static bool generator_config_valid (const generator_config_t *config)
+{
+  if (config->type > BLE_DOUBLE || config->rate_ms == 0)
+  {
+    return false;
+  }
+  switch (config->kind)
+  {
+    case GENERATOR_SINE:
+    case GENERATOR_RAMP:
+      return config->period_ms > 0;
+    case GENERATOR_RANDOM:
+    case GENERATOR_WALK:
+      return config->min <= config->max;
+    case GENERATOR_COUNTER:
+      return config->min <= config->max && config->step > 0;
+    case GENERATOR_STEP:
+      return config->value_count > 0;
+  }
+  return false;
+}
+
+bool generator_attach (struct characteristic_t *characteristic, const generator_config_t *config, uint64_t now)
+{
+  if (!generator_config_valid (config))
+  {
+    return false;
+  }
+
+  generator_t *generator = calloc (1, sizeof (*generator));
+  if (NULL == generator)
+  {
+    return false;
+  }
+  generator->config = *config;
+  generator->config.values = NULL;
+  if (config->kind == GENERATOR_STEP)
+  {
+    double *values = malloc (config->value_count * sizeof (*values));
+    if (NULL == values)
+    {
+      free (generator);
+      return false;
+    }
+    memcpy (values, config->values, config->value_count * sizeof (*values));
+    generator->config.values = values;
+  }
+
+  if (generator_count == generator_capacity)
+  {
+    size_t capacity = generator_capacity ? generator_capacity * 2 : 64;
+    generator_t **heap = realloc (generators, capacity * sizeof (*heap));
+    if (NULL == heap)
+    {
+      free ((double *) generator->config.values);
+      free (generator);
+      return false;
+    }
+    generators = heap;
+    generator_capacity = capacity;
+  }
+
+  generator_detach (characteristic);
+  generator->characteristic = characteristic;
+  generator->start = now;
+  generator->due = now;
+  generator->random_state = config->seeded ? config->seed : generator_seed + generator_attach_count * 0x9E3779B97F4A7C15ull;
+  generator_attach_count++;
+  generator->value = config->kind == GENERATOR_COUNTER ? config->min : fmin (fmax (config->offset, config->min), config->max);
+  characteristic->generator = generator;
+
+  generator_heap_set (generator_count++, generator);
+  generator_sift_up (generator->heap_index);
+  return true;
+}
+
+void generator_detach (struct characteristic_t *characteristic)
+{
+  generator_t *generator = characteristic->generator;
+  if (NULL == generator)
+  {
+    return;
+  }
+
+  size_t index = generator->heap_index;
+  generator_t *last = generators[--generator_count];
+  if (last != generator)
+  {
+    generator_heap_set (index, last);
+    generator_sift_up (index);
+    generator_sift_down (last->heap_index);
+  }
+
+  characteristic->generator = NULL;
+  free ((double *) generator->config.values);
+  free (generator);
+}
+
+void generator_move (struct characteristic_t *from, struct characteristic_t *to)
+{
+  if (from == to)
+  {
+    return;
+  }
+
+  generator_detach (to);
+  to->generator = from->generator;
+  from->generator = NULL;
+  if (NULL != to->generator)
+  {
+    to->generator->characteristic = to;
+  }
+}
+
+static double generator_next_value (generator_t *generator, uint64_t now)
+{
+  const generator_config_t *config = &generator->config;
+  double elapsed = (double) (now - generator->start);
+  switch (config->kind)
+  {
+    case GENERATOR_SINE:
+      return config->offset + config->amplitude * sin (GENERATOR_TWO_PI * elapsed / config->period_ms);
+    case GENERATOR_RAMP:
+      return config->min + (config->max - config->min) * (fmod (elapsed, config->period_ms) / config->period_ms);
+    case GENERATOR_RANDOM:
+      return config->min + (config->max - config->min) * generator_next_unit (generator);
+    case GENERATOR_WALK:
+      generator->value += (2.0 * generator_next_unit (generator) - 1.0) * config->step;
+      generator->value = fmin (fmax (generator->value, config->min), config->max);
+      return generator->value;
+    case GENERATOR_COUNTER:
+    {
+      double value = generator->value;
+      generator->value += config->step;
+      if (generator->value > config->max)
+      {
+        generator->value = config->min;
+      }
+      return value;
+    }
+    case GENERATOR_STEP:
+    {
+      double value = config->values[generator->step_index];
+      generator->step_index = (generator->step_index + 1) % config->value_count;
+      return value;
+    }
+  }
+  return 0;
+}
+
+//rounds and clamps a value into an integer range so the cast is defined, a NaN (inf - inf) becomes the bound nearest 0
+static double generator_clamp (double value, double min, double max)
+{
+  if (isnan (value))
+  {
+    return min > 0 ? min : (max < 0 ? max : 0);
+  }
+  value = nearbyint (value);
+  return value < min ? min : (value > max ? max : value);
+}
+
+static void generator_encode (ble_data_type_t type, double value, uint8_t *data)
+{
+  switch (type)
+  {
+    case BLE_BOOL:   *data = value != 0; break;
+    case BLE_INT8:   { int8_t v = (int8_t) generator_clamp (value, INT8_MIN, INT8_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_UINT8:  { uint8_t v = (uint8_t) generator_clamp (value, 0, UINT8_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_INT16:  { int16_t v = (int16_t) generator_clamp (value, INT16_MIN, INT16_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_UINT16: { uint16_t v = (uint16_t) generator_clamp (value, 0, UINT16_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_INT32:  { int32_t v = (int32_t) generator_clamp (value, INT32_MIN, INT32_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_UINT32: { uint32_t v = (uint32_t) generator_clamp (value, 0, UINT32_MAX); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_INT64:  { int64_t v = (int64_t) generator_clamp (value, -9223372036854775808.0, 9223372036854774784.0); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_UINT64: { uint64_t v = (uint64_t) generator_clamp (value, 0, 18446744073709549568.0); memcpy (data, &v, sizeof (v)); break; }
+    case BLE_FLOAT:  { float v = (float) value; memcpy (data, &v, sizeof (v)); break; }
+    case BLE_DOUBLE: memcpy (data, &value, sizeof (value)); break;
+    default: break;
+  }
+}
+
+size_t generator_run (uint64_t now)
+{
+  size_t generated = 0;
+  while (generator_count > 0 && generators[0]->due <= now)
+  {
+    generator_t *generator = generators[0];
+    if (!device_skips_characteristic (generator->characteristic)) //an idle device keeps its place in the heap
+    {
+      uint8_t data[sizeof (double)];
+      generator_encode (generator->config.type, generator_next_value (generator, now), data);
+      characteristic_update_value (generator->characteristic, data, BLE_DATA_TYPE_SIZE[generator->config.type]);
+      generated++;
+    }
+
+    generator->due += generator->config.rate_ms;
+    if (generator->due <= now) //fell behind, skip the missed values rather than catching up
+    {
+      generator->due = now + generator->config.rate_ms;
+    }
+    generator_sift_down (0);
+  }
+  return generated;
+}
+
+size_t generator_get_count (void)
+{
+  return generator_count;
+}
+
+void generator_fini (void)
+{
+  while (generator_count > 0)
+  {
+    generator_detach (generators[0]->characteristic);
+  }
+  free (generators);
+  generators = NULL;
+  generator_capacity = 0;
+}
@@ -0,0 +1,109 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_GENERATOR_H
+#define BLE_SIM_GENERATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defines.h"
+
+/**
+ * Value generators written in C - sine waves, ramps, random values, random walks, counters and step
+ * profiles - attached to characteristics. Generators are kept in a min heap ordered by when they are
+ * next due and run on the dbus thread every tick without entering lua.
+ * Random sources are seeded per generator so a run can be reproduced.
+ **/
+
+struct characteristic_t;
+
+typedef enum generator_kind_t
+{
+  GENERATOR_SINE = 0, //offset + amplitude * sin (2 pi t / period)
+  GENERATOR_RAMP, //min to max over period, then back to min
+  GENERATOR_RANDOM, //uniform between min and max
+  GENERATOR_WALK, //moves up to step from the last value, kept between min and max
+  GENERATOR_COUNTER, //min, min + step ... max, then back to min
+  GENERATOR_STEP //each of values in turn
+} generator_kind_t;
+
+typedef struct generator_config_t
+{
+  generator_kind_t kind;
+  ble_data_type_t type; //numeric types and BLE_BOOL
+  uint32_t rate_ms; //how often a new value is generated
+  double period_ms;
+  double amplitude;
+  double offset; //added to sine values, the starting value of a walk
+  double min;
+  double max;
+  double step;
+  const double *values; //step profile values, copied
+  size_t value_count;
+  uint64_t seed;
+  bool seeded; //if false the seed is taken from the number of generators attached so far, so runs of the same script repeat
+} generator_config_t;
+
+/**
+ * Looks up a generator kind by name e.g "sine"
+ * @param name the name
+ * @param kind set to the kind
+ * @return true/false if the name is a generator kind
+ **/
+bool generator_get_kind (const char *name, generator_kind_t *kind);
+
+/**
+ * Sets the run seed. Generators attached without a seed are seeded from it and the order they are attached in
+ * @param seed the seed, 0 by default
+ **/
+void generator_set_seed (uint64_t seed);
+
+/**
+ * Attaches a generator to a characteristic, replacing any generator it already has.
+ * The first value is generated on the next run
+ * @param characteristic the characteristic
+ * @param config the generator settings
+ * @param now the current time in milliseconds
+ * @return success true/false - false if the settings are invalid or the generator could not be allocated
+ **/
+bool generator_attach (struct characteristic_t *characteristic, const generator_config_t *config, uint64_t now);
+
+/**
+ * Removes and frees a characteristics generator, does nothing if it has none
+ * @param characteristic the characteristic
+ **/
+void generator_detach (struct characteristic_t *characteristic);
+
+/**
+ * Moves a generator to another characteristic, replacing any generator it already has. The generator
+ * keeps its state so the values it produces carry on where they were
+ * @param from the characteristic the generator is attached to, left without one
+ * @param to the characteristic to attach it to
+ **/
+void generator_move (struct characteristic_t *from, struct characteristic_t *to);
+
+/**
+ * Generates and sets the values of every generator that is due, skipping those of idle devices
+ * when device_skips_characteristic says so
+ * @param now the current time in milliseconds
+ * @return the number of values generated
+ **/
+size_t generator_run (uint64_t now);
+
+/**
+ * @return the number of attached generators
+ **/
+size_t generator_get_count (void);
+
+/**
+ * Detaches every generator
+ **/
+void generator_fini (void);
+
+#endif //BLE_SIM_GENERATOR_H
@@ -0,0 +1,124 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_LUA_COMPAT_H
+#define BLE_SIM_LUA_COMPAT_H
+
+/**
+ * Headers of the lua the simulator is built against. The sources use the Lua 5.3 API, when built with
+ * USE_LUAJIT the parts of it LuaJIT 2.1 (the Lua 5.1 API) does not have are emulated below:
+ * - lua_getfield, lua_getglobal, lua_rawget and lua_rawgeti return the type of the value they push
+ * - lua_isinteger and lua_tointegerx treat numbers with an integral value as integers, LuaJIT has no integer subtype
+ * - lua_getextraspace is a userdata in the registry, found with a lookup rather than at a fixed offset
+ * - lua_resume and lua_dump take the 5.3 arguments, the ones 5.1 does not have are ignored
+ **/
+
+#ifdef USE_LUAJIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "luajit-2.1/lua.h"
+#include "luajit-2.1/lauxlib.h"
+#include "luajit-2.1/lualib.h"
+#include "luajit-2.1/luajit.h"
+
+#define LUA_COMPAT_SEARCHERS "loaders" //package.searchers in 5.3
+#define LUA_COMPAT_EXTRASPACE_KEY "ble-sim.extraspace"
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#ifndef LUA_EXTRASPACE
+#define LUA_EXTRASPACE (sizeof (void *))
+#endif
+
+//shared by a state and its coroutines like the 5.3 extra space, created zeroed the first time it is asked for
+static inline void *lua_compat_getextraspace (lua_State *lua_state)
+{
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUA_COMPAT_EXTRASPACE_KEY);
+  void *space = lua_touserdata (lua_state, -1);
+  lua_pop (lua_state, 1);
+  if (NULL == space)
+  {
+    space = lua_newuserdata (lua_state, LUA_EXTRASPACE);
+    memset (space, 0, LUA_EXTRASPACE);
+    lua_setfield (lua_state, LUA_REGISTRYINDEX, LUA_COMPAT_EXTRASPACE_KEY);
+  }
+  return space;
+}
+
+static inline int lua_compat_getfield (lua_State *lua_state, int index, const char *key)
+{
+  lua_getfield (lua_state, index, key);
+  return lua_type (lua_state, -1);
+}
+
+static inline int lua_compat_rawget (lua_State *lua_state, int index)
+{
+  lua_rawget (lua_state, index);
+  return lua_type (lua_state, -1);
+}
+
+static inline int lua_compat_rawgeti (lua_State *lua_state, int index, lua_Integer n)
+{
+  lua_rawgeti (lua_state, index, (int) n);
+  return lua_type (lua_state, -1);
+}
+
+static inline lua_Integer lua_compat_tointegerx (lua_State *lua_state, int index, int *is_integer)
+{
+  lua_Number number = lua_tonumber (lua_state, index);
+  int integral = lua_isnumber (lua_state, index) && number >= (lua_Number) PTRDIFF_MIN && number < -(lua_Number) PTRDIFF_MIN
+    && (lua_Number) (lua_Integer) number == number;
+  if (NULL != is_integer)
+  {
+    *is_integer = integral;
+  }
+  return integral ? (lua_Integer) number : 0;
+}
+
+static inline int lua_compat_isinteger (lua_State *lua_state, int index)
+{
+  int is_integer = 0;
+  if (lua_type (lua_state, index) == LUA_TNUMBER)
+  {
+    lua_compat_tointegerx (lua_state, index, &is_integer);
+  }
+  return is_integer;
+}
+
+#define lua_getextraspace(L) lua_compat_getextraspace (L)
+#define lua_getfield(L, i, k) lua_compat_getfield (L, (i), (k)) //lua_getglobal expands to lua_getfield
+#define lua_rawget(L, i) lua_compat_rawget (L, (i))
+#define lua_rawgeti(L, i, n) lua_compat_rawgeti (L, (i), (n))
+#define lua_tointegerx(L, i, is_integer) lua_compat_tointegerx (L, (i), (is_integer))
+#define lua_isinteger(L, i) lua_compat_isinteger (L, (i))
+#define lua_resume(L, from, nargs) lua_resume (L, (nargs))
+#define lua_dump(L, writer, data, strip) lua_dump (L, (writer), (data))
+
+#ifndef lua_rawlen
+#define lua_rawlen(L, i) lua_objlen (L, (i))
+#endif
+
+#ifndef luaL_newlibtable
+#define luaL_newlibtable(L, l) lua_createtable (L, 0, sizeof (l) / sizeof ((l)[0]) - 1)
+#endif
+
+#else
+
+#include "lua5.3/lua.h"
+#include "lua5.3/lauxlib.h"
+#include "lua5.3/lualib.h"
+
+#define LUA_COMPAT_SEARCHERS "searchers"
+
+#endif //USE_LUAJIT
+
+#endif //BLE_SIM_LUA_COMPAT_H
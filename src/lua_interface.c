@@ -6,11 +6,31 @@
  **********************************************************************/
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #include "lua_interface.h"
 #include "defines.h"
 #include "device.h"
+#include "registry.h"
+#include "schema.h"
+#include "update_queue.h"
+#include "scheduler.h"
+#include "events.h"
+#include "generator.h"
+#include "format.h"
+#include "pack.h"
+#include "pool.h"
+#include "profile.h"
+#include "script_cache.h"
+#include "simclock.h"
 #include "utils.h"
 #include "logger.h"
 
@@ -22,33 +42,159 @@
   lua_settable(L, -3);
 
 
+#define LUAI_SCRATCH_MIN_CAPACITY 64
+#define LUAI_WORKER_QUEUE_CAPACITY 4096
+#define LUAI_REGISTRY_WAITERS "ble-sim.waiters" //registry table of event name -> array of waiting coroutine references
+#define LUAI_REGISTRY_CALLBACKS "ble-sim.callbacks" //registry table of object lightuserdata -> {[0] = handle, [kind + 1] = function}
+#define LUAI_REGISTRY_VIEW "ble-sim.view" //the view passed to onWrite callbacks
+#define LUAI_REGISTRY_FORMATS "ble-sim.formats" //registry table of format string -> compiled format, so each string is compiled once
+#define LUAI_REGISTRY_HANDLES "ble-sim.handles" //weak valued registry table of object lightuserdata -> handle, so an object has one handle
+#define LUAI_REGISTRY_ALIASES "ble-sim.aliases" //registry table of object lightuserdata -> weak keyed set of other handles to it
+#define LUAI_CALLBACK_HANDLE 0
+#define LUAI_CALLBACK_OVERRUNS (-1) //callbacks table index of the number of budget overruns
+#define LUAI_GC_IDLE_BUDGET_US 5000 //collection time per state after each tick
+#define LUAI_GC_PAUSE 200 //a collection cycle starts once the heap is this percentage of its size after the last cycle
+#define LUAI_GC_MIN_THRESHOLD (256 * 1024) //heap size below which no cycle is started
+#define LUAI_BUDGET_HOOK_COUNT 10000 //instructions between budget checks
+#define LUAI_BUDGET_MAX_OVERRUNS 3 //overruns in a row before an Update function or an objects callbacks are quarantined
+#define LUAI_PROFILE_HOOK_COUNT 1000 //instructions between profiler clock reads
+#define LUAI_PROFILE_PERIOD_US 250 //lua or C time between stack samples
+#define LUAI_PROFILE_MAX_DEPTH 64 //frames sampled from the leaf, deeper stacks are cut at the root
+#define LUAI_PROFILE_STACK_SIZE 4096
+
+typedef struct luai_format_t
+{
+  format_t *format;
+} luai_format_t;
+
+typedef struct luai_view_t
+{
+  const uint8_t *data; //only valid while the callback it was passed to runs
+  size_t size;
+} luai_view_t;
+
+//the collector of a state is stopped once its script has loaded and stepped in the idle time after each tick
+typedef struct luai_gc_t
+{
+  size_t threshold; //heap size that starts the next cycle
+  bool collecting; //a cycle is in progress
+  atomic_size_t heap_bytes; //published after each tick for luai_get_heap_stats
+  atomic_size_t peak_bytes;
+  atomic_uint_least64_t failed_allocations;
+  atomic_uint_least64_t cycles;
+  atomic_uint_least64_t total_us;
+  atomic_uint_least64_t max_us;
+} luai_gc_t;
+
+typedef struct luai_context_t
+{
+  uint8_t *scratch; //reused to encode values passed to setValue so updates do not allocate
+  size_t scratch_capacity;
+  scheduler_t scheduler; //coroutines started with ble.spawn that are sleeping or ready to run
+  lua_State *running; //the spawned coroutine being resumed, NULL outside luai_run_scheduler
+  int running_ref;
+  bool parked; //set when the running coroutine yields through ble.sleep or ble.waitFor
+  struct luai_worker_t *worker; //the worker the state belongs to, NULL for the single state
+  luai_view_t *view; //reused for every written value, kept alive by the registry
+  pool_t pool; //allocator of the state
+  bool pooled; //false when LuaJIT runs the state on its own allocator, the heap is then measured by lua_gc
+  luai_gc_t gc;
+  bool budget_armed; //a call into the script is running, checked by the count hook
+  bool budget_exceeded; //the hook aborted the call
+  uint64_t budget_deadline_us; //wall clock limit of the call, 0 for none
+  uint64_t budget_instructions; //instructions left for the call when there is an instruction budget
+  unsigned int update_overruns; //Update calls in a row aborted by the budget
+  uint64_t update_ms; //simulation time of the last Update, its dt is measured from here
+  uint64_t random_state; //math.random sequence of the state when the run is seeded
+  profile_t profile; //stacks sampled while profiling, merged into luai_profile when the state is closed
+  uint64_t profile_mark_us; //time up to which the running call has been accounted
+  uint64_t profile_lua_us; //lua time not yet sampled
+  uint64_t profile_c_us; //time in api functions not yet sampled
+  char profile_stack[LUAI_PROFILE_STACK_SIZE]; //the sampled stack, "root;...;leaf"
+} luai_context_t;
+
+typedef struct luai_object_t
+{
+  void *object; //the device, service, characteristic, descriptor or schema the handle refers to
+  bool owned; //if lua frees the object when the handle is collected
+} luai_object_t;
+
+typedef struct luai_worker_t
+{
+  unsigned int index;
+  lua_State *lua_state; //the workers own copy of the script
+  pthread_t thread;
+  bool started;
+  sem_t wake; //posted by the dbus thread to run Update
+  atomic_bool busy; //set by the dbus thread when Update is posted, cleared by the worker when it returns
+  atomic_bool quit;
+  update_queue_t queue; //value writes and released objects for the dbus thread
+  sem_t room; //posted by the dbus thread when it drains the queue while the worker waits for room in it
+  atomic_bool waiting; //set by a worker blocked on a full queue
+  event_queue_t events; //events for the workers callbacks, only touched by the dbus thread while the worker is not busy
+} luai_worker_t;
+
+typedef struct luai_buffer_t
+{
+  size_t size;
+  uint8_t data[]; //filled in place by the script, passed to setValue as raw bytes
+} luai_buffer_t;
+
+typedef struct luai_reload_t
+{
+  bool active; //the new script is being loaded
+  char **device_names; //devices registered by the previous script, NULL once the new script takes the device over
+  unsigned int device_count;
+  unsigned int kept; //devices taken over with their controllers and registrations
+  unsigned int replaced; //devices whose layout changed, removed and registered again
+} luai_reload_t;
+
+typedef uint32_t (*luai_flag_lookup_function) (const char *flag);
+
 static lua_State *luai_state;
 
+static bool luai_restored = false; //devices were restored from a snapshot before the script was loaded
+
+static size_t luai_memory_limit = 0; //cap on the heap of each lua state, 0 for none
+
+static uint64_t luai_time_budget_us = (uint64_t) SIM_DEFAULT_LUA_TIME_BUDGET_MS * 1000; //per call, 0 for none
+
+static uint64_t luai_instruction_budget = 0; //per call, 0 for none
+
+static const char *luai_profile_path = NULL; //the collapsed stacks are written here, NULL when not profiling
+
+static profile_t luai_profile; //stacks of the closed states
+
+static bool luai_seeded = false; //math.random of every state is replaced by a sequence derived from luai_seed
+static uint64_t luai_seed = 0;
+
+static luai_reload_t luai_reload = {0};
+
+static volatile sig_atomic_t luai_reload_requested = 0;
+
+static luai_worker_t *luai_workers = NULL;
+static unsigned int luai_worker_count = 0;
+static _Thread_local luai_worker_t *luai_current_worker = NULL; //the worker running on this thread, NULL on the dbus thread
+
 static void lua_fail (lua_State *lua_state);
 
-static bool init_lua_state (lua_State **lua_state, const char *file_path);
+static bool init_lua_state (lua_State **lua_state, const char *file_path, luai_worker_t *worker);
 
-static void luai_setup_lua_sim_api (lua_State *lua_state);
+static void luai_setup_lua_sim_api (lua_State *lua_state, const luai_worker_t *worker);
 
 static void luai_register_datatype_enums (lua_State *lua_state);
 
 static void luai_setup_object_metatables (lua_State *lua_state);
 
-static bool luai_call_function (lua_State *lua_state, const char *function_name);
+static bool luai_call_function (lua_State *lua_state, const char *function_name, lua_Integer argument);
 
 static void luai_check_type (lua_State *lua_state, int index, int expected_parameter_type);
 
 static void luai_check_argument_count (lua_State *lua_state, int expected_argument_count);
 
-static bool luai_get_array (lua_State *lua_state, int idx, ble_data_type_t type, void **array, size_t *array_size);
+static bool luai_get_array (lua_State *lua_state, int idx, ble_data_type_t type, const void **array, size_t *array_size);
 
-static bool luai_lua_data_arg_to_ble_data_type (
-  lua_State *lua_state,
-  int index,
-  ble_data_type_t type,
-  void **data,
-  size_t *data_size
-);
+static bool luai_encode_value (lua_State *lua_state, int index, ble_data_type_t type, uint8_t *data);
 
 //lua api
 static int luai_create_device (lua_State *lua_state);
@@ -61,6 +207,20 @@ static int luai_create_descriptor (lua_State *lua_state);
 
 static int luai_register_device (lua_State *lua_state);
 
+static int luai_remove_device (lua_State *lua_state);
+
+static int luai_create_schema (lua_State *lua_state);
+
+static int luai_create_devices (lua_State *lua_state);
+
+static int luai_get_device (lua_State *lua_state);
+
+static int luai_create_buffer (lua_State *lua_state);
+
+static int luai_create_format (lua_State *lua_state);
+
+static int luai_set_values_function (lua_State *lua_state);
+
 //lua device methods
 static int luai_device_add_service (lua_State *lua_state);
 
@@ -68,31 +228,119 @@ static int luai_device_set_powered (lua_State *lua_state);
 
 static int luai_device_set_discoverable (lua_State *lua_state);
 
+static int luai_device_get_service (lua_State *lua_state);
+
+static int luai_device_set_values (lua_State *lua_state);
+
+static int luai_device_on_connect (lua_State *lua_state);
+
+static int luai_device_on_disconnect (lua_State *lua_state);
+
+static int luai_device_is_active (lua_State *lua_state);
+
 static int luai_device_free (lua_State *lua_state);
 
 //lua service methods
 static int luai_service_add_characteristic (lua_State *lua_state);
 
+static int luai_service_get_characteristic (lua_State *lua_state);
+
 static int luai_service_free (lua_State *lua_state);
 
 //lua characteristic methods
 static int luai_characteristic_add_descriptor (lua_State *lua_state);
 
+static int luai_characteristic_get_descriptor (lua_State *lua_state);
+
 static int luai_characteristic_set_notifying (lua_State *lua_state);
 
 static int luai_characteristic_set_value (lua_State *lua_state);
 
+static int luai_characteristic_on_write (lua_State *lua_state);
+
+static int luai_characteristic_on_read (lua_State *lua_state);
+
+static int luai_characteristic_on_subscribe (lua_State *lua_state);
+
+static int luai_characteristic_on_unsubscribe (lua_State *lua_state);
+
+static int luai_characteristic_generate (lua_State *lua_state);
+
 static int luai_characteristic_free (lua_State *lua_state);
 
 //lua descriptor methods
+static int luai_descriptor_set_value (lua_State *lua_state);
+
 static int luai_descriptor_free (lua_State *lua_state);
 
+//lua schema methods
+static int luai_schema_instantiate (lua_State *lua_state);
+
+static int luai_schema_free (lua_State *lua_state);
+
+//lua buffer methods
+static int luai_buffer_write (lua_State *lua_state);
+
+static int luai_buffer_fill (lua_State *lua_state);
+
+static int luai_buffer_to_string (lua_State *lua_state);
+
+static int luai_buffer_index (lua_State *lua_state);
+
+static int luai_buffer_new_index (lua_State *lua_state);
+
+static int luai_buffer_length (lua_State *lua_state);
+
+//lua format methods
+static int luai_format_length (lua_State *lua_state);
+
+static int luai_format_free (lua_State *lua_state);
+
+//lua view methods
+static int luai_view_to_string (lua_State *lua_state);
+
+static int luai_view_index (lua_State *lua_state);
+
+static int luai_view_length (lua_State *lua_state);
+
+static int luai_spawn (lua_State *lua_state);
+
+static int luai_sleep (lua_State *lua_state);
+
+static int luai_wait_for (lua_State *lua_state);
+
+static int luai_signal (lua_State *lua_state);
+
+static int luai_now (lua_State *lua_state);
+
+static int luai_math_random (lua_State *lua_state);
+
+static int luai_math_randomseed (lua_State *lua_state);
+
 static const struct luaL_Reg luai_ble_sim_api[] = {
   {LUA_API_CREATE_DEVICE,         luai_create_device},
   {LUA_API_CREATE_SERVICE,        luai_create_service},
   {LUA_API_CREATE_CHARACTERISTIC, luai_create_characteristic},
   {LUA_API_CREATE_DESCRIPTOR,     luai_create_descriptor},
   {LUA_API_REGISTER_DEVICE,       luai_register_device},
+  {LUA_API_REMOVE_DEVICE,         luai_remove_device},
+  {LUA_API_CREATE_SCHEMA,         luai_create_schema},
+  {LUA_API_CREATE_DEVICES,        luai_create_devices},
+  {LUA_API_GET_DEVICE,            luai_get_device},
+  {LUA_API_BUFFER,                luai_create_buffer},
+  {LUA_API_FORMAT,                luai_create_format},
+  {LUA_API_SET_VALUES,            luai_set_values_function},
+  {LUA_API_SPAWN,                 luai_spawn},
+  {LUA_API_SLEEP,                 luai_sleep},
+  {LUA_API_WAIT_FOR,              luai_wait_for},
+  {LUA_API_SIGNAL,                luai_signal},
+  {LUA_API_NOW,                   luai_now},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg luai_seeded_math_functions[] = {
+  {LUA_MATH_RANDOM,     luai_math_random},
+  {LUA_MATH_RANDOMSEED, luai_math_randomseed},
   {NULL, NULL}
 };
 
@@ -100,22 +348,63 @@ static const struct luaL_Reg luai_device_object_functions[] = {
   {LUA_DEVICE_ADD_SERVICE,      luai_device_add_service},
   {LUA_DEVICE_SET_POWERED,      luai_device_set_powered},
   {LUA_DEVICE_SET_DISCOVERABLE, luai_device_set_discoverable},
+  {LUA_DEVICE_GET_SERVICE,      luai_device_get_service},
+  {LUA_DEVICE_SET_VALUES,       luai_device_set_values},
+  {LUA_DEVICE_ON_CONNECT,       luai_device_on_connect},
+  {LUA_DEVICE_ON_DISCONNECT,    luai_device_on_disconnect},
+  {LUA_DEVICE_IS_ACTIVE,        luai_device_is_active},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg luai_service_object_functions[] = {
   {LUA_SERVICE_ADD_CHARACTERISTIC, luai_service_add_characteristic},
+  {LUA_SERVICE_GET_CHARACTERISTIC, luai_service_get_characteristic},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg luai_characteristic_object_functions[] = {
   {LUA_CHARACTERISTIC_ADD_DESCRIPTOR, luai_characteristic_add_descriptor},
+  {LUA_CHARACTERISTIC_GET_DESCRIPTOR, luai_characteristic_get_descriptor},
   {LUA_CHARACTERISTIC_SET_NOTIFYING,  luai_characteristic_set_notifying},
   {LUA_CHARACTERISTIC_SET_VALUE,      luai_characteristic_set_value},
+  {LUA_CHARACTERISTIC_ON_WRITE,       luai_characteristic_on_write},
+  {LUA_CHARACTERISTIC_ON_READ,        luai_characteristic_on_read},
+  {LUA_CHARACTERISTIC_ON_SUBSCRIBE,   luai_characteristic_on_subscribe},
+  {LUA_CHARACTERISTIC_ON_UNSUBSCRIBE, luai_characteristic_on_unsubscribe},
+  {LUA_CHARACTERISTIC_GENERATE,       luai_characteristic_generate},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg luai_descriptor_object_functions[] = {
+  {LUA_DESCRIPTOR_SET_VALUE, luai_descriptor_set_value},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg luai_schema_object_functions[] = {
+  {LUA_SCHEMA_INSTANTIATE, luai_schema_instantiate},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg luai_buffer_object_functions[] = {
+  {LUA_BUFFER_WRITE,            luai_buffer_write},
+  {LUA_BUFFER_FILL,             luai_buffer_fill},
+  {LUA_BUFFER_TO_STRING,        luai_buffer_to_string},
+  {LUA_INDEX_FIELD,             luai_buffer_index},
+  {LUA_NEW_INDEX_FIELD,         luai_buffer_new_index},
+  {LUA_LENGTH_FIELD,            luai_buffer_length},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg luai_format_object_functions[] = {
+  {LUA_LENGTH_FIELD,            luai_format_length},
+  {LUA_GARBAGE_COLLECTOR_FIELD, luai_format_free},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg luai_view_object_functions[] = {
+  {LUA_BUFFER_TO_STRING, luai_view_to_string},
+  {LUA_INDEX_FIELD,      luai_view_index},
+  {LUA_LENGTH_FIELD,     luai_view_length},
   {NULL, NULL}
 };
 
@@ -123,11 +412,52 @@ static ble_data_type_t luai_check_type_ble_data_type (lua_State *lua_state, int
 {
   luai_check_type (lua_state, index, LUA_TNUMBER);
   uint8_t type_int = (uint8_t) lua_tointeger(lua_state, index);
-  luaL_argcheck (lua_state, type_int <= BLE_STRING, index, "Argument must be a valid" LUA_API_ENUM_DATATYPE " enum: ");
+  luaL_argcheck (lua_state, type_int <= BLE_BYTES, index, "Argument must be a valid" LUA_API_ENUM_DATATYPE " enum: ");
   ble_data_type_t type = (ble_data_type_t) lua_tointeger(lua_state, index);
   return type;
 }
 
+//an object has one handle while the handle is alive, a reload points it at the live object that takes the objects place
+static void luai_push_object (lua_State *lua_state, void *object, const char *metadata_table_name, bool owned)
+{
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_HANDLES);
+  lua_pushlightuserdata (lua_state, object);
+  lua_rawget (lua_state, -2);
+  luai_object_t *handle = (luai_object_t *) luaL_testudata (lua_state, -1, metadata_table_name);
+  if (NULL != handle && handle->object == object) //a released handle waiting to be collected is not reused
+  {
+    handle->object = object;
+    handle->owned = handle->owned || owned;
+    lua_remove (lua_state, -2);
+    return;
+  }
+  lua_pop (lua_state, 1);
+
+  handle = (luai_object_t *) lua_newuserdata (lua_state, sizeof (*handle));
+  handle->object = object;
+  handle->owned = owned;
+
+  luaL_getmetatable (lua_state, metadata_table_name); //add the userdata metatable to this object
+  lua_setmetatable (lua_state, -2);
+
+  lua_pushlightuserdata (lua_state, object);
+  lua_pushvalue (lua_state, -2);
+  lua_rawset (lua_state, -4);
+  lua_remove (lua_state, -2);
+}
+
+static luai_object_t *luai_check_argument_handle (
+  lua_State *lua_state,
+  int index,
+  const char *metadata_table_name,
+  const char *error_message
+)
+{
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, index, metadata_table_name);
+  luaL_argcheck(lua_state, handle != NULL && handle->object != NULL, index, error_message);
+  return handle;
+}
+
 static void *luai_check_argument_userdata (
   lua_State *lua_state,
   int index,
@@ -135,9 +465,7 @@ static void *luai_check_argument_userdata (
   const char *error_message
 )
 {
-  void *userdata = luaL_checkudata (lua_state, index, metadata_table_name);
-  luaL_argcheck(lua_state, userdata != NULL, index, error_message);
-  return userdata;
+  return luai_check_argument_handle (lua_state, index, metadata_table_name, error_message)->object;
 }
 
 static device_t *luai_check_argument_device (lua_State *lua_state, int index) //checks device is the first arguement
@@ -160,593 +488,3421 @@ static descriptor_t *luai_check_argument_descriptor (lua_State *lua_state, int i
   return (descriptor_t *) luai_check_argument_userdata (lua_state, index, LUA_USERDATA_DESCRIPTOR, "' " LUA_USERDATA_DESCRIPTOR "' expected");
 }
 
-static bool luai_call_function (lua_State *lua_state, const char *function_name)
+static device_schema_t *luai_check_argument_schema (lua_State *lua_state, int index)
 {
-  lua_getglobal (lua_state, function_name);
-  if (lua_pcall (lua_state, 0, 0, 0))
-  {
-    log_error ("No '%s' function found.\n", function_name);
-    lua_fail (lua_state);
-    return false;
-  }
-  return true;
+  return (device_schema_t *) luai_check_argument_userdata (lua_state, index, LUA_USERDATA_SCHEMA, "' " LUA_USERDATA_SCHEMA "' expected");
 }
 
-static bool init_lua_state (lua_State **lua_state, const char *file_path)
+static luai_buffer_t *luai_check_argument_buffer (lua_State *lua_state, int index)
 {
-  *lua_state = luaL_newstate ();
-  luaL_openlibs (*lua_state);
-
-  luai_setup_lua_sim_api (*lua_state);
-  luai_setup_object_metatables (*lua_state);
+  return (luai_buffer_t *) luaL_checkudata (lua_state, index, LUA_USERDATA_BUFFER);
+}
 
-  if (luaL_loadfile (*lua_state, file_path) || lua_pcall (*lua_state, 0, 0, 0))
+static void *luai_alloc_object (lua_State *lua_state, size_t size)
+{
+  void *object = malloc (size);
+  if (NULL == object)
   {
-    lua_fail (*lua_state);
-    return false;
+    luaL_error (lua_state, "Could not allocate object");
   }
-  return true;
+  return object;
 }
 
-static void luai_setup_object_metatables (lua_State *lua_state)
+//functions that touch dbus, the path table or objects the dbus thread reads can only run on the dbus thread
+static void luai_check_dbus_thread (lua_State *lua_state)
 {
-  //device
-  luaL_newmetatable (lua_state, LUA_USERDATA_DEVICE);
-  lua_pushvalue (lua_state, -1); // there are two 'copies' of the metatable on the stack
-  lua_setfield (lua_state, -2, LUA_INDEX_FIELD); // pop one of those copies and assign it to  __index field of the 1st metatable
-  luaL_setfuncs (lua_state, luai_device_object_functions, 0);
-
-  lua_pushcfunction (lua_state, luai_device_free); //set garbage collector cleanup function
-  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
-
-  //service
-  luaL_newmetatable (lua_state, LUA_USERDATA_SERVICE);
-  lua_pushvalue (lua_state, -1);
-  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
-  luaL_setfuncs (lua_state, luai_service_object_functions, 0);
-
-  lua_pushcfunction (lua_state, luai_service_free); //set garbage collector cleanup function
-  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
-  //characterisitc
-  luaL_newmetatable (lua_state, LUA_USERDATA_CHARACTERISTIC);
-  lua_pushvalue (lua_state, -1);
-  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
-  luaL_setfuncs (lua_state, luai_characteristic_object_functions, 0);
-
-  lua_pushcfunction (lua_state, luai_characteristic_free); //set garbage collector cleanup function
-  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
-  //descriptor
-  luaL_newmetatable (lua_state, LUA_USERDATA_DESCRIPTOR);
-  lua_pushvalue (lua_state, -1);
-  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
-  luaL_setfuncs (lua_state, luai_descriptor_object_functions, 0);
+  if (NULL != luai_current_worker)
+  {
+    luaL_error (lua_state, "This function can not be called from a worker Update, call it while the script is loaded");
+  }
+}
 
-  lua_pushcfunction (lua_state, luai_descriptor_free); //set garbage collector cleanup function
-  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+//blocks a worker whose queue is full until the dbus thread drains it on its next tick
+static void luai_wait_for_room (luai_worker_t *worker)
+{
+  while (update_queue_is_full (&worker->queue))
+  {
+    atomic_store (&worker->waiting, true);
+    atomic_thread_fence (memory_order_seq_cst); //pairs with the fence in luai_drain_worker
+    if (update_queue_is_full (&worker->queue) || !atomic_exchange (&worker->waiting, false))
+    {
+      while (sem_wait (&worker->room) != 0 && errno == EINTR); //the drain cleared waiting and posts
+    }
+  }
 }
 
-static void luai_register_datatype_enums (lua_State *lua_state)
+//applies the updates a worker queued and wakes it if it is waiting for room, dbus thread only
+static void luai_drain_worker (luai_worker_t *worker)
 {
-  lua_newtable(lua_state);
+  update_queue_drain (&worker->queue);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (&worker->waiting, false))
   {
-    LUA_ENUM(lua_state, BOOL, BLE_BOOL);
-    LUA_ENUM(lua_state, INT8, BLE_INT8);
-    LUA_ENUM(lua_state, UINT8, BLE_UINT8);
-    LUA_ENUM(lua_state, INT16, BLE_INT16);
-    LUA_ENUM(lua_state, UINT16, BLE_UINT16);
-    LUA_ENUM(lua_state, INT32, BLE_INT32);
-    LUA_ENUM(lua_state, UINT32, BLE_UINT32);
-    LUA_ENUM(lua_state, INT64, BLE_INT64);
-    LUA_ENUM(lua_state, UINT64, BLE_UINT64);
-    LUA_ENUM(lua_state, FLOAT, BLE_FLOAT);
-    LUA_ENUM(lua_state, DOUBLE, BLE_DOUBLE);
-    LUA_ENUM(lua_state, STRING, BLE_STRING);
+    sem_post (&worker->room);
   }
-  lua_setglobal(lua_state, LUA_API_ENUM_DATATYPE);
 }
 
-static void luai_setup_lua_sim_api (lua_State *lua_state)
+//on a worker thread the value is queued for the dbus thread, false if it could not be queued
+static bool luai_push_value (characteristic_t *characteristic, const void *data, size_t data_size)
 {
-  luaL_newlib(lua_state, luai_ble_sim_api);
-  lua_setglobal (lua_state, "ble");
+  luai_worker_t *worker = luai_current_worker;
+  if (NULL == worker)
+  {
+    characteristic_update_value (characteristic, data, data_size);
+    return true;
+  }
 
-  luai_register_datatype_enums (lua_state);
+  luai_wait_for_room (worker);
+  return update_queue_push_value (&worker->queue, characteristic, data, (uint32_t) data_size);
 }
 
-static void lua_fail (lua_State *lua_state)
+static void luai_update_value (lua_State *lua_state, characteristic_t *characteristic, const void *data, size_t data_size)
 {
-  log_error ("Lua - %s", lua_tostring(lua_state, -1));
+  if (!luai_push_value (characteristic, data, data_size))
+  {
+    luaL_error (lua_state, "Could not queue value");
+  }
 }
 
-static void luai_check_type (lua_State *lua_state, int index, int expected_parameter_type)
+//frees an object owned by a handle, objects released by a worker are freed on the dbus thread
+static void luai_release_object (luai_object_t *handle, update_free_function free_function)
 {
-  int type = lua_type (lua_state, index);
-
-  luaL_argcheck (
-    lua_state,
-    type == expected_parameter_type,
-    index,
-    ""
-  );
+  if (handle->owned && NULL != handle->object)
+  {
+    luai_worker_t *worker = luai_current_worker;
+    if (NULL == worker)
+    {
+      free_function (handle->object);
+    }
+    else
+    {
+      do
+      {
+        luai_wait_for_room (worker);
+      } while (!update_queue_push_free (&worker->queue, handle->object, free_function));
+    }
+  }
+  handle->object = NULL;
 }
 
-static void luai_check_argument_count (lua_State *lua_state, int expected_argument_count)
+//objects adopted on a reload belong to the registry, see luai_adopt_device
+static void luai_free_device (void *object)
 {
-  if (lua_gettop (lua_state) != expected_argument_count)
+  device_t *device = (device_t *) object;
+  if (device->origin != ORIGIN_C)
   {
-    luaL_error(lua_state, "Expected %d arguments to function", expected_argument_count);
+    device_free (device);
   }
 }
 
-static int luai_create_device (lua_State *lua_state)
+static void luai_free_service (void *object)
 {
-  luai_check_argument_count (lua_state, 1);
-  luai_check_type (lua_state, 1, LUA_TSTRING);
-  const char *device_name = lua_tostring(lua_state, 1);
-
-  device_t *device = (device_t *) lua_newuserdata (lua_state, sizeof (*device));
-  device_init (device, device_name, ORIGIN_LUA);
+  service_t *service = (service_t *) object;
+  if (service->origin != ORIGIN_C)
+  {
+    service_free (service);
+  }
+}
 
-  luaL_getmetatable (lua_state, LUA_USERDATA_DEVICE); //add the userdata metatable to this object
-  lua_setmetatable (lua_state, -2);
+static void luai_free_characteristic (void *object)
+{
+  characteristic_t *characteristic = (characteristic_t *) object;
+  if (characteristic->origin != ORIGIN_C)
+  {
+    characteristic_free (characteristic);
+  }
+}
 
-  return 1; //the device is already on the stack so return 
+static void luai_free_descriptor (void *object)
+{
+  descriptor_t *descriptor = (descriptor_t *) object;
+  if (descriptor->origin != ORIGIN_C)
+  {
+    descriptor_free (descriptor);
+  }
 }
 
-static int luai_create_service (lua_State *lua_state)
+static void luai_free_schema (void *object)
 {
-  luai_check_argument_count (lua_state, 1);
-  luai_check_type (lua_state, 1, LUA_TSTRING);
-  const char *uuid = lua_tostring(lua_state, 1);
+  device_schema_unref ((device_schema_t *) object);
+}
 
-  service_t *service = (service_t *) lua_newuserdata (lua_state, sizeof (*service));
-  service_init (service, uuid, true, ORIGIN_LUA);
+static void luai_adopt_origin (int *origin)
+{
+  if (*origin == ORIGIN_LUA)
+  {
+    *origin = ORIGIN_C;
+  }
+}
 
-  luaL_getmetatable (lua_state, LUA_USERDATA_SERVICE); //add the userdata metatable to this object
-  lua_setmetatable (lua_state, -2);
+//hands a device and the objects a script built it from to the registry, so it outlives the state that owns them.
+//the callbacks and generators of the script go, they belong to the state
+static void luai_adopt_device (device_t *device)
+{
+  if (device->event_mask)
+  {
+    events_remove_object (device);
+  }
+  device->event_mask = 0;
+  device->event_listener = NULL;
 
-  return 1; //the service is already on the stack so return 
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    for (characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      generator_detach (characteristic);
+      if (characteristic->event_mask)
+      {
+        events_remove_object (characteristic);
+      }
+      characteristic->event_mask = 0;
+      characteristic->event_listener = NULL;
+      characteristic->read_ttl_ms = 0;
+      characteristic->read_expires_ms = 0;
+      for (descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+      {
+        luai_adopt_origin (&descriptor->origin);
+      }
+      luai_adopt_origin (&characteristic->origin);
+    }
+    luai_adopt_origin (&service->origin);
+  }
+  luai_adopt_origin (&device->origin);
 }
 
-static int luai_create_characteristic (lua_State *lua_state)
+//takes the value of object out of a registry table, leaving it on the stack above the table
+static int luai_take_registry_entry (lua_State *lua_state, const char *table, void *object)
 {
-  luai_check_argument_count (lua_state, 1);
-  luai_check_type (lua_state, 1, LUA_TSTRING);
-  const char *char_uuid = lua_tostring(lua_state, 1);
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, table);
+  lua_pushlightuserdata (lua_state, object);
+  int type = lua_rawget (lua_state, -2);
+  lua_pushlightuserdata (lua_state, object);
+  lua_pushnil (lua_state);
+  lua_rawset (lua_state, -4);
+  return type;
+}
 
-  characteristic_t *characteristic = (characteristic_t *) lua_newuserdata (lua_state, sizeof (*characteristic));
-  characteristic_init (characteristic, char_uuid, ORIGIN_LUA);
+//the handle of the new object refers to the live one. A live object the script already holds a handle to, from
+//ble.getDevice or its lookups, keeps that handle and the new one is kept as an alias so both are cleared when it is freed
+static void luai_rebind_handle (lua_State *lua_state, void *object, void *live)
+{
+  if (luai_take_registry_entry (lua_state, LUAI_REGISTRY_HANDLES, object) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 2);
+    return;
+  }
+  luai_object_t *handle = (luai_object_t *) lua_touserdata (lua_state, -1);
+  handle->object = live;
+  handle->owned = false;
 
-  luaL_getmetatable (lua_state, LUA_USERDATA_CHARACTERISTIC); //add the userdata metatable to this object
-  lua_setmetatable (lua_state, -2);
+  lua_pushlightuserdata (lua_state, live);
+  if (lua_rawget (lua_state, -3) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 1);
+    lua_pushlightuserdata (lua_state, live);
+    lua_pushvalue (lua_state, -2);
+    lua_rawset (lua_state, -4);
+    lua_pop (lua_state, 2);
+    return;
+  }
+  lua_pop (lua_state, 1);
 
-  return 1; //the characteristic is already on the stack so return this
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_ALIASES);
+  lua_pushlightuserdata (lua_state, live);
+  if (lua_rawget (lua_state, -2) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 1);
+    lua_newtable (lua_state);
+    lua_createtable (lua_state, 0, 1);
+    lua_pushliteral (lua_state, "k");
+    lua_setfield (lua_state, -2, "__mode");
+    lua_setmetatable (lua_state, -2);
+    lua_pushlightuserdata (lua_state, live);
+    lua_pushvalue (lua_state, -2);
+    lua_rawset (lua_state, -4);
+  }
+  lua_pushvalue (lua_state, -3);
+  lua_pushboolean (lua_state, true);
+  lua_rawset (lua_state, -3);
+  lua_pop (lua_state, 4);
 }
 
-static int luai_create_descriptor (lua_State *lua_state)
+//callbacks the new object has are added to those the script already set on the live object, an event set on both takes
+//the new objects callback
+static void luai_rebind_callbacks (lua_State *lua_state, void *object, void *live)
 {
-  luai_check_argument_count (lua_state, 1);
-  luai_check_type (lua_state, 1, LUA_TSTRING);
-  const char *desc_uuid = lua_tostring(lua_state, 1);
-
-  descriptor_t *descriptor = (descriptor_t *) lua_newuserdata (lua_state, sizeof (*descriptor));
-  descriptor_init (descriptor, desc_uuid, ORIGIN_LUA);
+  if (luai_take_registry_entry (lua_state, LUAI_REGISTRY_CALLBACKS, object) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 2);
+    return;
+  }
 
-  luaL_getmetatable (lua_state, LUA_USERDATA_DESCRIPTOR); //add the userdata metatable to this object
+  lua_pushlightuserdata (lua_state, live);
+  if (lua_rawget (lua_state, -3) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 1);
+    lua_pushlightuserdata (lua_state, live);
+    lua_pushvalue (lua_state, -2);
+    lua_rawset (lua_state, -4);
+    lua_pop (lua_state, 2);
+    return;
+  }
+
+  lua_pushnil (lua_state);
+  while (lua_next (lua_state, -3))
+  {
+    lua_Integer key = lua_tointeger (lua_state, -2);
+    if (key > LUAI_CALLBACK_HANDLE) //the live object keeps its handle and overrun count
+    {
+      lua_rawseti (lua_state, -3, key);
+    }
+    else
+    {
+      lua_pop (lua_state, 1);
+    }
+  }
+  lua_pop (lua_state, 3);
+}
+
+//points the handle of an object built by a reloaded script at the live object that takes its place and moves its callbacks
+static void luai_rebind_object (lua_State *lua_state, void *object, void *live)
+{
+  luai_rebind_handle (lua_state, object, live);
+  luai_rebind_callbacks (lua_state, object, live);
+}
+
+//moves the events an object built by a reloaded script listens for to the live object, leaving those already set on it
+static void luai_rebind_events (uint8_t *event_mask, void **event_listener, uint8_t *live_mask, void **live_listener)
+{
+  if (0 == *event_mask)
+  {
+    return;
+  }
+  if (*live_mask && *live_listener != *event_listener)
+  {
+    log_warn ("Callbacks of the reloaded object are set by another worker, keeping those");
+  }
+  else
+  {
+    *live_mask |= *event_mask;
+    *live_listener = *event_listener;
+  }
+  *event_mask = 0;
+}
+
+static void luai_rebind_characteristic (lua_State *lua_state, characteristic_t *characteristic, characteristic_t *live)
+{
+  luai_rebind_object (lua_state, characteristic, live);
+  if (characteristic->event_mask & EVENT_MASK (EVENT_READ))
+  {
+    live->read_ttl_ms = characteristic->read_ttl_ms;
+    live->read_expires_ms = 0;
+  }
+  luai_rebind_events (&characteristic->event_mask, &characteristic->event_listener, &live->event_mask, &live->event_listener);
+  generator_move (characteristic, live);
+  if (NULL != characteristic->value) //a value the script did not set is kept
+  {
+    characteristic_update_value (live, characteristic->value, characteristic->value_size);
+  }
+
+  descriptor_t *live_descriptor = live->descriptors;
+  for (descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+  {
+    luai_rebind_object (lua_state, descriptor, live_descriptor);
+    if (NULL != descriptor->value)
+    {
+      free (live_descriptor->value);
+      live_descriptor->value = descriptor->value;
+      live_descriptor->value_size = descriptor->value_size;
+      descriptor->value = NULL;
+      descriptor->value_size = 0;
+    }
+    live_descriptor = live_descriptor->next;
+  }
+}
+
+//a device built by a reloaded script with the layout of the live device of the same name is applied to the live device
+//and freed - the live device keeps its controller, registrations and notifying state
+static void luai_rebind_device (lua_State *lua_state, device_t *device, device_t *live)
+{
+  luai_rebind_object (lua_state, device, live);
+  luai_rebind_events (&device->event_mask, &device->event_listener, &live->event_mask, &live->event_listener);
+
+  service_t *live_service = live->services;
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    luai_rebind_object (lua_state, service, live_service);
+    characteristic_t *live_characteristic = live_service->characteristics;
+    for (characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      luai_rebind_characteristic (lua_state, characteristic, live_characteristic);
+      live_characteristic = live_characteristic->next;
+    }
+    live_service = live_service->next;
+  }
+
+  luai_adopt_device (device);
+  device_free (device);
+}
+
+//drops the handle and callbacks of an object C is about to free, a script still holding the handle gets an error rather
+//than the freed object or a new object allocated at the same address
+static void luai_forget_object (lua_State *lua_state, void *object)
+{
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_HANDLES);
+  lua_pushlightuserdata (lua_state, object);
+  lua_rawget (lua_state, -2);
+  luai_object_t *handle = (luai_object_t *) lua_touserdata (lua_state, -1);
+  if (NULL != handle)
+  {
+    handle->object = NULL;
+    handle->owned = false;
+  }
+  lua_pop (lua_state, 2);
+
+  if (luai_take_registry_entry (lua_state, LUAI_REGISTRY_ALIASES, object) == LUA_TTABLE)
+  {
+    lua_pushnil (lua_state);
+    while (lua_next (lua_state, -2))
+    {
+      handle = (luai_object_t *) lua_touserdata (lua_state, -2);
+      handle->object = NULL;
+      handle->owned = false;
+      lua_pop (lua_state, 1);
+    }
+  }
+  lua_pop (lua_state, 2);
+
+  static const char *tables[] = {LUAI_REGISTRY_HANDLES, LUAI_REGISTRY_CALLBACKS};
+  for (size_t i = 0; i < sizeof (tables) / sizeof (tables[0]); i++)
+  {
+    lua_getfield (lua_state, LUA_REGISTRYINDEX, tables[i]);
+    lua_pushlightuserdata (lua_state, object);
+    lua_pushnil (lua_state);
+    lua_rawset (lua_state, -3);
+    lua_pop (lua_state, 1);
+  }
+}
+
+//objects made by a script stay with their handles, the rest of the tree is freed with the device
+static void luai_forget_device_tree (lua_State *lua_state, device_t *device)
+{
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    for (characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      for (descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+      {
+        if (descriptor->origin != ORIGIN_LUA)
+        {
+          luai_forget_object (lua_state, descriptor);
+        }
+      }
+      if (characteristic->origin != ORIGIN_LUA)
+      {
+        luai_forget_object (lua_state, characteristic);
+      }
+    }
+    if (service->origin != ORIGIN_LUA)
+    {
+      luai_forget_object (lua_state, service);
+    }
+  }
+  luai_forget_object (lua_state, device);
+}
+
+//removes a registered device, the dbus thread only frees devices while the workers are idle so every state is updated
+static bool luai_remove_registered_device (const char *device_name)
+{
+  device_t *device = device_get_device (device_name);
+  if (NULL != device && device->origin != ORIGIN_LUA)
+  {
+    if (NULL != luai_state)
+    {
+      luai_forget_device_tree (luai_state, device);
+    }
+    for (unsigned int i = 0; i < luai_worker_count; i++)
+    {
+      if (NULL != luai_workers[i].lua_state)
+      {
+        luai_forget_device_tree (luai_workers[i].lua_state, device);
+      }
+    }
+  }
+  return device_remove (device_name);
+}
+
+//takes a device registered by the previous script off the list of devices removed once the reload finishes
+static bool luai_reload_claim (const char *device_name)
+{
+  for (unsigned int i = 0; i < luai_reload.device_count; i++)
+  {
+    if (NULL != luai_reload.device_names[i] && strcmp (luai_reload.device_names[i], device_name) == 0)
+    {
+      free (luai_reload.device_names[i]);
+      luai_reload.device_names[i] = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+//during a reload a device registered under the name of a device of the previous script takes the live device over if
+//the layouts match - the device is freed and its handles refer to the live one - otherwise the live device is removed
+static bool luai_reload_take_over (lua_State *lua_state, device_t *device)
+{
+  if (!luai_reload.active || !luai_reload_claim (device->device_name))
+  {
+    return false;
+  }
+
+  device_t *live = device_get_device (device->device_name);
+  if (NULL != live && device_has_same_layout (device, live))
+  {
+    luai_rebind_device (lua_state, device, live);
+    luai_reload.kept++;
+    return true;
+  }
+  log_info ("Layout of device %s changed, registering it again", device->device_name);
+  luai_remove_registered_device (device->device_name);
+  luai_reload.replaced++;
+  return false;
+}
+
+static bool luai_call_function (lua_State *lua_state, const char *function_name, lua_Integer argument)
+{
+  if (lua_getglobal (lua_state, function_name) == LUA_TNIL) //optional, scripts driven by spawned coroutines do not need one
+  {
+    lua_pop (lua_state, 1);
+    return true;
+  }
+  lua_pushinteger (lua_state, argument);
+  if (lua_pcall (lua_state, 1, 0, 0)) //the error is the script's own or the budget's abort
+  {
+    log_error ("Lua - '%s' failed: %s", function_name, lua_tostring (lua_state, -1));
+    lua_pop (lua_state, 1);
+    return false;
+  }
+  return true;
+}
+
+static luai_context_t *luai_get_context (lua_State *lua_state)
+{
+  return *(luai_context_t **) lua_getextraspace (lua_state);
+}
+
+//the profiler reads the clock more often than the budget needs to be checked
+static int luai_get_hook_count (void)
+{
+  return luai_profile_path ? LUAI_PROFILE_HOOK_COUNT : LUAI_BUDGET_HOOK_COUNT;
+}
+
+//appends a frame to a sampled stack, ';' in the frame is replaced as it separates frames
+static size_t luai_profile_append (char *stack, size_t length, const char *format, ...)
+{
+  if (length + 2 >= LUAI_PROFILE_STACK_SIZE)
+  {
+    return length;
+  }
+
+  size_t start = length;
+  if (length)
+  {
+    stack[length++] = ';';
+  }
+  va_list args;
+  va_start (args, format);
+  int written = vsnprintf (stack + length, LUAI_PROFILE_STACK_SIZE - length, format, args);
+  va_end (args);
+  if (written < 0)
+  {
+    stack[start] = '\0';
+    return start;
+  }
+
+  size_t end = length + (size_t) written;
+  end = end < LUAI_PROFILE_STACK_SIZE - 1 ? end : LUAI_PROFILE_STACK_SIZE - 1;
+  for (size_t i = length; i < end; i++)
+  {
+    stack[i] = stack[i] == ';' ? ':' : stack[i];
+  }
+  return end;
+}
+
+//adds the stack of the running function from level down to the root, with an api function as the leaf if there is one
+static void luai_profile_sample (lua_State *lua_state, luai_context_t *context, int level, const char *leaf, uint64_t weight)
+{
+  lua_Debug frames[LUAI_PROFILE_MAX_DEPTH];
+  int depth = 0;
+  while (depth < LUAI_PROFILE_MAX_DEPTH && lua_getstack (lua_state, level + depth, &frames[depth]))
+  {
+    depth++;
+  }
+
+  char *stack = context->profile_stack;
+  size_t length = 0;
+  stack[0] = '\0';
+  if (NULL != context->worker)
+  {
+    length = luai_profile_append (stack, length, "worker %u", context->worker->index + 1);
+  }
+  if (lua_state == context->running)
+  {
+    length = luai_profile_append (stack, length, "[coroutine]");
+  }
+  if (depth == LUAI_PROFILE_MAX_DEPTH)
+  {
+    length = luai_profile_append (stack, length, "...");
+  }
+  for (int i = depth - 1; i >= 0; i--)
+  {
+    lua_Debug *frame = &frames[i];
+    lua_getinfo (lua_state, "Sn", frame);
+    if (*frame->what == 'C')
+    {
+      length = luai_profile_append (stack, length, "[C] %s", frame->name ? frame->name : "?");
+    }
+    else if (*frame->what == 'm')
+    {
+      length = luai_profile_append (stack, length, "main chunk (%s)", frame->short_src);
+    }
+    else
+    {
+      length = luai_profile_append (stack, length, "%s (%s:%d)", frame->name ? frame->name : "function", frame->short_src, frame->linedefined);
+    }
+  }
+  if (NULL != leaf)
+  {
+    length = luai_profile_append (stack, length, "[C] %s", leaf);
+  }
+
+  if (length)
+  {
+    profile_add (&context->profile, stack, weight);
+  }
+}
+
+//accounts the lua time since the mark, the stack is sampled each time a period of it has passed
+static void luai_profile_lua (lua_State *lua_state, luai_context_t *context)
+{
+  uint64_t now = utils_now_us ();
+  context->profile_lua_us += now - context->profile_mark_us;
+  context->profile_mark_us = now;
+  if (context->profile_lua_us >= LUAI_PROFILE_PERIOD_US)
+  {
+    luai_profile_sample (lua_state, context, 0, NULL, context->profile_lua_us);
+    context->profile_lua_us = 0;
+    context->profile_mark_us = utils_now_us (); //the sample is not part of the profile
+  }
+}
+
+//api functions are wrapped in this while profiling, time spent in them is sampled like lua time with the function as the leaf.
+//a function that raises an error leaves its time to the lua code around it
+static int luai_profile_call (lua_State *lua_state)
+{
+  const luaL_Reg *function = (const luaL_Reg *) lua_touserdata (lua_state, lua_upvalueindex (1));
+  luai_context_t *context = luai_get_context (lua_state);
+  if (!context->budget_armed) //loading the script is not profiled
+  {
+    return function->func (lua_state);
+  }
+
+  uint64_t start = utils_now_us ();
+  context->profile_lua_us += start - context->profile_mark_us;
+  int results = function->func (lua_state);
+  uint64_t now = utils_now_us ();
+  context->profile_c_us += now - start;
+  if (context->profile_c_us >= LUAI_PROFILE_PERIOD_US)
+  {
+    luai_profile_sample (lua_state, context, 1, function->name, context->profile_c_us);
+    context->profile_c_us = 0;
+    now = utils_now_us ();
+  }
+  context->profile_mark_us = now;
+  return results;
+}
+
+//sets the functions of the table on the top of the stack
+static void luai_set_functions (lua_State *lua_state, const luaL_Reg *functions)
+{
+  if (NULL == luai_profile_path)
+  {
+    luaL_setfuncs (lua_state, functions, 0);
+    return;
+  }
+
+  for (const luaL_Reg *function = functions; function->name; function++)
+  {
+    lua_pushlightuserdata (lua_state, (void *) function);
+    lua_pushcclosure (lua_state, luai_profile_call, 1);
+    lua_setfield (lua_state, -2, function->name);
+  }
+}
+
+//the count hook of a state, checks the budget of the running call and samples it for the profiler
+static void luai_hook (lua_State *lua_state, lua_Debug *debug)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  if (!context->budget_armed)
+  {
+    return;
+  }
+
+  if (luai_profile_path)
+  {
+    luai_profile_lua (lua_state, context);
+  }
+
+  bool exceeded = false;
+  if (luai_instruction_budget)
+  {
+    uint64_t count = (uint64_t) luai_get_hook_count ();
+    exceeded = context->budget_instructions <= count;
+    context->budget_instructions -= exceeded ? 0 : count;
+  }
+  if (context->budget_deadline_us && utils_now_us () > context->budget_deadline_us)
+  {
+    exceeded = true;
+  }
+
+  if (exceeded)
+  {
+    context->budget_exceeded = true;
+    luaL_error (lua_state, "Call aborted, it ran over its budget");
+  }
+}
+
+//starts the budget of a call into the script
+static void luai_budget_arm (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  uint64_t now = utils_now_us ();
+  context->budget_armed = true;
+  context->budget_exceeded = false;
+  context->budget_deadline_us = luai_time_budget_us ? now + luai_time_budget_us : 0;
+  context->budget_instructions = luai_instruction_budget;
+  context->profile_mark_us = now; //time between calls is not profiled
+}
+
+//ends the budget of a call, returns true if the call was aborted by it
+static bool luai_budget_disarm (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  context->budget_armed = false;
+  if (luai_profile_path) //the tail of the call is sampled with the next period
+  {
+    context->profile_lua_us += utils_now_us () - context->profile_mark_us;
+  }
+  return context->budget_exceeded;
+}
+
+//runs Update with the budget, an Update that overruns LUAI_BUDGET_MAX_OVERRUNS times in a row is no longer called
+//until the script is reloaded
+static bool luai_call_update_function (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  if (context->update_overruns >= LUAI_BUDGET_MAX_OVERRUNS)
+  {
+    return false;
+  }
+
+  uint64_t now = simclock_now_ms ();
+  lua_Integer elapsed = (lua_Integer) (now - context->update_ms);
+  context->update_ms = now;
+
+  luai_budget_arm (lua_state);
+  bool success = luai_call_function (lua_state, LUA_API_FUNCTION_UPDATE, elapsed);
+  if (!luai_budget_disarm (lua_state))
+  {
+    context->update_overruns = 0;
+  }
+  else if (++context->update_overruns >= LUAI_BUDGET_MAX_OVERRUNS)
+  {
+    log_error ("Update ran over its budget %d times in a row and has been quarantined until the script is reloaded",
+               LUAI_BUDGET_MAX_OVERRUNS);
+  }
+  return success;
+}
+
+//counts a callback aborted by the budget, the callbacks of an object that overruns LUAI_BUDGET_MAX_OVERRUNS times in a row
+//are removed
+static void luai_note_callback_overrun (lua_State *lua_state, void *object)
+{
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_CALLBACKS);
+  lua_pushlightuserdata (lua_state, object);
+  if (lua_rawget (lua_state, -2) != LUA_TTABLE)
+  {
+    lua_pop (lua_state, 2);
+    return;
+  }
+
+  lua_rawgeti (lua_state, -1, LUAI_CALLBACK_OVERRUNS);
+  lua_Integer overruns = lua_tointeger (lua_state, -1) + 1;
+  lua_pop (lua_state, 1);
+  if (overruns >= LUAI_BUDGET_MAX_OVERRUNS)
+  {
+    log_error ("Callbacks ran over their budget %d times in a row and have been quarantined", LUAI_BUDGET_MAX_OVERRUNS);
+    lua_pushlightuserdata (lua_state, object);
+    lua_pushnil (lua_state);
+    lua_rawset (lua_state, -4);
+  }
+  else
+  {
+    lua_pushinteger (lua_state, overruns);
+    lua_rawseti (lua_state, -2, LUAI_CALLBACK_OVERRUNS);
+  }
+  lua_pop (lua_state, 2);
+}
+
+static void luai_close_state (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  lua_close (lua_state);
+  if (NULL != context)
+  {
+    scheduler_fini (&context->scheduler); //the coroutine references went with the state
+    if (luai_profile_path && !profile_merge (&luai_profile, &context->profile))
+    {
+      log_warn ("Profile of a lua state could not be kept");
+    }
+    profile_fini (&context->profile);
+    free (context->scratch);
+    pool_fini (&context->pool);
+    free (context);
+  }
+}
+
+static int luai_panic (lua_State *lua_state)
+{
+  log_error ("Lua - unprotected error: %s", lua_tostring (lua_state, -1));
+  return 0; //lua aborts
+}
+
+static size_t luai_heap_used (lua_State *lua_state, luai_context_t *context)
+{
+  if (context->pooled)
+  {
+    return pool_get_used (&context->pool);
+  }
+  return (size_t) lua_gc (lua_state, LUA_GCCOUNT, 0) * 1024 + (size_t) lua_gc (lua_state, LUA_GCCOUNTB, 0);
+}
+
+static void luai_publish_heap_stats (lua_State *lua_state, luai_context_t *context)
+{
+  size_t used = luai_heap_used (lua_state, context);
+  atomic_store (&context->gc.heap_bytes, used);
+  if (context->pooled)
+  {
+    atomic_store (&context->gc.peak_bytes, pool_get_peak (&context->pool));
+    atomic_store (&context->gc.failed_allocations, pool_get_failed (&context->pool));
+  }
+  else if (used > atomic_load (&context->gc.peak_bytes)) //the peak between ticks is not seen
+  {
+    atomic_store (&context->gc.peak_bytes, used);
+  }
+}
+
+static void luai_set_gc_threshold (lua_State *lua_state, luai_context_t *context)
+{
+  size_t threshold = luai_heap_used (lua_state, context) / 100 * LUAI_GC_PAUSE;
+  context->gc.threshold = threshold > LUAI_GC_MIN_THRESHOLD ? threshold : LUAI_GC_MIN_THRESHOLD;
+}
+
+//runs collection steps in the idle time after a tick, starting a cycle once the heap has grown past the threshold.
+//a state allocating faster than its idle steps collect finishes the cycle in one go rather than growing without bound
+static void luai_step_garbage_collector (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  if (!context->gc.collecting && luai_heap_used (lua_state, context) < context->gc.threshold)
+  {
+    luai_publish_heap_stats (lua_state, context);
+    return;
+  }
+
+  context->gc.collecting = true;
+  bool behind = luai_heap_used (lua_state, context) >= context->gc.threshold * 2;
+  uint64_t start = utils_now_us ();
+  uint64_t now = start;
+  do
+  {
+    if (lua_gc (lua_state, LUA_GCSTEP, 0))
+    {
+      context->gc.collecting = false;
+      luai_set_gc_threshold (lua_state, context);
+      atomic_fetch_add (&context->gc.cycles, 1);
+      now = utils_now_us ();
+      break;
+    }
+    now = utils_now_us ();
+  } while (behind || now - start < LUAI_GC_IDLE_BUDGET_US);
+
+  uint64_t elapsed = now - start;
+  atomic_fetch_add (&context->gc.total_us, elapsed);
+  if (elapsed > atomic_load (&context->gc.max_us))
+  {
+    atomic_store (&context->gc.max_us, elapsed);
+  }
+  luai_publish_heap_stats (lua_state, context);
+}
+
+static bool init_lua_state (lua_State **lua_state, const char *file_path, luai_worker_t *worker)
+{
+  luai_context_t *context = calloc (1, sizeof (*context));
+  if (NULL == context)
+  {
+    return false;
+  }
+  pool_init (&context->pool, luai_memory_limit);
+  atomic_init (&context->gc.heap_bytes, 0);
+  atomic_init (&context->gc.peak_bytes, 0);
+  atomic_init (&context->gc.failed_allocations, 0);
+  atomic_init (&context->gc.cycles, 0);
+  atomic_init (&context->gc.total_us, 0);
+  atomic_init (&context->gc.max_us, 0);
+
+  *lua_state = lua_newstate (pool_alloc, &context->pool);
+  context->pooled = NULL != *lua_state;
+#ifdef USE_LUAJIT
+  if (NULL == *lua_state) //LuaJIT built without GC64 only runs on its own allocator, the pool and its limit go unused
+  {
+    *lua_state = luaL_newstate ();
+  }
+#endif
+  if (NULL == *lua_state)
+  {
+    pool_fini (&context->pool);
+    free (context);
+    return false;
+  }
+  lua_atpanic (*lua_state, luai_panic);
+  if (luai_time_budget_us || luai_instruction_budget || luai_profile_path)
+  {
+    lua_sethook (*lua_state, luai_hook, LUA_MASKCOUNT, luai_get_hook_count ()); //inherited by coroutines
+  }
+  scheduler_init (&context->scheduler);
+  profile_init (&context->profile);
+  context->running_ref = LUA_NOREF;
+  context->worker = worker;
+  context->update_ms = simclock_now_ms ();
+  *(luai_context_t **) lua_getextraspace (*lua_state) = context;
+
+  luaL_openlibs (*lua_state);
+  if (luai_seeded) //every worker draws its own sequence so the run does not depend on how the workers interleave
+  {
+    uint64_t state = luai_seed ^ ((uint64_t) (worker ? worker->index + 1 : 0) << 32);
+    context->random_state = utils_splitmix64 (&state);
+    lua_getglobal (*lua_state, LUA_MATH_LIBRARY);
+    luai_set_functions (*lua_state, luai_seeded_math_functions);
+    lua_pop (*lua_state, 1);
+  }
+  script_cache_install_searcher (*lua_state);
+
+  luai_setup_lua_sim_api (*lua_state, worker);
+  luai_setup_object_metatables (*lua_state);
+  lua_newtable (*lua_state);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_WAITERS);
+  lua_newtable (*lua_state);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_CALLBACKS);
+  lua_newtable (*lua_state);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_FORMATS);
+  lua_newtable (*lua_state);
+  lua_createtable (*lua_state, 0, 1);
+  lua_pushliteral (*lua_state, "v");
+  lua_setfield (*lua_state, -2, "__mode");
+  lua_setmetatable (*lua_state, -2);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_HANDLES);
+  lua_newtable (*lua_state);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_ALIASES);
+  context->view = (luai_view_t *) lua_newuserdata (*lua_state, sizeof (luai_view_t));
+  context->view->data = NULL;
+  context->view->size = 0;
+  luaL_setmetatable (*lua_state, LUA_USERDATA_VIEW);
+  lua_setfield (*lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_VIEW);
+
+  if (script_cache_loadfile (*lua_state, file_path) || lua_pcall (*lua_state, 0, 0, 0))
+  {
+    lua_fail (*lua_state);
+    luai_publish_heap_stats (*lua_state, context);
+    return false;
+  }
+
+  //collection from here on runs between ticks, see luai_step_garbage_collector
+  lua_gc (*lua_state, LUA_GCSTOP, 0);
+  luai_set_gc_threshold (*lua_state, context);
+  luai_publish_heap_stats (*lua_state, context);
+  return true;
+}
+
+static void luai_setup_object_metatables (lua_State *lua_state)
+{
+  //device
+  luaL_newmetatable (lua_state, LUA_USERDATA_DEVICE);
+  lua_pushvalue (lua_state, -1); // there are two 'copies' of the metatable on the stack
+  lua_setfield (lua_state, -2, LUA_INDEX_FIELD); // pop one of those copies and assign it to  __index field of the 1st metatable
+  luai_set_functions (lua_state, luai_device_object_functions);
+
+  lua_pushcfunction (lua_state, luai_device_free); //set garbage collector cleanup function
+  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+
+  //service
+  luaL_newmetatable (lua_state, LUA_USERDATA_SERVICE);
+  lua_pushvalue (lua_state, -1);
+  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
+  luai_set_functions (lua_state, luai_service_object_functions);
+
+  lua_pushcfunction (lua_state, luai_service_free); //set garbage collector cleanup function
+  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+  //characterisitc
+  luaL_newmetatable (lua_state, LUA_USERDATA_CHARACTERISTIC);
+  lua_pushvalue (lua_state, -1);
+  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
+  luai_set_functions (lua_state, luai_characteristic_object_functions);
+
+  lua_pushcfunction (lua_state, luai_characteristic_free); //set garbage collector cleanup function
+  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+  //descriptor
+  luaL_newmetatable (lua_state, LUA_USERDATA_DESCRIPTOR);
+  lua_pushvalue (lua_state, -1);
+  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
+  luai_set_functions (lua_state, luai_descriptor_object_functions);
+
+  lua_pushcfunction (lua_state, luai_descriptor_free); //set garbage collector cleanup function
+  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+  //schema
+  luaL_newmetatable (lua_state, LUA_USERDATA_SCHEMA);
+  lua_pushvalue (lua_state, -1);
+  lua_setfield (lua_state, -2, LUA_INDEX_FIELD);
+  luai_set_functions (lua_state, luai_schema_object_functions);
+
+  lua_pushcfunction (lua_state, luai_schema_free); //set garbage collector cleanup function
+  lua_setfield (lua_state, -2, LUA_GARBAGE_COLLECTOR_FIELD);
+  //buffer - lua owns the memory so there is no garbage collector function, __index also handles byte indices
+  luaL_newmetatable (lua_state, LUA_USERDATA_BUFFER);
+  luai_set_functions (lua_state, luai_buffer_object_functions);
+  //format - compiled format string, #format is the size of an encoded value
+  luaL_newmetatable (lua_state, LUA_USERDATA_FORMAT);
+  luai_set_functions (lua_state, luai_format_object_functions);
+  //view - read only bytes owned by C, there is no __newindex so writes raise an error
+  luaL_newmetatable (lua_state, LUA_USERDATA_VIEW);
+  luai_set_functions (lua_state, luai_view_object_functions);
+}
+
+static void luai_register_datatype_enums (lua_State *lua_state)
+{
+  lua_newtable(lua_state);
+  {
+    LUA_ENUM(lua_state, BOOL, BLE_BOOL);
+    LUA_ENUM(lua_state, INT8, BLE_INT8);
+    LUA_ENUM(lua_state, UINT8, BLE_UINT8);
+    LUA_ENUM(lua_state, INT16, BLE_INT16);
+    LUA_ENUM(lua_state, UINT16, BLE_UINT16);
+    LUA_ENUM(lua_state, INT32, BLE_INT32);
+    LUA_ENUM(lua_state, UINT32, BLE_UINT32);
+    LUA_ENUM(lua_state, INT64, BLE_INT64);
+    LUA_ENUM(lua_state, UINT64, BLE_UINT64);
+    LUA_ENUM(lua_state, FLOAT, BLE_FLOAT);
+    LUA_ENUM(lua_state, DOUBLE, BLE_DOUBLE);
+    LUA_ENUM(lua_state, STRING, BLE_STRING);
+    LUA_ENUM(lua_state, BYTES, BLE_BYTES);
+  }
+  lua_setglobal(lua_state, LUA_API_ENUM_DATATYPE);
+}
+
+static void luai_setup_lua_sim_api (lua_State *lua_state, const luai_worker_t *worker)
+{
+  luaL_newlibtable (lua_state, luai_ble_sim_api);
+  luai_set_functions (lua_state, luai_ble_sim_api);
+  lua_pushboolean (lua_state, luai_restored);
+  lua_setfield (lua_state, -2, LUA_API_RESTORED);
+  lua_pushboolean (lua_state, luai_reload.active);
+  lua_setfield (lua_state, -2, LUA_API_RELOADED);
+  if (NULL != worker) //ble.worker = {index = 1..count, count = count} so each copy of the script builds its share of the devices
+  {
+    lua_createtable (lua_state, 0, 2);
+    lua_pushinteger (lua_state, (lua_Integer) worker->index + 1);
+    lua_setfield (lua_state, -2, LUA_FIELD_INDEX);
+    lua_pushinteger (lua_state, (lua_Integer) luai_worker_count);
+    lua_setfield (lua_state, -2, LUA_FIELD_COUNT);
+    lua_setfield (lua_state, -2, LUA_API_WORKER);
+  }
+  lua_setglobal (lua_state, "ble");
+
+  luai_register_datatype_enums (lua_state);
+}
+
+static void lua_fail (lua_State *lua_state)
+{
+  log_error ("Lua - %s", lua_tostring(lua_state, -1));
+}
+
+static void luai_check_type (lua_State *lua_state, int index, int expected_parameter_type)
+{
+  int type = lua_type (lua_state, index);
+
+  luaL_argcheck (
+    lua_state,
+    type == expected_parameter_type,
+    index,
+    ""
+  );
+}
+
+static void luai_check_argument_count (lua_State *lua_state, int expected_argument_count)
+{
+  if (lua_gettop (lua_state) != expected_argument_count)
+  {
+    luaL_error(lua_state, "Expected %d arguments to function", expected_argument_count);
+  }
+}
+
+static int luai_create_device (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  const char *device_name = lua_tostring(lua_state, 1);
+
+  device_t *device = (device_t *) luai_alloc_object (lua_state, sizeof (*device));
+  device_init (device, device_name, ORIGIN_LUA);
+  luai_push_object (lua_state, device, LUA_USERDATA_DEVICE, true);
+
+  return 1; //the device is already on the stack so return 
+}
+
+static int luai_create_service (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  const char *uuid = lua_tostring(lua_state, 1);
+
+  service_t *service = (service_t *) luai_alloc_object (lua_state, sizeof (*service));
+  service_init (service, uuid, true, ORIGIN_LUA);
+  luai_push_object (lua_state, service, LUA_USERDATA_SERVICE, true);
+
+  return 1; //the service is already on the stack so return 
+}
+
+static int luai_create_characteristic (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  const char *char_uuid = lua_tostring(lua_state, 1);
+
+  characteristic_t *characteristic = (characteristic_t *) luai_alloc_object (lua_state, sizeof (*characteristic));
+  characteristic_init (characteristic, char_uuid, ORIGIN_LUA);
+  luai_push_object (lua_state, characteristic, LUA_USERDATA_CHARACTERISTIC, true);
+
+  return 1; //the characteristic is already on the stack so return this
+}
+
+static int luai_create_descriptor (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  const char *desc_uuid = lua_tostring(lua_state, 1);
+
+  descriptor_t *descriptor = (descriptor_t *) luai_alloc_object (lua_state, sizeof (*descriptor));
+  descriptor_init (descriptor, desc_uuid, ORIGIN_LUA);
+  luai_push_object (lua_state, descriptor, LUA_USERDATA_DESCRIPTOR, true);
+
+  return 1; //the device is already on the stack so return this
+}
+
+static int luai_register_device (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 1);
+  luai_object_t *handle = luai_check_argument_handle (lua_state, 1, LUA_USERDATA_DEVICE, "' " LUA_USERDATA_DEVICE "' expected");
+  device_t *device = (device_t *) handle->object;
+
+  if (luai_reload_take_over (lua_state, device))
+  {
+    lua_pushboolean (lua_state, true);
+    return 1;
+  }
+
+  bool success = device_register (device);
+  if (success)
+  {
+    device->scripted = true;
+  }
+  if (success && device->origin == ORIGIN_SCHEMA)
+  {
+    handle->owned = false; //the registry now owns the device, it is freed when the device is removed
+  }
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_remove_device (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  const char *device_name = lua_tostring(lua_state, 1);
+
+  if (luai_reload.active)
+  {
+    luai_reload_claim (device_name);
+  }
+  bool success = luai_remove_registered_device (device_name);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_get_device (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+
+  device_t *device = device_get_device (lua_tostring (lua_state, 1));
+  if (NULL == device)
+  {
+    lua_pushnil (lua_state);
+    return 1;
+  }
+  if (luai_reload.active) //a device the new script looks up is kept as it is
+  {
+    luai_reload_claim (device->device_name);
+  }
+  luai_push_object (lua_state, device, LUA_USERDATA_DEVICE, false);
+  return 1;
+}
+
+static int luai_device_add_service (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  service_t *service = luai_check_argument_service (lua_state, 2);
+
+  bool success = device_add_service (device, service);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_device_set_powered (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  bool powered = lua_toboolean (lua_state, 2);
+
+  bool success = device_set_powered (device, powered);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_device_set_discoverable (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  bool discoverable = lua_toboolean (lua_state, 2);
+
+  bool success = device_set_discoverable (device, discoverable);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_device_get_service (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 2);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  luai_check_type (lua_state, 2, LUA_TSTRING);
+
+  service_t *service = device_get_service (device, lua_tostring (lua_state, 2));
+  if (NULL == service)
+  {
+    lua_pushnil (lua_state);
+    return 1;
+  }
+  luai_push_object (lua_state, service, LUA_USERDATA_SERVICE, false);
+  return 1;
+}
+
+static int luai_device_free (lua_State *lua_state)
+{
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_DEVICE);
+  luai_release_object (handle, luai_free_device);
+  return 0;
+}
+
+static int luai_service_add_characteristic (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  service_t *service = luai_check_argument_service (lua_state, 1);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 2);
+
+  bool success = service_add_characteristic (service, characteristic);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_service_get_characteristic (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 2);
+  service_t *service = luai_check_argument_service (lua_state, 1);
+  luai_check_type (lua_state, 2, LUA_TSTRING);
+
+  characteristic_t *characteristic = service_get_characteristic (service, lua_tostring (lua_state, 2));
+  if (NULL == characteristic)
+  {
+    lua_pushnil (lua_state);
+    return 1;
+  }
+  luai_push_object (lua_state, characteristic, LUA_USERDATA_CHARACTERISTIC, false);
+  return 1;
+}
+
+static int luai_service_free (lua_State *lua_state)
+{
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_SERVICE);
+  luai_release_object (handle, luai_free_service);
+  return 0;
+}
+
+static int luai_characteristic_add_descriptor (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  descriptor_t *descriptor = luai_check_argument_descriptor (lua_state, 2);
+
+  bool success = characteristic_add_descriptor (characteristic, descriptor);
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static int luai_characteristic_set_notifying (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 2);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  bool notifying = lua_toboolean (lua_state, 2);
+
+  characteristic_set_notifying (characteristic, notifying);
+  return 0;
+}
+
+static int luai_characteristic_get_descriptor (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 2);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  luai_check_type (lua_state, 2, LUA_TSTRING);
+
+  descriptor_t *descriptor = characteristic_get_descriptor (characteristic, lua_tostring (lua_state, 2));
+  if (NULL == descriptor)
+  {
+    lua_pushnil (lua_state);
+    return 1;
+  }
+  luai_push_object (lua_state, descriptor, LUA_USERDATA_DESCRIPTOR, false);
+  return 1;
+}
+
+static int luai_characteristic_free (lua_State *lua_state)
+{
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_CHARACTERISTIC);
+  luai_release_object (handle, luai_free_characteristic);
+  return 0;
+}
+
+//encodes a lua boolean or number as a ble data type, writes BLE_DATA_TYPE_SIZE[type] bytes to data
+static bool luai_encode_value (lua_State *lua_state, int index, ble_data_type_t type, uint8_t *data)
+{
+  if (type == BLE_BOOL)
+  {
+    if (lua_type (lua_state, index) != LUA_TBOOLEAN)
+    {
+      return false;
+    }
+    bool val = lua_toboolean (lua_state, index);
+    memcpy (data, &val, sizeof (val));
+    return true;
+  }
+
+  if (lua_type (lua_state, index) != LUA_TNUMBER)
+  {
+    return false;
+  }
+
+#define LUAI_ENCODE_CASE(ble_type, c_type, lua_get) \
+  case ble_type: \
+  { \
+    c_type val = (c_type) lua_get (lua_state, index); \
+    memcpy (data, &val, sizeof (val)); \
+  } \
+    break;
+
+  switch (type)
+  {
+    LUAI_ENCODE_CASE (BLE_INT8, int8_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_UINT8, uint8_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_INT16, int16_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_UINT16, uint16_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_INT32, int32_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_UINT32, uint32_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_INT64, int64_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_UINT64, uint64_t, lua_tointeger)
+    LUAI_ENCODE_CASE (BLE_FLOAT, float, lua_tonumber)
+    LUAI_ENCODE_CASE (BLE_DOUBLE, double, lua_tonumber)
+    default:
+      luaL_argerror(lua_state, index, "Argument type must match specified data type");
+      return false;
+  }
+#undef LUAI_ENCODE_CASE
+
+  return true;
+}
+
+static uint8_t *luai_get_scratch (lua_State *lua_state, size_t size)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  if (size > context->scratch_capacity)
+  {
+    size_t capacity = context->scratch_capacity ? context->scratch_capacity : LUAI_SCRATCH_MIN_CAPACITY;
+    while (capacity < size)
+    {
+      capacity *= 2;
+    }
+
+    uint8_t *scratch = realloc (context->scratch, capacity);
+    if (NULL == scratch)
+    {
+      luaL_error (lua_state, "Could not allocate value buffer");
+    }
+    context->scratch = scratch;
+    context->scratch_capacity = capacity;
+  }
+  return context->scratch;
+}
+
+typedef enum luai_gather_t
+{
+  LUAI_GATHER_INTEGERS = 0, //lua_tointeger, reals without an integer value read as 0
+  LUAI_GATHER_ROUNDED, //integers, reals rounded to the nearest integer
+  LUAI_GATHER_REALS //lua_tonumber
+} luai_gather_t;
+
+//reads the numbers of a lua array into int64_t or double values for the pack kernels,
+//the array ends at its first nil and *count is set to the numbers read
+static bool luai_gather_numbers (lua_State *lua_state, int idx, luai_gather_t gather, void *values, size_t *count)
+{
+  int64_t *integers = (int64_t *) values;
+  double *reals = (double *) values;
+  size_t items = *count;
+
+  for (size_t i = 0; i < items; i++)
+  {
+    int item_type = lua_rawgeti (lua_state, idx, (lua_Integer) i + 1);
+    if (item_type == LUA_TNIL)
+    {
+      lua_pop (lua_state, 1);
+      *count = i;
+      return true;
+    }
+
+    if (item_type == LUA_TTABLE)
+    {
+      luaL_argerror(lua_state, idx, "Argument type cannot be an array of arrays");
+      return false;
+    }
+
+    if (item_type != LUA_TNUMBER)
+    {
+      lua_pop (lua_state, 1);
+      return false;
+    }
+
+    if (gather == LUAI_GATHER_REALS)
+    {
+      reals[i] = (double) lua_tonumber (lua_state, -1);
+    }
+    else
+    {
+      int is_integer = 0;
+      integers[i] = (int64_t) lua_tointegerx (lua_state, -1, &is_integer);
+      if (!is_integer && gather == LUAI_GATHER_ROUNDED && !format_round_integer (lua_tonumber (lua_state, -1), &integers[i]))
+      {
+        lua_pop (lua_state, 1);
+        return false;
+      }
+    }
+    lua_pop (lua_state, 1);
+  }
+  return true;
+}
+
+//encodes a lua array one element at a time through luai_encode_value, used for arrays the pack kernels do not handle.
+//the array ends at its first nil and *count is set to the elements encoded
+static bool luai_encode_elements (lua_State *lua_state, int idx, ble_data_type_t type, uint8_t *buf, size_t *count)
+{
+  size_t type_size = BLE_DATA_TYPE_SIZE[type];
+  size_t items = *count;
+  for (size_t i = 1; i <= items; i++)
+  {
+    int item_type = lua_rawgeti (lua_state, idx, (lua_Integer) i);
+    if (item_type == LUA_TNIL) //is value null then we need to fix the size of the array
+    {
+      lua_pop (lua_state, 1);
+      *count = i - 1;
+      return true;
+    }
+
+    if (item_type == LUA_TTABLE)
+    {
+      luaL_argerror(lua_state, idx, "Argument type cannot be an array of arrays");
+      return false;
+    }
+
+    bool success = luai_encode_value (lua_state, -1, type, buf + ((i - 1) * type_size));
+    lua_pop(lua_state, 1); //pops one value off the top
+    if (!success)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//encodes a lua array into the states scratch buffer, the array ends at its first nil.
+//numbers are gathered into a staging area at the start of the buffer then packed in bulk after it
+static bool luai_get_array (lua_State *lua_state, int idx, ble_data_type_t type, const void **array, size_t *array_size)
+{
+  size_t items = lua_rawlen (lua_state, idx);
+  if (items == 0)
+  {
+    return false;
+  }
+
+  if (type == BLE_STRING || type == BLE_BYTES)
+  {
+    luaL_argerror(lua_state, idx, "Argument type cannot be an array of strings or bytes");
+    return false;
+  }
+
+  size_t type_size = BLE_DATA_TYPE_SIZE[type];
+  if (type == BLE_BOOL)
+  {
+    uint8_t *buf = luai_get_scratch (lua_state, items * type_size);
+    if (!luai_encode_elements (lua_state, idx, type, buf, &items))
+    {
+      return false;
+    }
+    *array = buf;
+    *array_size = items * type_size;
+    return true;
+  }
+
+  uint8_t *buf = luai_get_scratch (lua_state, items * (sizeof (int64_t) + type_size));
+  uint8_t *packed = buf + items * sizeof (int64_t);
+  bool real = type == BLE_FLOAT || type == BLE_DOUBLE;
+  if (!luai_gather_numbers (lua_state, idx, real ? LUAI_GATHER_REALS : LUAI_GATHER_INTEGERS, buf, &items))
+  {
+    return false;
+  }
+
+  switch (type)
+  {
+    case BLE_FLOAT:
+      pack_floats ((const double *) buf, items, false, packed);
+      break;
+    case BLE_DOUBLE:
+      pack_doubles ((const double *) buf, items, false, packed);
+      break;
+    default:
+      pack_integers ((const int64_t *) buf, items, type_size, false, packed);
+      break;
+  }
+
+  *array = packed;
+  *array_size = items * type_size;
+  return true;
+}
+
+//encodes a setValue value argument - array, string, buffer or scalar - scalars are written to the scalar buffer
+static bool luai_encode_argument (
+  lua_State *lua_state,
+  int index,
+  ble_data_type_t ble_type,
+  uint8_t *scalar,
+  const void **data,
+  size_t *data_size
+)
+{
+  int type = lua_type (lua_state, index);
+  if (type == LUA_TTABLE)
+  {
+    return luai_get_array (lua_state, index, ble_type, data, data_size);
+  }
+
+  if (type == LUA_TSTRING)
+  {
+    if (ble_type != BLE_STRING && ble_type != BLE_BYTES) //raw bytes are asked for with BYTES, not with a numeric type
+    {
+      luaL_argerror (lua_state, index, "Argument type must match specified data type");
+    }
+    *data = lua_tolstring (lua_state, index, data_size); //not copied, the characteristic copies it if the value changed
+    if (ble_type == BLE_STRING)
+    {
+      *data_size = strlen (*data); //text values end at the first nul, use BYTES to keep them
+    }
+    return true;
+  }
+
+  if (type == LUA_TUSERDATA)
+  {
+    luai_view_t *view = (luai_view_t *) luaL_testudata (lua_state, index, LUA_USERDATA_VIEW);
+    if (NULL != view)
+    {
+      *data = view->data;
+      *data_size = view->size;
+      return NULL != view->data;
+    }
+    luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, index);
+    *data = buffer->data;
+    *data_size = buffer->size;
+    return true;
+  }
+
+  *data = scalar;
+  *data_size = BLE_DATA_TYPE_SIZE[ble_type];
+  return luai_encode_value (lua_state, index, ble_type, scalar);
+}
+
+//pushes the compiled format for a format string, compiling and caching it the first time the string is seen
+static format_t *luai_push_format (lua_State *lua_state, int index)
+{
+  const char *spec = luaL_checkstring (lua_state, index);
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_FORMATS);
+  lua_pushvalue (lua_state, index);
+  if (lua_rawget (lua_state, -2) == LUA_TUSERDATA)
+  {
+    lua_remove (lua_state, -2);
+    return ((luai_format_t *) lua_touserdata (lua_state, -1))->format;
+  }
+  lua_pop (lua_state, 1);
+
+  luai_format_t *handle = (luai_format_t *) lua_newuserdata (lua_state, sizeof (*handle));
+  handle->format = NULL;
+  luaL_setmetatable (lua_state, LUA_USERDATA_FORMAT);
+  const char *error = NULL;
+  handle->format = format_compile (spec, &error);
+  if (NULL == handle->format)
+  {
+    luaL_error (lua_state, "Invalid format '%s': %s", spec, error);
+  }
+
+  lua_pushvalue (lua_state, index);
+  lua_pushvalue (lua_state, -2);
+  lua_rawset (lua_state, -4);
+  lua_remove (lua_state, -2);
+  return handle->format;
+}
+
+//ble.format (spec) - compiles a format string e.g "<u8 sfloat u16" for setValue
+static int luai_create_format (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TSTRING);
+  luai_push_format (lua_state, 1);
+  return 1;
+}
+
+static int luai_format_length (lua_State *lua_state)
+{
+  luai_format_t *handle = (luai_format_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_FORMAT);
+  lua_pushinteger (lua_state, handle->format ? (lua_Integer) handle->format->size : 0);
+  return 1;
+}
+
+static int luai_format_free (lua_State *lua_state)
+{
+  luai_format_t *handle = (luai_format_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_FORMAT);
+  format_free (handle->format);
+  handle->format = NULL;
+  return 0;
+}
+
+//checks a setValue type argument - a DataType, a format from ble.format or a format string.
+//returns the format or NULL for a DataType, which is written to type
+static format_t *luai_check_value_type (lua_State *lua_state, int index, ble_data_type_t *type)
+{
+  switch (lua_type (lua_state, index))
+  {
+    case LUA_TUSERDATA:
+      return ((luai_format_t *) luaL_checkudata (lua_state, index, LUA_USERDATA_FORMAT))->format;
+    case LUA_TSTRING:
+    {
+      format_t *format = luai_push_format (lua_state, index);
+      lua_pop (lua_state, 1); //still referenced by the format cache
+      return format;
+    }
+    default:
+      *type = luai_check_type_ble_data_type (lua_state, index);
+      return NULL;
+  }
+}
+
+//encodes an array of numbers with a single field format e.g ">i16" - one field per number, packed in bulk
+static bool luai_encode_format_array (lua_State *lua_state, int index, const format_t *format, const void **data, size_t *data_size)
+{
+  const format_field_t *field = &format->fields[0];
+  size_t items = lua_rawlen (lua_state, index);
+  if (items == 0)
+  {
+    return luaL_argerror (lua_state, index, "Value must have at least one number");
+  }
+
+  uint8_t *buf = luai_get_scratch (lua_state, items * (sizeof (int64_t) + format->size));
+  uint8_t *packed = buf + items * sizeof (int64_t);
+  bool real = format_field_is_real (field);
+  if (!luai_gather_numbers (lua_state, index, real ? LUAI_GATHER_REALS : LUAI_GATHER_ROUNDED, buf, &items))
+  {
+    return luaL_argerror (lua_state, index, "Format fields must be finite numbers in the range of the field");
+  }
+
+  bool swap = format_field_is_swapped (field);
+  switch (field->type)
+  {
+    case FORMAT_F32:
+      pack_floats ((const double *) buf, items, swap, packed);
+      break;
+    case FORMAT_F64:
+      pack_doubles ((const double *) buf, items, swap, packed);
+      break;
+    case FORMAT_U24:
+    case FORMAT_I24:
+    case FORMAT_SFLOAT:
+    case FORMAT_FLOAT: //no kernel for these, encode each value
+      for (size_t i = 0; i < items; i++)
+      {
+        if (real)
+        {
+          format_encode_real (field, ((const double *) buf)[i], packed + i * format->size); //real fields take any value
+        }
+        else
+        {
+          format_encode_integer (field, ((const int64_t *) buf)[i], packed + i * format->size);
+        }
+      }
+      break;
+    default:
+      pack_integers ((const int64_t *) buf, items, format->size, swap, packed);
+      break;
+  }
+
+  *data = packed;
+  *data_size = items * format->size;
+  return true;
+}
+
+//encodes a table of field values, or a single number for a one value format, in one pass over the fields.
+//a table for a single field format is an array of values
+static bool luai_encode_formatted (lua_State *lua_state, int index, const format_t *format, const void **data, size_t *data_size)
+{
+  if (format->field_count == 1 && format->value_count == 1 && lua_istable (lua_state, index))
+  {
+    return luai_encode_format_array (lua_state, index, format, data, data_size);
+  }
+
+  bool table = lua_istable (lua_state, index);
+  if (!table && (format->value_count != 1 || !lua_isnumber (lua_state, index)))
+  {
+    return luaL_argerror (lua_state, index, "Value must be a table with a number for each field of the format");
+  }
+  if (table && lua_rawlen (lua_state, index) != format->value_count)
+  {
+    return luaL_argerror (lua_state, index, "Value must have a number for each field of the format");
+  }
+
+  uint8_t *record = luai_get_scratch (lua_state, format->size);
+  lua_Integer value_index = 0;
+  for (size_t i = 0; i < format->field_count; i++)
+  {
+    const format_field_t *field = &format->fields[i];
+    if (field->type == FORMAT_PAD)
+    {
+      format_encode_integer (field, 0, record);
+      continue;
+    }
+
+    if (table)
+    {
+      lua_rawgeti (lua_state, index, ++value_index);
+    }
+    else
+    {
+      lua_pushvalue (lua_state, index);
+    }
+    int is_integer = 0;
+    lua_Integer integer = lua_tointegerx (lua_state, -1, &is_integer);
+    if (is_integer && !format_field_is_real (field))
+    {
+      format_encode_integer (field, (int64_t) integer, record);
+    }
+    else if (!lua_isnumber (lua_state, -1))
+    {
+      return luaL_argerror (lua_state, index, "Format fields must be numbers");
+    }
+    else if (!format_encode_real (field, (double) lua_tonumber (lua_state, -1), record))
+    {
+      return luaL_argerror (lua_state, index, "Format fields must be finite numbers in the range of the field");
+    }
+    lua_pop (lua_state, 1);
+  }
+
+  *data = record;
+  *data_size = format->size;
+  return true;
+}
+
+//encodes a value with a DataType or a format
+static bool luai_encode_typed (
+  lua_State *lua_state,
+  int index,
+  ble_data_type_t type,
+  const format_t *format,
+  uint8_t *scalar,
+  const void **data,
+  size_t *data_size
+)
+{
+  if (NULL != format)
+  {
+    return luai_encode_formatted (lua_state, index, format, data, data_size);
+  }
+  return luai_encode_argument (lua_state, index, type, scalar, data, data_size);
+}
+
+static int luai_characteristic_set_value (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 3);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  if (device_skips_characteristic (characteristic)) //the value is not encoded for a device nobody watches
+  {
+    lua_pushboolean (lua_state, true);
+    return 1;
+  }
+  ble_data_type_t ble_type = BLE_BYTES;
+  const format_t *format = luai_check_value_type (lua_state, 3, &ble_type);
+  const void *data = NULL;
+  size_t data_size = 0;
+  uint8_t scalar[sizeof (uint64_t)];
+
+  bool success = luai_encode_typed (lua_state, 2, ble_type, format, scalar, &data, &data_size);
+  if (success)
+  {
+    luai_update_value (lua_state, characteristic, data, data_size);
+  }
+
+  lua_pushboolean (lua_state, success);
+  return 1;
+}
+
+static characteristic_t *luai_device_find_characteristic (device_t *device, const char *characteristic_uuid)
+{
+  for (service_t *service = device->services; service; service = service->next)
+  {
+    characteristic_t *characteristic = service_get_characteristic (service, characteristic_uuid);
+    if (NULL != characteristic)
+    {
+      return characteristic;
+    }
+  }
+  return NULL;
+}
+
+//walks the device rather than the object paths, which workers may not read
+static bool luai_device_has_characteristic (const device_t *device, const characteristic_t *characteristic)
+{
+  for (const service_t *service = device->services; service; service = service->next)
+  {
+    for (const characteristic_t *owned = service->characteristics; owned; owned = owned->next)
+    {
+      if (owned == characteristic)
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+//applies a table of {characteristic, value, type} entries, device is NULL for ble.setValues
+//with a device the characteristic can also be given by uuid and must belong to the device
+static bool luai_set_values (lua_State *lua_state, int index, device_t *device)
+{
+  luai_check_type (lua_state, index, LUA_TTABLE);
+  size_t count = lua_rawlen (lua_state, index);
+  bool success = true;
+  uint8_t scalar[sizeof (uint64_t)];
+
+  for (size_t i = 1; i <= count; i++)
+  {
+    if (lua_rawgeti (lua_state, index, (lua_Integer) i) != LUA_TTABLE)
+    {
+      luaL_error (lua_state, "setValues entry %d must be a {characteristic, value, type} table", (int) i);
+    }
+    int entry = lua_gettop (lua_state);
+    lua_rawgeti (lua_state, entry, 1);
+    lua_rawgeti (lua_state, entry, 2);
+    lua_rawgeti (lua_state, entry, 3);
+
+    characteristic_t *characteristic = NULL;
+    if (NULL != device && lua_type (lua_state, entry + 1) == LUA_TSTRING)
+    {
+      characteristic = luai_device_find_characteristic (device, lua_tostring (lua_state, entry + 1));
+    }
+    else
+    {
+      luai_object_t *handle = (luai_object_t *) luaL_testudata (lua_state, entry + 1, LUA_USERDATA_CHARACTERISTIC);
+      characteristic = handle ? (characteristic_t *) handle->object : NULL;
+      if (NULL != characteristic && NULL != device && !luai_device_has_characteristic (device, characteristic))
+      {
+        characteristic = NULL;
+      }
+    }
+    if (NULL == characteristic)
+    {
+      luaL_error (lua_state, "setValues entry %d has an unknown characteristic", (int) i);
+    }
+    if (device_skips_characteristic (characteristic))
+    {
+      lua_settop (lua_state, entry - 1);
+      continue;
+    }
+
+    const format_t *format = NULL;
+    lua_Integer type = BLE_BYTES;
+    if (lua_type (lua_state, entry + 3) == LUA_TNUMBER)
+    {
+      type = lua_isinteger (lua_state, entry + 3) ? lua_tointeger (lua_state, entry + 3) : -1;
+      if (type < BLE_BOOL || type > BLE_BYTES)
+      {
+        luaL_error (lua_state, "setValues entry %d must have a valid " LUA_API_ENUM_DATATYPE " enum", (int) i);
+      }
+    }
+    else
+    {
+      ble_data_type_t unused;
+      format = luai_check_value_type (lua_state, entry + 3, &unused);
+    }
+
+    const void *data = NULL;
+    size_t data_size = 0;
+    if (luai_encode_typed (lua_state, entry + 2, (ble_data_type_t) type, format, scalar, &data, &data_size))
+    {
+      luai_update_value (lua_state, characteristic, data, data_size);
+    }
+    else
+    {
+      success = false;
+    }
+
+    lua_settop (lua_state, entry - 1);
+  }
+
+  return success;
+}
+
+static int luai_set_values_function (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  lua_pushboolean (lua_state, luai_set_values (lua_state, 1, NULL));
+  return 1;
+}
+
+static int luai_device_set_values (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 2);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  lua_pushboolean (lua_state, luai_set_values (lua_state, 2, device));
+  return 1;
+}
+
+//checks a 1 based byte offset of a buffer for a value of size bytes and returns it 0 based
+static size_t luai_check_buffer_offset (lua_State *lua_state, int index, const luai_buffer_t *buffer, size_t size)
+{
+  luai_check_type (lua_state, index, LUA_TNUMBER);
+  lua_Integer offset = lua_tointeger (lua_state, index);
+  luaL_argcheck (lua_state, offset >= 1 && (size_t) offset <= buffer->size && size <= buffer->size - (size_t) (offset - 1), index, "offset out of range");
+  return (size_t) (offset - 1);
+}
+
+static int luai_create_buffer (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TNUMBER);
+  lua_Integer size = lua_tointeger (lua_state, 1);
+  luaL_argcheck (lua_state, size >= 0 && size <= UINT32_MAX, 1, "size out of range");
+
+  luai_buffer_t *buffer = (luai_buffer_t *) lua_newuserdata (lua_state, sizeof (*buffer) + (size_t) size);
+  buffer->size = (size_t) size;
+  memset (buffer->data, 0, buffer->size);
+
+  luaL_getmetatable (lua_state, LUA_USERDATA_BUFFER);
   lua_setmetatable (lua_state, -2);
+  return 1;
+}
+
+//buffer:write (offset, value, type) - encodes a value at a 1 based byte offset and returns the offset after it
+static int luai_buffer_write (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 4);
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+  ble_data_type_t type = luai_check_type_ble_data_type (lua_state, 4);
+
+  size_t size = BLE_DATA_TYPE_SIZE[type];
+  const void *bytes = NULL;
+  if (type == BLE_STRING || type == BLE_BYTES)
+  {
+    luai_check_type (lua_state, 3, LUA_TSTRING);
+    bytes = lua_tolstring (lua_state, 3, &size);
+  }
+
+  size_t offset = luai_check_buffer_offset (lua_state, 2, buffer, size);
+  if (NULL != bytes)
+  {
+    memcpy (buffer->data + offset, bytes, size);
+  }
+  else
+  {
+    luaL_argcheck (lua_state, luai_encode_value (lua_state, 3, type, buffer->data + offset), 3, "value does not match type");
+  }
+
+  lua_pushinteger (lua_state, (lua_Integer) (offset + size + 1));
+  return 1;
+}
+
+static int luai_buffer_fill (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 2);
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+  luai_check_type (lua_state, 2, LUA_TNUMBER);
+
+  memset (buffer->data, (uint8_t) lua_tointeger (lua_state, 2), buffer->size);
+  return 0;
+}
+
+static int luai_buffer_to_string (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+
+  lua_pushlstring (lua_state, (const char *) buffer->data, buffer->size);
+  return 1;
+}
+
+//buffer[i] reads the byte at a 1 based index, other keys are the buffer methods
+static int luai_buffer_index (lua_State *lua_state)
+{
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+  if (lua_type (lua_state, 2) == LUA_TNUMBER)
+  {
+    lua_Integer index = lua_tointeger (lua_state, 2);
+    if (index >= 1 && (size_t) index <= buffer->size)
+    {
+      lua_pushinteger (lua_state, buffer->data[index - 1]);
+    }
+    else
+    {
+      lua_pushnil (lua_state);
+    }
+    return 1;
+  }
+
+  lua_getmetatable (lua_state, 1);
+  lua_pushvalue (lua_state, 2);
+  lua_rawget (lua_state, -2);
+  return 1;
+}
+
+//buffer[i] = byte
+static int luai_buffer_new_index (lua_State *lua_state)
+{
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+  size_t offset = luai_check_buffer_offset (lua_state, 2, buffer, 1);
+  luai_check_type (lua_state, 3, LUA_TNUMBER);
+
+  buffer->data[offset] = (uint8_t) lua_tointeger (lua_state, 3);
+  return 0;
+}
+
+static int luai_buffer_length (lua_State *lua_state)
+{
+  luai_buffer_t *buffer = luai_check_argument_buffer (lua_state, 1);
+  lua_pushinteger (lua_state, (lua_Integer) buffer->size);
+  return 1;
+}
+
+static luai_view_t *luai_check_argument_view (lua_State *lua_state, int index)
+{
+  return (luai_view_t *) luaL_checkudata (lua_state, index, LUA_USERDATA_VIEW);
+}
+
+static int luai_view_to_string (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_view_t *view = luai_check_argument_view (lua_state, 1);
+
+  lua_pushlstring (lua_state, view->data ? (const char *) view->data : "", view->size);
+  return 1;
+}
+
+//view[i] reads the byte at a 1 based index, other keys are the view methods
+static int luai_view_index (lua_State *lua_state)
+{
+  luai_view_t *view = luai_check_argument_view (lua_state, 1);
+  if (lua_type (lua_state, 2) == LUA_TNUMBER)
+  {
+    lua_Integer index = lua_tointeger (lua_state, 2);
+    if (index >= 1 && (size_t) index <= view->size)
+    {
+      lua_pushinteger (lua_state, view->data[index - 1]);
+    }
+    else
+    {
+      lua_pushnil (lua_state);
+    }
+    return 1;
+  }
+
+  lua_getmetatable (lua_state, 1);
+  lua_pushvalue (lua_state, 2);
+  lua_rawget (lua_state, -2);
+  return 1;
+}
+
+static int luai_view_length (lua_State *lua_state)
+{
+  luai_view_t *view = luai_check_argument_view (lua_state, 1);
+  lua_pushinteger (lua_state, (lua_Integer) view->size);
+  return 1;
+}
+
+//sets or clears (fn = nil) the callback for an event on a characteristic or device handle at index 1
+static int luai_set_callback (lua_State *lua_state, void *object, uint8_t *event_mask, void **event_listener, event_kind_t kind)
+{
+  luai_check_argument_count (lua_state, 2);
+  luai_check_dbus_thread (lua_state);
+  bool clear = lua_isnil (lua_state, 2);
+  if (!clear)
+  {
+    luai_check_type (lua_state, 2, LUA_TFUNCTION);
+  }
+
+  luai_context_t *context = luai_get_context (lua_state);
+  if (*event_mask && *event_listener != context->worker)
+  {
+    return luaL_error (lua_state, "Callbacks for this object are already set by another worker");
+  }
+
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_CALLBACKS);
+  lua_pushlightuserdata (lua_state, object);
+  if (lua_rawget (lua_state, -2) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 1);
+    lua_newtable (lua_state);
+    lua_pushvalue (lua_state, 1);
+    lua_rawseti (lua_state, -2, LUAI_CALLBACK_HANDLE); //the handle is kept alive while the object has callbacks
+    lua_pushlightuserdata (lua_state, object);
+    lua_pushvalue (lua_state, -2);
+    lua_rawset (lua_state, -4);
+  }
+  lua_pushvalue (lua_state, 2);
+  lua_rawseti (lua_state, -2, kind + 1);
+
+  if (clear)
+  {
+    *event_mask &= (uint8_t) ~EVENT_MASK (kind);
+  }
+  else
+  {
+    *event_mask |= (uint8_t) EVENT_MASK (kind);
+  }
+  *event_listener = context->worker;
+
+  if (*event_mask == 0)
+  {
+    lua_pushlightuserdata (lua_state, object);
+    lua_pushnil (lua_state);
+    lua_rawset (lua_state, -4);
+  }
+  lua_pop (lua_state, 2);
+  return 0;
+}
+
+static int luai_device_on_connect (lua_State *lua_state)
+{
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  return luai_set_callback (lua_state, device, &device->event_mask, &device->event_listener, EVENT_CONNECT);
+}
+
+static int luai_device_on_disconnect (lua_State *lua_state)
+{
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  return luai_set_callback (lua_state, device, &device->event_mask, &device->event_listener, EVENT_DISCONNECT);
+}
+
+//device:isActive () - true while a central is connected or subscribed to one of its characteristics
+static int luai_device_is_active (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  device_t *device = luai_check_argument_device (lua_state, 1);
+  lua_pushboolean (lua_state, device_is_active (device));
+  return 1;
+}
+
+static int luai_characteristic_on_write (lua_State *lua_state)
+{
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  return luai_set_callback (lua_state, characteristic, &characteristic->event_mask, &characteristic->event_listener, EVENT_WRITE);
+}
+
+//characteristic:onRead (fn, [ttl]) - fn (characteristic) returns value, type when a central reads,
+//the value is reused for ttl milliseconds (default 0, computed on every read)
+static int luai_characteristic_on_read (lua_State *lua_state)
+{
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  lua_Integer ttl = luaL_optinteger (lua_state, 3, 0);
+  luaL_argcheck (lua_state, ttl >= 0 && ttl <= UINT32_MAX, 3, "ttl out of range");
+  lua_settop (lua_state, 2);
+
+  luai_set_callback (lua_state, characteristic, &characteristic->event_mask, &characteristic->event_listener, EVENT_READ);
+  characteristic->read_ttl_ms = (uint32_t) ttl;
+  characteristic->read_expires_ms = 0;
+  return 0;
+}
+
+static int luai_characteristic_on_subscribe (lua_State *lua_state)
+{
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  return luai_set_callback (lua_state, characteristic, &characteristic->event_mask, &characteristic->event_listener, EVENT_SUBSCRIBE);
+}
+
+static int luai_characteristic_on_unsubscribe (lua_State *lua_state)
+{
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  return luai_set_callback (lua_state, characteristic, &characteristic->event_mask, &characteristic->event_listener, EVENT_UNSUBSCRIBE);
+}
+
+//calls the callback for an event - onWrite (characteristic, view), onSubscribe/onUnsubscribe (characteristic),
+//onConnect/onDisconnect (device, address)
+static void luai_deliver_event (lua_State *lua_state, const event_t *event)
+{
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_CALLBACKS);
+  lua_pushlightuserdata (lua_state, event->object);
+  if (lua_rawget (lua_state, -2) != LUA_TTABLE)
+  {
+    lua_pop (lua_state, 2); //the callbacks were cleared after the event was posted
+    return;
+  }
+  if (lua_rawgeti (lua_state, -1, event->kind + 1) != LUA_TFUNCTION)
+  {
+    lua_pop (lua_state, 3);
+    return;
+  }
+  lua_rawgeti (lua_state, -2, LUAI_CALLBACK_HANDLE);
+
+  int argument_count = 1;
+  luai_view_t *view = NULL;
+  if (event->kind == EVENT_WRITE)
+  {
+    view = luai_get_context (lua_state)->view;
+    view->data = event_get_data (event);
+    view->size = event->size;
+    lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_VIEW);
+    argument_count++;
+  }
+  else if (event->kind == EVENT_CONNECT || event->kind == EVENT_DISCONNECT)
+  {
+    lua_pushstring (lua_state, (const char *) event_get_data (event));
+    argument_count++;
+  }
+
+  luai_budget_arm (lua_state);
+  if (lua_pcall (lua_state, argument_count, 0, 0))
+  {
+    log_error ("Event callback failed: %s", lua_tostring (lua_state, -1));
+    lua_pop (lua_state, 1);
+  }
+  bool overrun = luai_budget_disarm (lua_state);
+  if (NULL != view)
+  {
+    view->data = NULL; //the event data is freed after the callback
+    view->size = 0;
+  }
+  if (!overrun)
+  {
+    if (lua_rawgeti (lua_state, -1, LUAI_CALLBACK_OVERRUNS) != LUA_TNIL) //a call within budget clears the count
+    {
+      lua_pushnil (lua_state);
+      lua_rawseti (lua_state, -3, LUAI_CALLBACK_OVERRUNS);
+    }
+    lua_pop (lua_state, 1);
+  }
+  lua_pop (lua_state, 2);
+  if (overrun)
+  {
+    luai_note_callback_overrun (lua_state, event->object);
+  }
+}
+
+//runs the onRead callback of the characteristic at index 1 (lightuserdata) and sets the value it returns,
+//called in protected mode so a bad return value raises a lua error
+static int luai_call_read_callback (lua_State *lua_state)
+{
+  characteristic_t *characteristic = (characteristic_t *) lua_touserdata (lua_state, 1);
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_CALLBACKS);
+  lua_pushlightuserdata (lua_state, characteristic);
+  if (lua_rawget (lua_state, -2) != LUA_TTABLE || lua_rawgeti (lua_state, -1, EVENT_READ + 1) != LUA_TFUNCTION)
+  {
+    return 0;
+  }
+  lua_rawgeti (lua_state, -2, LUAI_CALLBACK_HANDLE);
+  lua_call (lua_state, 1, 2);
+  if (lua_isnil (lua_state, -2))
+  {
+    return 0; //keep the current value
+  }
+
+  int value_index = lua_gettop (lua_state) - 1;
+  ble_data_type_t type = BLE_BYTES;
+  const format_t *format = luai_check_value_type (lua_state, value_index + 1, &type);
+  uint8_t scalar[sizeof (uint64_t)];
+  const void *data = NULL;
+  size_t data_size = 0;
+  if (!luai_encode_typed (lua_state, value_index, type, format, scalar, &data, &data_size))
+  {
+    return luaL_error (lua_state, "Value returned by onRead does not match its type");
+  }
+  characteristic_update_value (characteristic, data, data_size);
+  return 0;
+}
 
-  return 1; //the device is already on the stack so return this
+//characteristic_read_function for the characteristic callbacks, runs on the dbus thread. A worker's state is
+//only used while the worker is idle, if it is running Update the last value is returned
+static bool luai_read_characteristic (characteristic_t *characteristic)
+{
+  luai_worker_t *worker = (luai_worker_t *) characteristic->event_listener;
+  lua_State *lua_state = luai_state;
+  if (NULL != worker)
+  {
+    bool idle = false;
+    if (!atomic_compare_exchange_strong (&worker->busy, &idle, true))
+    {
+      return false;
+    }
+    lua_state = worker->lua_state;
+  }
+
+  bool success = false;
+  if (NULL != lua_state)
+  {
+    lua_pushcfunction (lua_state, luai_call_read_callback);
+    lua_pushlightuserdata (lua_state, characteristic);
+    luai_budget_arm (lua_state);
+    success = lua_pcall (lua_state, 1, 0, 0) == LUA_OK;
+    if (!success)
+    {
+      log_error ("onRead callback failed: %s", lua_tostring (lua_state, -1));
+      lua_pop (lua_state, 1);
+    }
+    if (luai_budget_disarm (lua_state))
+    {
+      luai_note_callback_overrun (lua_state, characteristic);
+    }
+  }
+
+  if (NULL != worker)
+  {
+    atomic_store (&worker->busy, false);
+  }
+  return success;
 }
 
-static int luai_register_device (lua_State *lua_state)
+static void luai_deliver_events (lua_State *lua_state, event_queue_t *queue)
 {
-  luai_check_argument_count (lua_state, 1);
-  device_t *device = luai_check_argument_device (lua_state, 1);
+  event_t event;
+  while (event_queue_pop (queue, &event))
+  {
+    luai_deliver_event (lua_state, &event);
+    event_fini (&event);
+  }
+}
 
-  bool success = device_register (device);
-  lua_pushboolean (lua_state, success);
+//ble.spawn (fn, ...) - fn runs as a coroutine from the next tick, returns the coroutine
+static int luai_spawn (lua_State *lua_state)
+{
+  luaL_checktype (lua_state, 1, LUA_TFUNCTION);
+  int argument_count = lua_gettop (lua_state);
+  luai_context_t *context = luai_get_context (lua_state);
+
+  lua_State *thread = lua_newthread (lua_state);
+  lua_insert (lua_state, 1);
+  lua_xmove (lua_state, thread, argument_count); //the function and its arguments wait on the coroutines stack until it starts
+
+  lua_pushvalue (lua_state, 1);
+  int thread_ref = luaL_ref (lua_state, LUA_REGISTRYINDEX);
+  if (!scheduler_add (&context->scheduler, simclock_now_ms (), thread_ref, LUA_NOREF))
+  {
+    luaL_unref (lua_state, LUA_REGISTRYINDEX, thread_ref);
+    return luaL_error (lua_state, "Could not schedule coroutine");
+  }
   return 1;
 }
 
-static int luai_device_add_service (lua_State *lua_state)
+static luai_context_t *luai_check_spawned (lua_State *lua_state, const char *function_name)
 {
-  luai_check_argument_count (lua_state, 2);
-  device_t *device = luai_check_argument_device (lua_state, 1);
-  service_t *service = luai_check_argument_service (lua_state, 2);
+  luai_context_t *context = luai_get_context (lua_state);
+  if (context->running != lua_state)
+  {
+    luaL_error (lua_state, "ble.%s can only be called from a function started with ble.spawn", function_name);
+  }
+  return context;
+}
 
-  bool success = device_add_service (device, service);
-  lua_pushboolean (lua_state, success);
+//ble.sleep (ms) - resumes the coroutine on the first tick after ms milliseconds
+static int luai_sleep (lua_State *lua_state)
+{
+  lua_Integer milliseconds = luaL_checkinteger (lua_state, 1);
+  luai_context_t *context = luai_check_spawned (lua_state, LUA_API_SLEEP);
+
+  uint64_t due = simclock_now_ms () + (milliseconds > 0 ? (uint64_t) milliseconds : 0);
+  if (!scheduler_add (&context->scheduler, due, context->running_ref, LUA_NOREF))
+  {
+    return luaL_error (lua_state, "Could not schedule coroutine");
+  }
+  context->parked = true;
+  return lua_yield (lua_state, 0);
+}
+
+//ble.waitFor (event) - resumes the coroutine when the event is signalled, returns the values passed to ble.signal
+static int luai_wait_for (lua_State *lua_state)
+{
+  luaL_checkstring (lua_state, 1);
+  luai_context_t *context = luai_check_spawned (lua_state, LUA_API_WAIT_FOR);
+
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_WAITERS);
+  lua_pushvalue (lua_state, 1);
+  if (lua_rawget (lua_state, -2) == LUA_TNIL)
+  {
+    lua_pop (lua_state, 1);
+    lua_newtable (lua_state);
+    lua_pushvalue (lua_state, 1);
+    lua_pushvalue (lua_state, -2);
+    lua_rawset (lua_state, -4);
+  }
+  lua_pushinteger (lua_state, context->running_ref);
+  lua_rawseti (lua_state, -2, (lua_Integer) lua_rawlen (lua_state, -2) + 1);
+  lua_pop (lua_state, 2);
+
+  context->parked = true;
+  return lua_yield (lua_state, 0);
+}
+
+//ble.signal (event, ...) - wakes every coroutine waiting for the event on this tick, returns how many were woken
+static int luai_signal (lua_State *lua_state)
+{
+  luaL_checkstring (lua_state, 1);
+  int value_count = lua_gettop (lua_state) - 1;
+  luai_context_t *context = luai_get_context (lua_state);
+
+  lua_getfield (lua_state, LUA_REGISTRYINDEX, LUAI_REGISTRY_WAITERS);
+  lua_pushvalue (lua_state, 1);
+  if (lua_rawget (lua_state, -2) == LUA_TNIL)
+  {
+    lua_pushinteger (lua_state, 0);
+    return 1;
+  }
+  lua_pushvalue (lua_state, 1);
+  lua_pushnil (lua_state);
+  lua_rawset (lua_state, -4); //the waiters are taken before any of them run so waiting again needs a new signal
+
+  lua_Integer waiter_count = (lua_Integer) lua_rawlen (lua_state, -1);
+  for (lua_Integer i = 1; i <= waiter_count; i++)
+  {
+    lua_rawgeti (lua_state, -1, i);
+    int thread_ref = (int) lua_tointeger (lua_state, -1);
+    lua_pop (lua_state, 1);
+
+    int args_ref = LUA_NOREF;
+    if (value_count > 0)
+    {
+      lua_createtable (lua_state, value_count, 0);
+      for (int value = 1; value <= value_count; value++)
+      {
+        lua_pushvalue (lua_state, value + 1);
+        lua_rawseti (lua_state, -2, value);
+      }
+      args_ref = luaL_ref (lua_state, LUA_REGISTRYINDEX);
+    }
+    if (!scheduler_add (&context->scheduler, simclock_now_ms (), thread_ref, args_ref))
+    {
+      luaL_unref (lua_state, LUA_REGISTRYINDEX, args_ref);
+      luaL_unref (lua_state, LUA_REGISTRYINDEX, thread_ref);
+      log_error ("Could not schedule coroutine, it will not be resumed");
+    }
+  }
+
+  lua_pushinteger (lua_state, waiter_count);
   return 1;
 }
 
-static int luai_device_set_powered (lua_State *lua_state)
+//ble.now () - simulation time in milliseconds, the same for the whole tick
+static int luai_now (lua_State *lua_state)
 {
-  luai_check_argument_count (lua_state, 2);
-  device_t *device = luai_check_argument_device (lua_state, 1);
-  bool powered = lua_toboolean (lua_state, 2);
+  lua_pushinteger (lua_state, (lua_Integer) simclock_now_ms ());
+  return 1;
+}
 
-  bool success = device_set_powered (device, powered);
-  lua_pushboolean (lua_state, success);
+//math.random ([m [, n]]) of a seeded run, same arguments as the standard one but drawn from the sequence of the state
+static int luai_math_random (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  uint64_t random = utils_splitmix64 (&context->random_state);
+  lua_Integer low = 1;
+  lua_Integer up = 0;
+  switch (lua_gettop (lua_state))
+  {
+    case 0:
+      lua_pushnumber (lua_state, (lua_Number) (random >> 11) * (1.0 / 9007199254740992.0)); //53 bits in [0, 1)
+      return 1;
+    case 1:
+      up = luaL_checkinteger (lua_state, 1);
+      break;
+    case 2:
+      low = luaL_checkinteger (lua_state, 1);
+      up = luaL_checkinteger (lua_state, 2);
+      break;
+    default:
+      return luaL_error (lua_state, "wrong number of arguments");
+  }
+  luaL_argcheck (lua_state, low <= up, lua_gettop (lua_state), "interval is empty");
+
+  uint64_t range = (uint64_t) up - (uint64_t) low;
+  uint64_t offset = range == UINT64_MAX ? random : random % (range + 1);
+  lua_pushinteger (lua_state, (lua_Integer) ((uint64_t) low + offset));
   return 1;
 }
 
-static int luai_device_set_discoverable (lua_State *lua_state)
+//math.randomseed (x) of a seeded run, restarts the sequence of the state
+static int luai_math_randomseed (lua_State *lua_state)
 {
-  luai_check_argument_count (lua_state, 2);
-  device_t *device = luai_check_argument_device (lua_state, 1);
-  bool discoverable = lua_toboolean (lua_state, 2);
+  luai_context_t *context = luai_get_context (lua_state);
+  lua_Integer seed = lua_isinteger (lua_state, 1) ? lua_tointeger (lua_state, 1) : (lua_Integer) luaL_checknumber (lua_state, 1);
+  context->random_state = (uint64_t) seed;
+  return 0;
+}
+
+//resumes every spawned coroutine that is due, coroutines scheduled while this runs wait for the next call
+static void luai_run_scheduler (lua_State *lua_state)
+{
+  luai_context_t *context = luai_get_context (lua_state);
+  if (scheduler_get_count (&context->scheduler) == 0)
+  {
+    return;
+  }
+
+  uint64_t now = simclock_now_ms ();
+  uint64_t before = scheduler_get_sequence (&context->scheduler);
+  scheduler_timer_t timer;
+  while (scheduler_pop_due (&context->scheduler, now, before, &timer))
+  {
+    lua_rawgeti (lua_state, LUA_REGISTRYINDEX, timer.thread_ref);
+    lua_State *thread = lua_tothread (lua_state, -1);
+    lua_pop (lua_state, 1); //kept alive by the reference
+
+    int argument_count = 0;
+    if (lua_status (thread) == LUA_OK)
+    {
+      argument_count = lua_gettop (thread) - 1; //first run, the function and the arguments from ble.spawn
+    }
+    if (timer.args_ref != LUA_NOREF)
+    {
+      lua_rawgeti (lua_state, LUA_REGISTRYINDEX, timer.args_ref);
+      int value_count = (int) lua_rawlen (lua_state, -1);
+      luaL_checkstack (thread, value_count, NULL);
+      for (int value = 1; value <= value_count; value++)
+      {
+        lua_rawgeti (lua_state, -1, value);
+        lua_xmove (lua_state, thread, 1);
+      }
+      lua_pop (lua_state, 1);
+      luaL_unref (lua_state, LUA_REGISTRYINDEX, timer.args_ref);
+      argument_count += value_count;
+    }
+
+    context->running = thread;
+    context->running_ref = timer.thread_ref;
+    context->parked = false;
+    luai_budget_arm (lua_state);
+    int status = lua_resume (thread, lua_state, argument_count); //a coroutine that runs over the budget fails
+    luai_budget_disarm (lua_state);
+    context->running = NULL;
+    context->running_ref = LUA_NOREF;
+
+    if (status == LUA_YIELD)
+    {
+      lua_settop (thread, 0); //values passed to coroutine.yield are dropped
+      if (!context->parked && !scheduler_add (&context->scheduler, now, timer.thread_ref, LUA_NOREF)) //a plain coroutine.yield runs again next tick
+      {
+        luaL_unref (lua_state, LUA_REGISTRYINDEX, timer.thread_ref);
+        log_error ("Could not schedule coroutine, it will not be resumed");
+      }
+    }
+    else
+    {
+      if (status != LUA_OK)
+      {
+        luaL_traceback (lua_state, thread, lua_tostring (thread, -1), 0);
+        log_error ("Spawned function failed: %s", lua_tostring (lua_state, -1));
+        lua_pop (lua_state, 1);
+      }
+      luaL_unref (lua_state, LUA_REGISTRYINDEX, timer.thread_ref);
+    }
+  }
+}
+
+//descriptor:setValue (value, type) - encoded like characteristic:setValue, a Client Characteristic Configuration
+//value turns notifying of the characteristic on or off
+static int luai_descriptor_set_value (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 3);
+  descriptor_t *descriptor = luai_check_argument_descriptor (lua_state, 1);
+  luai_check_dbus_thread (lua_state);
+  ble_data_type_t ble_type = BLE_BYTES;
+  const format_t *format = luai_check_value_type (lua_state, 3, &ble_type);
+  const void *data = NULL;
+  size_t data_size = 0;
+  uint8_t scalar[sizeof (uint64_t)];
+
+  bool success = luai_encode_typed (lua_state, 2, ble_type, format, scalar, &data, &data_size)
+    && descriptor_update_value (descriptor, data, (uint32_t) data_size);
 
-  bool success = device_set_discoverable (device, discoverable);
   lua_pushboolean (lua_state, success);
   return 1;
 }
 
-static int luai_device_free (lua_State *lua_state)
+static int luai_descriptor_free (lua_State *lua_state)
 {
-  device_t *device = luai_check_argument_device (lua_state, 1);
-  device_fini (device);
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_DESCRIPTOR);
+  luai_release_object (handle, luai_free_descriptor);
   return 0;
 }
 
-static int luai_service_add_characteristic (lua_State *lua_state)
+static const char *luai_get_string_field (lua_State *lua_state, int index, const char *field)
+{
+  lua_getfield (lua_state, index, field);
+  if (!lua_isstring (lua_state, -1))
+  {
+    luaL_error (lua_state, "Field '%s' must be a string", field);
+  }
+  const char *value = lua_tostring (lua_state, -1);
+  lua_pop (lua_state, 1); //the string is still referenced by the table
+  return value;
+}
+
+static uint32_t luai_get_flags_field (lua_State *lua_state, int index, luai_flag_lookup_function lookup, uint32_t default_flags)
+{
+  lua_getfield (lua_state, index, LUA_FIELD_FLAGS);
+  if (lua_isnil (lua_state, -1))
+  {
+    lua_pop (lua_state, 1);
+    return default_flags;
+  }
+
+  if (!lua_istable (lua_state, -1))
+  {
+    luaL_error (lua_state, "Field '" LUA_FIELD_FLAGS "' must be an array of strings");
+  }
+
+  uint32_t flags = 0;
+  size_t flag_count = lua_rawlen (lua_state, -1);
+  for (size_t i = 1; i <= flag_count; i++)
+  {
+    lua_rawgeti (lua_state, -1, i);
+    const char *flag = lua_tostring (lua_state, -1);
+    uint32_t bit = flag ? lookup (flag) : 0;
+    if (bit == 0)
+    {
+      luaL_error (lua_state, "Unknown flag '%s'", flag ? flag : "?");
+    }
+    flags |= bit;
+    lua_pop (lua_state, 1);
+  }
+  lua_pop (lua_state, 1);
+  return flags;
+}
+
+static uint32_t luai_descriptor_flag_bit (const char *flag)
+{
+  return descriptor_get_flag_bit (flag);
+}
+
+static void luai_parse_schema_descriptors (lua_State *lua_state, int index, device_schema_t *schema, int service_index, int characteristic_index)
+{
+  lua_getfield (lua_state, index, LUA_FIELD_DESCRIPTORS);
+  if (!lua_istable (lua_state, -1))
+  {
+    lua_pop (lua_state, 1);
+    return;
+  }
+
+  int descriptors = lua_gettop (lua_state);
+  size_t descriptor_count = lua_rawlen (lua_state, descriptors);
+  for (size_t i = 1; i <= descriptor_count; i++)
+  {
+    lua_rawgeti (lua_state, descriptors, i);
+    luaL_argcheck (lua_state, lua_istable (lua_state, -1), 1, "descriptor definition must be a table");
+    const char *uuid = luai_get_string_field (lua_state, -1, LUA_FIELD_UUID);
+    uint16_t flags = (uint16_t) luai_get_flags_field (lua_state, -1, luai_descriptor_flag_bit, DESCRIPTOR_FLAGS_ALL_ENABLED);
+    if (device_schema_add_descriptor (schema, service_index, characteristic_index, uuid, flags) < 0)
+    {
+      luaL_error (lua_state, "Could not add descriptor %s to schema", uuid);
+    }
+    lua_pop (lua_state, 1);
+  }
+  lua_pop (lua_state, 1);
+}
+
+static void luai_parse_schema_characteristics (lua_State *lua_state, int index, device_schema_t *schema, int service_index)
+{
+  lua_getfield (lua_state, index, LUA_FIELD_CHARACTERISTICS);
+  if (!lua_istable (lua_state, -1))
+  {
+    lua_pop (lua_state, 1);
+    return;
+  }
+
+  int characteristics = lua_gettop (lua_state);
+  size_t characteristic_count = lua_rawlen (lua_state, characteristics);
+  for (size_t i = 1; i <= characteristic_count; i++)
+  {
+    lua_rawgeti (lua_state, characteristics, i);
+    luaL_argcheck (lua_state, lua_istable (lua_state, -1), 1, "characteristic definition must be a table");
+    int characteristic = lua_gettop (lua_state);
+    const char *uuid = luai_get_string_field (lua_state, characteristic, LUA_FIELD_UUID);
+    uint32_t flags = luai_get_flags_field (lua_state, characteristic, characteristic_get_flag_bit, CHARACTERISTIC_FLAGS_ALL_ENABLED);
+    int characteristic_index = device_schema_add_characteristic (schema, service_index, uuid, flags);
+    if (characteristic_index < 0)
+    {
+      luaL_error (lua_state, "Could not add characteristic %s to schema", uuid);
+    }
+    luai_parse_schema_descriptors (lua_state, characteristic, schema, service_index, characteristic_index);
+    lua_pop (lua_state, 1);
+  }
+  lua_pop (lua_state, 1);
+}
+
+static void luai_parse_schema (lua_State *lua_state, int index, device_schema_t *schema)
+{
+  lua_getfield (lua_state, index, LUA_FIELD_SERVICES);
+  luaL_argcheck (lua_state, lua_istable (lua_state, -1), index, "'" LUA_FIELD_SERVICES "' table expected");
+
+  int services = lua_gettop (lua_state);
+  size_t service_count = lua_rawlen (lua_state, services);
+  for (size_t i = 1; i <= service_count; i++)
+  {
+    lua_rawgeti (lua_state, services, i);
+    luaL_argcheck (lua_state, lua_istable (lua_state, -1), index, "service definition must be a table");
+    int service = lua_gettop (lua_state);
+    const char *uuid = luai_get_string_field (lua_state, service, LUA_FIELD_UUID);
+
+    lua_getfield (lua_state, service, LUA_FIELD_PRIMARY);
+    bool primary = lua_isnil (lua_state, -1) ? true : lua_toboolean (lua_state, -1);
+    lua_pop (lua_state, 1);
+
+    int service_index = device_schema_add_service (schema, uuid, primary);
+    if (service_index < 0)
+    {
+      luaL_error (lua_state, "Could not add service %s to schema", uuid);
+    }
+    luai_parse_schema_characteristics (lua_state, service, schema, service_index);
+    lua_pop (lua_state, 1);
+  }
+  lua_pop (lua_state, 1);
+}
+
+static double luai_get_number_field (lua_State *lua_state, int index, const char *field, double default_value)
+{
+  lua_getfield (lua_state, index, field);
+  double value = default_value;
+  if (!lua_isnil (lua_state, -1))
+  {
+    if (!lua_isnumber (lua_state, -1) || !isfinite (lua_tonumber (lua_state, -1)))
+    {
+      luaL_error (lua_state, "Field '%s' must be a finite number", field);
+    }
+    value = lua_tonumber (lua_state, -1);
+  }
+  lua_pop (lua_state, 1);
+  return value;
+}
+
+//characteristic:generate {kind = "sine", type = DataType.INT16, rate = ms, ...} attaches a C generator,
+//characteristic:generate (nil) removes it
+static int luai_characteristic_generate (lua_State *lua_state)
 {
   luai_check_argument_count (lua_state, 2);
-  service_t *service = luai_check_argument_service (lua_state, 1);
-  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 2);
+  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
+  luai_check_dbus_thread (lua_state);
+  if (lua_isnil (lua_state, 2))
+  {
+    generator_detach (characteristic);
+    lua_pushboolean (lua_state, true);
+    return 1;
+  }
+  luai_check_type (lua_state, 2, LUA_TTABLE);
 
-  bool success = service_add_characteristic (service, characteristic);
+  generator_config_t config;
+  memset (&config, 0, sizeof (config));
+  if (!generator_get_kind (luai_get_string_field (lua_state, 2, LUA_FIELD_KIND), &config.kind))
+  {
+    return luaL_error (lua_state, "Unknown generator kind '%s'", luai_get_string_field (lua_state, 2, LUA_FIELD_KIND));
+  }
+  lua_getfield (lua_state, 2, LUA_FIELD_TYPE);
+  config.type = luai_check_type_ble_data_type (lua_state, -1);
+  lua_pop (lua_state, 1);
+  double rate = luai_get_number_field (lua_state, 2, LUA_FIELD_RATE, GENERATOR_DEFAULT_RATE_MS);
+  luaL_argcheck (lua_state, rate >= 1 && rate <= UINT32_MAX, 2, "rate out of range");
+  config.rate_ms = (uint32_t) rate;
+  config.period_ms = luai_get_number_field (lua_state, 2, LUA_FIELD_PERIOD, GENERATOR_DEFAULT_PERIOD_MS);
+  config.amplitude = luai_get_number_field (lua_state, 2, LUA_FIELD_AMPLITUDE, 1);
+  config.offset = luai_get_number_field (lua_state, 2, LUA_FIELD_OFFSET, 0);
+  config.min = luai_get_number_field (lua_state, 2, LUA_FIELD_MIN, 0);
+  config.max = luai_get_number_field (lua_state, 2, LUA_FIELD_MAX, 100);
+  config.step = luai_get_number_field (lua_state, 2, LUA_FIELD_STEP, 1);
+
+  lua_getfield (lua_state, 2, LUA_FIELD_SEED);
+  if (!lua_isnil (lua_state, -1))
+  {
+    config.seed = (uint64_t) luaL_checkinteger (lua_state, -1);
+    config.seeded = true;
+  }
+  lua_pop (lua_state, 1);
+
+  if (lua_getfield (lua_state, 2, LUA_FIELD_VALUES) == LUA_TTABLE)
+  {
+    size_t count = lua_rawlen (lua_state, -1);
+    double *values = (double *) luai_get_scratch (lua_state, count * sizeof (*values)); //copied by the generator
+    for (size_t i = 0; i < count; i++)
+    {
+      lua_rawgeti (lua_state, -1, (lua_Integer) i + 1);
+      if (!lua_isnumber (lua_state, -1) || !isfinite (lua_tonumber (lua_state, -1)))
+      {
+        return luaL_error (lua_state, "Field '%s' must be an array of finite numbers", LUA_FIELD_VALUES);
+      }
+      values[i] = lua_tonumber (lua_state, -1);
+      lua_pop (lua_state, 1);
+    }
+    config.values = values;
+    config.value_count = count;
+  }
+  lua_pop (lua_state, 1);
+
+  bool success = generator_attach (characteristic, &config, simclock_now_ms ());
+  if (!success)
+  {
+    log_warn ("Could not attach %s generator to characteristic %s", luai_get_string_field (lua_state, 2, LUA_FIELD_KIND), characteristic->uuid);
+  }
   lua_pushboolean (lua_state, success);
   return 1;
 }
 
-static int luai_service_free (lua_State *lua_state)
-{
-  service_t *service = luai_check_argument_service (lua_state, 1);
-  service_fini (service);
-  return 0;
+static int luai_create_schema (lua_State *lua_state)
+{
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TTABLE);
+
+  device_schema_t *schema = device_schema_new ();
+  if (NULL == schema)
+  {
+    return luaL_error (lua_state, "Could not allocate schema");
+  }
+  luai_push_object (lua_state, schema, LUA_USERDATA_SCHEMA, true); //pushed first so the schema is collected if parsing fails
+
+  luai_parse_schema (lua_state, 1, schema);
+  return 1;
+}
+
+//formats the name of a device from a pattern with one %d, %% is a literal %
+static bool luai_format_device_name (const char *pattern, lua_Integer number, luaL_Buffer *name)
+{
+  bool numbered = false;
+  for (const char *c = pattern; *c; c++)
+  {
+    if (*c != '%')
+    {
+      luaL_addchar (name, *c);
+      continue;
+    }
+
+    c++;
+    if (*c == '%')
+    {
+      luaL_addchar (name, '%');
+    }
+    else if (*c == 'd' && !numbered)
+    {
+      lua_pushinteger (name->L, number);
+      luaL_addvalue (name);
+      numbered = true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return numbered;
+}
+
+//ble.createDevices {template = schema or definition, count = n, name = "sensor-%d", start = 1} builds count devices
+//from the template and registers them as one batch, returns the handles of the registered devices in order
+static int luai_create_devices (lua_State *lua_state)
+{
+  luai_check_dbus_thread (lua_state);
+  luai_check_argument_count (lua_state, 1);
+  luai_check_type (lua_state, 1, LUA_TTABLE);
+  const char *pattern = luai_get_string_field (lua_state, 1, LUA_FIELD_NAME);
+  double count = luai_get_number_field (lua_state, 1, LUA_FIELD_COUNT, 0);
+  double start = luai_get_number_field (lua_state, 1, LUA_FIELD_START, 1);
+  luaL_argcheck (lua_state, count >= 1 && count <= SIM_MAX_BULK_DEVICES && count == floor (count), 1, "'" LUA_FIELD_COUNT "' must be a positive integer");
+  luaL_argcheck (lua_state, start == floor (start) && fabs (start) < 1e15, 1, "'" LUA_FIELD_START "' must be an integer");
+
+  //a schema handle is shared by the devices, a definition table is compiled into one first
+  lua_getfield (lua_state, 1, LUA_FIELD_TEMPLATE);
+  int template_index = lua_gettop (lua_state);
+  device_schema_t *schema = NULL;
+  if (lua_istable (lua_state, template_index))
+  {
+    schema = device_schema_new ();
+    if (NULL == schema)
+    {
+      return luaL_error (lua_state, "Could not allocate schema");
+    }
+    luai_push_object (lua_state, schema, LUA_USERDATA_SCHEMA, true);
+    luai_parse_schema (lua_state, template_index, schema);
+  }
+  else
+  {
+    luaL_argcheck (lua_state, luaL_testudata (lua_state, template_index, LUA_USERDATA_SCHEMA) != NULL, 1, "'" LUA_FIELD_TEMPLATE "' must be a schema or a table");
+    schema = luai_check_argument_schema (lua_state, template_index);
+  }
+
+  size_t device_count = (size_t) count;
+  device_t **devices = (device_t **) lua_newuserdata (lua_state, device_count * sizeof (*devices));
+  lua_createtable (lua_state, (int) device_count, 0); //every handle, the ones of devices that fail to register are collected
+  int handles = lua_gettop (lua_state);
+  for (size_t i = 0; i < device_count; i++)
+  {
+    luaL_Buffer name;
+    luaL_buffinit (lua_state, &name);
+    if (!luai_format_device_name (pattern, (lua_Integer) start + (lua_Integer) i, &name))
+    {
+      return luaL_argerror (lua_state, 1, "'" LUA_FIELD_NAME "' must contain one %d");
+    }
+    luaL_pushresult (&name);
+
+    device_t *device = device_schema_instantiate (schema, lua_tostring (lua_state, -1));
+    lua_pop (lua_state, 1);
+    if (NULL == device)
+    {
+      return luaL_error (lua_state, "Could not allocate device");
+    }
+    luai_push_object (lua_state, device, LUA_USERDATA_DEVICE, true);
+    lua_rawseti (lua_state, handles, (lua_Integer) i + 1);
+    devices[i] = luai_reload_take_over (lua_state, device) ? NULL : device;
+  }
+
+  device_register_batch (devices, device_count);
+  lua_createtable (lua_state, (int) device_count, 0);
+  lua_Integer result_count = 0;
+  for (size_t i = 0; i < device_count; i++)
+  {
+    lua_rawgeti (lua_state, handles, (lua_Integer) i + 1);
+    luai_object_t *handle = (luai_object_t *) lua_touserdata (lua_state, -1);
+    if (NULL != devices[i] && !devices[i]->initialised)
+    {
+      lua_pop (lua_state, 1);
+      continue;
+    }
+    if (NULL != devices[i])
+    {
+      devices[i]->scripted = true;
+      handle->owned = false; //the registry now owns the device, it is freed when the device is removed
+    }
+    lua_rawseti (lua_state, -2, ++result_count);
+  }
+
+  if ((size_t) result_count < device_count)
+  {
+    log_warn ("%zu of %zu devices could not be registered", device_count - (size_t) result_count, device_count);
+  }
+  return 1;
 }
 
-static int luai_characteristic_add_descriptor (lua_State *lua_state)
+static int luai_schema_instantiate (lua_State *lua_state)
 {
+  luai_check_dbus_thread (lua_state);
   luai_check_argument_count (lua_state, 2);
-  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
-  descriptor_t *descriptor = luai_check_argument_descriptor (lua_state, 2);
+  device_schema_t *schema = luai_check_argument_schema (lua_state, 1);
+  luai_check_type (lua_state, 2, LUA_TSTRING);
 
-  bool success = characteristic_add_descriptor (characteristic, descriptor);
-  lua_pushboolean (lua_state, success);
+  device_t *device = device_schema_instantiate (schema, lua_tostring (lua_state, 2));
+  if (NULL == device)
+  {
+    lua_pushnil (lua_state);
+    return 1;
+  }
+  luai_push_object (lua_state, device, LUA_USERDATA_DEVICE, true); //owned until the device is registered
   return 1;
 }
 
-static int luai_characteristic_set_notifying (lua_State *lua_state)
+static int luai_schema_free (lua_State *lua_state)
 {
-  luai_check_argument_count (lua_state, 2);
-  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
-  bool notifying = lua_toboolean (lua_state, 2);
-
-  characteristic_set_notifying (characteristic, notifying);
+  luai_object_t *handle = (luai_object_t *) luaL_checkudata (lua_state, 1, LUA_USERDATA_SCHEMA);
+  luai_release_object (handle, luai_free_schema);
   return 0;
 }
 
-static int luai_characteristic_free (lua_State *lua_state)
+static void *luai_worker_run (void *data)
 {
-  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
-  characteristic_fini (characteristic);
-  return 0;
-}
+  luai_worker_t *worker = (luai_worker_t *) data;
+  luai_current_worker = worker;
 
-//TODO: could extract each case into a macro
-static bool luai_lua_number_to_opc_ua_data_type (
-  lua_State *lua_state,
-  int index, ble_data_type_t type,
-  void **data,
-  size_t *data_size
-)
-{
-  switch (type)
+  while (true)
   {
-    case BLE_INT8:
+    while (sem_wait (&worker->wake) != 0 && errno == EINTR);
+    if (atomic_load (&worker->quit))
     {
-      int8_t val = (int8_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (int8_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (int8_t);
-      memcpy (*data, &val, sizeof(int8_t));
-    }
       break;
-    case BLE_UINT8:
-    {
-      uint8_t val = (uint8_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (uint8_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (uint8_t);
-      memcpy (*data, &val, sizeof(uint8_t));
     }
-      break;
-    case BLE_INT16:
+
+    luai_deliver_events (worker->lua_state, &worker->events);
+    luai_call_update_function (worker->lua_state); //a failing Update is logged and run again next tick
+    luai_run_scheduler (worker->lua_state);
+    luai_step_garbage_collector (worker->lua_state);
+    atomic_store (&worker->busy, false);
+  }
+  return NULL;
+}
+
+//posts Update to every idle worker, a worker still running its last Update skips this tick
+static void luai_call_worker_updates (void)
+{
+  //hand each idle worker the events for its callbacks, events for a busy worker wait for the next tick
+  event_queue_t *pending = events_get_pending ();
+  for (size_t count = event_queue_get_count (pending); count > 0; count--)
+  {
+    event_t event;
+    event_queue_pop (pending, &event);
+    luai_worker_t *worker = (luai_worker_t *) event.listener;
+    if (NULL == worker)
     {
-      int16_t val = (int16_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (int16_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (int16_t);
-      memcpy (*data, &val, sizeof(int16_t));
+      event_fini (&event);
+      continue;
     }
-      break;
-    case BLE_UINT16:
+    event_queue_push (atomic_load (&worker->busy) ? pending : &worker->events, &event);
+  }
+
+  for (unsigned int i = 0; i < luai_worker_count; i++)
+  {
+    luai_worker_t *worker = &luai_workers[i];
+    if (atomic_load (&worker->busy))
     {
-      uint16_t val = (uint16_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (uint16_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (uint16_t);
-      memcpy (*data, &val, sizeof(uint16_t));
+      log_debug ("Worker %u is still running its last Update", worker->index + 1);
     }
-      break;
-    case BLE_INT32:
+    else
     {
-      int32_t val = (int32_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (int8_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (int32_t);
-      memcpy (*data, &val, sizeof(int32_t));
+      atomic_store (&worker->busy, true);
+      sem_post (&worker->wake);
     }
-      break;
-    case BLE_UINT32:
+  }
+
+  for (unsigned int i = 0; i < luai_worker_count; i++)
+  {
+    luai_drain_worker (&luai_workers[i]);
+  }
+}
+
+bool luai_call_update ()
+{
+  if (luai_worker_count)
+  {
+    luai_call_worker_updates ();
+    return true;
+  }
+
+  if (NULL == luai_state)
+  {
+    log_debug ("Lua state was NULL");
+    return false;
+  }
+
+  luai_deliver_events (luai_state, events_get_pending ());
+  bool success = luai_call_update_function (luai_state);
+  luai_run_scheduler (luai_state);
+  return success;
+}
+
+bool luai_load_script (const char *script_path)
+{
+  characteristic_set_read_function (luai_read_characteristic);
+  if (!init_lua_state (&luai_state, script_path, NULL))
+  {
+    log_error ("Failed to open luafile");
+    return false;
+  }
+
+  return true;
+}
+
+bool luai_load_script_workers (const char *script_path, unsigned int worker_count)
+{
+  characteristic_set_read_function (luai_read_characteristic);
+  luai_workers = calloc (worker_count, sizeof (*luai_workers));
+  if (NULL == luai_workers)
+  {
+    return false;
+  }
+  luai_worker_count = worker_count;
+
+  //every copy of the script is loaded on this thread so devices are built and registered here
+  for (unsigned int i = 0; i < worker_count; i++)
+  {
+    luai_worker_t *worker = &luai_workers[i];
+    worker->index = i;
+    atomic_init (&worker->busy, false);
+    atomic_init (&worker->quit, false);
+    atomic_init (&worker->waiting, false);
+    event_queue_init (&worker->events);
+    if (!update_queue_init (&worker->queue, LUAI_WORKER_QUEUE_CAPACITY))
     {
-      uint32_t val = (uint32_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (uint32_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (uint32_t);
-      memcpy (*data, &val, sizeof(uint32_t));
+      return false;
     }
-      break;
-    case BLE_INT64:
+
+    if (!init_lua_state (&worker->lua_state, script_path, worker))
     {
-      int64_t val = (int64_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (int64_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (int64_t);
-      memcpy (*data, &val, sizeof(int64_t));
+      log_error ("Failed to open luafile for worker %u", i + 1);
+      return false;
     }
-      break;
-    case BLE_UINT64:
+  }
+
+  for (unsigned int i = 0; i < worker_count; i++)
+  {
+    luai_worker_t *worker = &luai_workers[i];
+    if (sem_init (&worker->wake, 0, 0) != 0)
     {
-      uint64_t val = (uint64_t) lua_tointeger (lua_state, index);
-      *data = malloc (sizeof (uint64_t));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (uint64_t);
-      memcpy (*data, &val, sizeof(uint64_t));
+      return false;
     }
-      break;
-    case BLE_FLOAT:
+    if (sem_init (&worker->room, 0, 0) != 0)
     {
-      float val = (float) lua_tonumber (lua_state, index);
-      *data = malloc (sizeof (float));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (float);
-      memcpy (*data, &val, sizeof(float));
+      sem_destroy (&worker->wake);
+      return false;
     }
-      break;
-    case BLE_DOUBLE:
+    if (pthread_create (&worker->thread, NULL, luai_worker_run, worker) != 0)
     {
-      double val = (double) lua_tonumber (lua_state, index);
-      *data = malloc (sizeof (double));
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = sizeof (double);
-      memcpy (*data, &val, sizeof(double));
-    }
-      break;
-    default:
-      luaL_argerror(lua_state, index, "Argument type must match specified data type");
+      sem_destroy (&worker->wake);
+      sem_destroy (&worker->room);
+      log_error ("Could not start worker %u", i + 1);
       return false;
-      break;
+    }
+    worker->started = true;
   }
+
+  log_info ("Running Update on %u workers", worker_count);
   return true;
 }
 
-static bool luai_lua_data_arg_to_ble_data_type (
-  lua_State *lua_state,
-  int index,
-  ble_data_type_t type,
-  void **data,
-  size_t *data_size
-)
+//joins the workers and applies the values and frees they queued
+static void luai_stop_workers (void)
 {
-  int lua_arg_type = lua_type (lua_state, index);
-  switch (lua_arg_type)
+  for (unsigned int i = 0; i < luai_worker_count; i++)
   {
-    case LUA_TBOOLEAN: {
-      if (type != BLE_BOOL)
-      {
-        return false;
-      }
-      bool val = lua_toboolean(lua_state, index);
-      *data = malloc(sizeof (val));
-      if (*data == NULL)
+    luai_worker_t *worker = &luai_workers[i];
+    if (worker->started)
+    {
+      atomic_store (&worker->quit, true);
+      sem_post (&worker->wake);
+      while (atomic_load (&worker->busy)) //a worker waiting for room in its queue only finishes its Update once it is drained
       {
-        return false;
+        luai_drain_worker (worker);
+        sched_yield ();
       }
-      *data_size = sizeof (val);
-      memcpy (*data, &val, sizeof (val));
+      pthread_join (worker->thread, NULL);
+      sem_destroy (&worker->wake);
+      sem_destroy (&worker->room);
+      worker->started = false;
     }
-      break;
-    case LUA_TNUMBER: {
-      bool success = luai_lua_number_to_opc_ua_data_type(lua_state, index, type, data, data_size);
-      if (!success)
-      {
-        return false;
-      }
+  }
+
+  for (unsigned int i = 0; i < luai_worker_count; i++)
+  {
+    if (NULL != luai_workers[i].queue.entries)
+    {
+      update_queue_drain (&luai_workers[i].queue);
     }
-      break;
-    case LUA_TSTRING: {
-      const char *str = lua_tostring(lua_state, index);
-      if (str == NULL) {
-        return false;
-      }
-      *data = strdup(str);
-      if (*data == NULL)
-      {
-        return false;
-      }
-      *data_size = strlen(str);
+  }
+}
+
+static void luai_cleanup_workers (void)
+{
+  luai_stop_workers ();
+
+  for (unsigned int i = 0; i < luai_worker_count; i++)
+  {
+    luai_worker_t *worker = &luai_workers[i];
+    if (NULL != worker->lua_state)
+    {
+      luai_close_state (worker->lua_state);
     }
-    default:
-      return false;
+    update_queue_fini (&worker->queue);
+    event_queue_fini (&worker->events);
   }
 
-  return true;
+  free (luai_workers);
+  luai_workers = NULL;
+  luai_worker_count = 0;
 }
 
-static bool luai_get_array (lua_State *lua_state, int idx, ble_data_type_t type, void **array, size_t *array_size)
+static void luai_adopt_devices (void)
 {
-  size_t items = lua_rawlen (lua_state, idx);
-  if (items == 0)
+  for (device_t *device = registry_get_devices (); device; device = device->next)
   {
-    return false;
+    luai_adopt_device (device);
   }
+}
 
-  if (type == BLE_STRING)
+//loads the script again into fresh states. The devices the previous script registered keep running, a device the
+//new script registers with the same name and layout takes over the live device, one with a changed layout replaces it
+//and those it no longer registers or looks up are removed
+static bool luai_reload_script (const char *script_path)
+{
+  lua_State *check = luaL_newstate (); //a script that does not compile leaves the running one in place
+  if (NULL == check)
   {
-    luaL_argerror(lua_state, idx, "Argument type cannot be an array of strings");
     return false;
   }
-
-  size_t type_size = BLE_DATA_TYPE_SIZE[type];
-
-  void *buf = calloc(items,type_size);
-  if (buf == NULL)
+  if (script_cache_loadfile (check, script_path))
   {
+    lua_fail (check);
+    log_error ("Not reloading %s", script_path);
+    lua_close (check);
     return false;
   }
+  lua_close (check);
 
-  for (size_t i = 1; i <= items; i++)
+  //the names are copied before anything is stopped so a failed copy leaves the running script in place, a NULL name
+  //would read as one the new script claimed
+  unsigned int device_count = 0;
+  char **device_names = calloc (registry_get_device_count () + 1, sizeof (*device_names));
+  if (NULL == device_names)
   {
-    lua_pushinteger (lua_state, i); //push index on to stack for gettable function
-    lua_gettable (lua_state, idx);
-
-    if (lua_isnil(lua_state, -1)) //is value null then we need to fix the size of the array
-    {
-      items = i - 1;
-      break;
-    }
-
-    if (lua_istable(lua_state, -1))
+    log_error ("Not reloading %s, could not allocate the device list", script_path);
+    return false;
+  }
+  for (device_t *device = registry_get_devices (); device; device = device->next)
+  {
+    if (device->scripted && NULL == (device_names[device_count++] = strdup (device->device_name)))
     {
-      luaL_argerror(lua_state, idx, "Argument type cannot be an array of arrays");
-      free (buf);
+      for (unsigned int i = 0; i < device_count; i++)
+      {
+        free (device_names[i]);
+      }
+      free (device_names);
+      log_error ("Not reloading %s, could not copy the device names", script_path);
       return false;
     }
+  }
 
-    void *item_data = NULL;
-    size_t item_size = 0;
-    bool success = luai_lua_data_arg_to_ble_data_type (lua_state, -1, type, &item_data, &item_size);
-    if (!success || item_size != type_size)
+  log_info ("Reloading %s", script_path);
+  unsigned int worker_count = luai_worker_count;
+  luai_stop_workers ();
+  luai_adopt_devices ();
+  luai_cleanup ();
+
+  luai_reload.active = true;
+  luai_reload.device_names = device_names;
+  luai_reload.device_count = device_count;
+  luai_reload.kept = 0;
+  luai_reload.replaced = 0;
+  bool success = worker_count ? luai_load_script_workers (script_path, worker_count) : luai_load_script (script_path);
+  luai_reload.active = false;
+
+  unsigned int removed = 0;
+  for (unsigned int i = 0; i < device_count; i++)
+  {
+    if (success && NULL != device_names[i])
     {
-      free (buf);
-      return false;
+      luai_remove_registered_device (device_names[i]);
+      removed++;
     }
+    free (device_names[i]);
+  }
+  free (device_names);
+  luai_reload.device_names = NULL;
+  luai_reload.device_count = 0;
 
-    uint8_t *buf_offset = buf + ((i - 1) * type_size);
-    memcpy (buf_offset, item_data, type_size); //equivalent to buf[i - 1] = item_data;
-    free (item_data);
-
-    lua_pop(lua_state, 1); //pops one value off the top
+  if (!success)
+  {
+    //what the new script registered before it failed stays with the rest of the devices
+    luai_adopt_devices ();
+    luai_cleanup ();
+    log_error ("Reloading %s failed, the devices keep running without a script until the next reload", script_path);
+    return false;
   }
 
-  *array = buf;
-  *array_size = items * type_size;
+  log_info (
+    "Reloaded %s - %u devices kept, %u registered again, %u removed",
+    script_path,
+    luai_reload.kept,
+    luai_reload.replaced,
+    removed
+  );
   return true;
 }
 
-static int luai_characteristic_set_value (lua_State *lua_state)
+void luai_request_reload (void)
 {
-  luai_check_argument_count (lua_state, 3);
-  characteristic_t *characteristic = luai_check_argument_characteristic (lua_state, 1);
-  ble_data_type_t ble_type = luai_check_type_ble_data_type (lua_state, 3);
-  bool success = false;
-  void *data = NULL;
-  size_t data_size = 0;
+  luai_reload_requested = 1;
+}
 
-  if (lua_istable(lua_state,2))
+void luai_reload_poll (const char *script_path)
+{
+  if (!luai_reload_requested)
   {
-    success = luai_get_array (lua_state, 2, ble_type, &data, &data_size);
+    return;
   }
-  else
+
+  luai_reload_requested = 0;
+  if (NULL == script_path)
   {
-    success = luai_lua_data_arg_to_ble_data_type (lua_state, 2, ble_type, &data, &data_size);
+    log_warn ("No script to reload");
+    return;
   }
+  luai_reload_script (script_path);
+}
 
-  if (success)
+void luai_set_restored (bool restored)
+{
+  luai_restored = restored;
+}
+
+size_t luai_get_handle_size (void)
+{
+  return sizeof (luai_object_t);
+}
+
+void luai_set_memory_limit (size_t limit)
+{
+  luai_memory_limit = limit;
+}
+
+void luai_set_budget (unsigned int time_ms, uint64_t instructions)
+{
+  luai_time_budget_us = (uint64_t) time_ms * 1000;
+  luai_instruction_budget = instructions;
+}
+
+#ifdef USE_LUAJIT
+bool luai_ffi_set_value (void *characteristic, const void *data, uint32_t size)
+{
+  luai_object_t *handle = (luai_object_t *) characteristic;
+  if (NULL == handle || NULL == handle->object || (NULL == data && size) || size > FORMAT_MAX_SIZE)
+  {
+    return false;
+  }
+  if (device_skips_characteristic ((characteristic_t *) handle->object)) //like setValue, idle devices are left alone
   {
-    characteristic_update_value (characteristic, data, data_size, global_dbus_connection);
-    free (data);
+    return true;
   }
+  return luai_push_value ((characteristic_t *) handle->object, data, size);
+}
+#endif
 
-  lua_pushboolean (lua_state, success);
-  return 1;
+void luai_set_seed (uint64_t seed)
+{
+  luai_seeded = true;
+  luai_seed = seed;
 }
 
-static int luai_descriptor_free (lua_State *lua_state)
+void luai_set_profile (const char *path)
 {
-  descriptor_t *descriptor = luai_check_argument_descriptor (lua_state, 1);
-  descriptor_fini (descriptor);
-  return 0;
+  luai_profile_path = path;
 }
 
-bool luai_call_update ()
+bool luai_write_profile (void)
 {
-  if (NULL == luai_state)
+  if (NULL == luai_profile_path)
   {
-    log_debug ("Lua state was NULL");
-    return false;
+    return true;
   }
 
-  return luai_call_function (luai_state, LUA_API_FUNCTION_UPDATE);
+  bool success = profile_write (&luai_profile, luai_profile_path);
+  profile_fini (&luai_profile);
+  return success;
 }
 
-bool luai_load_script (const char *script_path)
+void luai_collect_garbage (void)
 {
-  if (!init_lua_state (&luai_state, script_path))
+  if (NULL != luai_state)
   {
-    log_error ("Failed to open luafile");
-    return false;
+    luai_step_garbage_collector (luai_state);
   }
+}
 
-  return true;
+static void luai_add_heap_stats (lua_State *lua_state, luai_heap_stats_t *stats)
+{
+  const luai_gc_t *gc = &luai_get_context (lua_state)->gc;
+  stats->heap_bytes += atomic_load (&gc->heap_bytes);
+  stats->peak_bytes += atomic_load (&gc->peak_bytes);
+  stats->failed_allocations += atomic_load (&gc->failed_allocations);
+  stats->gc_cycles += atomic_load (&gc->cycles);
+  stats->gc_total_us += atomic_load (&gc->total_us);
+  uint64_t max_us = atomic_load (&gc->max_us);
+  if (max_us > stats->gc_max_us)
+  {
+    stats->gc_max_us = max_us;
+  }
+}
+
+void luai_get_heap_stats (luai_heap_stats_t *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+  stats->limit_bytes = luai_memory_limit;
+  for (unsigned int i = 0; i < luai_worker_count; i++)
+  {
+    if (NULL != luai_workers[i].lua_state)
+    {
+      luai_add_heap_stats (luai_workers[i].lua_state, stats);
+    }
+  }
+
+  if (NULL != luai_state)
+  {
+    luai_add_heap_stats (luai_state, stats);
+  }
+}
+
+size_t luai_get_memory_usage (void)
+{
+  luai_heap_stats_t stats;
+  luai_get_heap_stats (&stats);
+  return stats.heap_bytes;
 }
 
 void luai_cleanup (void)
 {
+  characteristic_set_read_function (NULL);
+  luai_cleanup_workers ();
+
   if (NULL != luai_state)
   {
-    lua_close (luai_state);
+    luai_close_state (luai_state);
+    luai_state = NULL;
   }
 }
@@ -9,15 +9,127 @@
 #define BLE_SIM_LUA_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#include "lua5.3/lua.h"
-#include "lua5.3/lauxlib.h"
-#include "lua5.3/lualib.h"
+#include "lua_compat.h"
+
+typedef struct luai_heap_stats_t
+{
+  size_t heap_bytes; //bytes allocated by the lua states
+  size_t peak_bytes; //sum of the largest heap of each state
+  size_t limit_bytes; //cap on the heap of each state, 0 if there is none
+  uint64_t failed_allocations; //allocations refused by the cap
+  uint64_t gc_cycles; //collection cycles finished between ticks
+  uint64_t gc_total_us; //time spent collecting between ticks
+  uint64_t gc_max_us; //longest collection pause
+} luai_heap_stats_t;
 
 bool luai_load_script (const char *script_path);
 
+/**
+ * Loads a copy of the script into one lua state per worker and starts the workers.
+ * Each copy sees ble.worker = {index, count} so it can build its share of the devices, Update is then
+ * run on every worker in parallel and value writes are applied on the dbus thread
+ * @param script_path path to the script
+ * @param worker_count number of workers
+ * @return success true/false
+ **/
+bool luai_load_script_workers (const char *script_path, unsigned int worker_count);
+
 void luai_cleanup (void);
 
 bool luai_call_update (void);
 
+/**
+ * Sets ble.restored for scripts loaded afterwards so they can skip building devices restored from a snapshot
+ * @param restored if devices were restored
+ **/
+void luai_set_restored (bool restored);
+
+/**
+ * Asks for the script to be reloaded on the next luai_reload_poll, safe to call from a signal handler
+ **/
+void luai_request_reload (void);
+
+/**
+ * Reloads the script if a reload was asked for. The new script is loaded into fresh lua states and sees
+ * ble.reloaded = true. Devices the previous script registered keep their controllers and registrations: a
+ * device the new script registers with the same name and GATT layout takes over the live device - values,
+ * callbacks and generators - and one with a changed layout replaces it. Devices it no longer registers or
+ * looks up with ble.getDevice are removed. A script that does not compile leaves the running one in place
+ * @param script_path path to the script
+ **/
+void luai_reload_poll (const char *script_path);
+
+/**
+ * Caps the heap of lua states created afterwards, allocations over the cap raise a memory error in the script
+ * @param limit the cap in bytes, 0 for none
+ **/
+void luai_set_memory_limit (size_t limit);
+
+/**
+ * Sets the budget of each call into lua states created afterwards - Update, callbacks and coroutine resumes.
+ * A call over budget is aborted with an error, an Update function or the callbacks of an object that
+ * overrun several calls in a row are quarantined and no longer called until the script is reloaded
+ * @param time_ms wall time budget in milliseconds, 0 for none
+ * @param instructions instruction budget, 0 for none
+ **/
+void luai_set_budget (unsigned int time_ms, uint64_t instructions);
+
+#ifdef USE_LUAJIT
+/**
+ * FFI entry point for setValue, declared to scripts with
+ * ffi.cdef "bool luai_ffi_set_value (void *characteristic, const void *data, uint32_t size);"
+ * The value is set as raw bytes without checking the arguments through the lua API, from a worker Update
+ * it is queued like setValue. Exported from the executable so ffi.C finds it
+ * @param characteristic a characteristic handle (the userdata itself), passing any other object is undefined
+ * @param data the value
+ * @param size bytes in the value, at most 512
+ * @return success true/false - false if the handle was released or the value could not be queued
+ **/
+bool luai_ffi_set_value (void *characteristic, const void *data, uint32_t size);
+#endif
+
+/**
+ * Seeds lua states created afterwards, math.random and math.randomseed are replaced by a sequence derived from
+ * the seed and the worker index so the same script draws the same numbers on every run
+ * @param seed the seed
+ **/
+void luai_set_seed (uint64_t seed);
+
+/**
+ * Profiles lua states created afterwards. A count hook samples the lua stack of calls into the script and
+ * the API functions are wrapped to time them, the time of each stack is kept in microseconds
+ * @param path the collapsed stack file written by luai_write_profile, NULL to not profile
+ **/
+void luai_set_profile (const char *path);
+
+/**
+ * Writes the stacks sampled in the lua states closed so far, call after luai_cleanup
+ * @return success true/false, true if there is no profile
+ **/
+bool luai_write_profile (void);
+
+/**
+ * Runs incremental collection steps on the lua state in the idle time after a tick. Worker states
+ * collect on their own threads after their Update
+ **/
+void luai_collect_garbage (void);
+
+/**
+ * @param stats receives the heap and collection stats of every lua state
+ **/
+void luai_get_heap_stats (luai_heap_stats_t *stats);
+
+/**
+ * @return the size of the userdata handle lua holds for each object in bytes
+ **/
+size_t luai_get_handle_size (void);
+
+/**
+ * @return the number of bytes in use by the lua state, 0 if no script is loaded
+ **/
+size_t luai_get_memory_usage (void);
+
 #endif //BLE_SIM_LUA_H
@@ -6,7 +6,10 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <math.h>
 
 #include <unistd.h>
 #include <string.h>
@@ -23,13 +26,27 @@
 #include "service.h"
 #include "characteristic.h"
 #include "descriptor.h"
+#include "registry.h"
+#include "objpath.h"
+#include "memstats.h"
+#include "snapshot.h"
+#include "script_cache.h"
+#include "events.h"
+#include "generator.h"
+#include "simclock.h"
 #include "logger.h"
 
 DBusConnection *global_dbus_connection;
 char *default_adapter = NULL;
 char *script_path = NULL;
+static bool dry_run = false;
+static char *snapshot_path = NULL;
+static unsigned int worker_count = 0;
+static unsigned int lua_time_budget_ms = SIM_DEFAULT_LUA_TIME_BUDGET_MS;
+static unsigned long long lua_instruction_budget = 0;
 
 pthread_t controller_mainloop_thread;
+static bool controller_mainloop_started = false;
 
 struct vhci *default_controller = NULL;
 
@@ -48,6 +65,7 @@ static DBusHandlerResult filter_message (DBusConnection *connection, DBusMessage
           dbus_message_get_error_name (message) : ""
   );
 
+  device_handle_remote_properties_changed (message);
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
@@ -68,6 +86,9 @@ static bool dbus_init (void)
     return false;
   }
 
+  //remote device connections for the onConnect/onDisconnect callbacks
+  dbus_bus_add_match (global_dbus_connection, BLUEZ_DEVICE_PROPERTIES_CHANGED_MATCH, NULL);
+
   return true;
 }
 
@@ -87,6 +108,17 @@ static void print_usage (const char *filename)
   fprintf (stdout, "Usage: %s\n", filename);
   fprintf (stdout, "          [--script script_path]\n");
   fprintf (stdout, "          [--logging {None|Info|Error|Warn|Debug|Trace}]\n");
+  fprintf (stdout, "          [--dry-run]\n");
+  fprintf (stdout, "          [--snapshot snapshot_path]\n");
+  fprintf (stdout, "          [--workers count]\n");
+  fprintf (stdout, "          [--lua-memory-limit megabytes]\n");
+  fprintf (stdout, "          [--lua-time-budget milliseconds]\n");
+  fprintf (stdout, "          [--lua-instruction-budget count]\n");
+  fprintf (stdout, "          [--script-cache directory]\n");
+  fprintf (stdout, "          [--profile profile_path]\n");
+  fprintf (stdout, "          [--time-scale factor]\n");
+  fprintf (stdout, "          [--seed seed]\n");
+  fprintf (stdout, "          [--skip-idle]\n");
   fprintf (stdout, "          [--help]\n");
 }
 
@@ -99,6 +131,41 @@ static void print_help (const char *filename)
            "--logging level:\n"
            "    level - Sets the logging level, can be one of {None|Info|Error|Warn|Debug|Trace} (case insensitive).\n"
            "    By default logging is set to level 'Warn'\n\n"
+           "--dry-run:\n"
+           "    Builds the devices from the script without dbus or bluez, prints an estimate of the memory\n"
+           "    footprint of every device and attribute and exits\n\n"
+           "--snapshot snapshot_path:\n"
+           "    snapshot_path - Path to a device snapshot. If it exists the devices are restored from it before\n"
+           "    the script is loaded (ble.restored is true), a new snapshot is written to it on shutdown\n\n"
+           "--workers count:\n"
+           "    count - Loads a copy of the script per worker and runs their Update functions in parallel.\n"
+           "    Each copy sees ble.worker = {index, count} and should build its share of the devices\n\n"
+           "--lua-memory-limit megabytes:\n"
+           "    megabytes - Caps the heap of each Lua state, allocations over the cap raise a memory error in the script\n\n"
+           "--lua-time-budget milliseconds:\n"
+           "    milliseconds - Wall time each call into the script (Update, a callback or a coroutine resume) may take\n"
+           "    before it is aborted, by default there is no limit\n\n"
+           "--lua-instruction-budget count:\n"
+           "    count - Lua instructions each call into the script may run before it is aborted, by default there is no limit.\n"
+           "    An Update function or the callbacks of an object that overrun 3 times in a row are quarantined until the\n"
+           "    script is reloaded\n\n"
+           "--script-cache directory:\n"
+           "    directory - Caches the compiled script and the modules it requires in the directory, later runs load\n"
+           "    the bytecode instead of parsing sources that have not changed\n\n"
+           "--profile profile_path:\n"
+           "    profile_path - Samples the Lua stacks of calls into the script and the API functions they call, the time\n"
+           "    of each stack in microseconds is written to the file in the collapsed stack format on shutdown\n\n"
+           "--time-scale factor:\n"
+           "    factor - How many times faster than real time the simulation clock runs (ble.now, Update(dt), ble.sleep,\n"
+           "    generators and read caches), 0.5 runs at half speed. By default the factor is 1\n\n"
+           "--seed seed:\n"
+           "    seed - Makes the run replayable: math.random and generators without a seed draw from sequences derived\n"
+           "    from the seed and the simulation clock advances by a fixed step every tick instead of following real time\n\n"
+           "--skip-idle:\n"
+           "    Generators, setValue and setValues skip the characteristics of devices no central is connected or\n"
+           "    subscribed to (device:isActive () is false), a device is brought up to date once a central connects\n\n"
+           "Sending SIGUSR1 to a running simulator prints an estimate of the memory footprint of every device,\n"
+           "sending SIGUSR2 writes a snapshot and SIGHUP reloads the script\n\n"
            );
 }
 
@@ -124,6 +191,150 @@ static bool parse_args (int argc, char *argv[])
       i++;
       script_path = argv[i];
     }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_SNAPSHOT) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      snapshot_path = argv[i];
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_WORKERS) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      unsigned long count = strtoul (argv[i], &end, 10);
+      if (end == argv[i] || *end != '\0' || count == 0 || count > SIM_MAX_WORKERS)
+      {
+        log_error ("Worker count must be between 1 and %d", SIM_MAX_WORKERS);
+        return false;
+      }
+      worker_count = (unsigned int) count;
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_LUA_MEMORY_LIMIT) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      unsigned long megabytes = strtoul (argv[i], &end, 10);
+      if (end == argv[i] || *end != '\0' || megabytes == 0 || megabytes > SIM_MAX_LUA_MEMORY_LIMIT_MB)
+      {
+        log_error ("Lua memory limit must be between 1 and %d megabytes", SIM_MAX_LUA_MEMORY_LIMIT_MB);
+        return false;
+      }
+      luai_set_memory_limit ((size_t) megabytes << 20);
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_SCRIPT_CACHE) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      if (!script_cache_set_directory (argv[i]))
+      {
+        return false;
+      }
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_PROFILE) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      luai_set_profile (argv[i]);
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_TIME_SCALE) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      double scale = strtod (argv[i], &end);
+      if (end == argv[i] || *end != '\0' || !isfinite (scale) || scale <= 0 || scale > SIM_MAX_TIME_SCALE)
+      {
+        log_error ("Time scale must be greater than 0 and at most %g", SIM_MAX_TIME_SCALE);
+        return false;
+      }
+      simclock_set_scale (scale);
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_SEED) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      unsigned long long seed = strtoull (argv[i], &end, 0);
+      if (end == argv[i] || *end != '\0')
+      {
+        log_error ("Invalid seed '%s'", argv[i]);
+        return false;
+      }
+      luai_set_seed ((uint64_t) seed);
+      generator_set_seed ((uint64_t) seed);
+      simclock_set_deterministic (true);
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_LUA_TIME_BUDGET) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      unsigned long milliseconds = strtoul (argv[i], &end, 10);
+      if (end == argv[i] || *end != '\0' || milliseconds > UINT_MAX)
+      {
+        log_error ("Invalid Lua time budget '%s'", argv[i]);
+        return false;
+      }
+      lua_time_budget_ms = (unsigned int) milliseconds;
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_LUA_INSTRUCTION_BUDGET) == 0)
+    {
+      if (i == argc - 1)
+      {
+        print_usage (filename);
+        return false;
+      }
+      i++;
+      char *end = NULL;
+      lua_instruction_budget = strtoull (argv[i], &end, 10);
+      if (end == argv[i] || *end != '\0')
+      {
+        log_error ("Invalid Lua instruction budget '%s'", argv[i]);
+        return false;
+      }
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_DRY_RUN) == 0)
+    {
+      dry_run = true;
+    }
+    else if (strcmp (argv[i], SIM_ARGS_OPTION_SKIP_IDLE) == 0)
+    {
+      device_set_skip_idle (true);
+    }
     else if (strcmp (argv[i], SIM_ARGS_OPTION_HELP) == 0)
     {
       print_help (filename);
@@ -149,12 +360,21 @@ static bool parse_args (int argc, char *argv[])
       return false;
     }
   }
+
+  luai_set_budget (lua_time_budget_ms, (uint64_t) lua_instruction_budget);
   return true;
 }
 
 static void update (void *user_data)
 {
+  uint64_t now = simclock_tick (); //every part of the tick sees the same time
+  memstats_poll ();
+  snapshot_poll (snapshot_path);
+  luai_reload_poll (script_path);
   luai_call_update ();
+  generator_run (now);
+  characteristic_send_notifications (global_dbus_connection);
+  luai_collect_garbage (); //in the time left before the next tick
 }
 
 static void *controller_mainloop_runner(void* data)
@@ -165,11 +385,20 @@ static void *controller_mainloop_runner(void* data)
 
 static void cleanup_simulator (void)
 {
+  device_remove_all ();
   dbus_cleanup ();
   luai_cleanup ();
-  pthread_cancel (controller_mainloop_thread);
-  pthread_join (controller_mainloop_thread, NULL);
-  mainloop_quit();
+  luai_write_profile ();
+  events_fini ();
+  generator_fini ();
+  registry_fini ();
+  objpath_fini ();
+  if (controller_mainloop_started)
+  {
+    pthread_cancel (controller_mainloop_thread);
+    pthread_join (controller_mainloop_thread, NULL);
+    mainloop_quit();
+  }
 }
 
 static void stop_simulator (int a)
@@ -178,6 +407,21 @@ static void stop_simulator (int a)
   dbusutils_mainloop_running = false;
 }
 
+static void request_memory_report (int a)
+{
+  memstats_request_report ();
+}
+
+static void request_snapshot (int a)
+{
+  snapshot_request_save ();
+}
+
+static void request_reload (int a)
+{
+  luai_request_reload ();
+}
+
 static void exit_simulator (int status)
 {
   cleanup_simulator();
@@ -206,6 +450,15 @@ static bool power_default_controller(void)
   return true;
 }
 
+static bool load_script (void)
+{
+  if (NULL == script_path)
+  {
+    return false;
+  }
+  return worker_count ? luai_load_script_workers (script_path, worker_count) : luai_load_script (script_path);
+}
+
 int main (int argc, char *argv[])
 {
   setbuf(stdout, NULL); 
@@ -214,6 +467,18 @@ int main (int argc, char *argv[])
   {
     return 1;
   }
+  simclock_start ();
+
+  if (dry_run)
+  {
+    if (!load_script ())
+    {
+      exit_simulator (1);
+    }
+    memstats_report (stdout, true);
+    cleanup_simulator ();
+    return 0;
+  }
 
   if (dbus_init () == false)
   {
@@ -224,6 +489,7 @@ int main (int argc, char *argv[])
   //bluez mainloop for controllers to run on
   mainloop_init();
   pthread_create (&controller_mainloop_thread, NULL, controller_mainloop_runner, NULL);
+  controller_mainloop_started = true;
 
   log_info ("Starting simulator...");
 
@@ -242,7 +508,12 @@ int main (int argc, char *argv[])
     exit_simulator (1);
   }
 
-  if (NULL == script_path || !luai_load_script (script_path))
+  if (NULL != snapshot_path)
+  {
+    luai_set_restored (snapshot_restore (snapshot_path));
+  }
+
+  if (!load_script ())
   {
     exit_simulator(1);
   }
@@ -250,8 +521,16 @@ int main (int argc, char *argv[])
   signal (SIGINT, stop_simulator);
   signal (SIGQUIT, stop_simulator);
   signal (SIGTERM, stop_simulator);
+  signal (SIGUSR1, request_memory_report);
+  signal (SIGUSR2, request_snapshot);
+  signal (SIGHUP, request_reload);
 
   dbusutils_mainloop_run (global_dbus_connection, &update);
+  memstats_report (stdout, false);
+  if (NULL != snapshot_path)
+  {
+    snapshot_save (snapshot_path);
+  }
   cleanup_simulator ();
 
   return 0;
@@ -0,0 +1,270 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "memstats.h"
+#include "registry.h"
+#include "dbusutils.h"
+#include "lua_interface.h"
+#include "logger.h"
+
+static volatile sig_atomic_t report_requested = 0;
+
+static const char *memstats_category_names[] =
+  {
+    "structs",
+    "strings",
+    "values",
+    "paths",
+    "object_data",
+    "dbus",
+    "lua",
+    "vhci"
+  };
+
+static size_t memstats_string_size (const char *string)
+{
+  return (NULL == string) ? 0 : strlen (string) + 1;
+}
+
+//shared by every attribute - the path entry, object_data_t wrapper and libdbus tree entry of a registered object
+static void memstats_add_object (objpath_id_t path_id, int origin, memstats_t *stats)
+{
+  if (OBJPATH_NONE != path_id)
+  {
+    char path[OBJPATH_MAX_LENGTH];
+    objpath_format (path_id, path);
+    const char *segment = strrchr (path, '/');
+
+    stats->bytes[MEMSTATS_PATHS] += objpath_get_entry_size ();
+    stats->bytes[MEMSTATS_OBJECT_DATA] += dbusutils_get_object_data_size ();
+    stats->bytes[MEMSTATS_DBUS] += MEMSTATS_DBUS_OBJECT_ESTIMATE + memstats_string_size (segment ? segment + 1 : path);
+  }
+
+  if (ORIGIN_LUA == origin)
+  {
+    stats->bytes[MEMSTATS_LUA] += luai_get_handle_size ();
+  }
+}
+
+static void memstats_add_descriptor (const descriptor_t *descriptor, memstats_t *stats)
+{
+  stats->bytes[MEMSTATS_STRUCTS] += sizeof (*descriptor);
+  if (ORIGIN_SCHEMA != descriptor->origin)
+  {
+    stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (descriptor->uuid);
+  }
+  stats->bytes[MEMSTATS_VALUES] += descriptor->value_size;
+  memstats_add_object (descriptor->path_id, descriptor->origin, stats);
+  stats->attributes++;
+}
+
+static void memstats_add_characteristic (const characteristic_t *characteristic, memstats_t *stats)
+{
+  stats->bytes[MEMSTATS_STRUCTS] += sizeof (*characteristic);
+  if (ORIGIN_SCHEMA != characteristic->origin)
+  {
+    stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (characteristic->uuid);
+  }
+  stats->bytes[MEMSTATS_VALUES] += characteristic->value_size;
+  memstats_add_object (characteristic->path_id, characteristic->origin, stats);
+  stats->attributes++;
+}
+
+static void memstats_add_service (const service_t *service, memstats_t *stats)
+{
+  stats->bytes[MEMSTATS_STRUCTS] += sizeof (*service);
+  if (ORIGIN_SCHEMA != service->origin)
+  {
+    stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (service->uuid);
+  }
+  memstats_add_object (service->path_id, service->origin, stats);
+  stats->attributes++;
+}
+
+//the device itself and its advertisement, not its services
+static void memstats_add_device_only (const device_t *device, memstats_t *stats)
+{
+  stats->bytes[MEMSTATS_STRUCTS] += sizeof (*device);
+  stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (device->device_name);
+  stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (device->controller);
+  memstats_add_object (device->path_id, device->origin, stats);
+
+  const advertisement_t *advertisement = &device->advertisement;
+  if (OBJPATH_NONE != advertisement->path_id)
+  {
+    stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (advertisement->type);
+    stats->bytes[MEMSTATS_STRINGS] += memstats_string_size (advertisement->secondary_channel);
+    memstats_add_object (advertisement->path_id, ORIGIN_C, stats);
+  }
+
+  if (device->initialised)
+  {
+    stats->bytes[MEMSTATS_VHCI] += MEMSTATS_VHCI_ESTIMATE;
+  }
+}
+
+void memstats_add_device (const device_t *device, memstats_t *stats)
+{
+  memstats_add_device_only (device, stats);
+
+  for (const service_t *service = device->services; service; service = service->next)
+  {
+    memstats_add_service (service, stats);
+    for (const characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      memstats_add_characteristic (characteristic, stats);
+      for (const descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+      {
+        memstats_add_descriptor (descriptor, stats);
+      }
+    }
+  }
+}
+
+size_t memstats_get_total (const memstats_t *stats)
+{
+  size_t total = 0;
+  for (unsigned int i = 0; i < MEMSTATS_CATEGORY_COUNT; i++)
+  {
+    total += stats->bytes[i];
+  }
+  return total;
+}
+
+size_t memstats_get_estimated (const memstats_t *stats)
+{
+  size_t estimated = 0;
+  for (unsigned int i = 0; i < MEMSTATS_CATEGORY_COUNT; i++)
+  {
+    estimated += memstats_is_estimate ((memstats_category_t) i) ? stats->bytes[i] : 0;
+  }
+  return estimated;
+}
+
+bool memstats_is_estimate (memstats_category_t category)
+{
+  return category == MEMSTATS_DBUS || category == MEMSTATS_VHCI;
+}
+
+const char *memstats_get_category_name (memstats_category_t category)
+{
+  return (category < MEMSTATS_CATEGORY_COUNT) ? memstats_category_names[category] : "unknown";
+}
+
+static void memstats_write_categories (FILE *stream, const char *indent, const memstats_t *stats)
+{
+  fprintf (stream, "%s", indent);
+  for (unsigned int i = 0; i < MEMSTATS_CATEGORY_COUNT; i++)
+  {
+    fprintf (stream, "%s%s %s%zu", i ? ", " : "", memstats_category_names[i], memstats_is_estimate ((memstats_category_t) i) ? "~" : "",
+             stats->bytes[i]);
+  }
+  fprintf (stream, "\n");
+}
+
+static void memstats_write_attribute (FILE *stream, const char *indent, const char *kind, const char *uuid, objpath_id_t path_id, const memstats_t *stats)
+{
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (path_id, path);
+  fprintf (stream, "%s%s %s %s: ~%zu bytes\n", indent, kind, uuid, path, memstats_get_total (stats));
+}
+
+static void memstats_write_device_attributes (FILE *stream, const device_t *device)
+{
+  memstats_t stats;
+
+  for (const service_t *service = device->services; service; service = service->next)
+  {
+    memset (&stats, 0, sizeof (stats));
+    memstats_add_service (service, &stats);
+    memstats_write_attribute (stream, "    ", "service", service->uuid, service->path_id, &stats);
+
+    for (const characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+    {
+      memset (&stats, 0, sizeof (stats));
+      memstats_add_characteristic (characteristic, &stats);
+      memstats_write_attribute (stream, "      ", "characteristic", characteristic->uuid, characteristic->path_id, &stats);
+
+      for (const descriptor_t *descriptor = characteristic->descriptors; descriptor; descriptor = descriptor->next)
+      {
+        memset (&stats, 0, sizeof (stats));
+        memstats_add_descriptor (descriptor, &stats);
+        memstats_write_attribute (stream, "        ", "descriptor", descriptor->uuid, descriptor->path_id, &stats);
+      }
+    }
+  }
+}
+
+void memstats_report (FILE *stream, bool per_attribute)
+{
+  memstats_t total;
+  memset (&total, 0, sizeof (total));
+
+  unsigned int device_count = registry_get_device_count ();
+  fprintf (stream, "Estimated memory footprint of %u device(s), computed from requested sizes without allocator overhead,\n"
+                   "categories marked ~ are fixed per object estimates:\n", device_count);
+
+  for (const device_t *device = registry_get_devices (); device; device = device->next)
+  {
+    memstats_t stats;
+    memset (&stats, 0, sizeof (stats));
+    memstats_add_device (device, &stats);
+
+    char path[OBJPATH_MAX_LENGTH];
+    objpath_format (device->path_id, path);
+    fprintf (stream, "  device %s %s: ~%zu bytes, %u attribute(s)\n", device->device_name, path, memstats_get_total (&stats), stats.attributes);
+    if (per_attribute)
+    {
+      memset (&stats, 0, sizeof (stats));
+      memstats_add_device_only (device, &stats);
+      fprintf (stream, "    device object: ~%zu bytes\n", memstats_get_total (&stats));
+      memstats_write_device_attributes (stream, device);
+    }
+
+    memstats_add_device (device, &total);
+  }
+
+  size_t total_bytes = memstats_get_total (&total);
+  size_t estimated_bytes = memstats_get_estimated (&total);
+  fprintf (stream, "Total: ~%zu bytes (%zu from sizes, %zu estimated), %u attribute(s)", total_bytes, total_bytes - estimated_bytes,
+           estimated_bytes, total.attributes);
+  if (device_count)
+  {
+    fprintf (stream, ", ~%zu bytes per device", total_bytes / device_count);
+  }
+  fprintf (stream, "\n");
+  memstats_write_categories (stream, "  ", &total);
+  fprintf (stream, "  registered dbus objects %u, path table %u entries, lua heap %zu bytes\n",
+           dbusutils_get_registered_object_count (), objpath_get_count (), luai_get_memory_usage ());
+
+  luai_heap_stats_t heap;
+  luai_get_heap_stats (&heap);
+  fprintf (stream, "  lua heap peak %zu bytes, limit %zu bytes per state, %" PRIu64 " failed allocations\n",
+           heap.peak_bytes, heap.limit_bytes, heap.failed_allocations);
+  fprintf (stream, "  lua gc %" PRIu64 " cycles, %" PRIu64 " us collecting, longest pause %" PRIu64 " us\n",
+           heap.gc_cycles, heap.gc_total_us, heap.gc_max_us);
+}
+
+void memstats_request_report (void)
+{
+  report_requested = 1;
+}
+
+void memstats_poll (void)
+{
+  if (!report_requested)
+  {
+    return;
+  }
+
+  report_requested = 0;
+  memstats_report (stdout, false);
+}
@@ -0,0 +1,96 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_MEMSTATS_H
+#define BLE_SIM_MEMSTATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "device.h"
+
+/**
+ * Estimated memory footprint of the simulated devices, tagged by subsystem. Nothing is measured at the
+ * allocator: structs, strings, values, path entries, object_data_t wrappers and lua handles are computed
+ * from the sizes the simulator requests, without allocator overhead. libdbus object tree entries and vhci
+ * controllers are opaque so those categories are fixed per object constants. The report labels both.
+ * An attribute is counted as registered once it has an object path, so a dry run reports what the tree
+ * would cost once it is on the bus.
+ **/
+
+#define MEMSTATS_DBUS_OBJECT_ESTIMATE 96 //libdbus DBusObjectSubtree + children array slot, excluding the path segment
+#define MEMSTATS_VHCI_ESTIMATE 4096 //vhci + btdev state per virtual controller
+
+typedef enum memstats_category_t
+{
+  MEMSTATS_STRUCTS = 0, //device, service, characteristic and descriptor structs
+  MEMSTATS_STRINGS, //heap strings: names, uuids and controller paths
+  MEMSTATS_VALUES, //characteristic and descriptor values
+  MEMSTATS_PATHS, //object path table entries
+  MEMSTATS_OBJECT_DATA, //object_data_t wrappers handed to libdbus
+  MEMSTATS_DBUS, //libdbus object tree entries (estimate)
+  MEMSTATS_LUA, //lua userdata handles
+  MEMSTATS_VHCI, //virtual controllers (estimate)
+  MEMSTATS_CATEGORY_COUNT
+} memstats_category_t;
+
+typedef struct memstats_t
+{
+  size_t bytes[MEMSTATS_CATEGORY_COUNT];
+  unsigned int attributes; //services, characteristics and descriptors counted
+} memstats_t;
+
+/**
+ * Adds a devices footprint, including its services, characteristics and descriptors, to stats
+ * @param device the device
+ * @param stats the stats to add to
+ **/
+void memstats_add_device (const device_t *device, memstats_t *stats);
+
+/**
+ * @param stats the stats
+ * @return the total number of bytes over all categories
+ **/
+size_t memstats_get_total (const memstats_t *stats);
+
+/**
+ * @param stats the stats
+ * @return the number of bytes in the categories that are fixed per object constants
+ **/
+size_t memstats_get_estimated (const memstats_t *stats);
+
+/**
+ * @param category the category
+ * @return true if the category is a fixed per object constant rather than computed from sizes
+ **/
+bool memstats_is_estimate (memstats_category_t category);
+
+/**
+ * @param category the category
+ * @return the name of the category
+ **/
+const char *memstats_get_category_name (memstats_category_t category);
+
+/**
+ * Writes a footprint report of every registered device to a stream
+ * @param stream the stream to write to
+ * @param per_attribute if the footprint of every service, characteristic and descriptor is written too
+ **/
+void memstats_report (FILE *stream, bool per_attribute);
+
+/**
+ * Requests a report, safe to call from a signal handler. The report is written by memstats_poll
+ **/
+void memstats_request_report (void);
+
+/**
+ * Writes a report to stdout if one has been requested
+ **/
+void memstats_poll (void);
+
+#endif //BLE_SIM_MEMSTATS_H
@@ -0,0 +1,179 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "objpath.h"
+#include "defines.h"
+#include "utils.h"
+
+#define OBJPATH_MAX_DEPTH 8
+
+typedef struct objpath_entry_t
+{
+  void *object;
+  objpath_id_t parent;
+  uint32_t number;
+  uint8_t kind;
+  bool used;
+} objpath_entry_t;
+
+typedef struct objpath_kind_name_t
+{
+  const char *name;
+  size_t length;
+} objpath_kind_name_t;
+
+#define OBJPATH_KIND_NAME(name) { "/" name, sizeof (name) }
+
+static const objpath_kind_name_t objpath_kind_names[] =
+  {
+    OBJPATH_KIND_NAME (DEVICE_OBJECT_NAME),
+    OBJPATH_KIND_NAME (SERVICE_OBJECT_NAME),
+    OBJPATH_KIND_NAME (CHARACTERISTIC_OBJECT_NAME),
+    OBJPATH_KIND_NAME (DESCRIPTOR_OBJECT_NAME),
+    OBJPATH_KIND_NAME (ADVERTISEMENT_OBJECT_NAME),
+  };
+
+static objpath_entry_t *entries = NULL;
+static uint32_t entry_capacity = 0;
+static unsigned int entry_count = 0;
+static id_allocator_t entry_ids = {0, NULL, 0, 0};
+
+static objpath_entry_t *objpath_get_entry (objpath_id_t id)
+{
+  if (id >= entry_capacity || !entries[id].used)
+  {
+    return NULL;
+  }
+  return &entries[id];
+}
+
+objpath_id_t objpath_add (objpath_id_t parent, objpath_kind_t kind, uint32_t number, void *object)
+{
+  objpath_id_t id = id_allocator_acquire (&entry_ids);
+  if (id >= entry_capacity)
+  {
+    uint32_t capacity = entry_capacity ? entry_capacity * 2 : 64;
+    objpath_entry_t *grown = realloc (entries, capacity * sizeof (*entries));
+    if (NULL == grown)
+    {
+      id_allocator_release (&entry_ids, id);
+      return OBJPATH_NONE;
+    }
+    memset (grown + entry_capacity, 0, (capacity - entry_capacity) * sizeof (*entries));
+    entries = grown;
+    entry_capacity = capacity;
+  }
+
+  objpath_entry_t *entry = &entries[id];
+  entry->object = object;
+  entry->parent = parent;
+  entry->number = number;
+  entry->kind = (uint8_t) kind;
+  entry->used = true;
+  entry_count++;
+  return id;
+}
+
+void objpath_remove (objpath_id_t id)
+{
+  objpath_entry_t *entry = objpath_get_entry (id);
+  if (NULL == entry)
+  {
+    return;
+  }
+
+  memset (entry, 0, sizeof (*entry));
+  id_allocator_release (&entry_ids, id);
+  entry_count--;
+}
+
+static size_t objpath_format_number (uint32_t number, char *buffer)
+{
+  char digits[10];
+  size_t count = 0;
+  do
+  {
+    digits[count++] = (char) ('0' + number % 10);
+    number /= 10;
+  } while (number);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    buffer[i] = digits[count - i - 1];
+  }
+  return count;
+}
+
+size_t objpath_format (objpath_id_t id, char *buffer)
+{
+  const objpath_entry_t *chain[OBJPATH_MAX_DEPTH];
+  size_t depth = 0;
+
+  for (objpath_entry_t *entry = objpath_get_entry (id); entry && depth < OBJPATH_MAX_DEPTH; entry = objpath_get_entry (entry->parent))
+  {
+    chain[depth++] = entry;
+  }
+
+  size_t length = 0;
+  while (depth > 0)
+  {
+    const objpath_entry_t *entry = chain[--depth];
+    const objpath_kind_name_t *kind_name = &objpath_kind_names[entry->kind];
+    memcpy (buffer + length, kind_name->name, kind_name->length);
+    length += kind_name->length;
+    length += objpath_format_number (entry->number, buffer + length);
+  }
+  buffer[length] = '\0';
+
+  return length;
+}
+
+objpath_id_t objpath_get_parent (objpath_id_t id)
+{
+  objpath_entry_t *entry = objpath_get_entry (id);
+  return entry ? entry->parent : OBJPATH_NONE;
+}
+
+void *objpath_get_object (objpath_id_t id)
+{
+  objpath_entry_t *entry = objpath_get_entry (id);
+  return entry ? entry->object : NULL;
+}
+
+void objpath_iter_append (DBusMessageIter *iter, objpath_id_t id)
+{
+  char buffer[OBJPATH_MAX_LENGTH];
+  const char *path = buffer;
+  if (objpath_format (id, buffer) == 0)
+  {
+    path = ROOT_PATH;
+  }
+  dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH, &path);
+}
+
+unsigned int objpath_get_count (void)
+{
+  return entry_count;
+}
+
+size_t objpath_get_entry_size (void)
+{
+  return sizeof (objpath_entry_t);
+}
+
+void objpath_fini (void)
+{
+  free (entries);
+  entries = NULL;
+  entry_capacity = 0;
+  entry_count = 0;
+  id_allocator_fini (&entry_ids);
+  id_allocator_init (&entry_ids, 0);
+}
@@ -0,0 +1,95 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_OBJPATH_H
+#define BLE_SIM_OBJPATH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <dbus/dbus.h>
+
+/**
+ * Object paths are kept in a table of compact entries - parent index, object kind and number.
+ * Each path is stored once and children refer to their parent by index, the path string
+ * is only built (into a fixed width buffer) when dbus needs it.
+ **/
+
+#define OBJPATH_NONE UINT32_MAX
+#define OBJPATH_MAX_LENGTH 80 //enough for /dev<u32>/serv<u32>/char<u32>/desc<u32> and /dev<u32>/advrt<u32>
+
+typedef uint32_t objpath_id_t;
+
+typedef enum objpath_kind_t
+{
+  OBJPATH_KIND_DEVICE = 0,
+  OBJPATH_KIND_SERVICE,
+  OBJPATH_KIND_CHARACTERISTIC,
+  OBJPATH_KIND_DESCRIPTOR,
+  OBJPATH_KIND_ADVERTISEMENT,
+} objpath_kind_t;
+
+/**
+ * Adds a path to the table: parent path + "/" + kind name + number
+ * e.g parent = "/dev0", kind = OBJPATH_KIND_SERVICE, number = 1 is "/dev0/serv1"
+ * @param parent id of the parent path or OBJPATH_NONE for a root path
+ * @param kind the kind of object the path is for
+ * @param number the object's number
+ * @param object pointer to the object the path belongs to
+ * @return the path id or OBJPATH_NONE if the table could not grow
+ **/
+objpath_id_t objpath_add (objpath_id_t parent, objpath_kind_t kind, uint32_t number, void *object);
+
+/**
+ * Removes a path from the table, its id is reused by later paths
+ * @param id the path id, OBJPATH_NONE is ignored
+ **/
+void objpath_remove (objpath_id_t id);
+
+/**
+ * Writes the full path string into a buffer
+ * @param id the path id
+ * @param buffer buffer of at least OBJPATH_MAX_LENGTH bytes
+ * @return the length of the path, 0 if the id is invalid
+ **/
+size_t objpath_format (objpath_id_t id, char *buffer);
+
+/**
+ * @param id the path id
+ * @return the id of the path's parent or OBJPATH_NONE
+ **/
+objpath_id_t objpath_get_parent (objpath_id_t id);
+
+/**
+ * @param id the path id
+ * @return the object the path belongs to or NULL
+ **/
+void *objpath_get_object (objpath_id_t id);
+
+/**
+ * Appends a path to a dbus message iter as an object path
+ * @param iter the dbus message iter
+ * @param id the path id
+ **/
+void objpath_iter_append (DBusMessageIter *iter, objpath_id_t id);
+
+/**
+ * @return the number of paths in the table
+ **/
+unsigned int objpath_get_count (void);
+
+/**
+ * @return the size of one entry in the path table in bytes
+ **/
+size_t objpath_get_entry_size (void);
+
+/**
+ * Frees the path table
+ **/
+void objpath_fini (void);
+
+#endif //BLE_SIM_OBJPATH_H
@@ -0,0 +1,247 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <string.h>
+
+#include "pack.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#define PACK_SSE2
+#elif defined (__ARM_NEON) && defined (__aarch64__)
+#include <arm_neon.h>
+#define PACK_NEON
+#endif
+
+static inline uint16_t pack_swap16 (uint16_t value)
+{
+  return (uint16_t) ((value << 8) | (value >> 8));
+}
+
+static inline uint32_t pack_swap32 (uint32_t value)
+{
+  return ((value & 0x000000ffu) << 24) | ((value & 0x0000ff00u) << 8) |
+         ((value & 0x00ff0000u) >> 8) | ((value & 0xff000000u) >> 24);
+}
+
+static inline uint64_t pack_swap64 (uint64_t value)
+{
+  return ((uint64_t) pack_swap32 ((uint32_t) value) << 32) | pack_swap32 ((uint32_t) (value >> 32));
+}
+
+#if defined (PACK_SSE2)
+
+static inline __m128i pack_sse2_swap16 (__m128i v)
+{
+  return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+
+static inline __m128i pack_sse2_swap32 (__m128i v)
+{
+  v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+  v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+  return pack_sse2_swap16 (v);
+}
+
+static inline __m128i pack_sse2_swap64 (__m128i v)
+{
+  return pack_sse2_swap32 (_mm_shuffle_epi32 (v, _MM_SHUFFLE (2, 3, 0, 1)));
+}
+
+//low 32 bits of four int64
+static inline __m128i pack_sse2_narrow32 (const int64_t *values)
+{
+  __m128i a = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) values), _MM_SHUFFLE (2, 0, 2, 0));
+  __m128i b = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (values + 2)), _MM_SHUFFLE (2, 0, 2, 0));
+  return _mm_unpacklo_epi64 (a, b);
+}
+
+//low 16 bits of eight int64, sign extending first so the saturating pack truncates
+static inline __m128i pack_sse2_narrow16 (const int64_t *values)
+{
+  __m128i a = _mm_srai_epi32 (_mm_slli_epi32 (pack_sse2_narrow32 (values), 16), 16);
+  __m128i b = _mm_srai_epi32 (_mm_slli_epi32 (pack_sse2_narrow32 (values + 4), 16), 16);
+  return _mm_packs_epi32 (a, b);
+}
+
+//low 8 bits of sixteen int64
+static inline __m128i pack_sse2_narrow8 (const int64_t *values)
+{
+  __m128i a = _mm_srai_epi16 (_mm_slli_epi16 (pack_sse2_narrow16 (values), 8), 8);
+  __m128i b = _mm_srai_epi16 (_mm_slli_epi16 (pack_sse2_narrow16 (values + 8), 8), 8);
+  return _mm_packs_epi16 (a, b);
+}
+
+#elif defined (PACK_NEON)
+
+static inline int32x4_t pack_neon_narrow32 (const int64_t *values)
+{
+  return vcombine_s32 (vmovn_s64 (vld1q_s64 (values)), vmovn_s64 (vld1q_s64 (values + 2)));
+}
+
+static inline int16x8_t pack_neon_narrow16 (const int64_t *values)
+{
+  return vcombine_s16 (vmovn_s32 (pack_neon_narrow32 (values)), vmovn_s32 (pack_neon_narrow32 (values + 4)));
+}
+
+static inline int8x16_t pack_neon_narrow8 (const int64_t *values)
+{
+  return vcombine_s8 (vmovn_s16 (pack_neon_narrow16 (values)), vmovn_s16 (pack_neon_narrow16 (values + 8)));
+}
+
+#endif
+
+static void pack_integers8 (const int64_t *values, size_t count, uint8_t *out)
+{
+  size_t i = 0;
+#if defined (PACK_SSE2)
+  for (; i + 16 <= count; i += 16)
+  {
+    _mm_storeu_si128 ((__m128i *) (out + i), pack_sse2_narrow8 (values + i));
+  }
+#elif defined (PACK_NEON)
+  for (; i + 16 <= count; i += 16)
+  {
+    vst1q_s8 ((int8_t *) (out + i), pack_neon_narrow8 (values + i));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    out[i] = (uint8_t) values[i];
+  }
+}
+
+static void pack_integers16 (const int64_t *values, size_t count, bool swap, uint8_t *out)
+{
+  size_t i = 0;
+#if defined (PACK_SSE2)
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i v = pack_sse2_narrow16 (values + i);
+    _mm_storeu_si128 ((__m128i *) (out + i * 2), swap ? pack_sse2_swap16 (v) : v);
+  }
+#elif defined (PACK_NEON)
+  for (; i + 8 <= count; i += 8)
+  {
+    uint8x16_t v = vreinterpretq_u8_s16 (pack_neon_narrow16 (values + i));
+    vst1q_u8 (out + i * 2, swap ? vrev16q_u8 (v) : v);
+  }
+#endif
+  for (; i < count; i++)
+  {
+    uint16_t v = (uint16_t) values[i];
+    v = swap ? pack_swap16 (v) : v;
+    memcpy (out + i * 2, &v, sizeof (v));
+  }
+}
+
+static void pack_integers32 (const int64_t *values, size_t count, bool swap, uint8_t *out)
+{
+  size_t i = 0;
+#if defined (PACK_SSE2)
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i v = pack_sse2_narrow32 (values + i);
+    _mm_storeu_si128 ((__m128i *) (out + i * 4), swap ? pack_sse2_swap32 (v) : v);
+  }
+#elif defined (PACK_NEON)
+  for (; i + 4 <= count; i += 4)
+  {
+    uint8x16_t v = vreinterpretq_u8_s32 (pack_neon_narrow32 (values + i));
+    vst1q_u8 (out + i * 4, swap ? vrev32q_u8 (v) : v);
+  }
+#endif
+  for (; i < count; i++)
+  {
+    uint32_t v = (uint32_t) values[i];
+    v = swap ? pack_swap32 (v) : v;
+    memcpy (out + i * 4, &v, sizeof (v));
+  }
+}
+
+//copies 64 bit values, swapping each if asked
+static void pack_copy64 (const void *values, size_t count, bool swap, uint8_t *out)
+{
+  if (!swap)
+  {
+    memcpy (out, values, count * 8);
+    return;
+  }
+
+  const uint8_t *in = (const uint8_t *) values;
+  size_t i = 0;
+#if defined (PACK_SSE2)
+  for (; i + 2 <= count; i += 2)
+  {
+    _mm_storeu_si128 ((__m128i *) (out + i * 8), pack_sse2_swap64 (_mm_loadu_si128 ((const __m128i *) (in + i * 8))));
+  }
+#elif defined (PACK_NEON)
+  for (; i + 2 <= count; i += 2)
+  {
+    vst1q_u8 (out + i * 8, vrev64q_u8 (vld1q_u8 (in + i * 8)));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    uint64_t v;
+    memcpy (&v, in + i * 8, sizeof (v));
+    v = pack_swap64 (v);
+    memcpy (out + i * 8, &v, sizeof (v));
+  }
+}
+
+void pack_integers (const int64_t *values, size_t count, size_t width, bool swap, uint8_t *out)
+{
+  switch (width)
+  {
+    case 1:
+      pack_integers8 (values, count, out);
+      break;
+    case 2:
+      pack_integers16 (values, count, swap, out);
+      break;
+    case 4:
+      pack_integers32 (values, count, swap, out);
+      break;
+    default:
+      pack_copy64 (values, count, swap, out);
+      break;
+  }
+}
+
+void pack_floats (const double *values, size_t count, bool swap, uint8_t *out)
+{
+  size_t i = 0;
+#if defined (PACK_SSE2)
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 v = _mm_movelh_ps (_mm_cvtpd_ps (_mm_loadu_pd (values + i)), _mm_cvtpd_ps (_mm_loadu_pd (values + i + 2)));
+    __m128i bits = _mm_castps_si128 (v);
+    _mm_storeu_si128 ((__m128i *) (out + i * 4), swap ? pack_sse2_swap32 (bits) : bits);
+  }
+#elif defined (PACK_NEON)
+  for (; i + 4 <= count; i += 4)
+  {
+    float32x4_t v = vcombine_f32 (vcvt_f32_f64 (vld1q_f64 (values + i)), vcvt_f32_f64 (vld1q_f64 (values + i + 2)));
+    uint8x16_t bits = vreinterpretq_u8_f32 (v);
+    vst1q_u8 (out + i * 4, swap ? vrev32q_u8 (bits) : bits);
+  }
+#endif
+  for (; i < count; i++)
+  {
+    float f = (float) values[i];
+    uint32_t v;
+    memcpy (&v, &f, sizeof (v));
+    v = swap ? pack_swap32 (v) : v;
+    memcpy (out + i * 4, &v, sizeof (v));
+  }
+}
+
+void pack_doubles (const double *values, size_t count, bool swap, uint8_t *out)
+{
+  pack_copy64 (values, count, swap, out);
+}
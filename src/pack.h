@@ -0,0 +1,51 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_PACK_H
+#define BLE_SIM_PACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Bulk packing of numeric arrays into fixed width values e.g a waveform of int16 samples.
+ * Integers are truncated to the width of the value, reals are converted to float or copied as double,
+ * each value is optionally byte swapped. SSE2 and NEON kernels handle the bulk of the array, a scalar
+ * loop the remainder and other architectures.
+ * The source and destination must not overlap.
+ **/
+
+/**
+ * Packs integers
+ * @param values the integers
+ * @param count number of values
+ * @param width bytes per packed value - 1, 2, 4 or 8
+ * @param swap reverse the bytes of each packed value
+ * @param out receives count * width bytes
+ **/
+void pack_integers (const int64_t *values, size_t count, size_t width, bool swap, uint8_t *out);
+
+/**
+ * Packs reals as IEEE-754 single precision floats
+ * @param values the reals
+ * @param count number of values
+ * @param swap reverse the bytes of each packed value
+ * @param out receives count * 4 bytes
+ **/
+void pack_floats (const double *values, size_t count, bool swap, uint8_t *out);
+
+/**
+ * Packs reals as IEEE-754 double precision floats
+ * @param values the reals
+ * @param count number of values
+ * @param swap reverse the bytes of each packed value
+ * @param out receives count * 8 bytes
+ **/
+void pack_doubles (const double *values, size_t count, bool swap, uint8_t *out);
+
+#endif //BLE_SIM_PACK_H
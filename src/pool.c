@@ -0,0 +1,176 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_SLAB_HEADER POOL_CLASS_SIZE //keeps the blocks after the slab header aligned
+
+static bool pool_is_small (size_t size)
+{
+  return size <= POOL_SMALL_MAX;
+}
+
+static unsigned int pool_get_class (size_t size)
+{
+  return (unsigned int) ((size - 1) / POOL_CLASS_SIZE);
+}
+
+//carves a new slab into blocks of a size class
+static bool pool_add_slab (pool_t *pool, unsigned int size_class)
+{
+  pool_slab_t *slab = malloc (POOL_SLAB_SIZE);
+  if (NULL == slab)
+  {
+    return false;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->slab_bytes += POOL_SLAB_SIZE;
+
+  size_t block_size = (size_class + 1) * POOL_CLASS_SIZE;
+  uint8_t *start = (uint8_t *) slab + POOL_SLAB_HEADER;
+  size_t count = (POOL_SLAB_SIZE - POOL_SLAB_HEADER) / block_size;
+  for (size_t i = count; i > 0; i--) //pushed in reverse so blocks are handed out in address order
+  {
+    pool_block_t *block = (pool_block_t *) (start + (i - 1) * block_size);
+    block->next = pool->free_blocks[size_class];
+    pool->free_blocks[size_class] = block;
+  }
+  return true;
+}
+
+static void *pool_get_block (pool_t *pool, size_t size)
+{
+  if (!pool_is_small (size))
+  {
+    return malloc (size);
+  }
+
+  unsigned int size_class = pool_get_class (size);
+  if (NULL == pool->free_blocks[size_class] && !pool_add_slab (pool, size_class))
+  {
+    return NULL;
+  }
+  pool_block_t *block = pool->free_blocks[size_class];
+  pool->free_blocks[size_class] = block->next;
+  return block;
+}
+
+static void pool_put_block (pool_t *pool, void *ptr, size_t size)
+{
+  if (!pool_is_small (size))
+  {
+    free (ptr);
+    return;
+  }
+
+  unsigned int size_class = pool_get_class (size);
+  pool_block_t *block = (pool_block_t *) ptr;
+  block->next = pool->free_blocks[size_class];
+  pool->free_blocks[size_class] = block;
+}
+
+void pool_init (pool_t *pool, size_t limit)
+{
+  memset (pool, 0, sizeof (*pool));
+  pool->limit = limit;
+}
+
+void pool_fini (pool_t *pool)
+{
+  pool_slab_t *slab = pool->slabs;
+  while (slab)
+  {
+    pool_slab_t *next = slab->next;
+    free (slab);
+    slab = next;
+  }
+  memset (pool->free_blocks, 0, sizeof (pool->free_blocks));
+  pool->slabs = NULL;
+  pool->slab_bytes = 0;
+}
+
+void *pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  pool_t *pool = (pool_t *) ud;
+  if (NULL == ptr)
+  {
+    osize = 0; //holds the type of the object being created
+  }
+
+  if (nsize == 0)
+  {
+    if (NULL != ptr)
+    {
+      pool_put_block (pool, ptr, osize);
+      pool->used -= osize;
+    }
+    return NULL;
+  }
+
+  if (nsize > osize && pool->limit && pool->used - osize + nsize > pool->limit)
+  {
+    pool->failed++;
+    return NULL;
+  }
+
+  void *block = NULL;
+  if (NULL != ptr && pool_is_small (osize) && pool_is_small (nsize) && pool_get_class (osize) == pool_get_class (nsize))
+  {
+    block = ptr;
+  }
+  else if (NULL != ptr && !pool_is_small (osize) && !pool_is_small (nsize))
+  {
+    block = realloc (ptr, nsize);
+  }
+  else
+  {
+    block = pool_get_block (pool, nsize);
+    if (NULL != block && NULL != ptr)
+    {
+      memcpy (block, ptr, osize < nsize ? osize : nsize);
+      pool_put_block (pool, ptr, osize);
+    }
+  }
+
+  if (NULL == block)
+  {
+    if (nsize <= osize)
+    {
+      //lua expects shrinking to succeed and the old block is big enough. It is later freed into the
+      //free list of its new size, a malloc'd block that ends up there is not returned to the system
+      pool->used -= osize - nsize;
+      return ptr;
+    }
+    return NULL;
+  }
+
+  pool->used = pool->used - osize + nsize;
+  if (pool->used > pool->peak)
+  {
+    pool->peak = pool->used;
+  }
+  return block;
+}
+
+size_t pool_get_used (const pool_t *pool)
+{
+  return pool->used;
+}
+
+size_t pool_get_peak (const pool_t *pool)
+{
+  return pool->peak;
+}
+
+uint64_t pool_get_failed (const pool_t *pool)
+{
+  return pool->failed;
+}
@@ -0,0 +1,86 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_POOL_H
+#define BLE_SIM_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Allocator for a lua state (a lua_Alloc). Most lua objects - strings, tables, closures, userdata
+ * handles - are small, so blocks up to POOL_SMALL_MAX bytes are served from per size class free
+ * lists carved out of slabs, larger blocks go to malloc. The bytes lua has asked for are counted
+ * against an optional cap, allocations over it fail and lua runs an emergency collection before
+ * raising a memory error in the script.
+ * A pool is used by one thread at a time, slabs are only returned to the system by pool_fini.
+ **/
+
+#define POOL_CLASS_SIZE 16 //small blocks are rounded up to a multiple of this
+#define POOL_SMALL_MAX 256 //largest block served from the free lists
+#define POOL_CLASS_COUNT (POOL_SMALL_MAX / POOL_CLASS_SIZE)
+#define POOL_SLAB_SIZE 16384 //bytes allocated at a time for a size class
+
+typedef struct pool_block_t
+{
+  struct pool_block_t *next;
+} pool_block_t;
+
+typedef struct pool_slab_t
+{
+  struct pool_slab_t *next;
+} pool_slab_t;
+
+typedef struct pool_t
+{
+  pool_block_t *free_blocks[POOL_CLASS_COUNT];
+  pool_slab_t *slabs;
+  size_t limit; //cap on used, 0 for none
+  size_t used; //bytes allocated by lua, as requested
+  size_t peak; //largest used
+  size_t slab_bytes; //bytes held in slabs
+  uint64_t failed; //allocations refused by the cap
+} pool_t;
+
+/**
+ * Initialises a pool
+ * @param pool the pool
+ * @param limit cap on the bytes allocated from the pool, 0 for none
+ **/
+void pool_init (pool_t *pool, size_t limit);
+
+/**
+ * Frees the slabs of a pool, every block must have been freed (lua_close)
+ * @param pool the pool
+ **/
+void pool_fini (pool_t *pool);
+
+/**
+ * lua_Alloc for lua_newstate, ud is the pool
+ **/
+void *pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize);
+
+/**
+ * @param pool the pool
+ * @return the bytes allocated by lua
+ **/
+size_t pool_get_used (const pool_t *pool);
+
+/**
+ * @param pool the pool
+ * @return the largest number of bytes allocated by lua at once
+ **/
+size_t pool_get_peak (const pool_t *pool);
+
+/**
+ * @param pool the pool
+ * @return the number of allocations refused because they would have gone over the cap
+ **/
+uint64_t pool_get_failed (const pool_t *pool);
+
+#endif //BLE_SIM_POOL_H
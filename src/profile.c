@@ -0,0 +1,155 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "profile.h"
+#include "logger.h"
+
+#define PROFILE_INITIAL_BUCKETS 256
+
+static uint64_t profile_hash (const char *stack)
+{
+  uint64_t hash = 0xcbf29ce484222325ull; //FNV-1a
+  for (const unsigned char *c = (const unsigned char *) stack; *c; c++)
+  {
+    hash = (hash ^ *c) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static bool profile_grow (profile_t *profile)
+{
+  size_t bucket_count = profile->bucket_count ? profile->bucket_count * 2 : PROFILE_INITIAL_BUCKETS;
+  profile_entry_t **buckets = calloc (bucket_count, sizeof (*buckets));
+  if (NULL == buckets)
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < profile->bucket_count; i++)
+  {
+    profile_entry_t *entry = profile->buckets[i];
+    while (entry)
+    {
+      profile_entry_t *next = entry->next;
+      size_t index = entry->hash & (bucket_count - 1);
+      entry->next = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+  free (profile->buckets);
+  profile->buckets = buckets;
+  profile->bucket_count = bucket_count;
+  return true;
+}
+
+void profile_init (profile_t *profile)
+{
+  profile->buckets = NULL;
+  profile->bucket_count = 0;
+  profile->entry_count = 0;
+  profile->total_weight = 0;
+}
+
+void profile_fini (profile_t *profile)
+{
+  for (size_t i = 0; i < profile->bucket_count; i++)
+  {
+    profile_entry_t *entry = profile->buckets[i];
+    while (entry)
+    {
+      profile_entry_t *next = entry->next;
+      free (entry);
+      entry = next;
+    }
+  }
+  free (profile->buckets);
+  profile_init (profile);
+}
+
+bool profile_add (profile_t *profile, const char *stack, uint64_t weight)
+{
+  uint64_t hash = profile_hash (stack);
+  if (profile->bucket_count)
+  {
+    for (profile_entry_t *entry = profile->buckets[hash & (profile->bucket_count - 1)]; entry; entry = entry->next)
+    {
+      if (entry->hash == hash && strcmp (entry->stack, stack) == 0)
+      {
+        entry->weight += weight;
+        profile->total_weight += weight;
+        return true;
+      }
+    }
+  }
+
+  if (profile->entry_count >= profile->bucket_count && !profile_grow (profile))
+  {
+    return false;
+  }
+  size_t length = strlen (stack);
+  profile_entry_t *entry = malloc (sizeof (*entry) + length + 1);
+  if (NULL == entry)
+  {
+    return false;
+  }
+  memcpy (entry->stack, stack, length + 1);
+  entry->hash = hash;
+  entry->weight = weight;
+  size_t index = hash & (profile->bucket_count - 1);
+  entry->next = profile->buckets[index];
+  profile->buckets[index] = entry;
+  profile->entry_count++;
+  profile->total_weight += weight;
+  return true;
+}
+
+bool profile_merge (profile_t *profile, const profile_t *other)
+{
+  for (size_t i = 0; i < other->bucket_count; i++)
+  {
+    for (const profile_entry_t *entry = other->buckets[i]; entry; entry = entry->next)
+    {
+      if (!profile_add (profile, entry->stack, entry->weight))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool profile_write (const profile_t *profile, const char *path)
+{
+  FILE *file = fopen (path, "w");
+  if (NULL == file)
+  {
+    log_error ("Could not open profile file %s", path);
+    return false;
+  }
+
+  for (size_t i = 0; i < profile->bucket_count; i++)
+  {
+    for (const profile_entry_t *entry = profile->buckets[i]; entry; entry = entry->next)
+    {
+      fprintf (file, "%s %" PRIu64 "\n", entry->stack, entry->weight);
+    }
+  }
+
+  if (fclose (file) != 0)
+  {
+    log_error ("Could not write profile file %s", path);
+    return false;
+  }
+  log_info ("Wrote %zu stacks to profile %s", profile->entry_count, path);
+  return true;
+}
@@ -0,0 +1,74 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_PROFILE_H
+#define BLE_SIM_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Collapsed stack profile - the weight of every sampled stack, keyed by the stack as "root;caller;leaf".
+ * Written one stack per line followed by its weight, the format flame graph tools read.
+ * A profile is used by one thread at a time
+ **/
+
+typedef struct profile_entry_t
+{
+  struct profile_entry_t *next; //bucket chain
+  uint64_t hash;
+  uint64_t weight;
+  char stack[];
+} profile_entry_t;
+
+typedef struct profile_t
+{
+  profile_entry_t **buckets;
+  size_t bucket_count;
+  size_t entry_count;
+  uint64_t total_weight;
+} profile_t;
+
+/**
+ * Initialises an empty profile
+ * @param profile the profile
+ **/
+void profile_init (profile_t *profile);
+
+/**
+ * Frees the stacks of a profile
+ * @param profile the profile
+ **/
+void profile_fini (profile_t *profile);
+
+/**
+ * Adds weight to a stack
+ * @param profile the profile
+ * @param stack frames separated by ';', root first
+ * @param weight the weight to add
+ * @return success true/false - false if a new stack could not be allocated
+ **/
+bool profile_add (profile_t *profile, const char *stack, uint64_t weight);
+
+/**
+ * Adds the stacks of another profile
+ * @param profile the profile to add to
+ * @param other the profile to add
+ * @return success true/false
+ **/
+bool profile_merge (profile_t *profile, const profile_t *other);
+
+/**
+ * Writes the profile in the collapsed stack format, replacing the file
+ * @param profile the profile
+ * @param path the file to write
+ * @return success true/false
+ **/
+bool profile_write (const profile_t *profile, const char *path);
+
+#endif //BLE_SIM_PROFILE_H
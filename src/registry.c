@@ -0,0 +1,148 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+#include "utils.h"
+#include "logger.h"
+
+#define REGISTRY_INITIAL_BUCKETS 64
+
+static device_t **buckets = NULL; //name index, chained through device->bucket_next
+static unsigned int bucket_count = 0;
+static unsigned int device_count = 0;
+static device_t *device_list_head = NULL;
+
+static bool registry_grow (void)
+{
+  unsigned int new_count = bucket_count ? bucket_count * 2 : REGISTRY_INITIAL_BUCKETS;
+  device_t **new_buckets = calloc (new_count, sizeof (*new_buckets));
+  if (NULL == new_buckets)
+  {
+    return false;
+  }
+
+  for (device_t *device = device_list_head; device; device = device->next)
+  {
+    unsigned int index = utils_hash_string (device->device_name) & (new_count - 1);
+    device->bucket_next = new_buckets[index];
+    new_buckets[index] = device;
+  }
+
+  free (buckets);
+  buckets = new_buckets;
+  bucket_count = new_count;
+  return true;
+}
+
+bool registry_add (device_t *device)
+{
+  if (registry_find (device->device_name))
+  {
+    return false;
+  }
+
+  if (device_count >= bucket_count && !registry_grow () && NULL == buckets)
+  {
+    log_error ("Could not allocate the device registry");
+    return false;
+  }
+
+  unsigned int index = utils_hash_string (device->device_name) & (bucket_count - 1);
+  device->bucket_next = buckets[index];
+  buckets[index] = device;
+
+  device->prev = NULL;
+  device->next = device_list_head;
+  if (device_list_head)
+  {
+    device_list_head->prev = device;
+  }
+  device_list_head = device;
+
+  device_count++;
+  return true;
+}
+
+void registry_remove (device_t *device)
+{
+  if (NULL == buckets || NULL == device->device_name)
+  {
+    return;
+  }
+
+  unsigned int index = utils_hash_string (device->device_name) & (bucket_count - 1);
+  device_t **link = &buckets[index];
+  while (*link && *link != device)
+  {
+    link = &(*link)->bucket_next;
+  }
+
+  if (NULL == *link)
+  {
+    return; //not registered
+  }
+  *link = device->bucket_next;
+
+  if (device->prev)
+  {
+    device->prev->next = device->next;
+  }
+  else
+  {
+    device_list_head = device->next;
+  }
+  if (device->next)
+  {
+    device->next->prev = device->prev;
+  }
+
+  device->next = NULL;
+  device->prev = NULL;
+  device->bucket_next = NULL;
+  device_count--;
+}
+
+device_t *registry_find (const char *device_name)
+{
+  if (NULL == buckets)
+  {
+    return NULL;
+  }
+
+  device_t *device = buckets[utils_hash_string (device_name) & (bucket_count - 1)];
+  while (device)
+  {
+    if (strcmp (device_name, device->device_name) == 0)
+    {
+      return device;
+    }
+    device = device->bucket_next;
+  }
+  return NULL;
+}
+
+device_t *registry_get_devices (void)
+{
+  return device_list_head;
+}
+
+unsigned int registry_get_device_count (void)
+{
+  return device_count;
+}
+
+void registry_fini (void)
+{
+  free (buckets);
+  buckets = NULL;
+  bucket_count = 0;
+  device_count = 0;
+  device_list_head = NULL;
+}
@@ -0,0 +1,51 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_REGISTRY_H
+#define BLE_SIM_REGISTRY_H
+
+#include <stdbool.h>
+
+#include "device.h"
+
+/**
+ * Adds a device to the registry
+ * @param device the device to add
+ * @return success true/false - false if a device with the same name is already registered
+ **/
+bool registry_add (device_t *device);
+
+/**
+ * Removes a device from the registry, does nothing if the device is not registered
+ * @param device the device to remove
+ **/
+void registry_remove (device_t *device);
+
+/**
+ * Finds a registered device by name
+ * @param device_name name of the device
+ * @return the device or NULL if not found
+ **/
+device_t *registry_find (const char *device_name);
+
+/**
+ * Gets the head of the registered device list, the list is walked with device->next
+ * @return the first registered device or NULL if there are none
+ **/
+device_t *registry_get_devices (void);
+
+/**
+ * @return the number of registered devices
+ **/
+unsigned int registry_get_device_count (void);
+
+/**
+ * Frees the registry's index, devices themselves are not freed
+ **/
+void registry_fini (void);
+
+#endif //BLE_SIM_REGISTRY_H
@@ -0,0 +1,98 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+static bool scheduler_timer_before (const scheduler_timer_t *a, const scheduler_timer_t *b)
+{
+  return a->due < b->due || (a->due == b->due && a->sequence < b->sequence);
+}
+
+void scheduler_init (scheduler_t *scheduler)
+{
+  scheduler->timers = NULL;
+  scheduler->count = 0;
+  scheduler->capacity = 0;
+  scheduler->next_sequence = 0;
+}
+
+void scheduler_fini (scheduler_t *scheduler)
+{
+  free (scheduler->timers);
+  scheduler_init (scheduler);
+}
+
+bool scheduler_add (scheduler_t *scheduler, uint64_t due, int thread_ref, int args_ref)
+{
+  if (scheduler->count == scheduler->capacity)
+  {
+    size_t capacity = scheduler->capacity ? scheduler->capacity * 2 : 16;
+    scheduler_timer_t *timers = realloc (scheduler->timers, capacity * sizeof (*timers));
+    if (NULL == timers)
+    {
+      return false;
+    }
+    scheduler->timers = timers;
+    scheduler->capacity = capacity;
+  }
+
+  scheduler_timer_t timer = {due, scheduler->next_sequence++, thread_ref, args_ref};
+
+  //push the timer on to the heap
+  scheduler_timer_t *heap = scheduler->timers;
+  size_t i = scheduler->count++;
+  while (i > 0 && scheduler_timer_before (&timer, &heap[(i - 1) / 2]))
+  {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = timer;
+  return true;
+}
+
+bool scheduler_pop_due (scheduler_t *scheduler, uint64_t now, uint64_t before, scheduler_timer_t *timer)
+{
+  scheduler_timer_t *heap = scheduler->timers;
+  if (scheduler->count == 0 || heap[0].due > now || heap[0].sequence >= before)
+  {
+    return false;
+  }
+  *timer = heap[0];
+
+  //pop the earliest timer off the heap
+  size_t count = --scheduler->count;
+  scheduler_timer_t last = heap[count];
+  size_t i = 0;
+  while (2 * i + 1 < count)
+  {
+    size_t child = 2 * i + 1;
+    if (child + 1 < count && scheduler_timer_before (&heap[child + 1], &heap[child]))
+    {
+      child++;
+    }
+    if (!scheduler_timer_before (&heap[child], &last))
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return true;
+}
+
+uint64_t scheduler_get_sequence (const scheduler_t *scheduler)
+{
+  return scheduler->next_sequence;
+}
+
+size_t scheduler_get_count (const scheduler_t *scheduler)
+{
+  return scheduler->count;
+}
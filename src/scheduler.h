@@ -0,0 +1,81 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_SCHEDULER_H
+#define BLE_SIM_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Timer queue for the coroutines started with ble.spawn - a min heap ordered by due time,
+ * timers due at the same time run in the order they were added.
+ * Timers refer to the coroutine and the values it is resumed with by lua registry reference.
+ **/
+
+typedef struct scheduler_timer_t
+{
+  uint64_t due; //milliseconds on the monotonic clock
+  uint64_t sequence; //order the timer was added in
+  int thread_ref; //registry reference of the coroutine
+  int args_ref; //registry reference of a table of values to resume with or LUA_NOREF
+} scheduler_timer_t;
+
+typedef struct scheduler_t
+{
+  scheduler_timer_t *timers;
+  size_t count;
+  size_t capacity;
+  uint64_t next_sequence;
+} scheduler_t;
+
+/**
+ * Initialises a scheduler
+ * @param scheduler the scheduler
+ **/
+void scheduler_init (scheduler_t *scheduler);
+
+/**
+ * Frees a schedulers timers, the references they hold are not released
+ * @param scheduler the scheduler
+ **/
+void scheduler_fini (scheduler_t *scheduler);
+
+/**
+ * Adds a timer
+ * @param scheduler the scheduler
+ * @param due when the timer is due
+ * @param thread_ref registry reference of the coroutine
+ * @param args_ref registry reference of the values to resume with or LUA_NOREF
+ * @return success true/false
+ **/
+bool scheduler_add (scheduler_t *scheduler, uint64_t due, int thread_ref, int args_ref);
+
+/**
+ * Removes the earliest timer if it is due and was added before a sequence number
+ * @param scheduler the scheduler
+ * @param now the current time
+ * @param before only timers added before this sequence are returned, so timers added while running are left for the next run
+ * @param timer set to the removed timer
+ * @return true/false if a timer was removed
+ **/
+bool scheduler_pop_due (scheduler_t *scheduler, uint64_t now, uint64_t before, scheduler_timer_t *timer);
+
+/**
+ * @param scheduler the scheduler
+ * @return the sequence number the next timer will get
+ **/
+uint64_t scheduler_get_sequence (const scheduler_t *scheduler);
+
+/**
+ * @param scheduler the scheduler
+ * @return the number of pending timers
+ **/
+size_t scheduler_get_count (const scheduler_t *scheduler);
+
+#endif //BLE_SIM_SCHEDULER_H
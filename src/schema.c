@@ -0,0 +1,261 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "schema.h"
+#include "service.h"
+#include "characteristic.h"
+#include "descriptor.h"
+#include "logger.h"
+
+static bool schema_grow (void **array, unsigned int count, size_t element_size)
+{
+  //arrays grow in powers of two
+  if (count & (count - 1))
+  {
+    return true;
+  }
+
+  unsigned int capacity = count ? count * 2 : 1;
+  void *grown = realloc (*array, capacity * element_size);
+  if (NULL == grown)
+  {
+    return false;
+  }
+  *array = grown;
+  return true;
+}
+
+static bool schema_check_modifiable (device_schema_t *schema)
+{
+  if (schema->sealed)
+  {
+    log_warn ("Schema has already been instantiated and can not be modified");
+    return false;
+  }
+  return true;
+}
+
+device_schema_t *device_schema_new (void)
+{
+  device_schema_t *schema = calloc (1, sizeof (*schema));
+  if (NULL == schema)
+  {
+    return NULL;
+  }
+  schema->refcount = 1;
+  return schema;
+}
+
+device_schema_t *device_schema_ref (device_schema_t *schema)
+{
+  schema->refcount++;
+  return schema;
+}
+
+void device_schema_unref (device_schema_t *schema)
+{
+  if (NULL == schema || --schema->refcount > 0)
+  {
+    return;
+  }
+
+  for (unsigned int i = 0; i < schema->service_count; i++)
+  {
+    service_schema_t *service = &schema->services[i];
+    for (unsigned int j = 0; j < service->characteristic_count; j++)
+    {
+      characteristic_schema_t *characteristic = &service->characteristics[j];
+      for (unsigned int k = 0; k < characteristic->descriptor_count; k++)
+      {
+        free (characteristic->descriptors[k].uuid);
+      }
+      free (characteristic->descriptors);
+      free (characteristic->uuid);
+    }
+    free (service->characteristics);
+    free (service->uuid);
+  }
+  free (schema->services);
+  free (schema);
+}
+
+int device_schema_add_service (device_schema_t *schema, const char *uuid, bool primary)
+{
+  if (!schema_check_modifiable (schema))
+  {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < schema->service_count; i++)
+  {
+    if (strcmp (schema->services[i].uuid, uuid) == 0)
+    {
+      log_warn ("Service %s already exists in schema", uuid);
+      return -1;
+    }
+  }
+
+  if (!schema_grow ((void **) &schema->services, schema->service_count, sizeof (*schema->services)))
+  {
+    return -1;
+  }
+
+  service_schema_t *service = &schema->services[schema->service_count];
+  service->uuid = strdup (uuid);
+  if (NULL == service->uuid)
+  {
+    return -1;
+  }
+  service->primary = primary;
+  service->characteristics = NULL;
+  service->characteristic_count = 0;
+
+  return (int) schema->service_count++;
+}
+
+int device_schema_add_characteristic (device_schema_t *schema, int service_index, const char *uuid, uint32_t flags)
+{
+  if (!schema_check_modifiable (schema) || service_index < 0 || (unsigned int) service_index >= schema->service_count)
+  {
+    return -1;
+  }
+
+  service_schema_t *service = &schema->services[service_index];
+  for (unsigned int i = 0; i < service->characteristic_count; i++)
+  {
+    if (strcmp (service->characteristics[i].uuid, uuid) == 0)
+    {
+      log_warn ("Characteristic %s already exists in schema service %s", uuid, service->uuid);
+      return -1;
+    }
+  }
+
+  if (!schema_grow ((void **) &service->characteristics, service->characteristic_count, sizeof (*service->characteristics)))
+  {
+    return -1;
+  }
+
+  characteristic_schema_t *characteristic = &service->characteristics[service->characteristic_count];
+  characteristic->uuid = strdup (uuid);
+  if (NULL == characteristic->uuid)
+  {
+    return -1;
+  }
+  characteristic->flags = flags;
+  characteristic->descriptors = NULL;
+  characteristic->descriptor_count = 0;
+
+  schema->characteristic_total++;
+  return (int) service->characteristic_count++;
+}
+
+int device_schema_add_descriptor (device_schema_t *schema, int service_index, int characteristic_index, const char *uuid, uint16_t flags)
+{
+  if (!schema_check_modifiable (schema) || service_index < 0 || (unsigned int) service_index >= schema->service_count)
+  {
+    return -1;
+  }
+
+  service_schema_t *service = &schema->services[service_index];
+  if (characteristic_index < 0 || (unsigned int) characteristic_index >= service->characteristic_count)
+  {
+    return -1;
+  }
+
+  characteristic_schema_t *characteristic = &service->characteristics[characteristic_index];
+  for (unsigned int i = 0; i < characteristic->descriptor_count; i++)
+  {
+    if (strcmp (characteristic->descriptors[i].uuid, uuid) == 0)
+    {
+      log_warn ("Descriptor %s already exists in schema characteristic %s", uuid, characteristic->uuid);
+      return -1;
+    }
+  }
+
+  if (!schema_grow ((void **) &characteristic->descriptors, characteristic->descriptor_count, sizeof (*characteristic->descriptors)))
+  {
+    return -1;
+  }
+
+  descriptor_schema_t *descriptor = &characteristic->descriptors[characteristic->descriptor_count];
+  descriptor->uuid = strdup (uuid);
+  if (NULL == descriptor->uuid)
+  {
+    return -1;
+  }
+  descriptor->flags = flags;
+
+  schema->descriptor_total++;
+  return (int) characteristic->descriptor_count++;
+}
+
+device_t *device_schema_instantiate (device_schema_t *schema, const char *device_name)
+{
+  //the device and all of its attributes live in one block which is released by device_free
+  size_t size = sizeof (device_t)
+                + schema->service_count * sizeof (service_t)
+                + schema->characteristic_total * sizeof (characteristic_t)
+                + schema->descriptor_total * sizeof (descriptor_t);
+
+  device_t *device = calloc (1, size);
+  if (NULL == device)
+  {
+    log_error ("Could not allocate device %s from schema", device_name);
+    return NULL;
+  }
+
+  service_t *services = (service_t *) (device + 1);
+  characteristic_t *characteristics = (characteristic_t *) (services + schema->service_count);
+  descriptor_t *descriptors = (descriptor_t *) (characteristics + schema->characteristic_total);
+
+  schema->sealed = true;
+  device_init (device, device_name, ORIGIN_SCHEMA);
+  device->schema = device_schema_ref (schema);
+
+  for (unsigned int i = 0; i < schema->service_count; i++)
+  {
+    service_schema_t *service_schema = &schema->services[i];
+    service_t *service = services++;
+    service_init (service, service_schema->uuid, service_schema->primary, ORIGIN_SCHEMA);
+    if (!device_add_service (device, service))
+    {
+      device_free (device);
+      return NULL;
+    }
+
+    for (unsigned int j = 0; j < service_schema->characteristic_count; j++)
+    {
+      characteristic_schema_t *characteristic_schema = &service_schema->characteristics[j];
+      characteristic_t *characteristic = characteristics++;
+      characteristic_init (characteristic, characteristic_schema->uuid, ORIGIN_SCHEMA);
+      characteristic->flags = characteristic_schema->flags;
+      if (!service_add_characteristic (service, characteristic))
+      {
+        device_free (device);
+        return NULL;
+      }
+
+      for (unsigned int k = 0; k < characteristic_schema->descriptor_count; k++)
+      {
+        descriptor_schema_t *descriptor_schema = &characteristic_schema->descriptors[k];
+        descriptor_t *descriptor = descriptors++;
+        descriptor_init (descriptor, descriptor_schema->uuid, ORIGIN_SCHEMA);
+        descriptor->flags = descriptor_schema->flags;
+        if (!characteristic_add_descriptor (characteristic, descriptor))
+        {
+          device_free (device);
+          return NULL;
+        }
+      }
+    }
+  }
+
+  return device;
+}
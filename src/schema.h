@@ -0,0 +1,111 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_SCHEMA_H
+#define BLE_SIM_SCHEMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "device.h"
+
+typedef struct descriptor_schema_t
+{
+  char *uuid;
+  uint16_t flags;
+} descriptor_schema_t;
+
+typedef struct characteristic_schema_t
+{
+  char *uuid;
+  uint32_t flags;
+  descriptor_schema_t *descriptors;
+  unsigned int descriptor_count;
+} characteristic_schema_t;
+
+typedef struct service_schema_t
+{
+  char *uuid;
+  bool primary;
+  characteristic_schema_t *characteristics;
+  unsigned int characteristic_count;
+} service_schema_t;
+
+/**
+ * Immutable GATT layout shared by every device instantiated from it.
+ * Instances point at the schema's uuid strings rather than copying them
+ * and are allocated as a single block.
+ **/
+typedef struct device_schema_t
+{
+  service_schema_t *services;
+  unsigned int service_count;
+  unsigned int characteristic_total;
+  unsigned int descriptor_total;
+  bool sealed; //no more attributes can be added once the schema has been instantiated
+  unsigned int refcount;
+} device_schema_t;
+
+/**
+ * Creates an empty schema with a reference count of 1
+ * @return the schema or NULL
+ **/
+device_schema_t *device_schema_new (void);
+
+/**
+ * Takes a reference to a schema
+ * @param schema the schema
+ * @return the schema
+ **/
+device_schema_t *device_schema_ref (device_schema_t *schema);
+
+/**
+ * Drops a reference to a schema, freeing it when the last reference is dropped
+ * @param schema the schema
+ **/
+void device_schema_unref (device_schema_t *schema);
+
+/**
+ * Adds a service to the schema
+ * @param schema the schema
+ * @param uuid uuid of the service
+ * @param primary true/false if the service is a primary service
+ * @return index of the service or -1 on failure
+ **/
+int device_schema_add_service (device_schema_t *schema, const char *uuid, bool primary);
+
+/**
+ * Adds a characteristic to a service of the schema
+ * @param schema the schema
+ * @param service_index index of the service
+ * @param uuid uuid of the characteristic
+ * @param flags characteristic flag bits
+ * @return index of the characteristic within the service or -1 on failure
+ **/
+int device_schema_add_characteristic (device_schema_t *schema, int service_index, const char *uuid, uint32_t flags);
+
+/**
+ * Adds a descriptor to a characteristic of the schema
+ * @param schema the schema
+ * @param service_index index of the service
+ * @param characteristic_index index of the characteristic within the service
+ * @param uuid uuid of the descriptor
+ * @param flags descriptor flag bits
+ * @return index of the descriptor within the characteristic or -1 on failure
+ **/
+int device_schema_add_descriptor (device_schema_t *schema, int service_index, int characteristic_index, const char *uuid, uint16_t flags);
+
+/**
+ * Creates a device with the schema's services, characteristics and descriptors.
+ * The device is not registered
+ * @param schema the schema
+ * @param device_name name of the new device
+ * @return the device, freed with device_free, or NULL on failure
+ **/
+device_t *device_schema_instantiate (device_schema_t *schema, const char *device_name);
+
+#endif //BLE_SIM_SCHEMA_H
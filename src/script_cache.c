@@ -0,0 +1,233 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lua_compat.h"
+
+#include "script_cache.h"
+#include "logger.h"
+
+#define SCRIPT_CACHE_FNV_OFFSET 14695981039346656037ull
+#define SCRIPT_CACHE_FNV_PRIME 1099511628211ull
+#define SCRIPT_CACHE_SUFFIX ".luac"
+#define SCRIPT_CACHE_TEMP_SUFFIX ".XXXXXX"
+
+static const char *script_cache_directory = NULL;
+
+static uint64_t script_cache_hash (uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= SCRIPT_CACHE_FNV_PRIME;
+  }
+  return hash;
+}
+
+//reads a whole file, returns NULL if it cannot be read
+static char *script_cache_read_file (const char *path, size_t *size)
+{
+  FILE *file = fopen (path, "rb");
+  if (NULL == file)
+  {
+    return NULL;
+  }
+
+  char *data = NULL;
+  long length = -1;
+  if (fseek (file, 0, SEEK_END) == 0 && (length = ftell (file)) >= 0 && fseek (file, 0, SEEK_SET) == 0)
+  {
+    data = malloc ((size_t) length + 1);
+    if (NULL != data && fread (data, 1, (size_t) length, file) != (size_t) length)
+    {
+      free (data);
+      data = NULL;
+    }
+  }
+  fclose (file);
+
+  if (NULL != data)
+  {
+    *size = (size_t) length;
+  }
+  return data;
+}
+
+static int script_cache_writer (lua_State *lua_state, const void *data, size_t size, void *user_data)
+{
+  return fwrite (data, 1, size, (FILE *) user_data) == size ? 0 : 1;
+}
+
+//dumps the chunk on top of the stack to the cache file, written to a temporary file first so
+//states loading the same script at the same time never read a partial file
+static void script_cache_write (lua_State *lua_state, const char *cache_path)
+{
+  size_t path_length = strlen (cache_path);
+  char *tmp_path = malloc (path_length + sizeof (SCRIPT_CACHE_TEMP_SUFFIX));
+  if (NULL == tmp_path)
+  {
+    return;
+  }
+  memcpy (tmp_path, cache_path, path_length);
+  memcpy (tmp_path + path_length, SCRIPT_CACHE_TEMP_SUFFIX, sizeof (SCRIPT_CACHE_TEMP_SUFFIX));
+
+  int fd = mkstemp (tmp_path);
+  FILE *file = fd < 0 ? NULL : fdopen (fd, "wb");
+  if (NULL == file)
+  {
+    if (fd >= 0)
+    {
+      close (fd);
+      unlink (tmp_path);
+    }
+    log_warn ("Could not write bytecode cache %s: %s", cache_path, strerror (errno));
+    free (tmp_path);
+    return;
+  }
+
+  bool written = lua_dump (lua_state, script_cache_writer, file, 0) == 0;
+  written = fclose (file) == 0 && written;
+  if (!written || rename (tmp_path, cache_path) != 0)
+  {
+    unlink (tmp_path);
+    log_warn ("Could not write bytecode cache %s", cache_path);
+  }
+  free (tmp_path);
+}
+
+//loads a script read into memory, from its cached bytecode if the hash of the source matches
+static int script_cache_load_source (lua_State *lua_state, const char *source, size_t size, const char *chunk_name)
+{
+  if (size >= 3 && memcmp (source, "\xEF\xBB\xBF", 3) == 0) //UTF-8 byte order mark
+  {
+    source += 3;
+    size -= 3;
+  }
+  if (size && source[0] == '#') //skips a #! line but keeps its newline so line numbers match the file
+  {
+    const char *end = memchr (source, '\n', size);
+    size_t skip = end ? (size_t) (end - source) : size;
+    source += skip;
+    size -= skip;
+  }
+  if (size && source[0] == LUA_SIGNATURE[0])
+  {
+    return luaL_loadbufferx (lua_state, source, size, chunk_name, "b"); //already compiled
+  }
+
+  uint64_t hash = script_cache_hash (SCRIPT_CACHE_FNV_OFFSET, source, size);
+  hash = script_cache_hash (hash, chunk_name, strlen (chunk_name));
+  size_t path_size = strlen (script_cache_directory) + 1 + 16 + sizeof (SCRIPT_CACHE_SUFFIX);
+  char *cache_path = malloc (path_size);
+  if (NULL == cache_path)
+  {
+    return luaL_loadbufferx (lua_state, source, size, chunk_name, "t");
+  }
+  snprintf (cache_path, path_size, "%s/%016" PRIx64 SCRIPT_CACHE_SUFFIX, script_cache_directory, hash);
+
+  size_t bytecode_size = 0;
+  char *bytecode = script_cache_read_file (cache_path, &bytecode_size);
+  if (NULL != bytecode)
+  {
+    int status = luaL_loadbufferx (lua_state, bytecode, bytecode_size, chunk_name, "b");
+    free (bytecode);
+    if (status == LUA_OK)
+    {
+      log_debug ("Loaded %s from bytecode cache %s", chunk_name + 1, cache_path);
+      free (cache_path);
+      return status;
+    }
+    log_debug ("Replacing bytecode cache %s: %s", cache_path, lua_tostring (lua_state, -1));
+    lua_pop (lua_state, 1);
+  }
+
+  int status = luaL_loadbufferx (lua_state, source, size, chunk_name, "t");
+  if (status == LUA_OK)
+  {
+    script_cache_write (lua_state, cache_path);
+  }
+  free (cache_path);
+  return status;
+}
+
+bool script_cache_set_directory (const char *directory)
+{
+  if (mkdir (directory, 0755) != 0 && errno != EEXIST)
+  {
+    log_error ("Could not create bytecode cache directory %s: %s", directory, strerror (errno));
+    return false;
+  }
+  script_cache_directory = directory;
+  return true;
+}
+
+int script_cache_loadfile (lua_State *lua_state, const char *path)
+{
+  if (NULL == script_cache_directory)
+  {
+    return luaL_loadfile (lua_state, path);
+  }
+
+  size_t size = 0;
+  char *source = script_cache_read_file (path, &size);
+  if (NULL == source)
+  {
+    return luaL_loadfile (lua_state, path); //reports why the file cannot be read
+  }
+
+  const char *chunk_name = lua_pushfstring (lua_state, "@%s", path);
+  int status = script_cache_load_source (lua_state, source, size, chunk_name);
+  lua_remove (lua_state, -2); //the chunk name
+  free (source);
+  return status;
+}
+
+//package.searchers entry, finds a module on package.path like the lua file searcher and loads it through the cache
+static int script_cache_searcher (lua_State *lua_state)
+{
+  const char *name = luaL_checkstring (lua_state, 1);
+  lua_getglobal (lua_state, "package");
+  lua_getfield (lua_state, -1, "searchpath");
+  lua_pushvalue (lua_state, 1);
+  lua_getfield (lua_state, -3, "path");
+  lua_call (lua_state, 2, 2);
+  if (lua_isnil (lua_state, -2))
+  {
+    return 1; //the files that were tried, added to the error raised by require
+  }
+
+  const char *filename = lua_tostring (lua_state, -2);
+  if (script_cache_loadfile (lua_state, filename) != LUA_OK)
+  {
+    return luaL_error (lua_state, "error loading module '%s' from file '%s':\n\t%s", name, filename, lua_tostring (lua_state, -1));
+  }
+  lua_pushvalue (lua_state, -3); //the file name is passed to the module
+  return 2;
+}
+
+void script_cache_install_searcher (lua_State *lua_state)
+{
+  if (NULL == script_cache_directory)
+  {
+    return;
+  }
+
+  lua_getglobal (lua_state, "package");
+  lua_getfield (lua_state, -1, LUA_COMPAT_SEARCHERS);
+  lua_pushcfunction (lua_state, script_cache_searcher);
+  lua_rawseti (lua_state, -2, 2); //the lua file searcher
+  lua_pop (lua_state, 2);
+}
@@ -0,0 +1,44 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_SCRIPT_CACHE_H
+#define BLE_SIM_SCRIPT_CACHE_H
+
+#include <stdbool.h>
+
+#include "lua_compat.h"
+
+/**
+ * Cache of compiled scripts so large scripts are only parsed once. The bytecode from lua_dump is
+ * written to <directory>/<hash>.luac where hash is the 64 bit FNV-1a hash of the source and its chunk
+ * name, later loads of the same source read the bytecode instead. Bytecode that fails to load (e.g written
+ * by another lua version) is replaced. Modules loaded with require go through the cache too.
+ **/
+
+/**
+ * Enables the cache, the directory is created if it does not exist
+ * @param directory the cache directory, kept by reference
+ * @return success true/false
+ **/
+bool script_cache_set_directory (const char *directory);
+
+/**
+ * Loads a script like luaL_loadfile, through the cache when it is enabled
+ * @param lua_state the lua state
+ * @param path path of the script
+ * @return the luaL_loadfile status, the chunk or an error message is pushed
+ **/
+int script_cache_loadfile (lua_State *lua_state, const char *path);
+
+/**
+ * Replaces the lua file searcher of require with one that loads modules through the cache,
+ * does nothing if the cache is not enabled
+ * @param lua_state the lua state, its package library must be open
+ **/
+void script_cache_install_searcher (lua_State *lua_state);
+
+#endif //BLE_SIM_SCRIPT_CACHE_H
@@ -9,6 +9,7 @@
 
 #include "service.h"
 #include "characteristic.h"
+#include "device.h"
 #include "dbusutils.h"
 #include "logger.h"
 
@@ -35,9 +36,8 @@ static dbus_method_t service_methods[] =
 service_t *service_init (service_t *service, const char *uuid, bool primary, int origin)
 {
   service->origin = origin;
-  service->uuid = strdup (uuid);
-  service->device_path = NULL;
-  service->object_path = NULL;
+  service->uuid = (origin == ORIGIN_SCHEMA) ? (char *) uuid : strdup (uuid);
+  service->path_id = OBJPATH_NONE;
   service->primary = primary;
   service->characteristics = NULL;
   service->characteristic_count = 0;
@@ -46,27 +46,81 @@ service_t *service_init (service_t *service, const char *uuid, bool primary, int
   return service;
 }
 
-void service_fini (service_t *service)
+//a service the script frees before the device it was added to leaves the device's list
+static void service_unlink (service_t *service)
 {
-  if (NULL == service)
+  device_t *device = (device_t *) objpath_get_object (objpath_get_parent (service->path_id));
+  if (NULL == device)
   {
     return;
   }
 
-  free (service->uuid);
-  free (service->device_path);
-  free (service->object_path);
+  for (service_t **link = &device->services; *link; link = &(*link)->next)
+  {
+    if (*link == service)
+    {
+      *link = service->next;
+      break;
+    }
+  }
+}
 
-  if (service->origin == ORIGIN_C)
+//takes the service off the bus and out of the path table, characteristics the script made stay with the script
+static void service_release (service_t *service)
+{
+  if (OBJPATH_NONE != service->path_id)
   {
-    characteristic_t *tmp = NULL;
-    while (service->characteristics)
+    char path[OBJPATH_MAX_LENGTH];
+    objpath_format (service->path_id, path);
+    dbusutils_unregister_object (global_dbus_connection, path);
+  }
+
+  characteristic_t *characteristic = service->characteristics;
+  while (characteristic)
+  {
+    characteristic_t *next = characteristic->next;
+    if (characteristic->origin == ORIGIN_LUA)
+    {
+      characteristic_detach (characteristic);
+    }
+    else if (service->origin == ORIGIN_C)
+    {
+      characteristic_free (characteristic);
+    }
+    else if (service->origin == ORIGIN_SCHEMA)
     {
-      tmp = service->characteristics->next;
-      characteristic_free (service->characteristics);
-      service->characteristics = tmp;
+      characteristic_fini (characteristic);
     }
-    service->next = NULL;
+    characteristic = next;
+  }
+  service->characteristics = NULL;
+
+  objpath_remove (service->path_id);
+  service->path_id = OBJPATH_NONE;
+}
+
+void service_detach (service_t *service)
+{
+  service_release (service);
+  service->next = NULL;
+}
+
+void service_fini (service_t *service)
+{
+  if (NULL == service)
+  {
+    return;
+  }
+
+  if (service->origin == ORIGIN_LUA && OBJPATH_NONE != service->path_id)
+  {
+    service_unlink (service);
+  }
+  service_release (service);
+
+  if (service->origin != ORIGIN_SCHEMA)
+  {
+    free (service->uuid);
   }
 
 }
@@ -94,13 +148,13 @@ characteristic_t *service_get_characteristic (service_t *service, const char *ch
 
 bool service_add_characteristic (service_t *service, characteristic_t *characteristic)
 {
-  if (NULL == service->object_path)
+  if (OBJPATH_NONE == service->path_id)
   {
     log_warn ("Service must be added to a device first in order to add a characteristic to it!");
     return false;
   }
 
-  if (NULL != characteristic->service_path)
+  if (OBJPATH_NONE != characteristic->path_id)
   {
     log_warn ("Characteristic already belongs to another service.");
     return false;
@@ -111,24 +165,39 @@ bool service_add_characteristic (service_t *service, characteristic_t *character
     return false;
   }
 
-  characteristic->object_path = dbusutils_create_object_path (service->object_path, CHARACTERISTIC_OBJECT_NAME, service->characteristic_count);
-  if (!characteristic_register (characteristic))
+  characteristic->path_id = objpath_add (service->path_id, OBJPATH_KIND_CHARACTERISTIC, service->characteristic_count, characteristic);
+  if (OBJPATH_NONE == characteristic->path_id || !characteristic_register (characteristic))
   {
-    free (characteristic->object_path);
+    objpath_remove (characteristic->path_id);
+    characteristic->path_id = OBJPATH_NONE;
     return false;
   }
-  characteristic->service_path = strdup (service->object_path);
 
   characteristic->next = service->characteristics;
   service->characteristics = characteristic;
   service->characteristic_count++;
+  const device_t *device = (const device_t *) objpath_get_object (objpath_get_parent (service->path_id));
+  atomic_store (&characteristic->skipped, NULL != device && device_is_skipped (device));
 
   return true;
 }
 
 bool service_register (service_t *service)
 {
-  return dbusutils_register_object (global_dbus_connection, service->object_path, service_properties, service_methods, service);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (service->path_id, path);
+  return dbusutils_register_object (global_dbus_connection, path, service_properties, service_methods, service);
+}
+
+void service_unregister (service_t *service)
+{
+  for (characteristic_t *characteristic = service->characteristics; characteristic; characteristic = characteristic->next)
+  {
+    characteristic_unregister (characteristic);
+  }
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (service->path_id, path);
+  dbusutils_unregister_object (global_dbus_connection, path);
 }
 
 //DBUS
@@ -141,7 +210,7 @@ static void service_get_uuid (void *user_data, DBusMessageIter *iter)
 static void service_get_device_path (void *user_data, DBusMessageIter *iter)
 {
   service_t *service = (service_t *) user_data;
-  dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH, &service->device_path);
+  objpath_iter_append (iter, objpath_get_parent (service->path_id));
 }
 
 static void service_get_primary (void *user_data, DBusMessageIter *iter)
@@ -153,6 +222,8 @@ static void service_get_primary (void *user_data, DBusMessageIter *iter)
 
 void service_get_object (service_t *service, DBusMessageIter *iter)
 {
-  dbusutils_get_object_data (iter, service_properties, service->object_path, BLUEZ_GATT_SERVICE_INTERFACE, service);
+  char path[OBJPATH_MAX_LENGTH];
+  objpath_format (service->path_id, path);
+  dbusutils_get_object_data (iter, service_properties, path, BLUEZ_GATT_SERVICE_INTERFACE, service);
 }
 
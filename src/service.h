@@ -21,9 +21,8 @@
 typedef struct service_t
 {
   char *uuid; //128-bit service UUID
-  char *device_path; // Object path of the Bluetooth device the service belongs to
   bool primary;
-  char *object_path;
+  objpath_id_t path_id; //Object path of the service, its parent is the Bluetooth device the service belongs to
   characteristic_t *characteristics;
   unsigned int characteristic_count;
   int origin; //where the object was created - influences how we free it
@@ -35,7 +34,7 @@ typedef struct service_t
  * @param service service to initialise
  * @param uuid the uuid of the service 
  * @param primary true/false if the service is a devices primary service
- * @param the origin of the object used to distinguish if it was created in lua
+ * @param the origin of the object used to distinguish if it was created in lua, ORIGIN_SCHEMA objects borrow the uuid
  * @return initialised service  
  **/
 service_t *service_init (service_t *service, const char *uuid, bool primary, int origin);
@@ -53,6 +52,13 @@ void service_fini (service_t *service);
  **/
 void service_free (service_t *service);
 
+/**
+ * Takes a service whose device is being freed off the bus and out of the path table with its characteristics,
+ * the service stays usable and can be added to another device
+ * @param service the service
+ **/
+void service_detach (service_t *service);
+
 /**
  * Searches the service for a characteristic
  * 
@@ -79,6 +85,12 @@ bool service_add_characteristic (service_t *service, characteristic_t *character
  **/
 bool service_register (service_t *service);
 
+/**
+ * Unregisters the service object and its characteristics from dbus
+ * @param service pointer to the service
+ **/
+void service_unregister (service_t *service);
+
 /**
  * Populates a dbus message iter with a service's object data
  * @param service pointer to the service
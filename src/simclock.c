@@ -0,0 +1,62 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "simclock.h"
+#include "defines.h"
+#include "utils.h"
+
+static double simclock_scale = 1.0;
+static bool simclock_deterministic = false;
+static uint64_t simclock_origin_us = 0; //wall clock time the clock was started
+static atomic_uint_least64_t simclock_now_us = 0; //kept in microseconds so small scales do not round every tick away
+
+void simclock_set_scale (double scale)
+{
+  simclock_scale = scale;
+}
+
+double simclock_get_scale (void)
+{
+  return simclock_scale;
+}
+
+void simclock_set_deterministic (bool deterministic)
+{
+  simclock_deterministic = deterministic;
+}
+
+void simclock_start (void)
+{
+  simclock_origin_us = utils_now_us ();
+  atomic_store (&simclock_now_us, 0);
+}
+
+uint64_t simclock_tick (void)
+{
+  uint64_t last = atomic_load (&simclock_now_us);
+  uint64_t now = 0;
+  if (simclock_deterministic)
+  {
+    now = last + (uint64_t) ((double) BLE_SIM_TICK_RATE_MS * 1000.0 * simclock_scale);
+  }
+  else
+  {
+    now = (uint64_t) ((double) (utils_now_us () - simclock_origin_us) * simclock_scale);
+  }
+  now = now < last ? last : now; //monotonic
+
+  atomic_store (&simclock_now_us, now);
+  return now / 1000;
+}
+
+uint64_t simclock_now_ms (void)
+{
+  return atomic_load (&simclock_now_us) / 1000;
+}
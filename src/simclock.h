@@ -0,0 +1,54 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_SIMCLOCK_H
+#define BLE_SIM_SIMCLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Simulation clock - the time scripts, coroutine timers, generators and read caches run on. It is advanced
+ * once at the start of every tick and reads the same for the whole tick. By default it follows the monotonic
+ * wall clock multiplied by the time scale, in deterministic mode every tick advances it by the same step
+ * (BLE_SIM_TICK_RATE_MS times the scale) whatever the wall clock did, so runs of a script can be replayed.
+ * Time starts at 0 when the clock is started. Call budgets and the profiler stay on the wall clock
+ **/
+
+/**
+ * @param scale how many times faster than the wall clock simulation time runs, must be > 0
+ **/
+void simclock_set_scale (double scale);
+
+/**
+ * @return the time scale
+ **/
+double simclock_get_scale (void);
+
+/**
+ * @param deterministic advance a fixed step per tick instead of following the wall clock
+ **/
+void simclock_set_deterministic (bool deterministic);
+
+/**
+ * Starts the clock at 0
+ **/
+void simclock_start (void);
+
+/**
+ * Advances the clock, called at the start of every tick
+ * @return the simulation time in milliseconds
+ **/
+uint64_t simclock_tick (void);
+
+/**
+ * Safe to call from any thread
+ * @return the simulation time of the current tick in milliseconds
+ **/
+uint64_t simclock_now_ms (void);
+
+#endif //BLE_SIM_SIMCLOCK_H
@@ -0,0 +1,580 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "registry.h"
+#include "device.h"
+#include "logger.h"
+
+#define SNAPSHOT_MAGIC "BLESNAP"
+#define SNAPSHOT_BYTE_ORDER_MARK 0x01020304u
+
+typedef struct snapshot_writer_t
+{
+  FILE *file;
+  bool error;
+} snapshot_writer_t;
+
+typedef struct snapshot_reader_t
+{
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+  bool error;
+} snapshot_reader_t;
+
+static volatile sig_atomic_t save_requested = 0;
+
+//writer
+
+static void snapshot_write (snapshot_writer_t *writer, const void *data, size_t size)
+{
+  if (!writer->error && size && fwrite (data, 1, size, writer->file) != size)
+  {
+    writer->error = true;
+  }
+}
+
+static void snapshot_write_u8 (snapshot_writer_t *writer, uint8_t value)
+{
+  snapshot_write (writer, &value, sizeof (value));
+}
+
+static void snapshot_write_u16 (snapshot_writer_t *writer, uint16_t value)
+{
+  snapshot_write (writer, &value, sizeof (value));
+}
+
+static void snapshot_write_u32 (snapshot_writer_t *writer, uint32_t value)
+{
+  snapshot_write (writer, &value, sizeof (value));
+}
+
+static void snapshot_write_string (snapshot_writer_t *writer, const char *string)
+{
+  size_t length = strlen (string) + 1;
+  if (length > UINT16_MAX)
+  {
+    writer->error = true;
+    return;
+  }
+  snapshot_write_u16 (writer, (uint16_t) length);
+  snapshot_write (writer, string, length);
+}
+
+static void snapshot_write_value (snapshot_writer_t *writer, const void *value, uint32_t value_size)
+{
+  snapshot_write_u32 (writer, value_size);
+  snapshot_write (writer, value, value_size);
+}
+
+//object lists are prepended to, this returns them oldest first so they are restored with the same object paths
+static void **snapshot_list_in_order (void *head, size_t next_offset, uint32_t *count)
+{
+  uint32_t length = 0;
+  for (char *item = head; item; item = *(char **) (item + next_offset))
+  {
+    length++;
+  }
+
+  void **items = malloc ((length ? length : 1) * sizeof (*items));
+  if (NULL == items)
+  {
+    return NULL;
+  }
+
+  uint32_t index = length;
+  for (char *item = head; item; item = *(char **) (item + next_offset))
+  {
+    items[--index] = item;
+  }
+
+  *count = length;
+  return items;
+}
+
+static void snapshot_write_characteristic (snapshot_writer_t *writer, const characteristic_t *characteristic)
+{
+  snapshot_write_string (writer, characteristic->uuid);
+  snapshot_write_u32 (writer, characteristic->flags);
+  snapshot_write_u8 (writer, characteristic->notifying);
+  snapshot_write_value (writer, characteristic->value, characteristic->value_size);
+
+  uint32_t count = 0;
+  descriptor_t **descriptors = (descriptor_t **) snapshot_list_in_order (characteristic->descriptors, offsetof (descriptor_t, next), &count);
+  if (NULL == descriptors)
+  {
+    writer->error = true;
+    return;
+  }
+
+  snapshot_write_u32 (writer, count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    snapshot_write_string (writer, descriptors[i]->uuid);
+    snapshot_write_u16 (writer, descriptors[i]->flags);
+    snapshot_write_value (writer, descriptors[i]->value, descriptors[i]->value_size);
+  }
+  free (descriptors);
+}
+
+static void snapshot_write_service (snapshot_writer_t *writer, const service_t *service)
+{
+  snapshot_write_string (writer, service->uuid);
+  snapshot_write_u8 (writer, service->primary);
+
+  uint32_t count = 0;
+  characteristic_t **characteristics = (characteristic_t **) snapshot_list_in_order (service->characteristics, offsetof (characteristic_t, next), &count);
+  if (NULL == characteristics)
+  {
+    writer->error = true;
+    return;
+  }
+
+  snapshot_write_u32 (writer, count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    snapshot_write_characteristic (writer, characteristics[i]);
+  }
+  free (characteristics);
+}
+
+static void snapshot_write_advertisement (snapshot_writer_t *writer, const advertisement_t *advertisement)
+{
+  snapshot_write_u16 (writer, advertisement->manufacturer_data.id);
+  snapshot_write_u16 (writer, advertisement->manufacturer_data.data.length);
+  snapshot_write (writer, advertisement->manufacturer_data.data.data, advertisement->manufacturer_data.data.length);
+  snapshot_write_u8 (writer, advertisement->discoverable);
+  snapshot_write_u16 (writer, advertisement->discoverable_timeout);
+  snapshot_write_u16 (writer, advertisement->appearance);
+  snapshot_write_u16 (writer, advertisement->duration);
+  snapshot_write_u16 (writer, advertisement->timeout);
+  snapshot_write_u32 (writer, advertisement->min_interval);
+  snapshot_write_u32 (writer, advertisement->max_interval);
+  snapshot_write_u16 (writer, (uint16_t) advertisement->tx_power);
+}
+
+static void snapshot_write_device (snapshot_writer_t *writer, const device_t *device)
+{
+  snapshot_write_string (writer, device->device_name);
+  snapshot_write_advertisement (writer, &device->advertisement);
+
+  uint32_t count = 0;
+  service_t **services = (service_t **) snapshot_list_in_order (device->services, offsetof (service_t, next), &count);
+  if (NULL == services)
+  {
+    writer->error = true;
+    return;
+  }
+
+  snapshot_write_u32 (writer, count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    snapshot_write_service (writer, services[i]);
+  }
+  free (services);
+}
+
+bool snapshot_save (const char *path)
+{
+  size_t path_length = strlen (path);
+  char *tmp_path = malloc (path_length + sizeof (".tmp"));
+  if (NULL == tmp_path)
+  {
+    return false;
+  }
+  memcpy (tmp_path, path, path_length);
+  memcpy (tmp_path + path_length, ".tmp", sizeof (".tmp"));
+
+  snapshot_writer_t writer = {fopen (tmp_path, "wb"), false};
+  if (NULL == writer.file)
+  {
+    log_error ("Could not open snapshot file %s", tmp_path);
+    free (tmp_path);
+    return false;
+  }
+
+  snapshot_write (&writer, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC) - 1);
+  snapshot_write_u8 (&writer, SNAPSHOT_VERSION);
+  snapshot_write_u32 (&writer, SNAPSHOT_BYTE_ORDER_MARK);
+  snapshot_write_u32 (&writer, registry_get_device_count ());
+
+  uint32_t count = 0;
+  device_t **devices = (device_t **) snapshot_list_in_order (registry_get_devices (), offsetof (device_t, next), &count);
+  if (NULL == devices)
+  {
+    writer.error = true;
+  }
+  for (uint32_t i = 0; devices && i < count; i++)
+  {
+    snapshot_write_device (&writer, devices[i]);
+  }
+  free (devices);
+
+  if (fclose (writer.file) != 0)
+  {
+    writer.error = true;
+  }
+
+  if (writer.error || rename (tmp_path, path) != 0)
+  {
+    log_error ("Failed to write snapshot %s", path);
+    unlink (tmp_path);
+    free (tmp_path);
+    return false;
+  }
+
+  free (tmp_path);
+  log_info ("Saved snapshot of %u device(s) to %s", registry_get_device_count (), path);
+  return true;
+}
+
+//reader
+
+static const void *snapshot_read (snapshot_reader_t *reader, size_t size)
+{
+  if (reader->error || size > reader->size - reader->offset)
+  {
+    reader->error = true;
+    return NULL;
+  }
+
+  const void *data = reader->data + reader->offset;
+  reader->offset += size;
+  return data;
+}
+
+static uint8_t snapshot_read_u8 (snapshot_reader_t *reader)
+{
+  const uint8_t *data = snapshot_read (reader, sizeof (uint8_t));
+  return data ? *data : 0;
+}
+
+static uint16_t snapshot_read_u16 (snapshot_reader_t *reader)
+{
+  uint16_t value = 0;
+  const void *data = snapshot_read (reader, sizeof (value));
+  if (data)
+  {
+    memcpy (&value, data, sizeof (value));
+  }
+  return value;
+}
+
+static uint32_t snapshot_read_u32 (snapshot_reader_t *reader)
+{
+  uint32_t value = 0;
+  const void *data = snapshot_read (reader, sizeof (value));
+  if (data)
+  {
+    memcpy (&value, data, sizeof (value));
+  }
+  return value;
+}
+
+//strings are used straight from the mapping, they are nul terminated in the file
+static const char *snapshot_read_string (snapshot_reader_t *reader)
+{
+  uint16_t length = snapshot_read_u16 (reader);
+  const char *string = snapshot_read (reader, length);
+  if (NULL == string || 0 == length || string[length - 1] != '\0')
+  {
+    reader->error = true;
+    return NULL;
+  }
+  return string;
+}
+
+static const void *snapshot_read_value (snapshot_reader_t *reader, uint32_t *value_size)
+{
+  *value_size = snapshot_read_u32 (reader);
+  return snapshot_read (reader, *value_size);
+}
+
+static bool snapshot_read_descriptor (snapshot_reader_t *reader, characteristic_t *characteristic)
+{
+  const char *uuid = snapshot_read_string (reader);
+  uint16_t flags = snapshot_read_u16 (reader);
+  uint32_t value_size = 0;
+  const void *value = snapshot_read_value (reader, &value_size);
+  if (reader->error)
+  {
+    return false;
+  }
+
+  descriptor_t *descriptor = malloc (sizeof (*descriptor));
+  if (NULL == descriptor)
+  {
+    return false;
+  }
+  descriptor_init (descriptor, uuid, ORIGIN_C);
+  descriptor->flags = flags;
+  if (value_size)
+  {
+    descriptor->value = malloc (value_size);
+    if (NULL == descriptor->value)
+    {
+      descriptor_free (descriptor);
+      return false;
+    }
+    memcpy (descriptor->value, value, value_size);
+    descriptor->value_size = value_size;
+  }
+
+  if (!characteristic_add_descriptor (characteristic, descriptor))
+  {
+    descriptor_free (descriptor);
+    return false;
+  }
+  return true;
+}
+
+static bool snapshot_read_characteristic (snapshot_reader_t *reader, service_t *service)
+{
+  const char *uuid = snapshot_read_string (reader);
+  uint32_t flags = snapshot_read_u32 (reader);
+  bool notifying = snapshot_read_u8 (reader);
+  uint32_t value_size = 0;
+  const void *value = snapshot_read_value (reader, &value_size);
+  uint32_t descriptor_count = snapshot_read_u32 (reader);
+  if (reader->error)
+  {
+    return false;
+  }
+
+  characteristic_t *characteristic = malloc (sizeof (*characteristic));
+  if (NULL == characteristic)
+  {
+    return false;
+  }
+  characteristic_init (characteristic, uuid, ORIGIN_C);
+  characteristic->flags = flags;
+
+  if (!service_add_characteristic (service, characteristic))
+  {
+    characteristic_free (characteristic);
+    return false;
+  }
+
+  if (value_size)
+  {
+    characteristic_update_value (characteristic, value, value_size);
+  }
+
+  for (uint32_t i = 0; i < descriptor_count; i++)
+  {
+    if (!snapshot_read_descriptor (reader, characteristic))
+    {
+      return false;
+    }
+  }
+
+  characteristic_set_notifying (characteristic, notifying);
+  return true;
+}
+
+static bool snapshot_read_service (snapshot_reader_t *reader, device_t *device)
+{
+  const char *uuid = snapshot_read_string (reader);
+  bool primary = snapshot_read_u8 (reader);
+  uint32_t characteristic_count = snapshot_read_u32 (reader);
+  if (reader->error)
+  {
+    return false;
+  }
+
+  service_t *service = malloc (sizeof (*service));
+  if (NULL == service)
+  {
+    return false;
+  }
+  service_init (service, uuid, primary, ORIGIN_C);
+
+  if (!device_add_service (device, service))
+  {
+    service_free (service);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < characteristic_count; i++)
+  {
+    if (!snapshot_read_characteristic (reader, service))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void snapshot_read_advertisement (snapshot_reader_t *reader, advertisement_t *advertisement)
+{
+  advertisement->manufacturer_data.id = snapshot_read_u16 (reader);
+  uint16_t length = snapshot_read_u16 (reader);
+  const void *data = snapshot_read (reader, length);
+  if (data && length <= ADVERTISEMENT_DATA_MAX_SIZE)
+  {
+    memcpy (advertisement->manufacturer_data.data.data, data, length);
+    advertisement->manufacturer_data.data.length = length;
+  }
+  else
+  {
+    reader->error = true;
+  }
+  advertisement->discoverable = snapshot_read_u8 (reader);
+  advertisement->discoverable_timeout = snapshot_read_u16 (reader);
+  advertisement->appearance = snapshot_read_u16 (reader);
+  advertisement->duration = snapshot_read_u16 (reader);
+  advertisement->timeout = snapshot_read_u16 (reader);
+  advertisement->min_interval = snapshot_read_u32 (reader);
+  advertisement->max_interval = snapshot_read_u32 (reader);
+  advertisement->tx_power = (int16_t) snapshot_read_u16 (reader);
+}
+
+static bool snapshot_read_device (snapshot_reader_t *reader)
+{
+  const char *device_name = snapshot_read_string (reader);
+  advertisement_t advertisement;
+  memset (&advertisement, 0, sizeof (advertisement));
+  snapshot_read_advertisement (reader, &advertisement);
+  uint32_t service_count = snapshot_read_u32 (reader);
+  if (reader->error)
+  {
+    return false;
+  }
+
+  device_t *device = malloc (sizeof (*device));
+  if (NULL == device)
+  {
+    return false;
+  }
+  device_init (device, device_name, ORIGIN_C);
+
+  bool success = true;
+  for (uint32_t i = 0; success && i < service_count; i++)
+  {
+    success = snapshot_read_service (reader, device);
+  }
+
+  success = success && device_register (device);
+  if (!success)
+  {
+    for (service_t *service = device->services; service; service = service->next)
+    {
+      service_unregister (service);
+    }
+    device_free (device);
+    return false;
+  }
+
+  //bluez reads the advertisement properties once the mainloop runs, so these are the values it registers
+  if (OBJPATH_NONE != device->advertisement.path_id)
+  {
+    device->advertisement.manufacturer_data = advertisement.manufacturer_data;
+    device->advertisement.discoverable = advertisement.discoverable;
+    device->advertisement.discoverable_timeout = advertisement.discoverable_timeout;
+    device->advertisement.appearance = advertisement.appearance;
+    device->advertisement.duration = advertisement.duration;
+    device->advertisement.timeout = advertisement.timeout;
+    device->advertisement.min_interval = advertisement.min_interval;
+    device->advertisement.max_interval = advertisement.max_interval;
+    device->advertisement.tx_power = advertisement.tx_power;
+  }
+  return true;
+}
+
+bool snapshot_restore (const char *path)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    log_debug ("[%s:%u] No snapshot at %s", __FUNCTION__, __LINE__, path);
+    return false;
+  }
+
+  struct stat file_stat;
+  if (fstat (fd, &file_stat) != 0 || file_stat.st_size == 0)
+  {
+    close (fd);
+    return false;
+  }
+
+  void *mapping = mmap (NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (MAP_FAILED == mapping)
+  {
+    log_error ("Could not map snapshot %s", path);
+    return false;
+  }
+
+  snapshot_reader_t reader = {mapping, (size_t) file_stat.st_size, 0, false};
+
+  const void *magic = snapshot_read (&reader, sizeof (SNAPSHOT_MAGIC) - 1);
+  uint8_t version = snapshot_read_u8 (&reader);
+  uint32_t byte_order_mark = snapshot_read_u32 (&reader);
+  uint32_t device_count = snapshot_read_u32 (&reader);
+
+  bool success = !reader.error
+    && memcmp (magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC) - 1) == 0
+    && version == SNAPSHOT_VERSION
+    && byte_order_mark == SNAPSHOT_BYTE_ORDER_MARK;
+  if (!success)
+  {
+    log_error ("%s is not a valid snapshot", path);
+  }
+
+  uint32_t restored = 0;
+  for (; success && restored < device_count; restored++)
+  {
+    success = snapshot_read_device (&reader);
+  }
+
+  if (!success && reader.error)
+  {
+    log_error ("Snapshot %s is truncated or corrupt", path);
+  }
+
+  munmap (mapping, (size_t) file_stat.st_size);
+
+  if (success)
+  {
+    log_info ("Restored %u device(s) from snapshot %s", device_count, path);
+  }
+  return success;
+}
+
+void snapshot_request_save (void)
+{
+  save_requested = 1;
+}
+
+void snapshot_poll (const char *path)
+{
+  if (!save_requested)
+  {
+    return;
+  }
+
+  save_requested = 0;
+  if (NULL == path)
+  {
+    log_warn ("No snapshot file set, use --snapshot to set one");
+    return;
+  }
+  snapshot_save (path);
+}
@@ -0,0 +1,57 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_SNAPSHOT_H
+#define BLE_SIM_SNAPSHOT_H
+
+#include <stdbool.h>
+
+/**
+ * Binary snapshots of the simulated devices - every registered device's GATT tree, values,
+ * notifying flags and advertisement data. Restoring a snapshot recreates and registers the
+ * devices directly so a script can skip building them (see ble.restored and ble.getDevice).
+ *
+ * Layout, host byte order:
+ *  header: magic "BLESNAP", version u8, byte order mark u32, device count u32
+ *  device: name, advertisement, service count u32, services
+ *  service: uuid, primary u8, characteristic count u32, characteristics
+ *  characteristic: uuid, flags u32, notifying u8, value, descriptor count u32, descriptors
+ *  descriptor: uuid, flags u16, value
+ * strings are a u16 length followed by the bytes including the nul terminator,
+ * values are a u32 length followed by the bytes.
+ * Devices, services, characteristics and descriptors are written in the order they were added so
+ * the restored object paths match the saved ones.
+ **/
+
+#define SNAPSHOT_VERSION 1
+
+/**
+ * Writes a snapshot of every registered device, the file is replaced atomically
+ * @param path path of the snapshot file
+ * @return success true/false
+ **/
+bool snapshot_save (const char *path);
+
+/**
+ * Maps a snapshot file and recreates and registers its devices
+ * @param path path of the snapshot file
+ * @return success true/false - false if the file is missing or invalid, devices restored before an error are kept
+ **/
+bool snapshot_restore (const char *path);
+
+/**
+ * Requests a snapshot, safe to call from a signal handler. The snapshot is written by snapshot_poll
+ **/
+void snapshot_request_save (void);
+
+/**
+ * Writes a snapshot if one has been requested
+ * @param path path of the snapshot file, requests are dropped if NULL
+ **/
+void snapshot_poll (const char *path);
+
+#endif //BLE_SIM_SNAPSHOT_H
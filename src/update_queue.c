@@ -0,0 +1,143 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "update_queue.h"
+
+bool update_queue_init (update_queue_t *queue, uint32_t capacity)
+{
+  uint32_t size = 1;
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  queue->entries = calloc (size, sizeof (*queue->entries));
+  if (NULL == queue->entries)
+  {
+    return false;
+  }
+  queue->mask = size - 1;
+  atomic_init (&queue->head, 0);
+  atomic_init (&queue->tail, 0);
+  return true;
+}
+
+void update_queue_fini (update_queue_t *queue)
+{
+  if (NULL == queue->entries)
+  {
+    return;
+  }
+
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_acquire);
+  for (uint32_t tail = atomic_load_explicit (&queue->tail, memory_order_relaxed); tail != head; tail++)
+  {
+    free (queue->entries[tail & queue->mask].heap_value);
+  }
+  free (queue->entries);
+  queue->entries = NULL;
+}
+
+//returns the entry to fill or NULL if the queue is full
+static update_t *update_queue_reserve (update_queue_t *queue)
+{
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit (&queue->tail, memory_order_acquire);
+  if (head - tail > queue->mask)
+  {
+    return NULL;
+  }
+  return &queue->entries[head & queue->mask];
+}
+
+static void update_queue_commit (update_queue_t *queue)
+{
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+  atomic_store_explicit (&queue->head, head + 1, memory_order_release);
+}
+
+bool update_queue_is_full (update_queue_t *queue)
+{
+  return NULL == update_queue_reserve (queue);
+}
+
+bool update_queue_push_value (update_queue_t *queue, characteristic_t *characteristic, const void *value, uint32_t value_size)
+{
+  update_t *update = update_queue_reserve (queue);
+  if (NULL == update)
+  {
+    return false;
+  }
+
+  update->heap_value = NULL;
+  if (value_size > UPDATE_QUEUE_INLINE_SIZE)
+  {
+    update->heap_value = malloc (value_size);
+    if (NULL == update->heap_value)
+    {
+      return false;
+    }
+    memcpy (update->heap_value, value, value_size);
+  }
+  else
+  {
+    memcpy (update->value, value, value_size);
+  }
+
+  update->kind = UPDATE_VALUE;
+  update->object = characteristic;
+  update->free_function = NULL;
+  update->value_size = value_size;
+  update_queue_commit (queue);
+  return true;
+}
+
+bool update_queue_push_free (update_queue_t *queue, void *object, update_free_function free_function)
+{
+  update_t *update = update_queue_reserve (queue);
+  if (NULL == update)
+  {
+    return false;
+  }
+
+  update->kind = UPDATE_FREE;
+  update->object = object;
+  update->free_function = free_function;
+  update->value_size = 0;
+  update->heap_value = NULL;
+  update_queue_commit (queue);
+  return true;
+}
+
+unsigned int update_queue_drain (update_queue_t *queue)
+{
+  uint32_t head = atomic_load_explicit (&queue->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit (&queue->tail, memory_order_relaxed);
+  unsigned int count = head - tail;
+
+  for (; tail != head; tail++)
+  {
+    update_t *update = &queue->entries[tail & queue->mask];
+    if (update->kind == UPDATE_VALUE)
+    {
+      const void *value = update->heap_value ? update->heap_value : update->value;
+      characteristic_update_value ((characteristic_t *) update->object, value, update->value_size);
+      free (update->heap_value);
+      update->heap_value = NULL;
+    }
+    else
+    {
+      update->free_function (update->object);
+    }
+  }
+
+  atomic_store_explicit (&queue->tail, tail, memory_order_release);
+  return count;
+}
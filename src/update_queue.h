@@ -0,0 +1,97 @@
+/***********************************************************************
+ *
+ * Copyright (c) 2021
+ * IoTech Ltd
+ *
+ **********************************************************************/
+
+#ifndef BLE_SIM_UPDATE_QUEUE_H
+#define BLE_SIM_UPDATE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "characteristic.h"
+
+/**
+ * Single producer, single consumer lock free queue of updates from a lua worker thread
+ * to the dbus thread. The worker pushes value writes and objects its garbage collector
+ * released, the dbus thread drains the queue and applies them.
+ **/
+
+#define UPDATE_QUEUE_INLINE_SIZE 32 //values up to this size are copied into the entry, larger ones are allocated
+
+typedef void (*update_free_function) (void *object);
+
+typedef enum update_kind_t
+{
+  UPDATE_VALUE = 0, //set a characteristic value
+  UPDATE_FREE //free an object
+} update_kind_t;
+
+typedef struct update_t
+{
+  update_kind_t kind;
+  void *object; //the characteristic or the object to free
+  update_free_function free_function;
+  uint32_t value_size;
+  uint8_t *heap_value; //set if value_size is over UPDATE_QUEUE_INLINE_SIZE
+  uint8_t value[UPDATE_QUEUE_INLINE_SIZE];
+} update_t;
+
+typedef struct update_queue_t
+{
+  update_t *entries;
+  uint32_t mask; //capacity - 1
+  _Alignas (64) atomic_uint head; //next entry to push, written by the producer
+  _Alignas (64) atomic_uint tail; //next entry to drain, written by the consumer
+} update_queue_t;
+
+/**
+ * Initialises a queue
+ * @param queue the queue
+ * @param capacity number of entries, rounded up to a power of two
+ * @return success true/false
+ **/
+bool update_queue_init (update_queue_t *queue, uint32_t capacity);
+
+/**
+ * Frees a queue, updates still in the queue are dropped
+ * @param queue the queue
+ **/
+void update_queue_fini (update_queue_t *queue);
+
+/**
+ * @param queue the queue
+ * @return true/false if the queue is full, producer only
+ **/
+bool update_queue_is_full (update_queue_t *queue);
+
+/**
+ * Pushes a characteristic value, producer only
+ * @param queue the queue
+ * @param characteristic the characteristic to update
+ * @param value the value, copied into the queue
+ * @param value_size size of the value
+ * @return true/false if the update was queued, false if the queue is full or the value could not be copied
+ **/
+bool update_queue_push_value (update_queue_t *queue, characteristic_t *characteristic, const void *value, uint32_t value_size);
+
+/**
+ * Pushes an object to free, producer only
+ * @param queue the queue
+ * @param object the object
+ * @param free_function function that frees the object
+ * @return true/false if the update was queued, false if the queue is full
+ **/
+bool update_queue_push_free (update_queue_t *queue, void *object, update_free_function free_function);
+
+/**
+ * Applies every queued update in order, consumer only
+ * @param queue the queue
+ * @return the number of updates applied
+ **/
+unsigned int update_queue_drain (update_queue_t *queue);
+
+#endif //BLE_SIM_UPDATE_QUEUE_H
@@ -5,6 +5,7 @@
  *
  **********************************************************************/
 #include <time.h>
+#include <stdlib.h>
 
 #include "utils.h"
 
@@ -20,3 +21,109 @@ void msleep (unsigned int milliseconds)
   ts.tv_nsec = (milliseconds % 1000) * 1000000;
   nanosleep (&ts, &ts);
 }
+
+uint64_t utils_now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+uint64_t utils_now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+uint64_t utils_splitmix64 (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+uint32_t utils_hash_string (const char *str)
+{
+  uint32_t hash = 2166136261u;
+  while (*str)
+  {
+    hash ^= (uint8_t) *str++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void id_allocator_init (id_allocator_t *allocator, unsigned int first_id)
+{
+  allocator->next_id = first_id;
+  allocator->free_ids = NULL;
+  allocator->free_count = 0;
+  allocator->free_capacity = 0;
+}
+
+void id_allocator_fini (id_allocator_t *allocator)
+{
+  free (allocator->free_ids);
+  allocator->free_ids = NULL;
+  allocator->free_count = 0;
+  allocator->free_capacity = 0;
+}
+
+unsigned int id_allocator_acquire (id_allocator_t *allocator)
+{
+  if (allocator->free_count == 0)
+  {
+    return allocator->next_id++;
+  }
+
+  //pop the lowest id off the heap
+  unsigned int *heap = allocator->free_ids;
+  unsigned int id = heap[0];
+  size_t count = --allocator->free_count;
+  unsigned int last = heap[count];
+  size_t i = 0;
+  while (2 * i + 1 < count)
+  {
+    size_t child = 2 * i + 1;
+    if (child + 1 < count && heap[child + 1] < heap[child])
+    {
+      child++;
+    }
+    if (last <= heap[child])
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+
+  return id;
+}
+
+void id_allocator_release (id_allocator_t *allocator, unsigned int id)
+{
+  if (allocator->free_count == allocator->free_capacity)
+  {
+    size_t capacity = allocator->free_capacity ? allocator->free_capacity * 2 : 8;
+    unsigned int *free_ids = realloc (allocator->free_ids, capacity * sizeof (*free_ids));
+    if (NULL == free_ids)
+    {
+      return; //the id is leaked rather than reused
+    }
+    allocator->free_ids = free_ids;
+    allocator->free_capacity = capacity;
+  }
+
+  //push the id on to the heap
+  unsigned int *heap = allocator->free_ids;
+  size_t i = allocator->free_count++;
+  while (i > 0 && heap[(i - 1) / 2] > id)
+  {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = id;
+}
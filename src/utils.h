@@ -10,6 +10,15 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+
+typedef struct id_allocator_t
+{
+  unsigned int next_id; //next never used id
+  unsigned int *free_ids; //released ids, kept as a min heap so the lowest is reused first
+  size_t free_count;
+  size_t free_capacity;
+} id_allocator_t;
 
 /**
  * Checks if a (flag) bit is set on int x 
@@ -25,4 +34,55 @@ bool utils_is_flag_set (unsigned int x, unsigned int flag);
  **/
 void msleep (unsigned int milliseconds);
 
+/**
+ * @return milliseconds on the monotonic clock
+ **/
+uint64_t utils_now_ms (void);
+
+/**
+ * @return microseconds on the monotonic clock
+ **/
+uint64_t utils_now_us (void);
+
+/**
+ * Next value of a splitmix64 sequence
+ * @param state the state of the sequence, advanced
+ * @return the value
+ **/
+uint64_t utils_splitmix64 (uint64_t *state);
+
+/**
+ * Hashes a null terminated string (FNV-1a)
+ * @param str the string to hash
+ * @return the hash
+ **/
+uint32_t utils_hash_string (const char *str);
+
+/**
+ * Initialises an id allocator
+ * @param allocator the allocator
+ * @param first_id the first id the allocator hands out
+ **/
+void id_allocator_init (id_allocator_t *allocator, unsigned int first_id);
+
+/**
+ * Frees an id allocators values
+ * @param allocator the allocator
+ **/
+void id_allocator_fini (id_allocator_t *allocator);
+
+/**
+ * Gets an unused id, released ids are reused lowest first
+ * @param allocator the allocator
+ * @return the id
+ **/
+unsigned int id_allocator_acquire (id_allocator_t *allocator);
+
+/**
+ * Returns an id to the allocator so it can be reused
+ * @param allocator the allocator
+ * @param id the id to release
+ **/
+void id_allocator_release (id_allocator_t *allocator, unsigned int id);
+
 #endif //BLE_SIM_UTILS_H